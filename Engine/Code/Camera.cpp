@@ -29,6 +29,37 @@ glm::mat4 Camera::GetViewMatrix()
         return glm::lookAt(Position, Position + Front, Up);
 }
 
+glm::mat4 Camera::GetProjectionMatrix(float aspectRatio)
+{
+    return glm::perspective(glm::radians(Zoom), aspectRatio, NearPlane, FarPlane);
+}
+
+void Camera::GetFrustumPlanes(float aspectRatio, glm::vec4 planes[6])
+{
+    ExtractFrustumPlanes(GetProjectionMatrix(aspectRatio) * GetViewMatrix(), planes);
+}
+
+void Camera::ExtractFrustumPlanes(const glm::mat4& viewProjection, glm::vec4 planes[6])
+{
+    // Rows of the matrix, glm is column-major
+    glm::vec4 row0 = glm::vec4(viewProjection[0][0], viewProjection[1][0], viewProjection[2][0], viewProjection[3][0]);
+    glm::vec4 row1 = glm::vec4(viewProjection[0][1], viewProjection[1][1], viewProjection[2][1], viewProjection[3][1]);
+    glm::vec4 row2 = glm::vec4(viewProjection[0][2], viewProjection[1][2], viewProjection[2][2], viewProjection[3][2]);
+    glm::vec4 row3 = glm::vec4(viewProjection[0][3], viewProjection[1][3], viewProjection[2][3], viewProjection[3][3]);
+
+    // -w <= x, y, z <= w in clip space
+    planes[0] = row3 + row0;
+    planes[1] = row3 - row0;
+    planes[2] = row3 + row1;
+    planes[3] = row3 - row1;
+    planes[4] = row3 + row2;
+    planes[5] = row3 - row2;
+
+    // Normalized, so the plane distances can be compared against radii
+    for (int i = 0; i < 6; ++i)
+        planes[i] /= glm::length(glm::vec3(planes[i]));
+}
+
 void Camera::ProcessKeyboard(Camera_Movement direction, float deltaTime)
 {
     float velocity = DoubleSpeed ? MovementSpeed * 4 * deltaTime : MovementSpeed * deltaTime;
@@ -51,6 +51,15 @@ public:
     // returns the view matrix calculated using Euler Angles and the LookAt Matrix
     glm::mat4 GetViewMatrix();
 
+    // returns the perspective projection matrix for the camera zoom and clip planes
+    glm::mat4 GetProjectionMatrix(float aspectRatio);
+
+    // returns the 6 frustum planes (left, right, bottom, top, near, far) of the camera, see ExtractFrustumPlanes
+    void GetFrustumPlanes(float aspectRatio, glm::vec4 planes[6]);
+
+    // extracts the normalized frustum planes of a view-projection matrix (Gribb-Hartmann). A point p is inside when dot(plane.xyz, p) + plane.w >= 0 for all of them
+    static void ExtractFrustumPlanes(const glm::mat4& viewProjection, glm::vec4 planes[6]);
+
     // processes input received from any keyboard-like input system. Accepts input parameter in the form of camera defined ENUM (to abstract it from windowing systems)
     void ProcessKeyboard(Camera_Movement direction, float deltaTime);
 
@@ -1,5 +1,7 @@
 #include "engine.h"
 #include "Primitives.h"
+#include "geometry_pool.h"
+#include "culling.h"
 
 u32 LoadSphere(App* app)
 {
@@ -56,34 +58,124 @@ u32 LoadSphere(App* app)
     submesh.vertexBufferLayout = vertexBufferLayout;
     submesh.vertices.swap(vertices);
     submesh.indices.swap(indices);
+    ComputeSubmeshBounds(submesh);
 
     myMesh.submeshes.push_back(submesh);
 
 
+    ComputeMeshBounds(myMesh);
+
     ////Geometry
-    float verticesOffset = 0.0f;
-    float indicesOffset = 0.0f;
+    UploadMeshGeometry(app->geometryPool, myMesh);
 
-    glGenBuffers(1, &myMesh.vertexBufferHandle);
-    glGenBuffers(1, &myMesh.indexBufferHandle);
+    Model myModel = {};
+    Material myMat = {};
 
-    for (int i = 0; i < myMesh.submeshes.size(); ++i)
-    {
-        glBindBuffer(GL_ARRAY_BUFFER, myMesh.vertexBufferHandle);
-        glBufferData(GL_ARRAY_BUFFER, sizeof(float) * myMesh.submeshes[i].vertices.size(), &myMesh.submeshes[i].vertices[0], GL_STATIC_DRAW);
-        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    myModel.meshIdx = app->meshes.size();
+    app->meshes.push_back(myMesh);
 
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, myMesh.indexBufferHandle);
-        glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(u32) * myMesh.submeshes[i].indices.size(), &myMesh.submeshes[i].indices[0], GL_STATIC_DRAW);
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    u32 modelIdx = app->models.size();
 
-        submesh.vertexOffset = verticesOffset;
-        submesh.indexOffset = indicesOffset;
+    myMat.albedo = vec3(1.0f, 1.0f, 1.0f);
+    myMat.albedoTextureIdx = app->whiteTexIdx;
 
-        verticesOffset += sizeof(float) * myMesh.submeshes[i].vertices.size();
-        indicesOffset += sizeof(u32) * myMesh.submeshes[i].indices.size();
+    u32 materialIdx = app->materials.size();
+    app->materials.push_back(myMat);
+    myModel.materialIdx.push_back(materialIdx);
+
+    app->models.push_back(myModel);
+
+    return modelIdx;
+}
+
+u32 LoadIcosphere(App* app, u32 subdivisions)
+{
+    // Icosahedron
+    const float t = (1.0f + sqrtf(5.0f)) / 2.0f;
+    std::vector<vec3> positions = {
+        {-1,  t,  0}, { 1,  t,  0}, {-1, -t,  0}, { 1, -t,  0},
+        { 0, -1,  t}, { 0,  1,  t}, { 0, -1, -t}, { 0,  1, -t},
+        { t,  0, -1}, { t,  0,  1}, {-t,  0, -1}, {-t,  0,  1}
+    };
+    std::vector<u32> indices = {
+        0, 11, 5,   0, 5, 1,    0, 1, 7,    0, 7, 10,   0, 10, 11,
+        1, 5, 9,    5, 11, 4,   11, 10, 2,  10, 7, 6,   7, 1, 8,
+        3, 9, 4,    3, 4, 2,    3, 2, 6,    3, 6, 8,    3, 8, 9,
+        4, 9, 5,    2, 4, 11,   6, 2, 10,   8, 6, 7,    9, 8, 1
+    };
+    for (vec3& position : positions)
+        position = glm::normalize(position);
+
+    // Split every triangle in 4, pushing the new vertices to the sphere
+    for (u32 s = 0; s < subdivisions; ++s)
+    {
+        std::vector<u32> subdividedIndices;
+        for (u32 i = 0; i < indices.size(); i += 3)
+        {
+            u32 corners[3] = { indices[i], indices[i + 1], indices[i + 2] };
+            u32 middles[3];
+            for (u32 e = 0; e < 3; ++e)
+            {
+                // Shared edges get duplicated vertices, fine for a proxy mesh
+                middles[e] = positions.size();
+                positions.push_back(glm::normalize(positions[corners[e]] + positions[corners[(e + 1) % 3]]));
+            }
+
+            u32 triangles[] = {
+                corners[0], middles[0], middles[2],
+                corners[1], middles[1], middles[0],
+                corners[2], middles[2], middles[1],
+                middles[0], middles[1], middles[2]
+            };
+            subdividedIndices.insert(subdividedIndices.end(), triangles, triangles + ARRAY_COUNT(triangles));
+        }
+        indices.swap(subdividedIndices);
     }
 
+    // The faces are inside the unit sphere, scale the mesh so it contains it (light volumes
+    // must not clip the light's radius). Also make sure every face winds counter-clockwise.
+    float minFaceDistance = 1.0f;
+    for (u32 i = 0; i < indices.size(); i += 3)
+    {
+        vec3 a = positions[indices[i]], b = positions[indices[i + 1]], c = positions[indices[i + 2]];
+        vec3 normal = glm::normalize(glm::cross(b - a, c - a));
+        float faceDistance = glm::dot(normal, a);
+        if (faceDistance < 0.0f)
+        {
+            std::swap(indices[i + 1], indices[i + 2]);
+            faceDistance = -faceDistance;
+        }
+        minFaceDistance = glm::min(minFaceDistance, faceDistance);
+    }
+
+    std::vector<float> vertices;
+    for (const vec3& position : positions)
+    {
+        vec3 scaled = position / minFaceDistance;
+        vertices.insert(vertices.end(), { scaled.x, scaled.y, scaled.z, position.x, position.y, position.z, 0.0f, 0.0f });
+    }
+
+    Mesh myMesh = {};
+
+    VertexBufferLayout vertexBufferLayout = {};
+    vertexBufferLayout.attributes.push_back(VertexBufferAttribute{ 0, 3, 0 });
+    vertexBufferLayout.attributes.push_back(VertexBufferAttribute{ 1, 3, 3 * sizeof(float) });
+    vertexBufferLayout.attributes.push_back(VertexBufferAttribute{ 2, 2, 6 * sizeof(float) });
+    vertexBufferLayout.stride = 8 * sizeof(float);
+
+    Submesh submesh = {};
+    submesh.vertexBufferLayout = vertexBufferLayout;
+    submesh.vertices.swap(vertices);
+    submesh.indices.swap(indices);
+    ComputeSubmeshBounds(submesh);
+
+    myMesh.submeshes.push_back(submesh);
+
+    ComputeMeshBounds(myMesh);
+
+    ////Geometry
+    UploadMeshGeometry(app->geometryPool, myMesh);
+
     Model myModel = {};
     Material myMat = {};
 
@@ -132,32 +224,14 @@ u32 LoadQuad(App* app)
     submesh.vertexBufferLayout = vertexBufferLayout;
     submesh.vertices.swap(vertices);
     submesh.indices.swap(indices);
+    ComputeSubmeshBounds(submesh);
 
     myMesh.submeshes.push_back(submesh);
 
-    ////Geometry
-    float verticesOffset = 0.0f;
-    float indicesOffset = 0.0f;
-
-    glGenBuffers(1, &myMesh.vertexBufferHandle);
-    glGenBuffers(1, &myMesh.indexBufferHandle);
-
-    for (int i = 0; i < myMesh.submeshes.size(); ++i)
-    {
-        glBindBuffer(GL_ARRAY_BUFFER, myMesh.vertexBufferHandle);
-        glBufferData(GL_ARRAY_BUFFER, sizeof(float) * myMesh.submeshes[i].vertices.size(), &myMesh.submeshes[i].vertices[0], GL_STATIC_DRAW);
-        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    ComputeMeshBounds(myMesh);
 
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, myMesh.indexBufferHandle);
-        glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(u32) * myMesh.submeshes[i].indices.size(), &myMesh.submeshes[i].indices[0], GL_STATIC_DRAW);
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-
-        submesh.vertexOffset = verticesOffset;
-        submesh.indexOffset = indicesOffset;
-
-        verticesOffset += sizeof(float) * myMesh.submeshes[i].vertices.size();
-        indicesOffset += sizeof(u32) * myMesh.submeshes[i].indices.size();
-    }
+    ////Geometry
+    UploadMeshGeometry(app->geometryPool, myMesh);
 
     Model myModel;
 
@@ -267,32 +341,14 @@ u32 LoadCube(App* app)
     submesh.vertexBufferLayout = vertexBufferLayout;
     submesh.vertices.swap(vertices);
     submesh.indices.swap(indices);
+    ComputeSubmeshBounds(submesh);
 
     myMesh.submeshes.push_back(submesh);
 
-    ////Geometry
-    float verticesOffset = 0.0f;
-    float indicesOffset = 0.0f;
-
-    glGenBuffers(1, &myMesh.vertexBufferHandle);
-    glGenBuffers(1, &myMesh.indexBufferHandle);
-
-    for (int i = 0; i < myMesh.submeshes.size(); ++i)
-    {
-        glBindBuffer(GL_ARRAY_BUFFER, myMesh.vertexBufferHandle);
-        glBufferData(GL_ARRAY_BUFFER, sizeof(float) * myMesh.submeshes[i].vertices.size(), &myMesh.submeshes[i].vertices[0], GL_STATIC_DRAW);
-        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    ComputeMeshBounds(myMesh);
 
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, myMesh.indexBufferHandle);
-        glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(u32) * myMesh.submeshes[i].indices.size(), &myMesh.submeshes[i].indices[0], GL_STATIC_DRAW);
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-
-        submesh.vertexOffset = verticesOffset;
-        submesh.indexOffset = indicesOffset;
-
-        verticesOffset += sizeof(float) * myMesh.submeshes[i].vertices.size();
-        indicesOffset += sizeof(u32) * myMesh.submeshes[i].indices.size();
-    }
+    ////Geometry
+    UploadMeshGeometry(app->geometryPool, myMesh);
 
     Model myModel;
 
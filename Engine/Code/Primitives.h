@@ -1,3 +1,5 @@
 u32 LoadSphere(App* app);
+// Low poly sphere (20 * 4^subdivisions triangles) that contains the unit sphere, for light volumes
+u32 LoadIcosphere(App* app, u32 subdivisions);
 u32 LoadQuad(App* app);
 u32 LoadCube(App* app);
\ No newline at end of file
@@ -0,0 +1,750 @@
+#include "benchmark.h"
+#include "engine.h"
+#include "buffer_management.h"
+#include "job_system.h"
+#include "simd_math.h"
+#include "culling.h"
+#include "bvh.h"
+#include "clusters.h"
+#include "trace.h"
+#include <algorithm>
+#include <chrono>
+
+#define BENCHMARK_UNIFORM_ALIGNMENT 256 // worst case GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT
+
+f64 GetBenchmarkTime()
+{
+    using namespace std::chrono;
+    return duration<f64>(steady_clock::now().time_since_epoch()).count();
+}
+
+std::vector<Entity> CreateBenchmarkEntities(u32 count)
+{
+    std::vector<Entity> entities(count);
+
+    // Deterministic grid of rotated entities
+    u32 side = (u32)ceilf(sqrtf((f32)count));
+    for (u32 i = 0; i < count; ++i)
+    {
+        vec3 position = vec3((f32)(i % side) * 3.0f, 0.0f, (f32)(i / side) * 3.0f);
+        entities[i].worldMatrix = TransformPositionScale(position, vec3(1.0f));
+        entities[i].worldMatrix = glm::rotate(entities[i].worldMatrix, (f32)i * 0.1f, vec3(0.0f, 1.0f, 0.0f));
+    }
+
+    return entities;
+}
+
+void RunEntityUpdateBenchmark()
+{
+    const u32 entityCounts[] = { 1000, 10000, 100000 };
+    const u32 slotStride = Align(sizeof(EntityLocalParams), BENCHMARK_UNIFORM_ALIGNMENT);
+
+    printf("Entity update benchmark, world and normal matrices of every entity every frame (%u worker threads + main thread)\n", GetJobSystemWorkerCount());
+    printf("%10s %14s %14s %14s %14s %8s\n", "entities", "serial ms", "serial Me/s", "parallel ms", "parallel Me/s", "speedup");
+
+    for (u32 entityCount : entityCounts)
+    {
+        std::vector<Entity> entities = CreateBenchmarkEntities(entityCount);
+        std::vector<u8> slots((size_t)entityCount * slotStride);
+        std::vector<u8> dirtySlots(entityCount);
+
+        const u32 iterations = glm::max(10u, 2000000u / entityCount);
+        f64 elapsed[2] = {};
+
+        for (u32 parallel = 0; parallel < 2; ++parallel)
+        {
+            f64 start = GetBenchmarkTime();
+            for (u32 it = 0; it < iterations; ++it)
+            {
+                // Same work as Update for a fully dynamic scene (worst case)
+                for (Entity& entity : entities)
+                    entity.dirty = true;
+
+                ParallelForFunction function = [&](u32 begin, u32 end) {
+                    WriteEntityLocalParams(entities.data(), begin, end, slots.data(), slotStride, dirtySlots.data());
+                };
+                if (parallel)
+                    ParallelFor(entityCount, 256, function);
+                else
+                    function(0, entityCount);
+            }
+            elapsed[parallel] = (GetBenchmarkTime() - start) / iterations;
+        }
+
+        printf("%10u %14.3f %14.2f %14.3f %14.2f %7.2fx\n", entityCount,
+               elapsed[0] * 1000.0, entityCount / elapsed[0] / 1e6,
+               elapsed[1] * 1000.0, entityCount / elapsed[1] / 1e6,
+               elapsed[0] / elapsed[1]);
+    }
+
+    // Mostly static scenes: only the slots of the entities that moved are uploaded, in runs of
+    // neighbouring slots as FlushSlotBuffer merges them
+    const u32 entityCount = 10000;
+    const f32 movingFractions[] = { 0.001f, 0.01f, 0.1f, 1.0f };
+
+    printf("\nEntity slot uploads per frame, %u entities\n", entityCount);
+    printf("%10s %14s %14s %10s %10s\n", "moving", "dirty KB", "full KB", "runs", "reduction");
+
+    std::vector<Entity> entities = CreateBenchmarkEntities(entityCount);
+    std::vector<u8> slots((size_t)entityCount * slotStride);
+    std::vector<u8> dirtySlots(entityCount);
+    const u32 fullBytes = entityCount * slotStride;
+
+    for (f32 fraction : movingFractions)
+    {
+        // Same entities for every run, spread over the whole array (worst case for the merging)
+        u32 seed = 1;
+        for (Entity& entity : entities)
+        {
+            seed = seed * 1664525u + 1013904223u;
+            entity.dirty = (seed >> 8) / (f32)(1u << 24) < fraction;
+        }
+        WriteEntityLocalParams(entities.data(), 0, entityCount, slots.data(), slotStride, dirtySlots.data());
+
+        u32 uploadBytes = 0, runCount = 0;
+        for (u32 slot = 0; slot < entityCount;)
+        {
+            if (!dirtySlots[slot])
+            {
+                ++slot;
+                continue;
+            }
+
+            u32 firstSlot = slot;
+            while (slot < entityCount && dirtySlots[slot])
+                dirtySlots[slot++] = 0;
+            uploadBytes += (slot - 1 - firstSlot) * slotStride + sizeof(EntityLocalParams);
+            runCount++;
+        }
+
+        printf("%9.1f%% %14.2f %14.2f %10u %9.1fx\n", fraction * 100.0f, uploadBytes / (f32)KB(1), fullBytes / (f32)KB(1),
+               runCount, fullBytes / (f32)glm::max(uploadBytes, 1u));
+    }
+}
+
+void RunMat4Benchmark()
+{
+    const u32 entityCount = 10000;
+    const u32 iterations = 200;
+
+    glm::mat4 projection = glm::perspective(glm::radians(45.0f), 16.0f / 9.0f, 0.1f, 1000.0f);
+    glm::mat4 view = glm::lookAt(vec3(0.0f, 8.0f, -45.0f), vec3(0.0f), vec3(0.0f, 1.0f, 0.0f));
+
+    std::vector<Entity> entities = CreateBenchmarkEntities(entityCount);
+    std::vector<glm::mat4> reference(2 * entityCount);
+    std::vector<glm::mat4> result(2 * entityCount);
+
+    printf("mat4 benchmark, %u entities (worldView + worldViewProjection), SIMD path: %s\n", entityCount, SIMD_MATH_NAME);
+
+    // glm, projection * view re-multiplied for every entity
+    f64 start = GetBenchmarkTime();
+    for (u32 it = 0; it < iterations; ++it)
+    {
+        for (u32 i = 0; i < entityCount; ++i)
+        {
+            const glm::mat4& world = entities[i].worldMatrix;
+            reference[2 * i + 0] = view * world;
+            reference[2 * i + 1] = projection * view * world;
+        }
+    }
+    f64 glmElapsed = (GetBenchmarkTime() - start) / iterations;
+
+    // glm with the view-projection hoisted out of the loop
+    start = GetBenchmarkTime();
+    for (u32 it = 0; it < iterations; ++it)
+    {
+        glm::mat4 viewProjection = projection * view;
+        for (u32 i = 0; i < entityCount; ++i)
+        {
+            const glm::mat4& world = entities[i].worldMatrix;
+            result[2 * i + 0] = view * world;
+            result[2 * i + 1] = viewProjection * world;
+        }
+    }
+    f64 hoistedElapsed = (GetBenchmarkTime() - start) / iterations;
+
+    // SIMD kernel with the view-projection hoisted
+    start = GetBenchmarkTime();
+    for (u32 it = 0; it < iterations; ++it)
+    {
+        glm::mat4 viewProjection = MultiplyMat4(projection, view);
+        for (u32 i = 0; i < entityCount; ++i)
+        {
+            const glm::mat4& world = entities[i].worldMatrix;
+            result[2 * i + 0] = MultiplyMat4(view, world);
+            result[2 * i + 1] = MultiplyMat4(viewProjection, world);
+        }
+    }
+    f64 simdElapsed = (GetBenchmarkTime() - start) / iterations;
+
+    // The kernel must agree with glm (up to rounding of the reassociated product)
+    f32 maxError = 0.0f;
+    for (u32 i = 0; i < 2 * entityCount; ++i)
+        for (u32 c = 0; c < 4; ++c)
+            for (u32 r = 0; r < 4; ++r)
+                maxError = glm::max(maxError, glm::abs(result[i][c][r] - reference[i][c][r]) / glm::max(1.0f, glm::abs(reference[i][c][r])));
+
+    printf("%20s %10s %12s %8s\n", "path", "ms", "Mmat/s", "speedup");
+    printf("%20s %10.3f %12.2f %7.2fx\n", "glm", glmElapsed * 1000.0, 2 * entityCount / glmElapsed / 1e6, 1.0);
+    printf("%20s %10.3f %12.2f %7.2fx\n", "glm hoisted VP", hoistedElapsed * 1000.0, 2 * entityCount / hoistedElapsed / 1e6, glmElapsed / hoistedElapsed);
+    printf("%20s %10.3f %12.2f %7.2fx\n", "simd hoisted VP", simdElapsed * 1000.0, 2 * entityCount / simdElapsed / 1e6, glmElapsed / simdElapsed);
+    printf("max relative error vs glm: %g\n", maxError);
+}
+
+void CreateBenchmarkBounds(EntityBounds& bounds, u32 entityCount)
+{
+    bounds.centerX.resize(entityCount);
+    bounds.centerY.resize(entityCount);
+    bounds.centerZ.resize(entityCount);
+    bounds.radius.resize(entityCount);
+
+    // Deterministic grid of unit spheres around the camera
+    u32 side = (u32)ceilf(sqrtf((f32)entityCount));
+    for (u32 i = 0; i < entityCount; ++i)
+    {
+        bounds.centerX[i] = ((f32)(i % side) - side * 0.5f) * 3.0f;
+        bounds.centerY[i] = (f32)(i % 7);
+        bounds.centerZ[i] = ((f32)(i / side) - side * 0.5f) * 3.0f;
+        bounds.radius[i] = 1.0f + (f32)(i % 5) * 0.25f;
+    }
+}
+
+void GetBenchmarkFrustumPlanes(vec4 planes[6])
+{
+    // Camera in the middle of the scene, most entities are behind it or out of the sides
+    glm::mat4 projection = glm::perspective(glm::radians(45.0f), 16.0f / 9.0f, 0.1f, 1000.0f);
+    glm::mat4 view = glm::lookAt(vec3(0.0f, 2.0f, 0.0f), vec3(0.0f, 2.0f, 1.0f), vec3(0.0f, 1.0f, 0.0f));
+    Camera::ExtractFrustumPlanes(projection * view, planes);
+}
+
+void RunCullingBenchmark()
+{
+    const u32 entityCounts[] = { 10000, 100000, 1000000 };
+
+    vec4 planes[6];
+    GetBenchmarkFrustumPlanes(planes);
+
+    printf("Culling benchmark, bounding spheres against the 6 frustum planes, SIMD path: %s\n", SIMD_MATH_NAME);
+    printf("%10s %10s %12s %12s %12s %12s %8s\n", "entities", "visible", "scalar ms", "scalar Ms/s", "simd ms", "simd Ms/s", "speedup");
+
+    for (u32 entityCount : entityCounts)
+    {
+        EntityBounds bounds;
+        CreateBenchmarkBounds(bounds, entityCount);
+
+        std::vector<u32> reference(entityCount);
+        std::vector<u32> visible(entityCount);
+        u32 referenceCount = 0, visibleCount = 0;
+
+        const u32 iterations = glm::max(10u, 20000000u / entityCount);
+
+        f64 start = GetBenchmarkTime();
+        for (u32 it = 0; it < iterations; ++it)
+            referenceCount = CullSpheresScalar(planes, bounds.centerX.data(), bounds.centerY.data(), bounds.centerZ.data(), bounds.radius.data(),
+                                               entityCount, reference.data());
+        f64 scalarElapsed = (GetBenchmarkTime() - start) / iterations;
+
+        start = GetBenchmarkTime();
+        for (u32 it = 0; it < iterations; ++it)
+            visibleCount = CullSpheres(planes, bounds.centerX.data(), bounds.centerY.data(), bounds.centerZ.data(), bounds.radius.data(),
+                                       entityCount, visible.data());
+        f64 simdElapsed = (GetBenchmarkTime() - start) / iterations;
+
+        printf("%10u %10u %12.3f %12.2f %12.3f %12.2f %7.2fx\n", entityCount, visibleCount,
+               scalarElapsed * 1000.0, entityCount / scalarElapsed / 1e6,
+               simdElapsed * 1000.0, entityCount / simdElapsed / 1e6,
+               scalarElapsed / simdElapsed);
+
+        // Same planes and the same operation order, the lists must be identical
+        if (visibleCount != referenceCount || memcmp(visible.data(), reference.data(), visibleCount * sizeof(u32)) != 0)
+            printf("  visible lists differ: %u simd vs %u scalar\n", visibleCount, referenceCount);
+    }
+}
+
+void RunBvhBenchmark()
+{
+    const u32 entityCounts[] = { 10000, 100000, 1000000 };
+
+    vec4 planes[6];
+    GetBenchmarkFrustumPlanes(planes);
+
+    printf("BVH benchmark (%u worker threads + main thread)\n", GetJobSystemWorkerCount());
+    printf("%10s %8s %12s %12s %12s %12s %12s %12s\n", "entities", "nodes", "build ms", "par build ms", "refit 1% ms", "refit ms", "linear ms", "query ms");
+
+    for (u32 entityCount : entityCounts)
+    {
+        EntityBounds bounds;
+        CreateBenchmarkBounds(bounds, entityCount);
+        std::vector<u8> dirty(entityCount);
+        Bvh bvh = {};
+
+        const u32 iterations = glm::max(3u, 1000000u / entityCount);
+
+        f64 start = GetBenchmarkTime();
+        for (u32 it = 0; it < iterations; ++it)
+            BuildBvh(bvh, bounds.centerX.data(), bounds.centerY.data(), bounds.centerZ.data(), bounds.radius.data(), entityCount, false);
+        f64 buildElapsed = (GetBenchmarkTime() - start) / iterations;
+
+        start = GetBenchmarkTime();
+        for (u32 it = 0; it < iterations; ++it)
+            BuildBvh(bvh, bounds.centerX.data(), bounds.centerY.data(), bounds.centerZ.data(), bounds.radius.data(), entityCount, true);
+        f64 parallelBuildElapsed = (GetBenchmarkTime() - start) / iterations;
+
+        // Every 100th entity moves a bit
+        start = GetBenchmarkTime();
+        for (u32 it = 0; it < iterations; ++it)
+        {
+            for (u32 i = it % 100; i < entityCount; i += 100)
+            {
+                bounds.centerY[i] += 0.01f;
+                dirty[i] = 1;
+            }
+            RefitBvh(bvh, bounds.centerX.data(), bounds.centerY.data(), bounds.centerZ.data(), bounds.radius.data(), dirty.data());
+        }
+        f64 sparseRefitElapsed = (GetBenchmarkTime() - start) / iterations;
+
+        start = GetBenchmarkTime();
+        for (u32 it = 0; it < iterations; ++it)
+        {
+            memset(dirty.data(), 1, entityCount);
+            RefitBvh(bvh, bounds.centerX.data(), bounds.centerY.data(), bounds.centerZ.data(), bounds.radius.data(), dirty.data());
+        }
+        f64 refitElapsed = (GetBenchmarkTime() - start) / iterations;
+
+        // Frustum queries, the BVH must find the same entities as the linear kernel
+        std::vector<u32> linear(entityCount);
+        std::vector<u32> queried;
+        u32 linearCount = 0;
+
+        start = GetBenchmarkTime();
+        for (u32 it = 0; it < iterations; ++it)
+            linearCount = CullSpheres(planes, bounds.centerX.data(), bounds.centerY.data(), bounds.centerZ.data(), bounds.radius.data(),
+                                      entityCount, linear.data());
+        f64 linearElapsed = (GetBenchmarkTime() - start) / iterations;
+
+        start = GetBenchmarkTime();
+        for (u32 it = 0; it < iterations; ++it)
+        {
+            queried.clear();
+            BvhQueryFrustum(bvh, planes, queried);
+        }
+        f64 queryElapsed = (GetBenchmarkTime() - start) / iterations;
+
+        printf("%10u %8u %12.3f %12.3f %12.3f %12.3f %12.3f %12.3f\n", entityCount, (u32)bvh.nodes.size(),
+               buildElapsed * 1000.0, parallelBuildElapsed * 1000.0, sparseRefitElapsed * 1000.0, refitElapsed * 1000.0,
+               linearElapsed * 1000.0, queryElapsed * 1000.0);
+
+        linear.resize(linearCount);
+        std::sort(queried.begin(), queried.end());
+        if (queried != linear)
+            printf("  visible entities differ: %u bvh vs %u linear\n", (u32)queried.size(), linearCount);
+    }
+}
+
+void CreateBenchmarkClusterLights(ClusterLights& lights, u32 lightCount)
+{
+    lights.centerX.resize(lightCount);
+    lights.centerY.resize(lightCount);
+    lights.centerZ.resize(lightCount);
+    lights.radius.resize(lightCount);
+
+    // Deterministic view space lights in front of the camera, denser close to it
+    for (u32 i = 0; i < lightCount; ++i)
+    {
+        f32 t = (f32)i / lightCount;
+        f32 depth = 1.0f + 150.0f * t * t;
+        lights.centerX[i] = sinf(i * 12.9898f) * depth * 0.7f;
+        lights.centerY[i] = sinf(i * 78.233f) * depth * 0.4f;
+        lights.centerZ[i] = -depth;
+        lights.radius[i] = 2.0f + (f32)(i % 7);
+    }
+}
+
+void RunClusterBenchmark()
+{
+    const u32 lightCounts[] = { 256, 1024, 4096, 16384 };
+
+    glm::mat4 projection = glm::perspective(glm::radians(45.0f), 16.0f / 9.0f, 0.1f, 1000.0f);
+    LightClusters clusters = {};
+    LightClusters reference = {};
+    BuildLightClusters(clusters, projection, 0.1f, 1000.0f);
+    BuildLightClusters(reference, projection, 0.1f, 1000.0f);
+
+    printf("Light cluster benchmark, %ux%ux%u clusters, SIMD path: %s, %u worker threads + main thread\n",
+           CLUSTER_GRID_X, CLUSTER_GRID_Y, CLUSTER_GRID_Z, SIMD_MATH_NAME, GetJobSystemWorkerCount());
+    printf("%10s %10s %10s %12s %12s %12s %8s\n", "lights", "indices", "max/cluster", "scalar ms", "simd ms", "parallel ms", "speedup");
+
+    for (u32 lightCount : lightCounts)
+    {
+        ClusterLights lights;
+        CreateBenchmarkClusterLights(lights, lightCount);
+
+        const u32 iterations = glm::max(3u, 100000u / lightCount);
+
+        f64 start = GetBenchmarkTime();
+        for (u32 it = 0; it < iterations; ++it)
+            AssignLightsToClustersScalar(reference, lights);
+        f64 scalarElapsed = (GetBenchmarkTime() - start) / iterations;
+
+        start = GetBenchmarkTime();
+        for (u32 it = 0; it < iterations; ++it)
+            AssignLightsToClusters(clusters, lights, false);
+        f64 simdElapsed = (GetBenchmarkTime() - start) / iterations;
+
+        start = GetBenchmarkTime();
+        for (u32 it = 0; it < iterations; ++it)
+            AssignLightsToClusters(clusters, lights, true);
+        f64 parallelElapsed = (GetBenchmarkTime() - start) / iterations;
+
+        printf("%10u %10u %10u %12.3f %12.3f %12.3f %7.2fx\n", lightCount, (u32)clusters.lightIndices.size(), clusters.maxClusterLightCount,
+               scalarElapsed * 1000.0, simdElapsed * 1000.0, parallelElapsed * 1000.0, scalarElapsed / parallelElapsed);
+
+        // Same tests in the same order, the lists of every cluster must be identical
+        if (clusters.ranges != reference.ranges || clusters.lightIndices != reference.lightIndices)
+            printf("  cluster lists differ: %u indices vs %u scalar\n", (u32)clusters.lightIndices.size(), (u32)reference.lightIndices.size());
+    }
+}
+
+void AddClusterTestLight(ClusterLights& lights, glm::vec3 center, f32 radius)
+{
+    lights.centerX.push_back(center.x);
+    lights.centerY.push_back(center.y);
+    lights.centerZ.push_back(center.z);
+    lights.radius.push_back(radius);
+}
+
+bool ClusterListContains(const LightClusters& clusters, u32 cluster, u32 light)
+{
+    const glm::uvec2 range = clusters.ranges[cluster];
+    for (u32 i = range.x; i < range.x + range.y; ++i)
+        if (clusters.lightIndices[i] == light)
+            return true;
+    return false;
+}
+
+// Prints the first cluster whose range or indices differ from the reference
+bool CompareClusterLists(const char* testName, const char* pathName, const LightClusters& clusters, const LightClusters& reference)
+{
+    for (u32 cluster = 0; cluster < CLUSTER_COUNT; ++cluster)
+    {
+        const glm::uvec2 range = clusters.ranges[cluster];
+        const glm::uvec2 expected = reference.ranges[cluster];
+        if (range != expected)
+        {
+            printf("FAIL %s: %s cluster %u has range (%u, %u), scalar (%u, %u)\n", testName, pathName, cluster, range.x, range.y, expected.x, expected.y);
+            return false;
+        }
+
+        for (u32 i = 0; i < range.y; ++i)
+        {
+            if (clusters.lightIndices[range.x + i] != reference.lightIndices[expected.x + i])
+            {
+                printf("FAIL %s: %s cluster %u has light %u at %u, scalar %u\n", testName, pathName, cluster,
+                       clusters.lightIndices[range.x + i], i, reference.lightIndices[expected.x + i]);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+int RunClusterSelfTest()
+{
+    const f32 nearPlane = 0.1f, farPlane = 1000.0f;
+    glm::mat4 projection = glm::perspective(glm::radians(45.0f), 16.0f / 9.0f, nearPlane, farPlane);
+    LightClusters reference = {}, serial = {}, parallel = {};
+    BuildLightClusters(reference, projection, nearPlane, farPlane);
+    BuildLightClusters(serial, projection, nearPlane, farPlane);
+    BuildLightClusters(parallel, projection, nearPlane, farPlane);
+
+    printf("Light cluster self-test, SIMD path: %s, %u worker threads + main thread\n", SIMD_MATH_NAME, GetJobSystemWorkerCount());
+
+    // Runs the three paths on the lights and checks they build the same lists
+    auto assign = [&](const char* testName, const ClusterLights& lights)
+    {
+        AssignLightsToClustersScalar(reference, lights);
+        AssignLightsToClusters(serial, lights, false);
+        AssignLightsToClusters(parallel, lights, true);
+        return CompareClusterLists(testName, "simd", serial, reference) && CompareClusterLists(testName, "parallel", parallel, reference);
+    };
+
+    u32 failures = 0;
+
+    // Fixed lights of the benchmark, a count that leaves a partial register
+    {
+        ClusterLights lights;
+        CreateBenchmarkClusterLights(lights, 1003);
+        bool passed = assign("fixed lights", lights) && reference.lightIndices.size() > 0;
+        printf("%s fixed lights: %u lights, %u indices\n", passed ? "PASS" : "FAIL", (u32)lights.radius.size(), (u32)reference.lightIndices.size());
+        failures += !passed;
+    }
+
+    // Lights exactly on a boundary: a point on the plane between two depth slices, that has to be in
+    // the clusters of both, and a sphere tangent to the side of a cluster (distance equal to the radius).
+    // Points on the same plane in the other tiles follow, so both go through the SIMD lanes
+    {
+        const u32 x = 5, y = 3, slice = 11;
+        const u32 nearCluster = GetClusterIndex(x, y, slice), farCluster = GetClusterIndex(x, y, slice + 1);
+        const glm::vec3 nearMin = reference.boundsMin[nearCluster], nearMax = reference.boundsMax[nearCluster];
+        const glm::vec3 farMin = reference.boundsMin[farCluster], farMax = reference.boundsMax[farCluster];
+
+        ClusterLights lights;
+        glm::vec3 onPlane;
+        onPlane.x = (glm::max(nearMin.x, farMin.x) + glm::min(nearMax.x, farMax.x)) * 0.5f;
+        onPlane.y = (glm::max(nearMin.y, farMin.y) + glm::min(nearMax.y, farMax.y)) * 0.5f;
+        onPlane.z = nearMin.z; // the far side of the slice is the near side of the next one
+        AddClusterTestLight(lights, onPlane, 0.0f);
+
+        // The radius is the distance the test computes, so both squares are the same float
+        glm::vec3 tangent = (nearMin + nearMax) * 0.5f;
+        tangent.x = nearMax.x + 0.5f;
+        AddClusterTestLight(lights, tangent, tangent.x - nearMax.x);
+
+        for (u32 i = 1; i <= 14; ++i)
+        {
+            const u32 other = GetClusterIndex((x + i) % CLUSTER_GRID_X, (y + i) % CLUSTER_GRID_Y, slice);
+            glm::vec3 filler = (reference.boundsMin[other] + reference.boundsMax[other]) * 0.5f;
+            filler.z = onPlane.z;
+            AddClusterTestLight(lights, filler, 0.0f);
+        }
+
+        bool passed = assign("boundary", lights);
+        for (const LightClusters* clusters : { &reference, &serial, &parallel })
+        {
+            passed = passed && ClusterListContains(*clusters, nearCluster, 0) && ClusterListContains(*clusters, farCluster, 0);
+            passed = passed && ClusterListContains(*clusters, nearCluster, 1);
+        }
+        printf("%s boundary: slice plane in clusters %u and %u, tangent sphere in cluster %u\n", passed ? "PASS" : "FAIL", nearCluster, farCluster, nearCluster);
+        failures += !passed;
+    }
+
+    // Over-subscribed cluster: more touching lights than CLUSTER_MAX_LIGHTS, mixed with lights in another
+    // cluster of the same slice so the SIMD lanes are partly rejected. The list keeps the first ones in index order
+    {
+        const u32 cluster = GetClusterIndex(8, 4, 10), otherCluster = GetClusterIndex(1, 1, 10);
+        const glm::vec3 center = (reference.boundsMin[cluster] + reference.boundsMax[cluster]) * 0.5f;
+        const glm::vec3 otherCenter = (reference.boundsMin[otherCluster] + reference.boundsMax[otherCluster]) * 0.5f;
+
+        ClusterLights lights;
+        std::vector<u32> touching;
+        for (u32 i = 0; touching.size() < CLUSTER_MAX_LIGHTS + 45; ++i)
+        {
+            if (i % 4 == 1)
+            {
+                AddClusterTestLight(lights, otherCenter, 0.01f);
+                continue;
+            }
+            touching.push_back(i);
+            AddClusterTestLight(lights, center, 0.01f);
+        }
+
+        bool passed = assign("over-subscribed", lights);
+        for (const LightClusters* clusters : { &reference, &serial, &parallel })
+        {
+            const glm::uvec2 range = clusters->ranges[cluster];
+            passed = passed && range.y == CLUSTER_MAX_LIGHTS && clusters->fullClusterCount > 0;
+            for (u32 i = 0; passed && i < CLUSTER_MAX_LIGHTS; ++i)
+                passed = clusters->lightIndices[range.x + i] == touching[i];
+        }
+        printf("%s over-subscribed: %u touching lights, cluster %u keeps %u\n", passed ? "PASS" : "FAIL", (u32)touching.size(), cluster, reference.ranges[cluster].y);
+        failures += !passed;
+    }
+
+    printf("%u failed\n", failures);
+    return failures > 0 ? 1 : 0;
+}
+
+struct FrameTimeStats
+{
+    f64 mean, p50, p95, p99; // ms
+};
+
+FrameTimeStats ComputeFrameTimeStats(std::vector<f64> times)
+{
+    FrameTimeStats stats = {};
+    if (times.empty())
+        return stats;
+
+    std::sort(times.begin(), times.end());
+    for (f64 time : times)
+        stats.mean += time;
+    stats.mean /= times.size();
+
+    // Nearest rank
+    auto percentile = [&](f64 p) { return times[glm::min((u32)ceil(p * times.size()), (u32)times.size()) - 1]; };
+    stats.p50 = percentile(0.50);
+    stats.p95 = percentile(0.95);
+    stats.p99 = percentile(0.99);
+    return stats;
+}
+
+// Between quotes, escaping what would end the string or break the JSON (e.g. a quote in the renderer name)
+void WriteJsonString(FILE* file, const char* string)
+{
+    fputc('"', file);
+    for (const char* c = string; *c; ++c)
+    {
+        if (*c == '"' || *c == '\\')
+            fprintf(file, "\\%c", *c);
+        else if ((u8)*c < 0x20)
+            fprintf(file, "\\u%04x", (u8)*c);
+        else
+            fputc(*c, file);
+    }
+    fputc('"', file);
+}
+
+void WriteFrameTimeStats(FILE* file, const char* name, const FrameTimeStats& stats)
+{
+    fprintf(file, "\"%s\": { \"mean\": %.4f, \"p50\": %.4f, \"p95\": %.4f, \"p99\": %.4f }", name, stats.mean, stats.p50, stats.p95, stats.p99);
+}
+
+void SetHeadlessBenchmarkCamera(Camera& camera, f32 t)
+{
+    // One orbit around the scene, moving in and out and up and down
+    f32 angle = t * TAU;
+    f32 radius = 45.0f - 15.0f * sinf(angle * 2.0f);
+    camera.Position = vec3(sinf(angle) * radius, 8.0f + 4.0f * sinf(angle * 3.0f), -cosf(angle) * radius);
+    camera.LookAt = vec3(0.0f, 2.0f, 0.0f);
+    camera.Orbit = true;
+}
+
+int RunHeadlessBenchmark(App* app, u32 frameCount, const char* outputPath)
+{
+    static const char* modeNames[] = { "Forward", "Deferred", "Deferred Tiled", "Forward Clustered" };
+    static_assert(ARRAY_COUNT(modeNames) == Mode_Count, "Missing mode names");
+
+    frameCount = glm::max(frameCount, 1u);
+    const u32 warmupFrames = glm::min(frameCount, (u32)HEADLESS_BENCHMARK_WARMUP_FRAMES);
+
+    // Only the frame time, the zones of the profiler would add their own queries
+    app->gpuProfiler.enabled = false;
+    app->deltaTime = 1.0f / 60.0f;
+
+    std::vector<GLuint> queries(frameCount * 2);
+    glGenQueries(queries.size(), queries.data());
+
+    FrameTimeStats cpuStats[Mode_Count], gpuStats[Mode_Count];
+    f64 glIssued[Mode_Count] = {}, glSkipped[Mode_Count] = {}; // per frame
+    f64 uploadBytes[Mode_Count] = {}, fullUploadBytes[Mode_Count] = {}; // per frame, the scene is static and only the camera moves
+    bool failed = false;
+    const Camera initialCamera = app->camera;
+
+    printf("Headless benchmark, %u frames per mode at %dx%d on %s\n", frameCount, app->displaySize.x, app->displaySize.y, (const char*)glGetString(GL_RENDERER));
+    printf("%20s %10s %10s %10s %10s %10s %10s %10s %10s %10s %10s\n", "mode", "cpu mean", "cpu p50", "cpu p95", "cpu p99", "gpu mean", "gpu p50", "gpu p95", "gpu p99", "gl issued", "gl skipped");
+
+    for (u32 mode = 0; mode < Mode_Count; ++mode)
+    {
+        app->mode = (Mode)mode;
+        std::vector<f64> cpuTimes(frameCount);
+
+        // The warmup frames retrace the start of the path, so the measured ones are the same in every mode
+        for (u32 frame = 0; frame < warmupFrames + frameCount; ++frame)
+        {
+            bool measured = frame >= warmupFrames;
+            u32 sample = measured ? frame - warmupFrames : 0;
+            // Same frame boundaries as the main loop, for a --trace capture of the benchmark
+            EndTraceFrame();
+            TRACE_ZONE("Frame");
+
+            app->camera = initialCamera;
+            SetHeadlessBenchmarkCamera(app->camera, (f32)(measured ? sample : frame) / frameCount);
+
+            f64 start = GetBenchmarkTime();
+            BeginGpuProfilerFrame(app->gpuProfiler);
+            Update(app);
+            if (measured)
+                glQueryCounter(queries[sample * 2], GL_TIMESTAMP);
+            Render(app);
+            if (measured)
+                glQueryCounter(queries[sample * 2 + 1], GL_TIMESTAMP);
+            EndGpuProfilerFrame(app->gpuProfiler);
+            glFlush();
+
+            if (measured)
+                cpuTimes[sample] = (GetBenchmarkTime() - start) * 1000.0;
+
+            // Every frame, so the error is reported on the frame that raised it
+            for (GLenum error = glGetError(); error != GL_NO_ERROR; error = glGetError())
+            {
+                ELOG("Headless benchmark: GL error 0x%x in mode %s, frame %u%s", error, modeNames[mode], measured ? sample : frame, measured ? "" : " (warmup)");
+                failed = true;
+            }
+
+            if (measured)
+            {
+                // Render just rolled the GL state counters of the previous frame, a warmup one for the first sample
+                const GLStateCounters& counters = GetLastFrameGLStateCounters();
+                for (u32 call = 0; call < GLStateCall_Count; ++call)
+                {
+                    glIssued[mode] += counters.issued[call];
+                    glSkipped[mode] += counters.skipped[call];
+                }
+
+                uploadBytes[mode] += app->frameUploadBytes;
+                fullUploadBytes[mode] += app->frameFullUploadBytes;
+            }
+        }
+        glIssued[mode] /= frameCount;
+        glSkipped[mode] /= frameCount;
+        uploadBytes[mode] /= frameCount;
+        fullUploadBytes[mode] /= frameCount;
+
+        // Everything was submitted, waiting on the results doesn't disturb the measures anymore
+        std::vector<f64> gpuTimes(frameCount);
+        for (u32 sample = 0; sample < frameCount; ++sample)
+        {
+            GLuint64 begin = 0, end = 0;
+            glGetQueryObjectui64v(queries[sample * 2], GL_QUERY_RESULT, &begin);
+            glGetQueryObjectui64v(queries[sample * 2 + 1], GL_QUERY_RESULT, &end);
+            gpuTimes[sample] = (end - begin) / 1e6;
+        }
+
+        for (GLenum error = glGetError(); error != GL_NO_ERROR; error = glGetError())
+        {
+            ELOG("Headless benchmark: GL error 0x%x reading the GPU times of mode %s", error, modeNames[mode]);
+            failed = true;
+        }
+
+        cpuStats[mode] = ComputeFrameTimeStats(cpuTimes);
+        gpuStats[mode] = ComputeFrameTimeStats(gpuTimes);
+        printf("%20s %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f %10.1f %10.1f\n", modeNames[mode],
+               cpuStats[mode].mean, cpuStats[mode].p50, cpuStats[mode].p95, cpuStats[mode].p99,
+               gpuStats[mode].mean, gpuStats[mode].p50, gpuStats[mode].p95, gpuStats[mode].p99, glIssued[mode], glSkipped[mode]);
+    }
+
+    for (u32 mode = 0; mode < Mode_Count; ++mode)
+        printf("%20s uploads %.2f KB per frame, %.2f KB without dirty tracking (%.1fx less)\n", modeNames[mode],
+               uploadBytes[mode] / KB(1), fullUploadBytes[mode] / KB(1), fullUploadBytes[mode] / glm::max(uploadBytes[mode], 1.0));
+
+    glDeleteQueries(queries.size(), queries.data());
+    app->camera = initialCamera;
+
+    FILE* file = fopen(outputPath, "w");
+    if (!file)
+    {
+        ELOG("Headless benchmark: could not write %s", outputPath);
+        return 1;
+    }
+
+    fprintf(file, "{\n  \"frames\": %u,\n  \"width\": %d,\n  \"height\": %d,\n  \"renderer\": ", frameCount, app->displaySize.x, app->displaySize.y);
+    WriteJsonString(file, (const char*)glGetString(GL_RENDERER));
+    fprintf(file, ",\n  \"modes\": [\n");
+    for (u32 mode = 0; mode < Mode_Count; ++mode)
+    {
+        fprintf(file, "    { \"mode\": ");
+        WriteJsonString(file, modeNames[mode]);
+        fprintf(file, ", ");
+        WriteFrameTimeStats(file, "cpu_ms", cpuStats[mode]);
+        fprintf(file, ", ");
+        WriteFrameTimeStats(file, "gpu_ms", gpuStats[mode]);
+        fprintf(file, ", \"gl_state_calls_per_frame\": { \"issued\": %.1f, \"skipped\": %.1f }", glIssued[mode], glSkipped[mode]);
+        fprintf(file, ", \"upload_bytes_per_frame\": { \"dirty\": %.0f, \"full\": %.0f, \"reduction\": %.2f }",
+                uploadBytes[mode], fullUploadBytes[mode], fullUploadBytes[mode] / glm::max(uploadBytes[mode], 1.0));
+        fprintf(file, " }%s\n", mode + 1 < Mode_Count ? "," : "");
+    }
+    fprintf(file, "  ],\n  \"failed\": %s\n}\n", failed ? "true" : "false");
+    fclose(file);
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,66 @@
+//
+// benchmark.h: Benchmarks of the engine CPU hot paths. They are run from the command
+// line (see main in platform.cpp) and, but for the headless one, don't need a window nor
+// a graphics context.
+//
+
+#pragma once
+
+#include "platform.h"
+
+/**
+ * Measures how many entities per second get their LocalParams written (serial and through
+ * the job system) for scenes of 1k, 10k and 100k entities that all move every frame. Then
+ * reports the bytes of entity slots uploaded per frame when only a fraction of them moves.
+ */
+void RunEntityUpdateBenchmark();
+
+/**
+ * Compares the per-entity matrix products of glm (with and without the view-projection
+ * hoisted) against the SIMD MultiplyMat4 of simd_math.h, and checks they agree.
+ */
+void RunMat4Benchmark();
+
+/**
+ * Measures how many bounding spheres per second the frustum culling kernel of culling.h tests
+ * (SIMD path and one sphere at a time) for scenes of 10k, 100k and 1M entities spread around
+ * the camera, and checks both paths output the same visible list.
+ */
+void RunCullingBenchmark();
+
+/**
+ * Measures the entity BVH of bvh.h for scenes of 10k, 100k and 1M entities: serial and parallel
+ * builds, refits with 1% and all of the entities moved, and frustum queries against the linear
+ * culling kernel (checking both find the same entities).
+ */
+void RunBvhBenchmark();
+
+/**
+ * Measures the assignment of point lights to the clusters of clusters.h for 256 to 16k lights in
+ * front of the camera: every light against every cluster one at a time, the SIMD path per depth
+ * slice, and the same with the slices in the job system. Checks all of them build the same lists.
+ */
+void RunClusterBenchmark();
+
+/**
+ * Checks the scalar, SIMD and parallel cluster assignments build the same ranges and indices for
+ * fixed lights, lights exactly on a cluster boundary and a cluster with more than CLUSTER_MAX_LIGHTS
+ * lights (which must keep the first ones). Returns the exit status: 1 if any check fails.
+ */
+int RunClusterSelfTest();
+
+struct App;
+
+#define HEADLESS_BENCHMARK_FRAMES        300
+#define HEADLESS_BENCHMARK_WARMUP_FRAMES 30
+
+/**
+ * Renders frameCount frames in each render mode along the same scripted camera orbit, after a few
+ * warmup frames, and reports the mean, p50, p95 and p99 CPU (Update and Render) and GPU (Render)
+ * frame times, the GL state calls issued and skipped per frame (see gl_state.h) and the bytes
+ * uploaded per frame with and without the dirty tracking (the scene is static), on the
+ * console and as JSON in outputPath. Unlike the others it needs the app initialized on a GL
+ * context, without a window it's a headless one drawing into an offscreen backbuffer (see
+ * headless_context.h and RunHeadlessMain). GL errors are checked after every frame. Returns the exit status: 1 on GL errors or if the file can't be written.
+ */
+int RunHeadlessBenchmark(App* app, u32 frameCount, const char* outputPath);
@@ -14,6 +14,7 @@ Buffer CreateBuffer(u32 size, GLenum type, GLenum usage)
 {
     Buffer buffer = {};
     buffer.size = size;
+    buffer.regionSize = size;
     buffer.type = type;
 
     glGenBuffers(1, &buffer.handle);
@@ -24,13 +25,77 @@ Buffer CreateBuffer(u32 size, GLenum type, GLenum usage)
     return buffer;
 }
 
+Buffer CreatePersistentBuffer(u32 size, GLenum type, u32 alignment)
+{
+    if (!GLExt.bufferStorage)
+        return CreateBuffer(size, type, GL_STREAM_DRAW);
+
+    Buffer buffer = {};
+    buffer.type = type;
+    buffer.persistent = true;
+    buffer.regionSize = Align(size, alignment);
+    buffer.regionIdx = BUFFER_FRAMES_IN_FLIGHT - 1; // so the first frame starts at region 0
+    buffer.size = buffer.regionSize * BUFFER_FRAMES_IN_FLIGHT;
+
+    GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+    glGenBuffers(1, &buffer.handle);
+    glBindBuffer(type, buffer.handle);
+    glBufferStorage(type, buffer.size, NULL, flags);
+    buffer.data = glMapBufferRange(type, 0, buffer.size, flags);
+    glBindBuffer(type, 0);
+
+    return buffer;
+}
+
+void DestroyBuffer(Buffer& buffer)
+{
+    for (u32 i = 0; i < BUFFER_FRAMES_IN_FLIGHT; ++i)
+        if (buffer.regionFences[i])
+            glDeleteSync(buffer.regionFences[i]);
+
+    // Deleting the buffer also unmaps it if it is persistently mapped
+    glDeleteBuffers(1, &buffer.handle);
+    buffer = {};
+}
+
 void BindBuffer(const Buffer& buffer)
 {
     glBindBuffer(buffer.type, buffer.handle);
 }
 
+void WaitBufferRegion(Buffer& buffer, u32 regionIdx)
+{
+    GLsync& fence = buffer.regionFences[regionIdx];
+    if (!fence)
+        return;
+
+    // First try without blocking, then flush and wait in small steps
+    GLbitfield waitFlags = 0;
+    GLuint64 waitTimeout = 0;
+    for (;;)
+    {
+        GLenum result = glClientWaitSync(fence, waitFlags, waitTimeout);
+        if (result == GL_ALREADY_SIGNALED || result == GL_CONDITION_SATISFIED || result == GL_WAIT_FAILED)
+            break;
+        waitFlags = GL_SYNC_FLUSH_COMMANDS_BIT;
+        waitTimeout = 1000000; // 1ms
+    }
+
+    glDeleteSync(fence);
+    fence = NULL;
+}
+
 void MapBuffer(Buffer& buffer, GLenum access)
 {
+    if (buffer.persistent)
+    {
+        buffer.regionIdx = (buffer.regionIdx + 1) % BUFFER_FRAMES_IN_FLIGHT;
+        WaitBufferRegion(buffer, buffer.regionIdx);
+        buffer.head = buffer.regionIdx * buffer.regionSize;
+        return;
+    }
+
     glBindBuffer(buffer.type, buffer.handle);
     buffer.data = (u8*)glMapBuffer(buffer.type, access);
     buffer.head = 0;
@@ -38,10 +103,30 @@ void MapBuffer(Buffer& buffer, GLenum access)
 
 void UnmapBuffer(Buffer& buffer)
 {
+    buffer.bytesUsed = buffer.head - GetBufferRegionStart(buffer);
+    if (buffer.bytesUsed > buffer.highWaterMark)
+        buffer.highWaterMark = buffer.bytesUsed;
+
+    // Coherent mapping, the writes are visible to the GL without flushing
+    if (buffer.persistent)
+        return;
+
+    glBindBuffer(buffer.type, buffer.handle);
     glUnmapBuffer(buffer.type);
     glBindBuffer(buffer.type, 0);
 }
 
+void FenceBuffer(Buffer& buffer)
+{
+    if (!buffer.persistent)
+        return;
+
+    GLsync& fence = buffer.regionFences[buffer.regionIdx];
+    if (fence)
+        glDeleteSync(fence);
+    fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
 void AlignHead(Buffer& buffer, u32 alignment)
 {
     ASSERT(IsPowerOf2(alignment), "The alignment must be a power of 2");
@@ -52,6 +137,191 @@ void PushAlignedData(Buffer& buffer, const void* data, u32 size, u32 alignment)
 {
     ASSERT(buffer.data != NULL, "The buffer must be mapped first");
     AlignHead(buffer, alignment);
+    ASSERT(buffer.head + size <= GetBufferRegionEnd(buffer), "Trying to push more data than the buffer can hold");
     memcpy((u8*)buffer.data + buffer.head, data, size);
     buffer.head += size;
-}
\ No newline at end of file
+}
+u32 GetBufferRegionStart(const Buffer& buffer)
+{
+    return buffer.persistent ? buffer.regionIdx * buffer.regionSize : 0;
+}
+
+u32 GetBufferRegionEnd(const Buffer& buffer)
+{
+    return buffer.persistent ? (buffer.regionIdx + 1) * buffer.regionSize : buffer.size;
+}
+
+UniformArena CreateUniformArena(u32 chunkSize, u32 alignment)
+{
+    UniformArena arena = {};
+    arena.chunkSize = Align(chunkSize, alignment);
+    arena.alignment = alignment;
+    arena.chunks.push_back(CreatePersistentConstantBuffer(arena.chunkSize, alignment));
+    return arena;
+}
+
+void MapUniformArena(UniformArena& arena)
+{
+    // Chunks past the first one are mapped on demand by AllocUniformBlock
+    arena.chunkIdx = 0;
+    MapBuffer(arena.chunks[0], GL_WRITE_ONLY);
+}
+
+void UnmapUniformArena(UniformArena& arena)
+{
+    arena.frameBytesUsed = 0;
+    for (u32 i = 0; i <= arena.chunkIdx; ++i)
+    {
+        Buffer& chunk = arena.chunks[i];
+        arena.frameBytesUsed += chunk.head - GetBufferRegionStart(chunk);
+        UnmapBuffer(chunk);
+    }
+
+    if (arena.frameBytesUsed > arena.highWaterMark)
+        arena.highWaterMark = arena.frameBytesUsed;
+}
+
+void FenceUniformArena(UniformArena& arena)
+{
+    for (u32 i = 0; i <= arena.chunkIdx; ++i)
+        FenceBuffer(arena.chunks[i]);
+}
+
+Buffer& AllocUniformBlock(UniformArena& arena, u32 size)
+{
+    ASSERT(size <= arena.chunkSize, "The uniform block is bigger than an arena chunk");
+
+    Buffer* chunk = &arena.chunks[arena.chunkIdx];
+    AlignHead(*chunk, arena.alignment);
+
+    if (chunk->head + size > GetBufferRegionEnd(*chunk))
+    {
+        arena.chunkIdx++;
+        if (arena.chunkIdx == arena.chunks.size())
+            arena.chunks.push_back(CreatePersistentConstantBuffer(arena.chunkSize, arena.alignment));
+
+        chunk = &arena.chunks[arena.chunkIdx];
+        MapBuffer(*chunk, GL_WRITE_ONLY);
+    }
+
+    return *chunk;
+}
+
+UniformBlock ReserveUniformBlock(UniformArena& arena, u32 size)
+{
+    Buffer& chunk = AllocUniformBlock(arena, size);
+
+    UniformBlock block = {};
+    block.buffer = chunk.handle;
+    block.offset = chunk.head;
+    block.size = size;
+    block.data = (u8*)chunk.data + chunk.head;
+
+    chunk.head += size;
+    return block;
+}
+
+SlotBuffer CreateSlotBuffer(GLenum type, u32 slotSize, u32 alignment)
+{
+    SlotBuffer slots = {};
+    slots.buffer.type = type;
+    slots.slotSize = slotSize;
+    slots.slotStride = Align(slotSize, alignment);
+    return slots;
+}
+
+void DestroySlotBuffer(SlotBuffer& slots)
+{
+    if (slots.buffer.handle)
+        DestroyBuffer(slots.buffer);
+    slots = {};
+}
+
+bool ResizeSlotBuffer(SlotBuffer& slots, u32 slotCount)
+{
+    if (slotCount == slots.slotCount)
+        return false;
+
+    // New slots start dirty, their elements have never been uploaded
+    slots.shadow.resize(slotCount * slots.slotStride);
+    slots.dirtySlots.resize(slotCount, 1);
+
+    u32 capacity = slots.buffer.handle ? slots.buffer.size / slots.slotStride : 0;
+    if (slotCount > capacity)
+    {
+        // Grow with some slack so the buffer is not recreated every time an element is added. The
+        // slots of static elements are written once, the others by the copies of the flushes
+        GLenum type = slots.buffer.type;
+        if (slots.buffer.handle)
+            DestroyBuffer(slots.buffer);
+        slots.buffer = CreateBuffer((slotCount + slotCount / 2) * slots.slotStride, type, GL_STATIC_DRAW);
+        slots.dirtySlots.assign(slotCount, 1);
+    }
+
+    slots.slotCount = slotCount;
+    return true;
+}
+
+u8* WriteSlot(SlotBuffer& slots, u32 slot)
+{
+    ASSERT(slot < slots.slotCount, "Slot out of range");
+    slots.dirtySlots[slot] = 1;
+    return slots.shadow.data() + slot * slots.slotStride;
+}
+
+u32 GetSlotOffset(const SlotBuffer& slots, u32 slot)
+{
+    return slot * slots.slotStride;
+}
+
+void FlushSlotBuffer(SlotBuffer& slots, UniformArena& staging)
+{
+    slots.bytesUploaded = 0;
+
+    const bool staged = staging.chunks[0].persistent;
+    glBindBuffer(GL_COPY_WRITE_BUFFER, slots.buffer.handle);
+
+    u32 slot = 0;
+    while (slot < slots.slotCount)
+    {
+        if (!slots.dirtySlots[slot])
+        {
+            ++slot;
+            continue;
+        }
+
+        u32 firstSlot = slot;
+        while (slot < slots.slotCount && slots.dirtySlots[slot])
+            slots.dirtySlots[slot++] = 0;
+
+        // The padding between slots goes along, one call per run is cheaper than one per slot
+        u32 offset = firstSlot * slots.slotStride;
+        u32 size = (slot - 1 - firstSlot) * slots.slotStride + slots.slotSize;
+        slots.bytesUploaded += size;
+
+        if (!staged)
+        {
+            glBufferSubData(GL_COPY_WRITE_BUFFER, offset, size, slots.shadow.data() + offset);
+            continue;
+        }
+
+        // Runs longer than a chunk (e.g. every slot after a resize) are split
+        for (u32 copied = 0; copied < size;)
+        {
+            u32 blockSize = glm::min(size - copied, staging.chunkSize);
+            UniformBlock block = ReserveUniformBlock(staging, blockSize);
+            memcpy(block.data, slots.shadow.data() + offset + copied, blockSize);
+
+            // Coherent mapping, the copy already sees the data
+            glBindBuffer(GL_COPY_READ_BUFFER, block.buffer);
+            glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, block.offset, offset + copied, blockSize);
+            copied += blockSize;
+        }
+    }
+
+    if (slots.bytesUploaded > slots.highWaterMark)
+        slots.highWaterMark = slots.bytesUploaded;
+
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+}
@@ -5,15 +5,83 @@
 bool IsPowerOf2(u32 value);
 u32 Align(u32 value, u32 alignment);
 Buffer CreateBuffer(u32 size, GLenum type, GLenum usage);
+
+/**
+ * Creates an immutable buffer that stays mapped (persistent and coherent) for its whole life.
+ * It is split in BUFFER_FRAMES_IN_FLIGHT regions of the given size, each one guarded by a fence,
+ * so the CPU can fill the region of the current frame while the GPU is still reading the others.
+ * Falls back to a regular stream buffer when ARB_buffer_storage is not available.
+ */
+Buffer CreatePersistentBuffer(u32 size, GLenum type, u32 alignment);
+
+void DestroyBuffer(Buffer& buffer);
+
 void BindBuffer(const Buffer& buffer);
+
+/**
+ * For persistent buffers it does not map anything: it waits until the next region
+ * is free and moves the head to its start. The head is always an offset from the
+ * beginning of the whole buffer, so it can be used directly with glBindBufferRange.
+ */
 void MapBuffer(Buffer& buffer, GLenum access);
+
+// Also records how much of the region was filled (bytesUsed and highWaterMark)
 void UnmapBuffer(Buffer& buffer);
+
+/**
+ * Marks the current region of a persistent buffer as in use by the GPU.
+ * Call it once all the draw calls reading from the region have been issued.
+ */
+void FenceBuffer(Buffer& buffer);
 void AlignHead(Buffer& buffer, u32 alignment);
 void PushAlignedData(Buffer& buffer, const void* data, u32 size, u32 alignment);
 
+// Range of the buffer the head can move in (the current region for persistent buffers)
+u32 GetBufferRegionStart(const Buffer& buffer);
+u32 GetBufferRegionEnd(const Buffer& buffer);
+
+UniformArena CreateUniformArena(u32 chunkSize, u32 alignment);
+void MapUniformArena(UniformArena& arena);
+void UnmapUniformArena(UniformArena& arena);
+void FenceUniformArena(UniformArena& arena);
+
+/**
+ * Returns the chunk where a block of the given size fits, with its head already aligned.
+ * The caller pushes its data into it and binds the range (chunk.handle, head at start, size).
+ * A new chunk is created and mapped if none of the existing ones has enough room left.
+ */
+Buffer& AllocUniformBlock(UniformArena& arena, u32 size);
+
+// Like AllocUniformBlock but it only moves the head, the data is written later by the caller
+UniformBlock ReserveUniformBlock(UniformArena& arena, u32 size);
+
+SlotBuffer CreateSlotBuffer(GLenum type, u32 slotSize, u32 alignment);
+void DestroySlotBuffer(SlotBuffer& slots);
+
+/**
+ * Sets the number of slots. The contents of the existing slots are kept. When the GL buffer
+ * has to grow it is recreated (with some slack) and every slot is flagged to be uploaded again.
+ * Returns true if the number of slots changed.
+ */
+bool ResizeSlotBuffer(SlotBuffer& slots, u32 slotCount);
+
+// Returns the CPU copy of the slot to be written, and flags it to be uploaded on the next flush
+u8* WriteSlot(SlotBuffer& slots, u32 slot);
+u32 GetSlotOffset(const SlotBuffer& slots, u32 slot);
+
+/**
+ * Uploads the flagged slots, merging the neighbouring ones in a single run. The runs are written
+ * to the (mapped) staging arena and copied into the slot buffer on the GPU, after the draws of the
+ * frames in flight that may still read the old slots, so neither the CPU nor the driver waits.
+ * Without persistent mapping the arena can't be a copy source, then they go in with glBufferSubData.
+ */
+void FlushSlotBuffer(SlotBuffer& slots, UniformArena& staging);
+
 #define CreateConstantBuffer(size) CreateBuffer(size, GL_UNIFORM_BUFFER, GL_STREAM_DRAW)
+#define CreatePersistentConstantBuffer(size, alignment) CreatePersistentBuffer(size, GL_UNIFORM_BUFFER, alignment)
 #define CreateStaticVertexBuffer(size) CreateBuffer(size, GL_ARRAY_BUFFER, GL_STATIC_DRAW)
 #define CreateStaticIndexBuffer(size) CreateBuffer(size, GL_ELEMENT_ARRAY_BUFFER, GL_STATIC_DRAW)
+#define CreatePersistentStorageBuffer(size, alignment) CreatePersistentBuffer(size, GL_SHADER_STORAGE_BUFFER, alignment)
 
 #define PushData(buffer, data, size) PushAlignedData(buffer, data, size, 1)
 #define PushUInt(buffer, value) { u32 v = value; PushAlignedData(buffer, &v, sizeof(v), 4); }
@@ -0,0 +1,527 @@
+#include "bvh.h"
+#include "job_system.h"
+#include <atomic>
+#include <algorithm>
+#include <float.h>
+#include <string.h>
+
+#define BVH_MAX_DEPTH              48   // deeper nodes become leaves, so the query stacks are fixed
+#define BVH_PARALLEL_MIN_ITEMS     1024 // smaller subtrees are not worth a task
+#define BVH_TASKS_PER_THREAD       4
+#define BVH_TRAVERSAL_COST         1.0f // relative to the test of one item
+
+struct BvhBin
+{
+    glm::vec3 min;
+    glm::vec3 max;
+    u32       count;
+};
+
+struct BvhStackEntry
+{
+    u32 nodeIdx;
+    u32 value; // depth while building, plane mask in frustum queries
+};
+
+inline f32 SurfaceArea(const glm::vec3& min, const glm::vec3& max)
+{
+    glm::vec3 e = glm::max(max - min, glm::vec3(0.0f));
+    return e.x * e.y + e.y * e.z + e.z * e.x;
+}
+
+void SetBvhNodeBounds(Bvh& bvh, BvhNode& node, u32 first, u32 count)
+{
+    glm::vec3 min = glm::vec3(FLT_MAX), max = glm::vec3(-FLT_MAX);
+    for (u32 slot = first; slot < first + count; ++slot)
+    {
+        const glm::vec4& sphere = bvh.spheres[slot];
+        min = glm::min(min, glm::vec3(sphere) - sphere.w);
+        max = glm::max(max, glm::vec3(sphere) + sphere.w);
+    }
+    node.min = min;
+    node.max = max;
+    node.leftFirst = first;
+    node.count = count;
+}
+
+inline u32 GetBvhBin(f32 centroid, f32 binMin, f32 binScale)
+{
+    return glm::min((u32)((centroid - binMin) * binScale), (u32)BVH_BINS - 1);
+}
+
+// Splits a leaf in two with the binned SAH plane of lowest cost. Returns false if it stays a leaf
+bool SplitBvhNode(Bvh& bvh, u32 nodeIdx, u32 depth, std::atomic<u32>& nodeCount)
+{
+    BvhNode& node = bvh.nodes[nodeIdx];
+    const u32 first = node.leftFirst;
+    const u32 count = node.count;
+    if (count <= BVH_MAX_LEAF_ITEMS || depth >= BVH_MAX_DEPTH)
+        return false;
+
+    glm::vec3 centroidMin = glm::vec3(FLT_MAX), centroidMax = glm::vec3(-FLT_MAX);
+    for (u32 slot = first; slot < first + count; ++slot)
+    {
+        centroidMin = glm::min(centroidMin, glm::vec3(bvh.spheres[slot]));
+        centroidMax = glm::max(centroidMax, glm::vec3(bvh.spheres[slot]));
+    }
+
+    f32 bestCost = FLT_MAX;
+    i32 bestAxis = -1;
+    u32 bestBin = 0;
+
+    for (i32 axis = 0; axis < 3; ++axis)
+    {
+        const f32 extent = centroidMax[axis] - centroidMin[axis];
+        if (extent <= 0.0f)
+            continue;
+
+        BvhBin bins[BVH_BINS];
+        for (BvhBin& bin : bins)
+            bin = BvhBin{ glm::vec3(FLT_MAX), glm::vec3(-FLT_MAX), 0 };
+
+        const f32 binScale = BVH_BINS / extent;
+        for (u32 slot = first; slot < first + count; ++slot)
+        {
+            const glm::vec4& sphere = bvh.spheres[slot];
+            BvhBin& bin = bins[GetBvhBin(sphere[axis], centroidMin[axis], binScale)];
+            bin.min = glm::min(bin.min, glm::vec3(sphere) - sphere.w);
+            bin.max = glm::max(bin.max, glm::vec3(sphere) + sphere.w);
+            bin.count++;
+        }
+
+        // Cost of the items left of every plane, then added to the right ones sweeping back
+        f32 leftCost[BVH_BINS - 1];
+        glm::vec3 min = glm::vec3(FLT_MAX), max = glm::vec3(-FLT_MAX);
+        u32 leftCount = 0;
+        for (u32 i = 0; i < BVH_BINS - 1; ++i)
+        {
+            min = glm::min(min, bins[i].min);
+            max = glm::max(max, bins[i].max);
+            leftCount += bins[i].count;
+            leftCost[i] = leftCount ? leftCount * SurfaceArea(min, max) : FLT_MAX;
+        }
+
+        min = glm::vec3(FLT_MAX), max = glm::vec3(-FLT_MAX);
+        u32 rightCount = 0;
+        for (u32 i = BVH_BINS - 1; i > 0; --i)
+        {
+            min = glm::min(min, bins[i].min);
+            max = glm::max(max, bins[i].max);
+            rightCount += bins[i].count;
+            if (!rightCount || leftCost[i - 1] == FLT_MAX)
+                continue;
+
+            f32 cost = leftCost[i - 1] + rightCount * SurfaceArea(min, max);
+            if (cost < bestCost)
+            {
+                bestCost = cost;
+                bestAxis = axis;
+                bestBin = i - 1;
+            }
+        }
+    }
+
+    // Every centroid in the same point, the items can't be told apart
+    if (bestAxis < 0)
+        return false;
+
+    // Not worth it when testing all the items is cheaper than a split (unless the leaf is too big)
+    const f32 nodeArea = SurfaceArea(node.min, node.max);
+    if (count <= 4 * BVH_MAX_LEAF_ITEMS && bestCost + BVH_TRAVERSAL_COST * nodeArea >= count * nodeArea)
+        return false;
+
+    // Partition the slots in place
+    const f32 binScale = BVH_BINS / (centroidMax[bestAxis] - centroidMin[bestAxis]);
+    u32 i = first;
+    u32 j = first + count;
+    while (i < j)
+    {
+        if (GetBvhBin(bvh.spheres[i][bestAxis], centroidMin[bestAxis], binScale) <= bestBin)
+        {
+            ++i;
+        }
+        else
+        {
+            --j;
+            std::swap(bvh.spheres[i], bvh.spheres[j]);
+            std::swap(bvh.items[i], bvh.items[j]);
+        }
+    }
+
+    const u32 leftCount = i - first;
+    ASSERT(leftCount > 0 && leftCount < count, "Empty side in a BVH split");
+
+    u32 leftIdx = nodeCount.fetch_add(2);
+    SetBvhNodeBounds(bvh, bvh.nodes[leftIdx + 0], first, leftCount);
+    SetBvhNodeBounds(bvh, bvh.nodes[leftIdx + 1], i, count - leftCount);
+
+    node.leftFirst = leftIdx;
+    node.count = 0;
+    return true;
+}
+
+void BuildBvhSubtree(Bvh& bvh, u32 rootIdx, u32 rootDepth, std::atomic<u32>& nodeCount)
+{
+    BvhStackEntry stack[BVH_MAX_DEPTH + 2];
+    u32 stackSize = 0;
+    stack[stackSize++] = BvhStackEntry{ rootIdx, rootDepth };
+
+    while (stackSize)
+    {
+        BvhStackEntry entry = stack[--stackSize];
+        if (!SplitBvhNode(bvh, entry.nodeIdx, entry.value, nodeCount))
+            continue;
+
+        u32 leftIdx = bvh.nodes[entry.nodeIdx].leftFirst;
+        stack[stackSize++] = BvhStackEntry{ leftIdx + 1, entry.value + 1 };
+        stack[stackSize++] = BvhStackEntry{ leftIdx + 0, entry.value + 1 };
+    }
+}
+
+void BuildBvh(Bvh& bvh, const f32* centerX, const f32* centerY, const f32* centerZ, const f32* radius, u32 count, bool parallel)
+{
+    bvh.nodes.clear();
+    bvh.items.resize(count);
+    bvh.spheres.resize(count);
+    bvh.itemSlots.resize(count);
+    bvh.itemLeafs.resize(count);
+    bvh.refittedNodes = 0;
+    if (count == 0)
+    {
+        bvh.dirtyNodes.clear();
+        return;
+    }
+
+    for (u32 i = 0; i < count; ++i)
+    {
+        bvh.items[i] = i;
+        bvh.spheres[i] = glm::vec4(centerX[i], centerY[i], centerZ[i], radius[i]);
+    }
+
+    // A binary tree with leaves of at least one item has less than 2 * count nodes
+    bvh.nodes.resize(2 * count);
+    SetBvhNodeBounds(bvh, bvh.nodes[0], 0, count);
+    std::atomic<u32> nodeCount(1);
+
+    // Split the top levels here until there are enough subtrees for all the threads
+    std::vector<BvhStackEntry> tasks = { BvhStackEntry{ 0, 0 } };
+    const u32 taskTarget = parallel ? (GetJobSystemWorkerCount() + 1) * BVH_TASKS_PER_THREAD : 1;
+    while (tasks.size() < taskTarget)
+    {
+        std::vector<BvhStackEntry> nextTasks;
+        for (const BvhStackEntry& task : tasks)
+        {
+            if (bvh.nodes[task.nodeIdx].count >= BVH_PARALLEL_MIN_ITEMS && SplitBvhNode(bvh, task.nodeIdx, task.value, nodeCount))
+            {
+                u32 leftIdx = bvh.nodes[task.nodeIdx].leftFirst;
+                nextTasks.push_back(BvhStackEntry{ leftIdx + 0, task.value + 1 });
+                nextTasks.push_back(BvhStackEntry{ leftIdx + 1, task.value + 1 });
+            }
+            else
+            {
+                nextTasks.push_back(task);
+            }
+        }
+
+        // Nothing was big enough to split
+        if (nextTasks.size() == tasks.size())
+            break;
+        tasks.swap(nextTasks);
+    }
+
+    // The subtrees work on disjoint slot ranges, only the node allocation is shared
+    ParallelForFunction function = [&](u32 begin, u32 end) {
+        for (u32 i = begin; i < end; ++i)
+            BuildBvhSubtree(bvh, tasks[i].nodeIdx, tasks[i].value, nodeCount);
+    };
+    if (parallel && tasks.size() > 1)
+        ParallelFor(tasks.size(), 1, function);
+    else
+        function(0, tasks.size());
+
+    bvh.nodes.resize(nodeCount.load());
+    bvh.dirtyNodes.assign(bvh.nodes.size(), 0);
+
+    for (u32 nodeIdx = 0; nodeIdx < bvh.nodes.size(); ++nodeIdx)
+    {
+        const BvhNode& node = bvh.nodes[nodeIdx];
+        for (u32 slot = node.leftFirst; slot < node.leftFirst + node.count; ++slot)
+        {
+            bvh.itemSlots[bvh.items[slot]] = slot;
+            bvh.itemLeafs[bvh.items[slot]] = nodeIdx;
+        }
+    }
+}
+
+void RefitBvh(Bvh& bvh, const f32* centerX, const f32* centerY, const f32* centerZ, const f32* radius, u8* dirtyItems)
+{
+    bvh.refittedNodes = 0;
+
+    bool anyDirty = false;
+    for (u32 item = 0; item < bvh.items.size(); ++item)
+    {
+        if (!dirtyItems[item])
+            continue;
+
+        bvh.spheres[bvh.itemSlots[item]] = glm::vec4(centerX[item], centerY[item], centerZ[item], radius[item]);
+        bvh.dirtyNodes[bvh.itemLeafs[item]] = 1;
+        dirtyItems[item] = 0;
+        anyDirty = true;
+    }
+
+    if (!anyDirty)
+        return;
+
+    // Children come after their parent, so a reverse walk sees them refitted first
+    for (u32 nodeIdx = bvh.nodes.size(); nodeIdx-- > 0;)
+    {
+        BvhNode& node = bvh.nodes[nodeIdx];
+        if (node.count)
+        {
+            if (!bvh.dirtyNodes[nodeIdx])
+                continue;
+            SetBvhNodeBounds(bvh, node, node.leftFirst, node.count);
+        }
+        else
+        {
+            const BvhNode& left = bvh.nodes[node.leftFirst];
+            const BvhNode& right = bvh.nodes[node.leftFirst + 1];
+            if (!bvh.dirtyNodes[node.leftFirst] && !bvh.dirtyNodes[node.leftFirst + 1])
+                continue;
+            node.min = glm::min(left.min, right.min);
+            node.max = glm::max(left.max, right.max);
+            bvh.dirtyNodes[nodeIdx] = 1;
+        }
+        bvh.refittedNodes++;
+    }
+
+    memset(bvh.dirtyNodes.data(), 0, bvh.dirtyNodes.size());
+}
+
+// The slots of a subtree are contiguous: from the first one of its leftmost leaf to the last one of its rightmost leaf
+void GetBvhSubtreeSlots(const Bvh& bvh, u32 nodeIdx, u32* first, u32* end)
+{
+    const BvhNode* leftmost = &bvh.nodes[nodeIdx];
+    while (leftmost->count == 0)
+        leftmost = &bvh.nodes[leftmost->leftFirst];
+
+    const BvhNode* rightmost = &bvh.nodes[nodeIdx];
+    while (rightmost->count == 0)
+        rightmost = &bvh.nodes[rightmost->leftFirst + 1];
+
+    *first = leftmost->leftFirst;
+    *end = rightmost->leftFirst + rightmost->count;
+}
+
+void BvhQueryFrustum(const Bvh& bvh, const glm::vec4 planes[6], std::vector<u32>& items)
+{
+    if (bvh.nodes.empty())
+        return;
+
+    BvhStackEntry stack[BVH_MAX_DEPTH + 2];
+    u32 stackSize = 0;
+    stack[stackSize++] = BvhStackEntry{ 0, 0x3f };
+
+    while (stackSize)
+    {
+        BvhStackEntry entry = stack[--stackSize];
+        const BvhNode& node = bvh.nodes[entry.nodeIdx];
+
+        // Box against the planes still straddled by the parent
+        u32 planeMask = entry.value;
+        bool outside = false;
+        for (u32 p = 0; p < 6 && !outside; ++p)
+        {
+            if (!(planeMask & (1u << p)))
+                continue;
+
+            const glm::vec4& plane = planes[p];
+            glm::vec3 farCorner = glm::vec3(plane.x >= 0.0f ? node.max.x : node.min.x,
+                                            plane.y >= 0.0f ? node.max.y : node.min.y,
+                                            plane.z >= 0.0f ? node.max.z : node.min.z);
+            glm::vec3 nearCorner = node.min + node.max - farCorner;
+
+            if (glm::dot(glm::vec3(plane), farCorner) + plane.w < 0.0f)
+                outside = true;
+            else if (glm::dot(glm::vec3(plane), nearCorner) + plane.w >= 0.0f)
+                planeMask &= ~(1u << p);
+        }
+        if (outside)
+            continue;
+
+        // Inside all the planes, the whole subtree is visible
+        if (planeMask == 0)
+        {
+            u32 first, end;
+            GetBvhSubtreeSlots(bvh, entry.nodeIdx, &first, &end);
+            items.insert(items.end(), bvh.items.begin() + first, bvh.items.begin() + end);
+            continue;
+        }
+
+        if (node.count == 0)
+        {
+            stack[stackSize++] = BvhStackEntry{ node.leftFirst + 1, planeMask };
+            stack[stackSize++] = BvhStackEntry{ node.leftFirst + 0, planeMask };
+            continue;
+        }
+
+        for (u32 slot = node.leftFirst; slot < node.leftFirst + node.count; ++slot)
+        {
+            const glm::vec4& sphere = bvh.spheres[slot];
+            bool inside = true;
+            for (u32 p = 0; p < 6 && inside; ++p)
+                if (planeMask & (1u << p))
+                    inside = glm::dot(glm::vec3(planes[p]), glm::vec3(sphere)) + planes[p].w >= -sphere.w;
+
+            if (inside)
+                items.push_back(bvh.items[slot]);
+        }
+    }
+}
+
+void BvhQuerySphere(const Bvh& bvh, const glm::vec3& center, f32 radius, std::vector<u32>& items)
+{
+    if (bvh.nodes.empty())
+        return;
+
+    u32 stack[BVH_MAX_DEPTH + 2];
+    u32 stackSize = 0;
+    stack[stackSize++] = 0;
+
+    while (stackSize)
+    {
+        const BvhNode& node = bvh.nodes[stack[--stackSize]];
+
+        // Distance from the center to the box
+        glm::vec3 d = glm::max(glm::max(node.min - center, center - node.max), glm::vec3(0.0f));
+        if (glm::dot(d, d) > radius * radius)
+            continue;
+
+        if (node.count == 0)
+        {
+            stack[stackSize++] = node.leftFirst + 1;
+            stack[stackSize++] = node.leftFirst + 0;
+            continue;
+        }
+
+        for (u32 slot = node.leftFirst; slot < node.leftFirst + node.count; ++slot)
+        {
+            const glm::vec4& sphere = bvh.spheres[slot];
+            glm::vec3 offset = glm::vec3(sphere) - center;
+            f32 maxDistance = sphere.w + radius;
+            if (glm::dot(offset, offset) <= maxDistance * maxDistance)
+                items.push_back(bvh.items[slot]);
+        }
+    }
+}
+
+bool BvhAnySphereOverlap(const Bvh& bvh, const glm::vec3& center, f32 radius)
+{
+    if (bvh.nodes.empty())
+        return false;
+
+    u32 stack[BVH_MAX_DEPTH + 2];
+    u32 stackSize = 0;
+    stack[stackSize++] = 0;
+
+    while (stackSize)
+    {
+        const BvhNode& node = bvh.nodes[stack[--stackSize]];
+
+        glm::vec3 d = glm::max(glm::max(node.min - center, center - node.max), glm::vec3(0.0f));
+        if (glm::dot(d, d) > radius * radius)
+            continue;
+
+        if (node.count == 0)
+        {
+            stack[stackSize++] = node.leftFirst + 1;
+            stack[stackSize++] = node.leftFirst + 0;
+            continue;
+        }
+
+        for (u32 slot = node.leftFirst; slot < node.leftFirst + node.count; ++slot)
+        {
+            const glm::vec4& sphere = bvh.spheres[slot];
+            glm::vec3 offset = glm::vec3(sphere) - center;
+            f32 maxDistance = sphere.w + radius;
+            if (glm::dot(offset, offset) <= maxDistance * maxDistance)
+                return true;
+        }
+    }
+
+    return false;
+}
+
+// Distance where the ray enters the box, FLT_MAX if it misses it or enters past maxDistance
+inline f32 RayBoxDistance(const BvhNode& node, const glm::vec3& origin, const glm::vec3& inverseDirection, f32 maxDistance)
+{
+    glm::vec3 t0 = (node.min - origin) * inverseDirection;
+    glm::vec3 t1 = (node.max - origin) * inverseDirection;
+    glm::vec3 tNear = glm::min(t0, t1);
+    glm::vec3 tFar = glm::max(t0, t1);
+    f32 enter = glm::max(glm::max(tNear.x, tNear.y), glm::max(tNear.z, 0.0f));
+    f32 exit = glm::min(glm::min(tFar.x, tFar.y), glm::min(tFar.z, maxDistance));
+    return enter <= exit ? enter : FLT_MAX;
+}
+
+u32 BvhRaycast(const Bvh& bvh, const glm::vec3& origin, const glm::vec3& direction, f32 maxDistance, f32* hitDistance)
+{
+    u32 hitItem = UINT32_MAX;
+    f32 closest = maxDistance;
+    if (bvh.nodes.empty())
+        return hitItem;
+
+    const glm::vec3 inverseDirection = 1.0f / direction;
+
+    u32 stack[BVH_MAX_DEPTH + 2];
+    u32 stackSize = 0;
+    if (RayBoxDistance(bvh.nodes[0], origin, inverseDirection, closest) != FLT_MAX)
+        stack[stackSize++] = 0;
+
+    while (stackSize)
+    {
+        const BvhNode& node = bvh.nodes[stack[--stackSize]];
+
+        if (node.count == 0)
+        {
+            // Nearest child on top of the stack, so it can shorten the ray for the other one
+            u32 nearIdx = node.leftFirst, farIdx = node.leftFirst + 1;
+            f32 nearDistance = RayBoxDistance(bvh.nodes[nearIdx], origin, inverseDirection, closest);
+            f32 farDistance = RayBoxDistance(bvh.nodes[farIdx], origin, inverseDirection, closest);
+            if (farDistance < nearDistance)
+            {
+                std::swap(nearIdx, farIdx);
+                std::swap(nearDistance, farDistance);
+            }
+            if (farDistance != FLT_MAX)
+                stack[stackSize++] = farIdx;
+            if (nearDistance != FLT_MAX)
+                stack[stackSize++] = nearIdx;
+            continue;
+        }
+
+        // The box may be farther than a hit found meanwhile, the sphere tests below discard it
+        for (u32 slot = node.leftFirst; slot < node.leftFirst + node.count; ++slot)
+        {
+            const glm::vec4& sphere = bvh.spheres[slot];
+            glm::vec3 offset = origin - glm::vec3(sphere);
+            f32 b = glm::dot(offset, direction);
+            f32 c = glm::dot(offset, offset) - sphere.w * sphere.w;
+            f32 discriminant = b * b - c;
+            if (discriminant < 0.0f)
+                continue;
+
+            // Rays starting inside the sphere hit it right away
+            f32 distance = c <= 0.0f ? 0.0f : -b - glm::sqrt(discriminant);
+            if (distance >= 0.0f && distance < closest)
+            {
+                closest = distance;
+                hitItem = bvh.items[slot];
+            }
+        }
+    }
+
+    if (hitDistance)
+        *hitDistance = closest;
+    return hitItem;
+}
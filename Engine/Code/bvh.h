@@ -0,0 +1,69 @@
+//
+// bvh.h: Bounding volume hierarchy over bounding spheres (the world space bounds of the
+// entities), for frustum culling and sphere / ray queries. It is built with binned SAH,
+// in parallel with the job system, and refitted in place when the spheres move.
+//
+
+#pragma once
+
+#include "platform.h"
+
+#define BVH_BINS           12
+#define BVH_MAX_LEAF_ITEMS 4
+
+struct BvhNode
+{
+    glm::vec3 min;
+    u32       leftFirst; // first child (the second one follows) or, in leaves, first slot
+    glm::vec3 max;
+    u32       count;     // slots of a leaf, 0 in interior nodes
+};
+
+struct Bvh
+{
+    // Children always have a higher index than their parent, nodes[0] is the root
+    std::vector<BvhNode>   nodes;
+
+    // Items sorted so the ones of a leaf are contiguous (slots)
+    std::vector<u32>       items;     // slot -> item
+    std::vector<glm::vec4> spheres;   // slot -> center and radius of the item
+    std::vector<u32>       itemSlots; // item -> slot
+    std::vector<u32>       itemLeafs; // item -> leaf node
+
+    std::vector<u8>        dirtyNodes; // refit scratch
+
+    // Statistics
+    u32 refittedNodes; // by the last refit
+};
+
+/**
+ * Builds the hierarchy over count spheres given as separate arrays (e.g. EntityBounds). The top
+ * of the tree is split on the calling thread, then the subtrees are built by the job system
+ * when parallel is set.
+ */
+void BuildBvh(Bvh& bvh, const f32* centerX, const f32* centerY, const f32* centerZ, const f32* radius, u32 count, bool parallel);
+
+/**
+ * Moves the spheres of the items flagged in dirtyItems (and clears the flags), then grows or
+ * shrinks only the nodes above them. The topology is kept, so the tree quality degrades when
+ * the items travel far: rebuild it from time to time or when items are added or removed.
+ */
+void RefitBvh(Bvh& bvh, const f32* centerX, const f32* centerY, const f32* centerZ, const f32* radius, u8* dirtyItems);
+
+/**
+ * Appends to items the items whose sphere is not completely outside one of the frustum planes
+ * (normalized, see Camera::ExtractFrustumPlanes). Subtrees inside a plane skip its test.
+ */
+void BvhQueryFrustum(const Bvh& bvh, const glm::vec4 planes[6], std::vector<u32>& items);
+
+// Appends to items the items whose sphere overlaps the given one (e.g. a point light volume)
+void BvhQuerySphere(const Bvh& bvh, const glm::vec3& center, f32 radius, std::vector<u32>& items);
+
+// True if any item sphere overlaps the given one, stops at the first it finds
+bool BvhAnySphereOverlap(const Bvh& bvh, const glm::vec3& center, f32 radius);
+
+/**
+ * Returns the item whose sphere is hit first by the ray (direction normalized) closer than
+ * maxDistance, and its distance in hitDistance, or UINT32_MAX if none is hit.
+ */
+u32 BvhRaycast(const Bvh& bvh, const glm::vec3& origin, const glm::vec3& direction, f32 maxDistance, f32* hitDistance);
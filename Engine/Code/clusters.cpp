@@ -0,0 +1,259 @@
+#include "clusters.h"
+#include "job_system.h"
+#include "simd_math.h"
+
+// Room of the list of a cluster: the SIMD path writes a whole register of lanes past the count
+#define CLUSTER_LIST_CAPACITY (CLUSTER_MAX_LIGHTS + 8)
+
+void BuildLightClusters(LightClusters& clusters, const glm::mat4& projection, f32 nearPlane, f32 farPlane)
+{
+    clusters.projection = projection;
+    clusters.nearPlane = nearPlane;
+    clusters.farPlane = farPlane;
+    clusters.boundsMin.resize(CLUSTER_COUNT);
+    clusters.boundsMax.resize(CLUSTER_COUNT);
+    clusters.ranges.resize(CLUSTER_COUNT);
+
+    const glm::mat4 inverseProjection = glm::inverse(projection);
+
+    for (u32 y = 0; y < CLUSTER_GRID_Y; ++y)
+    {
+        for (u32 x = 0; x < CLUSTER_GRID_X; ++x)
+        {
+            // Directions through the corners of the tile, scaled so they are 1 unit deep
+            glm::vec3 corners[4];
+            for (u32 i = 0; i < 4; ++i)
+            {
+                f32 ndcX = -1.0f + 2.0f * (f32)(x + (i & 1)) / CLUSTER_GRID_X;
+                f32 ndcY = -1.0f + 2.0f * (f32)(y + (i >> 1)) / CLUSTER_GRID_Y;
+                glm::vec4 p = inverseProjection * glm::vec4(ndcX, ndcY, -1.0f, 1.0f);
+                glm::vec3 point = glm::vec3(p) / p.w;
+                corners[i] = point / -point.z;
+            }
+
+            // The slice of the tile frustum is the convex hull of its 8 corners
+            for (u32 slice = 0; slice < CLUSTER_GRID_Z; ++slice)
+            {
+                f32 sliceNear = GetClusterSliceDepth(nearPlane, farPlane, slice);
+                f32 sliceFar = slice + 1 < CLUSTER_GRID_Z ? GetClusterSliceDepth(nearPlane, farPlane, slice + 1) : farPlane;
+
+                glm::vec3 boundsMin = corners[0] * sliceNear;
+                glm::vec3 boundsMax = boundsMin;
+                for (u32 i = 0; i < 4; ++i)
+                {
+                    boundsMin = glm::min(boundsMin, glm::min(corners[i] * sliceNear, corners[i] * sliceFar));
+                    boundsMax = glm::max(boundsMax, glm::max(corners[i] * sliceNear, corners[i] * sliceFar));
+                }
+
+                u32 cluster = GetClusterIndex(x, y, slice);
+                clusters.boundsMin[cluster] = boundsMin;
+                clusters.boundsMax[cluster] = boundsMax;
+            }
+        }
+    }
+}
+
+inline f32 AxisDistance(f32 boundsMin, f32 boundsMax, f32 center)
+{
+    return glm::max(glm::max(boundsMin - center, center - boundsMax), 0.0f);
+}
+
+// Squared distance from the sphere center to the box against the squared radius, in the same
+// operation order as the SIMD path so both agree exactly
+inline bool SphereTouchesBounds(const glm::vec3& boundsMin, const glm::vec3& boundsMax, f32 x, f32 y, f32 z, f32 radius)
+{
+    f32 dx = AxisDistance(boundsMin.x, boundsMax.x, x);
+    f32 dy = AxisDistance(boundsMin.y, boundsMax.y, y);
+    f32 dz = AxisDistance(boundsMin.z, boundsMax.z, z);
+    return dx * dx + dy * dy + dz * dz <= radius * radius;
+}
+
+// Tests count lights of the slice against one cluster, writing the touching ones to list. Every
+// lane is written but only the touching ones advance the count, so there is no branch per light
+u32 AssignClusterLights(const glm::vec3& boundsMin, const glm::vec3& boundsMax, const f32* centerX, const f32* centerY, const f32* centerZ,
+                        const f32* radius, const u32* lightIndices, u32 count, u32* list)
+{
+    u32 listCount = 0;
+    u32 i = 0;
+
+#if defined(SIMD_MATH_AVX)
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 minX = _mm256_set1_ps(boundsMin.x), maxX = _mm256_set1_ps(boundsMax.x);
+    const __m256 minY = _mm256_set1_ps(boundsMin.y), maxY = _mm256_set1_ps(boundsMax.y);
+    const __m256 minZ = _mm256_set1_ps(boundsMin.z), maxZ = _mm256_set1_ps(boundsMax.z);
+
+    for (; i + 8 <= count && listCount < CLUSTER_MAX_LIGHTS; i += 8)
+    {
+        const __m256 x = _mm256_loadu_ps(centerX + i);
+        const __m256 y = _mm256_loadu_ps(centerY + i);
+        const __m256 z = _mm256_loadu_ps(centerZ + i);
+        const __m256 r = _mm256_loadu_ps(radius + i);
+
+        const __m256 dx = _mm256_max_ps(_mm256_max_ps(_mm256_sub_ps(minX, x), _mm256_sub_ps(x, maxX)), zero);
+        const __m256 dy = _mm256_max_ps(_mm256_max_ps(_mm256_sub_ps(minY, y), _mm256_sub_ps(y, maxY)), zero);
+        const __m256 dz = _mm256_max_ps(_mm256_max_ps(_mm256_sub_ps(minZ, z), _mm256_sub_ps(z, maxZ)), zero);
+        __m256 distanceSquared = _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy));
+        distanceSquared = _mm256_add_ps(distanceSquared, _mm256_mul_ps(dz, dz));
+
+        u32 mask = (u32)_mm256_movemask_ps(_mm256_cmp_ps(distanceSquared, _mm256_mul_ps(r, r), _CMP_LE_OQ));
+        if (mask)
+        {
+            for (u32 lane = 0; lane < 8; ++lane)
+            {
+                list[listCount] = lightIndices[i + lane];
+                listCount += (mask >> lane) & 1;
+            }
+        }
+    }
+#elif defined(SIMD_MATH_SSE)
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 minX = _mm_set1_ps(boundsMin.x), maxX = _mm_set1_ps(boundsMax.x);
+    const __m128 minY = _mm_set1_ps(boundsMin.y), maxY = _mm_set1_ps(boundsMax.y);
+    const __m128 minZ = _mm_set1_ps(boundsMin.z), maxZ = _mm_set1_ps(boundsMax.z);
+
+    for (; i + 4 <= count && listCount < CLUSTER_MAX_LIGHTS; i += 4)
+    {
+        const __m128 x = _mm_loadu_ps(centerX + i);
+        const __m128 y = _mm_loadu_ps(centerY + i);
+        const __m128 z = _mm_loadu_ps(centerZ + i);
+        const __m128 r = _mm_loadu_ps(radius + i);
+
+        const __m128 dx = _mm_max_ps(_mm_max_ps(_mm_sub_ps(minX, x), _mm_sub_ps(x, maxX)), zero);
+        const __m128 dy = _mm_max_ps(_mm_max_ps(_mm_sub_ps(minY, y), _mm_sub_ps(y, maxY)), zero);
+        const __m128 dz = _mm_max_ps(_mm_max_ps(_mm_sub_ps(minZ, z), _mm_sub_ps(z, maxZ)), zero);
+        __m128 distanceSquared = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy));
+        distanceSquared = _mm_add_ps(distanceSquared, _mm_mul_ps(dz, dz));
+
+        u32 mask = (u32)_mm_movemask_ps(_mm_cmple_ps(distanceSquared, _mm_mul_ps(r, r)));
+        if (mask)
+        {
+            for (u32 lane = 0; lane < 4; ++lane)
+            {
+                list[listCount] = lightIndices[i + lane];
+                listCount += (mask >> lane) & 1;
+            }
+        }
+    }
+#endif
+
+    // Remaining lights (all of them in the scalar path)
+    for (; i < count && listCount < CLUSTER_MAX_LIGHTS; ++i)
+    {
+        list[listCount] = lightIndices[i];
+        listCount += SphereTouchesBounds(boundsMin, boundsMax, centerX[i], centerY[i], centerZ[i], radius[i]);
+    }
+
+    return glm::min(listCount, (u32)CLUSTER_MAX_LIGHTS);
+}
+
+void AssignSliceLights(LightClusters& clusters, const ClusterLights& lights, u32 slice)
+{
+    const u32 lightCount = lights.radius.size();
+    const u32 first = slice * lightCount;
+    u32* sliceLights = clusters.sliceLights.data() + first;
+    f32* sliceX = clusters.sliceX.data() + first;
+    f32* sliceY = clusters.sliceY.data() + first;
+    f32* sliceZ = clusters.sliceZ.data() + first;
+    f32* sliceRadius = clusters.sliceRadius.data() + first;
+
+    // Every cluster of the slice has the same depth range, only the lights overlapping it are tested
+    const u32 firstCluster = GetClusterIndex(0, 0, slice);
+    const f32 minZ = clusters.boundsMin[firstCluster].z;
+    const f32 maxZ = clusters.boundsMax[firstCluster].z;
+
+    u32 count = 0;
+    for (u32 i = 0; i < lightCount; ++i)
+    {
+        f32 dz = AxisDistance(minZ, maxZ, lights.centerZ[i]);
+        if (dz * dz > lights.radius[i] * lights.radius[i])
+            continue;
+
+        sliceLights[count] = i;
+        sliceX[count] = lights.centerX[i];
+        sliceY[count] = lights.centerY[i];
+        sliceZ[count] = lights.centerZ[i];
+        sliceRadius[count] = lights.radius[i];
+        count++;
+    }
+
+    for (u32 cluster = firstCluster; cluster < firstCluster + CLUSTER_GRID_X * CLUSTER_GRID_Y; ++cluster)
+    {
+        clusters.ranges[cluster].y = count == 0 ? 0 :
+            AssignClusterLights(clusters.boundsMin[cluster], clusters.boundsMax[cluster], sliceX, sliceY, sliceZ, sliceRadius,
+                                sliceLights, count, clusters.clusterLights.data() + cluster * CLUSTER_LIST_CAPACITY);
+    }
+}
+
+// Packs the lists of the clusters one after the other, ranges[].y already holds the counts
+void CompactClusterLights(LightClusters& clusters)
+{
+    u32 totalCount = 0;
+    for (const glm::uvec2& range : clusters.ranges)
+        totalCount += range.y;
+    clusters.lightIndices.resize(totalCount);
+
+    clusters.maxClusterLightCount = 0;
+    clusters.fullClusterCount = 0;
+
+    u32 offset = 0;
+    for (u32 cluster = 0; cluster < CLUSTER_COUNT; ++cluster)
+    {
+        glm::uvec2& range = clusters.ranges[cluster];
+        range.x = offset;
+        memcpy(clusters.lightIndices.data() + offset, clusters.clusterLights.data() + cluster * CLUSTER_LIST_CAPACITY, range.y * sizeof(u32));
+        offset += range.y;
+
+        clusters.maxClusterLightCount = glm::max(clusters.maxClusterLightCount, range.y);
+        clusters.fullClusterCount += range.y == CLUSTER_MAX_LIGHTS;
+    }
+}
+
+void AssignLightsToClusters(LightClusters& clusters, const ClusterLights& lights, bool parallel)
+{
+    ASSERT(clusters.boundsMin.size() == CLUSTER_COUNT, "BuildLightClusters must be called first");
+
+    const u32 lightCount = lights.radius.size();
+    clusters.sliceLights.resize(CLUSTER_GRID_Z * lightCount);
+    clusters.sliceX.resize(CLUSTER_GRID_Z * lightCount);
+    clusters.sliceY.resize(CLUSTER_GRID_Z * lightCount);
+    clusters.sliceZ.resize(CLUSTER_GRID_Z * lightCount);
+    clusters.sliceRadius.resize(CLUSTER_GRID_Z * lightCount);
+    clusters.clusterLights.resize(CLUSTER_COUNT * CLUSTER_LIST_CAPACITY);
+
+    // The slices write disjoint parts of the scratch and of ranges
+    auto assignSlices = [&clusters, &lights](u32 begin, u32 end)
+    {
+        for (u32 slice = begin; slice < end; ++slice)
+            AssignSliceLights(clusters, lights, slice);
+    };
+
+    if (parallel)
+        ParallelFor(CLUSTER_GRID_Z, 1, assignSlices);
+    else
+        assignSlices(0, CLUSTER_GRID_Z);
+
+    CompactClusterLights(clusters);
+}
+
+void AssignLightsToClustersScalar(LightClusters& clusters, const ClusterLights& lights)
+{
+    ASSERT(clusters.boundsMin.size() == CLUSTER_COUNT, "BuildLightClusters must be called first");
+
+    const u32 lightCount = lights.radius.size();
+    clusters.clusterLights.resize(CLUSTER_COUNT * CLUSTER_LIST_CAPACITY);
+
+    for (u32 cluster = 0; cluster < CLUSTER_COUNT; ++cluster)
+    {
+        u32* list = clusters.clusterLights.data() + cluster * CLUSTER_LIST_CAPACITY;
+        u32 count = 0;
+        for (u32 i = 0; i < lightCount && count < CLUSTER_MAX_LIGHTS; ++i)
+        {
+            if (SphereTouchesBounds(clusters.boundsMin[cluster], clusters.boundsMax[cluster],
+                                    lights.centerX[i], lights.centerY[i], lights.centerZ[i], lights.radius[i]))
+                list[count++] = i;
+        }
+        clusters.ranges[cluster].y = count;
+    }
+
+    CompactClusterLights(clusters);
+}
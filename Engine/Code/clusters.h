@@ -0,0 +1,72 @@
+//
+// clusters.h: Light clusters of the clustered forward mode. The view frustum is split in a 3D
+// grid (screen tiles times exponential depth slices) and every cluster gets the list of point
+// lights whose sphere touches its view space AABB. The lights are tested several at a time with
+// the SSE / AVX path of simd_math.h, one depth slice per job.
+//
+
+#pragma once
+
+#include "platform.h"
+
+#define CLUSTER_GRID_X     16 // CLUSTER_GRID_X/Y/Z in the SHOW_TEXTURED_MESH shader
+#define CLUSTER_GRID_Y     9
+#define CLUSTER_GRID_Z     24
+#define CLUSTER_COUNT      (CLUSTER_GRID_X * CLUSTER_GRID_Y * CLUSTER_GRID_Z)
+#define CLUSTER_MAX_LIGHTS 256 // the lights past this in a cluster are dropped
+
+// View space point lights as separate arrays, for the SIMD test
+struct ClusterLights
+{
+    std::vector<f32> centerX, centerY, centerZ, radius;
+};
+
+struct LightClusters
+{
+    f32       nearPlane, farPlane;
+    glm::mat4 projection; // the bounds were built for
+
+    // View space AABB of every cluster, x fastest, then y, then the depth slice
+    std::vector<glm::vec3>  boundsMin, boundsMax;
+
+    // Cluster -> first index in lightIndices and count
+    std::vector<glm::uvec2> ranges;
+    std::vector<u32>        lightIndices;
+
+    // Scratch: the lights overlapping each slice and the list of each cluster before compacting
+    std::vector<u32>        sliceLights;
+    std::vector<f32>        sliceX, sliceY, sliceZ, sliceRadius;
+    std::vector<u32>        clusterLights;
+
+    // Statistics of the last assignment
+    u32 maxClusterLightCount;
+    u32 fullClusterCount; // clusters that reached CLUSTER_MAX_LIGHTS
+};
+
+/**
+ * Computes the view space AABB of every cluster for a perspective projection (glm::perspective
+ * convention). The depth slices go exponentially from nearPlane to farPlane, so the clusters
+ * keep a similar shape at every distance. Only needed again when the projection changes.
+ */
+void BuildLightClusters(LightClusters& clusters, const glm::mat4& projection, f32 nearPlane, f32 farPlane);
+
+/**
+ * Fills ranges and lightIndices with the lights touching each cluster, in increasing index
+ * order. Each depth slice first keeps the lights overlapping its depth range, then its clusters
+ * test them 8 (AVX) or 4 (SSE) at a time. The slices run in the job system when parallel is set.
+ */
+void AssignLightsToClusters(LightClusters& clusters, const ClusterLights& lights, bool parallel);
+
+// Same result testing every light against every cluster one at a time, the reference of the benchmark
+void AssignLightsToClustersScalar(LightClusters& clusters, const ClusterLights& lights);
+
+inline u32 GetClusterIndex(u32 x, u32 y, u32 slice)
+{
+    return (slice * CLUSTER_GRID_Y + y) * CLUSTER_GRID_X + x;
+}
+
+// Distance to the camera where the depth slice starts (the one past the last is farPlane)
+inline f32 GetClusterSliceDepth(f32 nearPlane, f32 farPlane, u32 slice)
+{
+    return nearPlane * powf(farPlane / nearPlane, (f32)slice / CLUSTER_GRID_Z);
+}
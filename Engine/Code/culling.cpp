@@ -0,0 +1,184 @@
+#include "culling.h"
+#include "simd_math.h"
+#include <float.h>
+
+void ComputeSubmeshBounds(Submesh& submesh)
+{
+    const VertexBufferLayout& layout = submesh.vertexBufferLayout;
+
+    u32 positionOffset = UINT32_MAX;
+    for (const VertexBufferAttribute& attribute : layout.attributes)
+        if (attribute.location == 0)
+            positionOffset = attribute.offset;
+    ASSERT(positionOffset != UINT32_MAX, "The submesh has no position attribute");
+
+    const u8* vertices = (const u8*)submesh.vertices.data();
+    const u32 vertexCount = submesh.vertices.size() * sizeof(float) / layout.stride;
+
+    submesh.aabb = AABB{ vec3(0.0f), vec3(0.0f) };
+    submesh.sphere = BoundingSphere{ vec3(0.0f), 0.0f };
+    if (vertexCount == 0)
+        return;
+
+    AABB aabb = { vec3(FLT_MAX), vec3(-FLT_MAX) };
+    for (u32 i = 0; i < vertexCount; ++i)
+    {
+        const f32* position = (const f32*)(vertices + i * layout.stride + positionOffset);
+        vec3 p = vec3(position[0], position[1], position[2]);
+        aabb.min = glm::min(aabb.min, p);
+        aabb.max = glm::max(aabb.max, p);
+    }
+
+    // Tighter than the half diagonal of the box
+    vec3 center = (aabb.min + aabb.max) * 0.5f;
+    f32 radiusSquared = 0.0f;
+    for (u32 i = 0; i < vertexCount; ++i)
+    {
+        const f32* position = (const f32*)(vertices + i * layout.stride + positionOffset);
+        vec3 d = vec3(position[0], position[1], position[2]) - center;
+        radiusSquared = glm::max(radiusSquared, glm::dot(d, d));
+    }
+
+    submesh.aabb = aabb;
+    submesh.sphere = BoundingSphere{ center, glm::sqrt(radiusSquared) };
+}
+
+void ComputeMeshBounds(Mesh& mesh)
+{
+    mesh.aabb = AABB{ vec3(0.0f), vec3(0.0f) };
+    mesh.sphere = BoundingSphere{ vec3(0.0f), 0.0f };
+    if (mesh.submeshes.empty())
+        return;
+
+    AABB aabb = mesh.submeshes[0].aabb;
+    for (const Submesh& submesh : mesh.submeshes)
+    {
+        aabb.min = glm::min(aabb.min, submesh.aabb.min);
+        aabb.max = glm::max(aabb.max, submesh.aabb.max);
+    }
+
+    // Encloses the spheres of the submeshes
+    vec3 center = (aabb.min + aabb.max) * 0.5f;
+    f32 radius = 0.0f;
+    for (const Submesh& submesh : mesh.submeshes)
+        radius = glm::max(radius, glm::distance(center, submesh.sphere.center) + submesh.sphere.radius);
+
+    mesh.aabb = aabb;
+    mesh.sphere = BoundingSphere{ center, radius };
+}
+
+u32 CullSpheresScalar(const vec4 planes[6], const f32* centerX, const f32* centerY, const f32* centerZ, const f32* radius,
+                      u32 count, u32* visible)
+{
+    u32 visibleCount = 0;
+    for (u32 i = 0; i < count; ++i)
+    {
+        bool inside = true;
+        for (u32 p = 0; p < 6; ++p)
+        {
+            f32 distance = planes[p].x * centerX[i] + planes[p].w + planes[p].y * centerY[i] + planes[p].z * centerZ[i];
+            inside = inside && distance >= -radius[i];
+        }
+
+        visible[visibleCount] = i;
+        visibleCount += inside;
+    }
+    return visibleCount;
+}
+
+// Appends the lanes set in mask. Every lane is written but only the visible ones advance the
+// count, so there is no branch per sphere (the write never goes past index first + lane)
+inline u32 AppendVisibleLanes(u32 mask, u32 first, u32 laneCount, u32* visible, u32 visibleCount)
+{
+    for (u32 lane = 0; lane < laneCount; ++lane)
+    {
+        visible[visibleCount] = first + lane;
+        visibleCount += (mask >> lane) & 1;
+    }
+    return visibleCount;
+}
+
+u32 CullSpheres(const vec4 planes[6], const f32* centerX, const f32* centerY, const f32* centerZ, const f32* radius,
+                u32 count, u32* visible)
+{
+    u32 visibleCount = 0;
+    u32 i = 0;
+
+#if defined(SIMD_MATH_AVX)
+    __m256 planeX[6], planeY[6], planeZ[6], planeW[6];
+    for (u32 p = 0; p < 6; ++p)
+    {
+        planeX[p] = _mm256_set1_ps(planes[p].x);
+        planeY[p] = _mm256_set1_ps(planes[p].y);
+        planeZ[p] = _mm256_set1_ps(planes[p].z);
+        planeW[p] = _mm256_set1_ps(planes[p].w);
+    }
+
+    for (; i + 8 <= count; i += 8)
+    {
+        const __m256 x = _mm256_loadu_ps(centerX + i);
+        const __m256 y = _mm256_loadu_ps(centerY + i);
+        const __m256 z = _mm256_loadu_ps(centerZ + i);
+        const __m256 negRadius = _mm256_sub_ps(_mm256_setzero_ps(), _mm256_loadu_ps(radius + i));
+
+        __m256 inside = _mm256_cmp_ps(negRadius, negRadius, _CMP_EQ_OQ); // all ones
+        for (u32 p = 0; p < 6; ++p)
+        {
+            __m256 distance = _mm256_add_ps(_mm256_mul_ps(planeX[p], x), planeW[p]);
+            distance = _mm256_add_ps(distance, _mm256_mul_ps(planeY[p], y));
+            distance = _mm256_add_ps(distance, _mm256_mul_ps(planeZ[p], z));
+            inside = _mm256_and_ps(inside, _mm256_cmp_ps(distance, negRadius, _CMP_GE_OQ));
+        }
+
+        u32 mask = (u32)_mm256_movemask_ps(inside);
+        if (mask)
+            visibleCount = AppendVisibleLanes(mask, i, 8, visible, visibleCount);
+    }
+#elif defined(SIMD_MATH_SSE)
+    __m128 planeX[6], planeY[6], planeZ[6], planeW[6];
+    for (u32 p = 0; p < 6; ++p)
+    {
+        planeX[p] = _mm_set1_ps(planes[p].x);
+        planeY[p] = _mm_set1_ps(planes[p].y);
+        planeZ[p] = _mm_set1_ps(planes[p].z);
+        planeW[p] = _mm_set1_ps(planes[p].w);
+    }
+
+    for (; i + 4 <= count; i += 4)
+    {
+        const __m128 x = _mm_loadu_ps(centerX + i);
+        const __m128 y = _mm_loadu_ps(centerY + i);
+        const __m128 z = _mm_loadu_ps(centerZ + i);
+        const __m128 negRadius = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(radius + i));
+
+        __m128 inside = _mm_cmpeq_ps(negRadius, negRadius); // all ones
+        for (u32 p = 0; p < 6; ++p)
+        {
+            __m128 distance = _mm_add_ps(_mm_mul_ps(planeX[p], x), planeW[p]);
+            distance = _mm_add_ps(distance, _mm_mul_ps(planeY[p], y));
+            distance = _mm_add_ps(distance, _mm_mul_ps(planeZ[p], z));
+            inside = _mm_and_ps(inside, _mm_cmpge_ps(distance, negRadius));
+        }
+
+        u32 mask = (u32)_mm_movemask_ps(inside);
+        if (mask)
+            visibleCount = AppendVisibleLanes(mask, i, 4, visible, visibleCount);
+    }
+#endif
+
+    // Remaining spheres (all of them in the scalar path)
+    for (; i < count; ++i)
+    {
+        bool inside = true;
+        for (u32 p = 0; p < 6; ++p)
+        {
+            f32 distance = planes[p].x * centerX[i] + planes[p].w + planes[p].y * centerY[i] + planes[p].z * centerZ[i];
+            inside = inside && distance >= -radius[i];
+        }
+
+        visible[visibleCount] = i;
+        visibleCount += inside;
+    }
+
+    return visibleCount;
+}
@@ -0,0 +1,48 @@
+//
+// culling.h: Bounding volumes of the meshes and frustum culling of bounding spheres, tested
+// several at a time with the SSE / AVX path of simd_math.h.
+//
+
+#pragma once
+
+#include "engine.h"
+
+/**
+ * Computes the AABB and the bounding sphere of the submesh from the positions (attribute 0)
+ * of its vertices. The sphere is centered in the AABB and encloses every vertex.
+ */
+void ComputeSubmeshBounds(Submesh& submesh);
+
+/**
+ * Computes the bounds of the whole mesh from the ones of its submeshes, that must be already
+ * computed (see ComputeSubmeshBounds).
+ */
+void ComputeMeshBounds(Mesh& mesh);
+
+/**
+ * Bounding sphere of the object space sphere transformed by the world matrix. The radius is
+ * scaled by the largest axis scale, so it stays conservative with non uniform scales.
+ */
+inline BoundingSphere TransformBoundingSphere(const glm::mat4& worldMatrix, const BoundingSphere& sphere)
+{
+    f32 scale = glm::sqrt(glm::max(glm::dot(vec3(worldMatrix[0]), vec3(worldMatrix[0])),
+                          glm::max(glm::dot(vec3(worldMatrix[1]), vec3(worldMatrix[1])),
+                                   glm::dot(vec3(worldMatrix[2]), vec3(worldMatrix[2])))));
+
+    BoundingSphere result;
+    result.center = vec3(worldMatrix * vec4(sphere.center, 1.0f));
+    result.radius = sphere.radius * scale;
+    return result;
+}
+
+/**
+ * Writes to visible the indices of the spheres that are not completely outside one of the
+ * frustum planes (normalized, see Camera::ExtractFrustumPlanes) and returns how many there are.
+ * The spheres are tested 8 (AVX) or 4 (SSE) per iteration. visible must have room for count indices.
+ */
+u32 CullSpheres(const vec4 planes[6], const f32* centerX, const f32* centerY, const f32* centerZ, const f32* radius,
+                u32 count, u32* visible);
+
+// Same as CullSpheres one sphere at a time, the reference of the culling benchmark
+u32 CullSpheresScalar(const vec4 planes[6], const f32* centerX, const f32* centerY, const f32* centerZ, const f32* radius,
+                      u32 count, u32* visible);
@@ -12,12 +12,27 @@
 #include <stb_image_write.h>
 #include "assimp_model_loading.h"
 #include "buffer_management.h"
+#include "job_system.h"
+#include "simd_math.h"
+#include "geometry_pool.h"
+#include "culling.h"
+#include "bvh.h"
+#include "clusters.h"
+#include "trace.h"
 
 #define BINDING(b) b
 #define NO_TEXTURE_ATTACHED 69
+#define ENTITY_INDEX_LOCATION 5
+#define ENTITY_UPDATE_MIN_BATCH 256
+#define MAX_MATERIAL_TEXTURE_ARRAYS 8 // same as in the shaders
+#define MATERIAL_TEXTURE_ARRAY_UNIT 8 // first unit of the texture arrays, after the G-buffer ones
+#define LIGHT_TILE_SIZE 16 // TILE_SIZE in the TILED_DEFERRED_LIGHTING shader
+#define SLOT_STAGING_CHUNK_SIZE MB(1) // the arena grows by this much when the dirty slots of a frame don't fit
 
 void ForwardRender(App* app);
+void ForwardPass(App* app);
 void DeferredRender(App* app);
+void OutputPass(App* app);
 void PositionRender(App* app);
 void DiffuseRender(App* app);
 void NormalRender(App* app);
@@ -25,14 +40,27 @@ void DepthRender(App* app);
 void FinalRender(App* app);
 void GeometryPass(App* app);
 void LightPass(App* app);
+void TiledLightPass(App* app);
 void StencilPass(App* app, unsigned int lightIndex);
 void PointLightPass(App* app, unsigned int lightIndex);
+void InstancedPointLightPass(App* app);
 void DirectionalLightPass(App* app);
 void PointLightDraw(App* app);
+void DrawEntitySubmesh(App* app, const Submesh& submesh, u32 entityIdx);
+void BuildRenderQueue(App* app, RenderPass pass);
+void SubmitOpaqueRenderQueue(App* app, bool occlusionCulling);
+void ReadOpaqueTimers(App* app);
+void ReadLightPassTimer(App* app);
+u32 GetGBufferProgram(App* app, u32 programIdx);
+GLenum GetFinalTargetFormat(App* app);
+u32 GetGBufferPixelSize(bool compact);
+void BindGBufferTextures(App* app, const Program& program, GLuint depthHandle);
+void BuildEntityBvh(App* app);
+bool UseOcclusionCulling(App* app);
 float CalcPointLightRadius(const Light& Light);
 u32 GenerateCustomMaterial(App* app, u32 base, u32 normal, u32 bump);
 
-GLuint CreateProgramFromSource(String programSource, const char* shaderName)
+GLuint CreateProgramFromSource(String programSource, const char* shaderName, const char* defines)
 {
     GLchar  infoLogBuffer[1024] = {};
     GLsizei infoLogBufferSize = sizeof(infoLogBuffer);
@@ -48,24 +76,28 @@ GLuint CreateProgramFromSource(String programSource, const char* shaderName)
     const GLchar* vertexShaderSource[] = {
         versionString,
         shaderNameDefine,
+        defines,
         vertexShaderDefine,
         programSource.str
     };
     const GLint vertexShaderLengths[] = {
         (GLint) strlen(versionString),
         (GLint) strlen(shaderNameDefine),
+        (GLint) strlen(defines),
         (GLint) strlen(vertexShaderDefine),
         (GLint) programSource.len
     };
     const GLchar* fragmentShaderSource[] = {
         versionString,
         shaderNameDefine,
+        defines,
         fragmentShaderDefine,
         programSource.str
     };
     const GLint fragmentShaderLengths[] = {
         (GLint) strlen(versionString),
         (GLint) strlen(shaderNameDefine),
+        (GLint) strlen(defines),
         (GLint) strlen(fragmentShaderDefine),
         (GLint) programSource.len
     };
@@ -101,7 +133,7 @@ GLuint CreateProgramFromSource(String programSource, const char* shaderName)
         ELOG("glLinkProgram() failed with program %s\nReported message:\n%s\n", shaderName, infoLogBuffer);
     }
 
-    glUseProgram(0);
+    GLStateUseProgram(0);
 
     glDetachShader(programHandle, vshader);
     glDetachShader(programHandle, fshader);
@@ -111,6 +143,59 @@ GLuint CreateProgramFromSource(String programSource, const char* shaderName)
     return programHandle;
 }
 
+GLuint CreateComputeProgramFromSource(String programSource, const char* shaderName, const char* defines)
+{
+    GLchar  infoLogBuffer[1024] = {};
+    GLsizei infoLogBufferSize = sizeof(infoLogBuffer);
+    GLsizei infoLogSize;
+    GLint   success;
+
+    char versionString[] = "#version 430\n";
+    char shaderNameDefine[128];
+    sprintf(shaderNameDefine, "#define %s\n", shaderName);
+    char computeShaderDefine[] = "#define COMPUTE\n";
+
+    const GLchar* computeShaderSource[] = {
+        versionString,
+        shaderNameDefine,
+        defines,
+        computeShaderDefine,
+        programSource.str
+    };
+    const GLint computeShaderLengths[] = {
+        (GLint) strlen(versionString),
+        (GLint) strlen(shaderNameDefine),
+        (GLint) strlen(defines),
+        (GLint) strlen(computeShaderDefine),
+        (GLint) programSource.len
+    };
+
+    GLuint cshader = glCreateShader(GL_COMPUTE_SHADER);
+    glShaderSource(cshader, ARRAY_COUNT(computeShaderSource), computeShaderSource, computeShaderLengths);
+    glCompileShader(cshader);
+    glGetShaderiv(cshader, GL_COMPILE_STATUS, &success);
+    if (!success)
+    {
+        glGetShaderInfoLog(cshader, infoLogBufferSize, &infoLogSize, infoLogBuffer);
+        ELOG("glCompileShader() failed with compute shader %s\nReported message:\n%s\n", shaderName, infoLogBuffer);
+    }
+
+    GLuint programHandle = glCreateProgram();
+    glAttachShader(programHandle, cshader);
+    glLinkProgram(programHandle);
+    glGetProgramiv(programHandle, GL_LINK_STATUS, &success);
+    if (!success)
+    {
+        glGetProgramInfoLog(programHandle, infoLogBufferSize, &infoLogSize, infoLogBuffer);
+        ELOG("glLinkProgram() failed with program %s\nReported message:\n%s\n", shaderName, infoLogBuffer);
+    }
+
+    glDetachShader(programHandle, cshader);
+    glDeleteShader(cshader);
+
+    return programHandle;
+}
+
 u8 GetSizeFromType(GLenum type) {
     switch (type)
     {
@@ -118,28 +203,35 @@ u8 GetSizeFromType(GLenum type) {
     case GL_FLOAT_VEC2: return 2;  break;
     case GL_FLOAT_VEC3: return 3;  break;
     case GL_FLOAT_VEC4: return 4;  break;
+    case GL_UNSIGNED_INT: return 1;  break;
     default:
         break;
     }
 }
 
-u32 LoadProgram(App* app, const char* filepath, const char* programName)
+u32 LoadProgram(App* app, const char* filepath, const char* programName, const char* defines, bool compute = false)
 {
     String programSource = ReadTextFile(filepath);
 
     Program program = {};
-    program.handle = CreateProgramFromSource(programSource, programName);
+    program.handle = compute ? CreateComputeProgramFromSource(programSource, programName, defines)
+                             : CreateProgramFromSource(programSource, programName, defines);
     program.filepath = filepath;
     program.programName = programName;
+    program.defines = defines;
     program.lastWriteTimestamp = GetFileLastWriteTimestamp(filepath);
+    program.materialIndexLocation = glGetUniformLocation(program.handle, "uMaterialIndex"); //set on every material change, not looked up in the draw loop
+    program.inverseViewProjectionLocation = glGetUniformLocation(program.handle, "uInverseViewProjectionMatrix"); //set on every light draw
     app->programs.push_back(program);
 
     return app->programs.size() - 1;
 }
 
-u32 InitProgram(App* app, const char* filepath, const char* programName)
+u32 InitProgram(App* app, const char* filepath, const char* programName, const char* defines = "")
 {
-    u32 programIdx = LoadProgram(app, "shaders.glsl", programName);
+    TRACE_FUNCTION();
+
+    u32 programIdx = LoadProgram(app, "shaders.glsl", programName, defines);
     Program& program = app->programs[programIdx];
 
     GLint attributeCount = 0;
@@ -164,6 +256,59 @@ u32 InitProgram(App* app, const char* filepath, const char* programName)
     return programIdx;
 }
 
+u32 InitComputeProgram(App* app, const char* filepath, const char* programName, const char* defines = "")
+{
+    TRACE_FUNCTION();
+
+    return LoadProgram(app, "shaders.glsl", programName, defines, true);
+}
+
+void InitProgramVariants(App* app, u32 programIdx)
+{
+    //The variants keep the defines of the program they come from
+    std::string programName = app->programs[programIdx].programName;
+    std::string defines = app->programs[programIdx].defines;
+    u32 transformTableIdx = InitProgram(app, "shaders.glsl", programName.c_str(), (defines + "#define TRANSFORM_TABLE\n").c_str());
+    app->programs[programIdx].transformTableProgramIdx = transformTableIdx;
+
+    if (app->materialTexturesMode == MaterialTextures_Bound)
+        return;
+
+    std::string materialDefine = app->materialTexturesMode == MaterialTextures_Bindless ? "#define MATERIAL_TEXTURES_BINDLESS\n" : "#define MATERIAL_TEXTURES_ARRAYS\n";
+    app->programs[programIdx].materialTexturesProgramIdx = InitProgram(app, "shaders.glsl", programName.c_str(), (defines + materialDefine).c_str());
+    app->programs[transformTableIdx].materialTexturesProgramIdx = InitProgram(app, "shaders.glsl", programName.c_str(), (defines + "#define TRANSFORM_TABLE\n" + materialDefine).c_str());
+
+    //The texture arrays are always bound to the same units
+    if (app->materialTexturesMode == MaterialTextures_Arrays)
+    {
+        GLint units[MAX_MATERIAL_TEXTURE_ARRAYS];
+        for (u32 i = 0; i < MAX_MATERIAL_TEXTURE_ARRAYS; ++i)
+            units[i] = MATERIAL_TEXTURE_ARRAY_UNIT + i;
+
+        for (u32 variantIdx : { app->programs[programIdx].materialTexturesProgramIdx, app->programs[transformTableIdx].materialTexturesProgramIdx })
+        {
+            GLStateUseProgram(app->programs[variantIdx].handle);
+            glUniform1iv(glGetUniformLocation(app->programs[variantIdx].handle, "uTextureArrays"), MAX_MATERIAL_TEXTURE_ARRAYS, units);
+        }
+        GLStateUseProgram(0);
+    }
+}
+
+bool UseMaterialTextures(App* app)
+{
+    return app->useMaterialTextures && app->materialTexturesMode != MaterialTextures_Bound;
+}
+
+// Variant of a mesh program for the current settings
+u32 GetProgramVariant(App* app, u32 programIdx)
+{
+    if (app->useTransformTable)
+        programIdx = app->programs[programIdx].transformTableProgramIdx;
+    if (UseMaterialTextures(app))
+        programIdx = app->programs[programIdx].materialTexturesProgramIdx;
+    return programIdx;
+}
+
 Image LoadImage(const char* filename)
 {
     Image img = {};
@@ -200,7 +345,7 @@ GLuint CreateTexture2DFromImage(Image image)
 
     GLuint texHandle;
     glGenTextures(1, &texHandle);
-    glBindTexture(GL_TEXTURE_2D, texHandle);
+    GLStateBindTexture(GL_TEXTURE_2D, texHandle);
     glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, image.size.x, image.size.y, 0, dataFormat, dataType, image.pixels);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR_MIPMAP_LINEAR);
@@ -208,13 +353,15 @@ GLuint CreateTexture2DFromImage(Image image)
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
     glGenerateMipmap(GL_TEXTURE_2D);
-    glBindTexture(GL_TEXTURE_2D, 0);
+    GLStateBindTexture(GL_TEXTURE_2D, 0);
 
     return texHandle;
 }
 
 u32 LoadTexture2D(App* app, const char* filepath)
 {
+    TRACE_FUNCTION();
+
     for (u32 texIdx = 0; texIdx < app->textures.size(); ++texIdx)
         if (app->textures[texIdx].filepath == filepath)
             return texIdx;
@@ -226,6 +373,8 @@ u32 LoadTexture2D(App* app, const char* filepath)
         Texture tex = {};
         tex.handle = CreateTexture2DFromImage(image);
         tex.filepath = filepath;
+        tex.size = image.size;
+        tex.internalFormat = image.nchannels == 4 ? GL_RGBA8 : GL_RGB8;
 
         u32 texIdx = app->textures.size();
         app->textures.push_back(tex);
@@ -259,7 +408,55 @@ glm::mat4 TransformRotation(const glm::mat4& matrix, float angle, vec3 axis)
     return transform;
 }
 
-GLuint FindVAO(Mesh& mesh, u32 submeshIndex, const Program& program)
+GLuint CreateVAO(GLuint vertexBuffer, GLuint indexBuffer, const VertexBufferLayout& layout, u32 vertexOffset, const Program& program, GLuint entityIndexBuffer)
+{
+    GLuint vaoHandle = 0;
+    glGenVertexArrays(1, &vaoHandle);
+    GLStateBindVertexArray(vaoHandle);
+
+    glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+
+    // We have to link all vertex inputs attributes to attributes in the vertex buffer
+    for (u32 i = 0; i < program.vertexInputLayout.attributes.size(); ++i)
+    {
+        bool attributeWasLinked = false;
+
+        // Per-instance entity index used by the transform table variants
+        if (program.vertexInputLayout.attributes[i].location == ENTITY_INDEX_LOCATION)
+        {
+            assert(entityIndexBuffer != 0);
+            glBindBuffer(GL_ARRAY_BUFFER, entityIndexBuffer);
+            glVertexAttribIPointer(ENTITY_INDEX_LOCATION, 1, GL_UNSIGNED_INT, sizeof(u32), (void*)0);
+            glVertexAttribDivisor(ENTITY_INDEX_LOCATION, 1);
+            glEnableVertexAttribArray(ENTITY_INDEX_LOCATION);
+            glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+            continue;
+        }
+
+        for (u32 j = 0; j < layout.attributes.size(); ++j)
+        {
+            if (program.vertexInputLayout.attributes[i].location == layout.attributes[j].location)
+            {
+                const u32 index = layout.attributes[j].location;
+                const u32 ncomp = layout.attributes[j].componentCount;
+                const u32 offset = layout.attributes[j].offset + vertexOffset; // attribute offset + vertex offset
+                const u32 stride = layout.stride;
+                glVertexAttribPointer(index, ncomp, GL_FLOAT, GL_FALSE, stride, (void*)(u64)offset);
+                glEnableVertexAttribArray(index);
+
+                attributeWasLinked = true;
+                break;
+            }
+        }
+        assert(attributeWasLinked); // The submesh should provide an attribute for each vertex inputs
+    }
+    GLStateBindVertexArray(0);
+
+    return vaoHandle;
+}
+
+GLuint FindVAO(Mesh& mesh, u32 submeshIndex, const Program& program, GLuint entityIndexBuffer = 0)
 {
     Submesh& submesh = mesh.submeshes[submeshIndex];
 
@@ -270,55 +467,72 @@ GLuint FindVAO(Mesh& mesh, u32 submeshIndex, const Program& program)
             return submesh.vaos[i].handle;
     }
 
-    GLuint vaoHandle = 0;
-
     //Create a new vao for this submesh/program
-    {
-        glGenVertexArrays(1, &vaoHandle);
-        glBindVertexArray(vaoHandle);
+    GLuint vaoHandle = CreateVAO(submesh.vertexBufferHandle, submesh.indexBufferHandle, submesh.vertexBufferLayout, submesh.vertexOffset, program, entityIndexBuffer);
 
-        glBindBuffer(GL_ARRAY_BUFFER, mesh.vertexBufferHandle);
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.indexBufferHandle);
+    //Store it in the list of vaos for this submesh
+    Vao vao = { vaoHandle, program.handle };
+    submesh.vaos.push_back(vao);
 
-        // We have to link all vertex inputs attributes to attributes in the vertex buffer
-        for (u32 i = 0; i < program.vertexInputLayout.attributes.size(); ++i)
-        {
-            bool attributeWasLinked = false;
+    return vaoHandle;
+}
 
-            for (u32 j = 0; j < submesh.vertexBufferLayout.attributes.size(); ++j)
-            {
-                if (program.vertexInputLayout.attributes[i].location == submesh.vertexBufferLayout.attributes[j].location)
-                {
-                    const u32 index = submesh.vertexBufferLayout.attributes[j].location;
-                    const u32 ncomp = submesh.vertexBufferLayout.attributes[j].componentCount;
-                    const u32 offset = submesh.vertexBufferLayout.attributes[j].offset + submesh.vertexOffset; // attribute offset + vertex offset
-                    const u32 stride = submesh.vertexBufferLayout.stride;
-                    glVertexAttribPointer(index, ncomp, GL_FLOAT, GL_FALSE, stride, (void*)(u64)offset);
-                    glEnableVertexAttribArray(index);
-
-                    attributeWasLinked = true;
-                    break;
-                }
-            }
-            assert(attributeWasLinked); // The submesh should provide an attribute for each vertex inputs
-        }
-        glBindVertexArray(0);
+// Same as FindVAO for all the submeshes of a vertex format in a geometry page, the draws select theirs with the base vertex
+GLuint FindPageVAO(GeometryPool& pool, u32 pageIdx, u32 layoutIdx, const Program& program, GLuint entityIndexBuffer)
+{
+    GeometryPage& page = pool.pages[pageIdx];
+    for (const GeometryPageVao& vao : page.vaos)
+    {
+        if (vao.programHandle == program.handle && vao.layoutIdx == layoutIdx)
+            return vao.handle;
     }
 
-    //Store it in the list of vaos for this submesh
-    Vao vao = { vaoHandle, program.handle };
-    submesh.vaos.push_back(vao);
+    GLuint vaoHandle = CreateVAO(page.vertexBufferHandle, page.indexBufferHandle, pool.layouts[layoutIdx], 0, program, entityIndexBuffer);
+    page.vaos.push_back(GeometryPageVao{ vaoHandle, program.handle, layoutIdx });
 
     return vaoHandle;
 }
 
+void DefragmentGeometry(App* app)
+{
+    if (!DefragmentGeometryPool(app->geometryPool))
+        return;
+
+    for (Mesh& mesh : app->meshes)
+        for (Submesh& submesh : mesh.submeshes)
+            RefreshSubmeshGeometry(app->geometryPool, submesh);
+}
+
+void UpdateEntityIndexBuffer(App* app)
+{
+    u32 entityCount = app->entities.size();
+    if (entityCount <= app->entityIndexBufferCount)
+        return;
+
+    // Keep the same buffer name so the existing vaos keep pointing to it
+    std::vector<u32> entityIndices(entityCount);
+    for (u32 i = 0; i < entityCount; ++i)
+        entityIndices[i] = i;
+
+    glBindBuffer(GL_ARRAY_BUFFER, app->entityIndexBufferHandle);
+    glBufferData(GL_ARRAY_BUFFER, entityCount * sizeof(u32), entityIndices.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    app->entityIndexBufferCount = entityCount;
+}
+
 void Init(App* app)
 {
+    TRACE_FUNCTION();
+
+    //Shadow copy of the GL state, nothing is known about the new context yet
+    ResetGLState();
+
     if (GLVersion.major > 4 || GLVersion.major == 4 && GLVersion.minor >= 3) {
         glDebugMessageCallback(OnGlError, app);
     }
 
-    glEnable(GL_DEPTH_TEST);
+    GLStateEnable(GL_DEPTH_TEST);
     // TODO: Initialize your resources here!
     // - vertex buffers
     // - element/index buffers
@@ -339,9 +553,11 @@ void Init(App* app)
     app->woodNormalTexIdx = LoadTexture2D(app, "Wood_Normal.png");
     app->woodHeightTexIdx = LoadTexture2D(app, "Wood_Height.png");
 
-    //Load Models/Primitives
+    //Load Models/Primitives, all their vertices and indices go to the shared pool buffers
+    app->geometryPool = CreateGeometryPool(GEOMETRY_VERTEX_PAGE_SIZE, GEOMETRY_INDEX_PAGE_SIZE);
     app->quadIdx = LoadCube(app);
     app->sphereIdx = LoadSphere(app);
+    app->lightVolumeIdx = LoadIcosphere(app, 1);
     app->patrickIdx = LoadModel(app, "Patrick/Patrick.obj");
     app->cubeIdx = LoadCube(app);
     app->cubeBumpIdx = LoadCube(app);
@@ -367,10 +583,13 @@ void Init(App* app)
 
         app->lights.push_back(Light{ LightType_Point, lightColor, {0.0, 0.0, 0.0}, lightPosition });
     }*/
-    app->lights.push_back(Light{ LightType_Point, {1,1,1}, {0.0, 0.0, 0.0}, {0,0.5,-1} });
+    //The generated scene has its own lights
+    if (!app->sceneConfig.enabled)
+        app->lights.push_back(Light{ LightType_Point, {1,1,1}, {0.0, 0.0, 0.0}, {0,0.5,-1} });
 
     //Program
     app->texturedGeometryProgramIdx = InitProgram(app, "shaders.glsl", "SHOW_TEXTURED_MESH");
+    app->texturedGeometryClusteredProgramIdx = InitProgram(app, "shaders.glsl", "SHOW_TEXTURED_MESH", "#define CLUSTERED_LIGHTS\n");
     app->texturedQuadProgramIdx = InitProgram(app, "shaders.glsl", "TEXTURED_GEOMETRY");
     app->depthProgramIdx = InitProgram(app, "shaders.glsl", "TEXTURED_DEPTH");
     app->gProgramIdx = InitProgram(app, "shaders.glsl", "G_BUFFER_SHADER");
@@ -380,6 +599,56 @@ void Init(App* app)
     app->reliefMappingIdx = InitProgram(app, "shaders.glsl", "RELIEF_MAPPING");
     app->gProgramNormalMappingIdx = InitProgram(app, "shaders.glsl", "G_BUFFER_NORMAL_MAPPING");
     app->nullGeometryIdx = InitProgram(app, "shaders.glsl", "NULL_GEOMETRY");
+    app->reliefMappingEarlyDepthIdx = InitProgram(app, "shaders.glsl", "RELIEF_MAPPING", "#define EARLY_DEPTH_TEST\n");
+    app->depthPrePassProgramIdx = InitProgram(app, "shaders.glsl", "DEPTH_PRE_PASS");
+    app->tiledDeferredProgramIdx = InitComputeProgram(app, "shaders.glsl", "TILED_DEFERRED_LIGHTING");
+    app->hiZBuildProgramIdx = InitComputeProgram(app, "shaders.glsl", "HI_Z_BUILD");
+    app->occlusionCullingProgramIdx = InitComputeProgram(app, "shaders.glsl", "OCCLUSION_CULLING");
+    app->deferredPointInstancedProgramIdx = InitProgram(app, "shaders.glsl", "DEFERRED_POINT_LIGHTING_PASS", "#define INSTANCED_LIGHTS\n");
+    app->pointLightDrawInstancedProgramIdx = InitProgram(app, "shaders.glsl", "POINT_LIGHT_DEBUG", "#define INSTANCED_LIGHTS\n");
+    app->gBufferViewProgramIdx = InitProgram(app, "shaders.glsl", "G_BUFFER_VIEW");
+
+    //Variants of the G-buffer readers for the compact layout
+    for (u32 programIdx : { app->deferredDirectionalProgramIdx, app->deferredPointProgramIdx, app->deferredPointInstancedProgramIdx,
+                            app->gBufferViewProgramIdx, app->tiledDeferredProgramIdx })
+    {
+        std::string programName = app->programs[programIdx].programName;
+        std::string defines = app->programs[programIdx].defines + "#define COMPACT_G_BUFFER\n";
+        u32 compactIdx = programIdx == app->tiledDeferredProgramIdx ?
+            InitComputeProgram(app, "shaders.glsl", programName.c_str(), defines.c_str()) :
+            InitProgram(app, "shaders.glsl", programName.c_str(), defines.c_str());
+        app->programs[programIdx].compactGBufferProgramIdx = compactIdx;
+    }
+
+    //Programs variants for the entity transform table
+    //Material textures without binds, the material buffer is read in the fragment stage
+    GLint maxFragmentStorageBlocks = 0;
+    glGetIntegerv(GL_MAX_FRAGMENT_SHADER_STORAGE_BLOCKS, &maxFragmentStorageBlocks);
+    if (maxFragmentStorageBlocks == 0)
+        app->materialTexturesMode = MaterialTextures_Bound;
+    else if (GLExt.bindlessTexture)
+        app->materialTexturesMode = MaterialTextures_Bindless;
+    else
+        app->materialTexturesMode = MaterialTextures_Arrays;
+    glGenBuffers(1, &app->materialsBufferHandle);
+
+    InitProgramVariants(app, app->texturedGeometryProgramIdx);
+    InitProgramVariants(app, app->texturedGeometryClusteredProgramIdx);
+    InitProgramVariants(app, app->gProgramIdx);
+    InitProgramVariants(app, app->reliefMappingIdx);
+    InitProgramVariants(app, app->reliefMappingEarlyDepthIdx);
+    InitProgramVariants(app, app->gProgramNormalMappingIdx);
+
+    //The pre-pass has no material, only the transform table variant
+    app->programs[app->depthPrePassProgramIdx].transformTableProgramIdx = InitProgram(app, "shaders.glsl", "DEPTH_PRE_PASS", "#define TRANSFORM_TABLE\n");
+
+    //Relief mapping can discard the edges, so its draws keep writing their own depth
+    for (u32 programIdx : { app->reliefMappingIdx, app->programs[app->reliefMappingIdx].transformTableProgramIdx })
+    {
+        app->programs[programIdx].discardsFragments = true;
+        if (app->programs[programIdx].materialTexturesProgramIdx != UINT32_MAX)
+            app->programs[app->programs[programIdx].materialTexturesProgramIdx].discardsFragments = true;
+    }
 
     ////////////////////////////////
     app->programUniformTexture = glGetUniformLocation(app->programs[app->texturedGeometryProgramIdx].handle, "uTexture");
@@ -387,36 +656,90 @@ void Init(App* app)
     app->depthProgramUniformTexture = glGetUniformLocation(app->programs[app->depthProgramIdx].handle, "uTexture");
     app->gProgramUniformTexture = glGetUniformLocation(app->programs[app->gProgramIdx].handle, "uTexture");
 
-    glUseProgram(app->programs[app->gProgramNormalMappingIdx].handle);
-    glUniform1i(glGetUniformLocation(app->programs[app->gProgramNormalMappingIdx].handle, "uTexture"), 0);
-    glUniform1i(glGetUniformLocation(app->programs[app->gProgramNormalMappingIdx].handle, "uNormalMap"), 1);
+    for (u32 programIdx : { app->gProgramNormalMappingIdx, app->programs[app->gProgramNormalMappingIdx].transformTableProgramIdx })
+    {
+        GLStateUseProgram(app->programs[programIdx].handle);
+        glUniform1i(glGetUniformLocation(app->programs[programIdx].handle, "uTexture"), 0);
+        glUniform1i(glGetUniformLocation(app->programs[programIdx].handle, "uNormalMap"), 1);
+    }
+
+    for (u32 programIdx : { app->reliefMappingIdx, app->programs[app->reliefMappingIdx].transformTableProgramIdx,
+                            app->reliefMappingEarlyDepthIdx, app->programs[app->reliefMappingEarlyDepthIdx].transformTableProgramIdx })
+    {
+        GLStateUseProgram(app->programs[programIdx].handle);
+        glUniform1i(glGetUniformLocation(app->programs[programIdx].handle, "uTexture"), 0);
+        glUniform1i(glGetUniformLocation(app->programs[programIdx].handle, "uNormalMap"), 1);
+        glUniform1i(glGetUniformLocation(app->programs[programIdx].handle, "uHeightMap"), 2);
+    }
+
+    //G-buffer readers of both layouts, see BindGBufferTextures
+    for (u32 programIdx : { app->deferredDirectionalProgramIdx, app->deferredPointProgramIdx, app->deferredPointInstancedProgramIdx,
+                            app->gBufferViewProgramIdx, app->tiledDeferredProgramIdx })
+    {
+        for (u32 variantIdx : { programIdx, app->programs[programIdx].compactGBufferProgramIdx })
+        {
+            GLuint handle = app->programs[variantIdx].handle;
+            GLStateUseProgram(handle);
+            glUniform1i(glGetUniformLocation(handle, "gPosition"), 0);
+            glUniform1i(glGetUniformLocation(handle, "gNormal"), 1);
+            glUniform1i(glGetUniformLocation(handle, "gDiffuse"), 2);
+            glUniform1i(glGetUniformLocation(handle, "gDepth"), 3);
+        }
+    }
+
+    GLStateUseProgram(app->programs[app->hiZBuildProgramIdx].handle);
+    glUniform1i(glGetUniformLocation(app->programs[app->hiZBuildProgramIdx].handle, "uSource"), 0);
+
+    GLStateUseProgram(app->programs[app->occlusionCullingProgramIdx].handle);
+    glUniform1i(glGetUniformLocation(app->programs[app->occlusionCullingProgramIdx].handle, "uHiZ"), 0);
 
-    glUseProgram(app->programs[app->reliefMappingIdx].handle);
-    glUniform1i(glGetUniformLocation(app->programs[app->reliefMappingIdx].handle, "uTexture"), 0);
-    glUniform1i(glGetUniformLocation(app->programs[app->reliefMappingIdx].handle, "uNormalMap"), 1);
-    glUniform1i(glGetUniformLocation(app->programs[app->reliefMappingIdx].handle, "uHeightMap"), 2);
+    GLStateUseProgram(0);
 
-    glUseProgram(app->programs[app->deferredDirectionalProgramIdx].handle);
-    glUniform1i(glGetUniformLocation(app->programs[app->deferredDirectionalProgramIdx].handle, "gPosition"), 0);
-    glUniform1i(glGetUniformLocation(app->programs[app->deferredDirectionalProgramIdx].handle, "gNormal"), 1);
-    glUniform1i(glGetUniformLocation(app->programs[app->deferredDirectionalProgramIdx].handle, "gDiffuse"), 2);
+    //Draws that passed each occlusion culling phase, copied every frame to a slot the CPU reads
+    //once its fence signals
+    const u32 occlusionStatsSize = sizeof(app->occlusionVisibleDraws);
+    glGenBuffers(1, &app->occlusionStatsBufferHandle);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, app->occlusionStatsBufferHandle);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, occlusionStatsSize, NULL, GL_DYNAMIC_COPY);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
 
-    glUseProgram(app->programs[app->deferredPointProgramIdx].handle);
-    glUniform1i(glGetUniformLocation(app->programs[app->deferredPointProgramIdx].handle, "gPosition"), 0);
-    glUniform1i(glGetUniformLocation(app->programs[app->deferredPointProgramIdx].handle, "gNormal"), 1);
-    glUniform1i(glGetUniformLocation(app->programs[app->deferredPointProgramIdx].handle, "gDiffuse"), 2);
+    glGenBuffers(1, &app->occlusionStatsReadbackHandle);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, app->occlusionStatsReadbackHandle);
+    if (GLExt.bufferStorage)
+    {
+        GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage(GL_COPY_WRITE_BUFFER, occlusionStatsSize * BUFFER_FRAMES_IN_FLIGHT, NULL, flags);
+        app->occlusionStatsReadbackData = glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, occlusionStatsSize * BUFFER_FRAMES_IN_FLIGHT, flags);
+    }
+    else
+    {
+        glBufferData(GL_COPY_WRITE_BUFFER, occlusionStatsSize * BUFFER_FRAMES_IN_FLIGHT, NULL, GL_STREAM_READ);
+    }
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
 
-    glUseProgram(0);
+    //GPU time of the opaque passes, two sets so the results are read without waiting
+    glGenQueries(2 * OpaqueTimer_Count, &app->opaqueTimerQueries[0][0]);
+    glGenQueries(2, app->lightPassTimerQueries);
 
-    //Create render targets
-    CreateFrameBufferObjects(app);
+    //Framebuffer of the passes, the render targets are created by the graph when a pass needs them
+    InitRenderGraph(app->renderGraph);
 
     //Uniform buffer
     glGetIntegerv(GL_MAX_UNIFORM_BLOCK_SIZE, &app->maxUniformBufferSize);
     glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &app->uniformBufferAlignment);
 
-    app->cbuffer = CreateConstantBuffer(app->maxUniformBufferSize);
-    app->lightsBuffer = CreateConstantBuffer(app->maxUniformBufferSize);
+    app->entityParams = CreateSlotBuffer(GL_UNIFORM_BUFFER, sizeof(EntityLocalParams), app->uniformBufferAlignment);
+    app->lightParams = CreateSlotBuffer(GL_UNIFORM_BUFFER, sizeof(glm::mat4), app->uniformBufferAlignment);
+    app->slotStaging = CreateUniformArena(SLOT_STAGING_CHUNK_SIZE, app->uniformBufferAlignment);
+
+    //Entity transform table, needs storage buffers on the vertex stage
+    GLint maxVertexStorageBlocks = 0;
+    glGetIntegerv(GL_MAX_VERTEX_SHADER_STORAGE_BLOCKS, &maxVertexStorageBlocks);
+    glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &app->storageBufferAlignment);
+    app->transformTableSupported = maxVertexStorageBlocks > 0;
+    app->instancedLightVolumesSupported = maxVertexStorageBlocks > 0; //the volumes read the point light list
+    app->transformTable = CreateSlotBuffer(GL_SHADER_STORAGE_BUFFER, sizeof(EntityLocalParams), sizeof(vec4)); //std430 struct array
+    glGenBuffers(1, &app->entityIndexBufferHandle);
 
     //Create entities
     //app->entities.push_back(Entity{ TransformPositionScale({10, 3, 0}, {1.0, 1.0, 1.0}), app->patrickIdx }); //Patrick
@@ -438,28 +761,38 @@ void Init(App* app)
     //app->entities.push_back(Entity{ TransformPositionScale({-10, 3, 10}, {1.0, 1.0, 1.0}), app->patrickIdx }); //Patrick
     //app->entities.back().worldMatrix = TransformRotation(app->entities.back().worldMatrix, 180, { 0, 1, 0 });
    
-    app->entities.push_back(Entity{ TransformPositionScale({-1.0, 0.5, 0.0}, {1.0, 1.0, 1.0}), app->cubeIdx, app->gProgramNormalMappingIdx }); //Cube
-    app->entities.back().worldMatrix = TransformRotation(app->entities.back().worldMatrix, 180, { 0, 1, 0 });
+    if (app->sceneConfig.enabled)
+    {
+        //Procedural stress scene, see scene_generator.h
+        GenerateScene(app, app->sceneConfig);
+    }
+    else
+    {
+        app->entities.push_back(Entity{ TransformPositionScale({-1.0, 0.5, 0.0}, {1.0, 1.0, 1.0}), app->cubeIdx, app->gProgramNormalMappingIdx }); //Cube
+        app->entities.back().worldMatrix = TransformRotation(app->entities.back().worldMatrix, 180, { 0, 1, 0 });
 
-    app->entities.push_back(Entity{ TransformPositionScale({-3.0, 0.5, 0.0}, {1.0, 1.0, 1.0}), app->cubeBumpIdx, app->reliefMappingIdx }); //Cube
-    app->entities.back().worldMatrix = TransformRotation(app->entities.back().worldMatrix, 180, { 0, 1, 0 });
+        app->entities.push_back(Entity{ TransformPositionScale({-3.0, 0.5, 0.0}, {1.0, 1.0, 1.0}), app->cubeBumpIdx, app->reliefMappingIdx }); //Cube
+        app->entities.back().worldMatrix = TransformRotation(app->entities.back().worldMatrix, 180, { 0, 1, 0 });
 
-    app->entities.push_back(Entity{ TransformPositionScale({1, 0.5, 0.0}, {1.0, 1.0, 1.0}), app->cubeIdx, app->gProgramIdx }); //Cube
-    app->entities.back().worldMatrix = TransformRotation(app->entities.back().worldMatrix, 180, { 0, 1, 0 });
+        app->entities.push_back(Entity{ TransformPositionScale({1, 0.5, 0.0}, {1.0, 1.0, 1.0}), app->cubeIdx, app->gProgramIdx }); //Cube
+        app->entities.back().worldMatrix = TransformRotation(app->entities.back().worldMatrix, 180, { 0, 1, 0 });
 
-    //app->entities.push_back(Entity{ TransformPositionScale({-3.0, 1.0, 0}, {0.2, 0.2, 0.2}), app->sphereIdx, app->gProgramIdx }); //Floor
+        //app->entities.push_back(Entity{ TransformPositionScale({-3.0, 1.0, 0}, {0.2, 0.2, 0.2}), app->sphereIdx, app->gProgramIdx }); //Floor
 
-    app->entities.push_back(Entity{ TransformPositionScale({0, -0.5, 0}, {100.0, 1.0, 100.0}), app->quadIdx, app->gProgramIdx }); //Floor
-    app->entities.back().worldMatrix = TransformRotation(app->entities.back().worldMatrix, -90, { 1, 0, 0 });
+        app->entities.push_back(Entity{ TransformPositionScale({0, -0.5, 0}, {100.0, 1.0, 100.0}), app->quadIdx, app->gProgramIdx }); //Floor
+        app->entities.back().worldMatrix = TransformRotation(app->entities.back().worldMatrix, -90, { 1, 0, 0 });
+    }
 
     app->mode = Mode::Mode_Deferred;
 }
 
 void Gui(App* app)
 {
+    TRACE_FUNCTION();
+
     ImGui::BeginMainMenuBar();
     {
-        static const char* modeSelections[]{ "Forward", "Deferred"};
+        static const char* modeSelections[]{ "Forward", "Deferred", "Deferred Tiled", "Forward Clustered"};
         static int selectedMode = app->mode;
 
         ImGui::SetNextItemWidth(ImGui::GetWindowWidth() * 0.25f);
@@ -469,7 +802,7 @@ void Gui(App* app)
         }
 
         ImGui::SetNextItemWidth(ImGui::GetWindowWidth() * 0.25f);
-        if (app->mode == Mode::Mode_Deferred)
+        if (app->mode == Mode::Mode_Deferred || app->mode == Mode::Mode_DeferredTiled)
         {
             static const char* selections[]{ "Position", "Diffuse", "Normals", "Depth", "Final" };
             static int selectedTarget = app->renderTarget;
@@ -493,552 +826,1921 @@ void Gui(App* app)
     ImGui::SliderInt("Min layers", &app->minLayers, 0.0f, 100.f);
     ImGui::SliderInt("Max layers", &app->maxLayers, 0.0f, 100.f);
 
+    ImGui::Separator();
+    ImGui::Text("Performance");
+    ImGui::Spacing();
+    ImGui::Checkbox("Parallel Entity Update", &app->parallelEntityUpdate);
+    ImGui::Checkbox("Frustum Culling", &app->useFrustumCulling);
+    if (app->useFrustumCulling)
+        ImGui::Checkbox("BVH Culling", &app->useBvhCulling);
+    if (app->instancedLightVolumesSupported)
+        ImGui::Checkbox("Instanced Light Volumes", &app->instancedLightVolumes);
+    if (app->transformTableSupported && ImGui::Checkbox("Entity Transform Table (SSBO)", &app->useTransformTable))
+    {
+        //The other buffer missed the updates done meanwhile
+        for (Entity& entity : app->entities)
+            entity.dirty = true;
+    }
+    if (app->materialTexturesMode != MaterialTextures_Bound)
+        ImGui::Checkbox(app->materialTexturesMode == MaterialTextures_Bindless ? "Material Textures (Bindless)" : "Material Textures (Texture Arrays)", &app->useMaterialTextures);
+    //The draws find their transform through the base instance, so it needs the transform table
+    if (app->useTransformTable)
+        ImGui::Checkbox("Multi-Draw Indirect", &app->useMultiDrawIndirect);
+    ImGui::Checkbox("Depth Pre-Pass", &app->useDepthPrePass);
+    //Tests the indirect draws against the G-buffer depth, so only in the deferred modes
+    if (app->useTransformTable && app->useMultiDrawIndirect && (app->mode == Mode_Deferred || app->mode == Mode_DeferredTiled))
+        ImGui::Checkbox("Hi-Z Occlusion Culling", &app->useOcclusionCulling);
+    if (app->mode == Mode_Deferred || app->mode == Mode_DeferredTiled)
+        ImGui::Checkbox("Compact G-Buffer", &app->useCompactGBuffer);
+
     ImGui::End();
-}
 
-void Update(App* app)
-{
-    glm::mat4 projection, view;
-    // You can handle app->input keyboard/mouse here
+    // Window for per-frame statistics
+    ImGui::Begin("Statistics", NULL, ImGuiWindowFlags_AlwaysAutoResize);
 
-    //////////////////////////////////////////KEYBOARD///////////////////////////////////////////
-    if (app->input.keys[K_W] == ButtonState::BUTTON_PRESSED) {
-        app->camera.ProcessKeyboard(Camera_Movement::FORWARD, app->deltaTime);
-    }
-    if (app->input.keys[K_S] == ButtonState::BUTTON_PRESSED) {
-        app->camera.ProcessKeyboard(Camera_Movement::BACKWARD, app->deltaTime);
-    }
-    if (app->input.keys[K_A] == ButtonState::BUTTON_PRESSED) {
-        app->camera.ProcessKeyboard(Camera_Movement::LEFT, app->deltaTime);
-    }
-    if (app->input.keys[K_D] == ButtonState::BUTTON_PRESSED) {
-        app->camera.ProcessKeyboard(Camera_Movement::RIGHT, app->deltaTime);
-    }
-    if (app->input.keys[K_SPACE] == ButtonState::BUTTON_PRESSED) {
-        app->camera.ProcessKeyboard(Camera_Movement::UP, app->deltaTime);
-    }
-    if (app->input.keys[K_SHIFT] == ButtonState::BUTTON_PRESS) {
-        app->camera.ProcessSpeed(true);
-    }
-    if (app->input.keys[K_SHIFT] == ButtonState::BUTTON_RELEASE) {
-        app->camera.ProcessSpeed(false);
-    }
+    if (IsTraceCapturing())
+        ImGui::Text("Capturing CPU trace...");
+    else if (ImGui::Button("Capture CPU Trace"))
+        StartTraceCapture("cpu_trace.json");
+    ImGui::Separator();
 
-    if (app->input.keys[K_I] == ButtonState::BUTTON_PRESSED) {
-        app->lights[0].position += vec3(0.0, 0.1, 0.0);
-    }
-    if (app->input.keys[K_K] == ButtonState::BUTTON_PRESSED) {
-        app->lights[0].position -= vec3(0.0, 0.1, 0.0);
-    }
-    if (app->input.keys[K_J] == ButtonState::BUTTON_PRESSED) {
-        app->lights[0].position += vec3(0.1, 0.0, 0.0);
-    }
-    if (app->input.keys[K_L] == ButtonState::BUTTON_PRESSED) {
-        app->lights[0].position -= vec3(0.1, 0.0, 0.0);
-    }
+    ImGui::Text("Uploads");
+    ImGui::Spacing();
+    ImGui::Text("This frame: %.2f KB", app->frameUploadBytes / (f32)KB(1));
+    ImGui::Text("Without dirty tracking: %.2f KB (%.1fx)", app->frameFullUploadBytes / (f32)KB(1), app->frameFullUploadBytes / (f32)glm::max(app->frameUploadBytes, 1u));
+    const SlotBuffer& entitySlots = app->useTransformTable ? app->transformTable : app->entityParams;
+    ImGui::Text("Entities: %.2f KB (peak %.2f KB)", entitySlots.bytesUploaded / (f32)KB(1), entitySlots.highWaterMark / (f32)KB(1));
+    ImGui::Text("Light volumes: %.2f KB (peak %.2f KB)", app->lightParams.bytesUploaded / (f32)KB(1), app->lightParams.highWaterMark / (f32)KB(1));
+    ImGui::Text("Slot staging: %.2f KB in %u chunks (peak %.2f KB)", app->slotStaging.frameBytesUsed / (f32)KB(1), (u32)app->slotStaging.chunks.size(), app->slotStaging.highWaterMark / (f32)KB(1));
+
+    // Fill of the persistent rings, per frame region
+    struct { const char* name; const Buffer& buffer; } rings[] = {
+        { "Global params", app->globalParams },
+        { "Lights", app->lightsStorage },
+        { "Light clusters", app->lightClustersStorage },
+        { "Light instances", app->pointLightInstances },
+        { "Indirect commands", app->indirectCommands },
+    };
+    for (const auto& ring : rings)
+        ImGui::Text("%s: %.2f / %.2f KB (peak %.2f KB)", ring.name, ring.buffer.bytesUsed / (f32)KB(1), ring.buffer.regionSize / (f32)KB(1), ring.buffer.highWaterMark / (f32)KB(1));
 
-    ////////////////////////////////////////////MOUSE/////////////////////////////////////////////
-    if (app->input.mouseButtons[1] == ButtonState::BUTTON_PRESSED) {
-        app->camera.ProcessMouseMovement(app->input.mouseDelta.x, -app->input.mouseDelta.y);
-        app->camera.Orbit = false;
+    ImGui::Separator();
+    ImGui::Text("Culling");
+    ImGui::Spacing();
+    ImGui::Text("Visible entities: %u / %u", (u32)app->visibleEntities.size(), (u32)app->entities.size());
+    ImGui::Text("BVH nodes: %u", (u32)app->entityBvh.nodes.size());
+    ImGui::Text("BVH refitted nodes: %u", app->entityBvh.refittedNodes);
+    if (app->pickedEntity != UINT32_MAX)
+        ImGui::Text("Picked entity: %u", app->pickedEntity);
+    else
+        ImGui::Text("Picked entity: none");
+    if (ImGui::Button("Rebuild BVH"))
+        BuildEntityBvh(app);
+    if (app->mode == Mode_ForwardClustered)
+    {
+        ImGui::Text("Light clusters: %u indices, up to %u lights per cluster", (u32)app->lightClusters.lightIndices.size(), app->lightClusters.maxClusterLightCount);
+        if (app->lightClusters.fullClusterCount > 0)
+            ImGui::Text("Full light clusters: %u (lights dropped)", app->lightClusters.fullClusterCount);
     }
+    if (UseOcclusionCulling(app))
+        ImGui::Text("Occlusion culling: %u + %u retested draws visible", app->occlusionVisibleDraws[0], app->occlusionVisibleDraws[1]);
 
-    if (app->input.mouseButtons[0] == ButtonState::BUTTON_PRESSED && app->input.keys[K_SHIFT] == ButtonState::BUTTON_PRESSED) {
-        app->camera.ProcessArcBallMovement(-app->input.mouseDelta.x, -app->input.mouseDelta.y, app->displaySize.x, app->displaySize.y);
-        app->camera.Orbit = true;
-    }
+    ImGui::Separator();
+    ImGui::Text("Opaque Passes (GPU)");
+    ImGui::Spacing();
+    ImGui::Text("Depth pre-pass: %.3f ms", app->opaqueTimes[OpaqueTimer_PrePass]);
+    ImGui::Text("%s pass: %.3f ms", app->mode == Mode_Forward || app->mode == Mode_ForwardClustered ? "Forward" : "Geometry", app->opaqueTimes[OpaqueTimer_Main]);
+    ImGui::Text("Total without pre-pass: %.3f ms", app->opaqueTotalTimes[0]);
+    ImGui::Text("Total with pre-pass: %.3f ms", app->opaqueTotalTimes[1]);
 
-    if (app->input.mouseButtons[0] == ButtonState::BUTTON_RELEASE || app->input.keys[K_SHIFT] == ButtonState::BUTTON_RELEASE) {
-        app->camera.Orbit = false;
+    if (app->mode == Mode_Deferred || app->mode == Mode_DeferredTiled)
+    {
+        ImGui::Separator();
+        ImGui::Text("G-Buffer");
+        ImGui::Spacing();
+        f32 pixelCount = (f32)app->displaySize.x * app->displaySize.y;
+        ImGui::Text("Full: %u B/px, %.2f MB", GetGBufferPixelSize(false), GetGBufferPixelSize(false) * pixelCount / MB(1));
+        ImGui::Text("Compact: %u B/px, %.2f MB", GetGBufferPixelSize(true), GetGBufferPixelSize(true) * pixelCount / MB(1));
+        ImGui::Text("Light pass: %.3f ms", app->lightPassTime);
+        ImGui::Text("Opaque + light, full: %.3f ms", app->gBufferFrameTimes[0]);
+        ImGui::Text("Opaque + light, compact: %.3f ms", app->gBufferFrameTimes[1]);
     }
 
-    //GLOBAL AND LOCAL CBUFFER
-    float aspectRatio = (float)app->displaySize.x / (float)app->displaySize.y;
-    vec3 upVector = { 0, 1, 0 };
-    projection = glm::perspective(glm::radians(app->camera.Zoom), aspectRatio, app->camera.NearPlane, app->camera.FarPlane);
-
-    view = app->camera.GetViewMatrix();
-
-    MapBuffer(app->cbuffer, GL_WRITE_ONLY);
-
-    // -- Global params
-    app->globalParamsOffset = app->cbuffer.head;
-    PushVec3(app->cbuffer, app->camera.Position);
-    PushUInt(app->cbuffer, app->lights.size());
+    ImGui::Separator();
+    ImGui::Text("Render Graph");
+    ImGui::Spacing();
+    ImGui::Text("Passes: %u, culled: %u", (u32)app->renderGraph.passes.size(), app->renderGraph.culledPassCount);
+    ImGui::Text("Render targets: %u, %.2f MB", (u32)app->renderGraph.pool.size(), app->renderGraph.poolBytes / (f32)MB(1));
+    ImGui::Text("Aliased: %u", app->renderGraph.aliasedTextureCount);
 
-    for (u32 i = 0; i < app->lights.size(); ++i)
+    ImGui::Separator();
+    ImGui::Text("GL State (issued / skipped)");
+    ImGui::Spacing();
+    const GLStateCounters& glCounters = GetLastFrameGLStateCounters();
+    u32 glIssued = 0, glSkipped = 0;
+    for (u32 call = 0; call < GLStateCall_Count; ++call)
     {
-        AlignHead(app->cbuffer, sizeof(vec4));
-
-        Light& light = app->lights[i];
-        PushUInt(app->cbuffer, light.type);
-        PushVec3(app->cbuffer, light.color);
-        PushVec3(app->cbuffer, light.direction);
-        PushVec3(app->cbuffer, light.position);
+        ImGui::Text("%s: %u / %u", GLStateCallNames[call], glCounters.issued[call], glCounters.skipped[call]);
+        glIssued += glCounters.issued[call];
+        glSkipped += glCounters.skipped[call];
     }
+    ImGui::Text("Total: %u / %u", glIssued, glSkipped);
 
-    app->globalParamsSize = app->cbuffer.head - app->globalParamsOffset;
+    ImGui::Separator();
+    ImGui::Text("Render Queue");
+    ImGui::Spacing();
+    ImGui::Text("Draws: %u", (u32)app->renderQueue.commands.size());
+    ImGui::Text("Draw calls: %u", app->renderQueue.drawCalls);
+    ImGui::Text("State changes: %u", app->renderQueue.stateChanges);
+    ImGui::Text("Skipped: %u", app->renderQueue.stateChangesSkipped);
 
-    // -- Local params
-    for(Entity &e : app->entities)
+    ImGui::Separator();
+    ImGui::Text("Geometry Pool");
+    ImGui::Spacing();
+    u32 vertexCapacity = 0, indexCapacity = 0, freeBlocks = 0;
+    for (const GeometryPage& page : app->geometryPool.pages)
     {
-        AlignHead(app->cbuffer, app->uniformBufferAlignment);
-        glm::mat4 world = e.worldMatrix;
-        glm::mat4 worldView = view * world;
-        glm::mat4 worldViewProjection = projection * view * world;
-
-        e.localParamsOffset = app->cbuffer.head;
-        PushMat4(app->cbuffer, world);
-        PushMat4(app->cbuffer, worldView);
-        PushMat4(app->cbuffer, worldViewProjection);
-        e.localParamsSize = app->cbuffer.head - e.localParamsOffset;
+        vertexCapacity += page.vertexBufferSize;
+        indexCapacity += page.indexBufferSize;
+        freeBlocks += page.freeVertexBlocks.size() + page.freeIndexBlocks.size();
     }
+    ImGui::Text("Pages: %u", (u32)app->geometryPool.pages.size());
+    ImGui::Text("Vertices: %.2f / %.2f MB", app->geometryPool.vertexBytesUsed / (f32)MB(1), vertexCapacity / (f32)MB(1));
+    ImGui::Text("Indices: %.2f / %.2f MB", app->geometryPool.indexBytesUsed / (f32)MB(1), indexCapacity / (f32)MB(1));
+    ImGui::Text("Free blocks: %u", freeBlocks);
+    if (ImGui::Button("Defragment"))
+        DefragmentGeometry(app);
 
-    UnmapBuffer(app->cbuffer);
+    ImGui::End();
 
-    MapBuffer(app->lightsBuffer, GL_WRITE_ONLY);
+    // Window for the GPU time of the passes
+    ImGui::Begin("GPU Profiler", NULL, ImGuiWindowFlags_AlwaysAutoResize);
 
-    // -- Light params to create Light Volumes
-    for (Light& light : app->lights)
+    GpuProfiler& profiler = app->gpuProfiler;
+    ImGui::Checkbox("Enabled", &profiler.enabled);
+    ImGui::Text("Last / average / max over %u frames (ms)", profiler.historyCount);
+    ImGui::Spacing();
+    for (const GpuProfilerZoneStats& zone : profiler.zones)
     {
-        if (light.type != LightType_Point) //Point Light
-            continue;
+        //Indent(0) would use the default indentation
+        if (zone.depth > 0) ImGui::Indent(zone.depth * 12.0f);
+        ImGui::Text("%s: %.3f / %.3f / %.3f", zone.name, zone.last, zone.average, zone.max);
+        if (zone.depth > 0) ImGui::Unindent(zone.depth * 12.0f);
+    }
+    if (!profiler.zones.empty())
+    {
+        //The root zone, from the oldest sample to the newest
+        u32 first = (profiler.historyHead + GPU_PROFILER_HISTORY - profiler.historyCount) % GPU_PROFILER_HISTORY;
+        ImGui::PlotLines("Frame", profiler.zones[0].history, profiler.historyCount, first, NULL, 0.0f, FLT_MAX, ImVec2(0.0f, 60.0f));
+    }
+    ImGui::Text("Dropped frames: %u", profiler.droppedFrames);
+    if (ImGui::Button("Export CSV"))
+    {
+        if (ExportGpuProfilerCsv(profiler, "gpu_profile.csv"))
+        {
+            ILOG("GPU profile written to gpu_profile.csv");
+        }
+        else
+        {
+            ELOG("Could not write gpu_profile.csv");
+        }
+    }
 
-        AlignHead(app->lightsBuffer, app->uniformBufferAlignment);
-        glm::mat4 model = glm::mat4(1.0f);
-        model = glm::translate(model, light.position);
-        model = glm::scale(model, glm::vec3(CalcPointLightRadius(light))); //this is for sphere light volume, makes sphere size same as radius of light
-        glm::mat4 worldViewProjection = projection * view * model;
+    ImGui::End();
+}
 
-        light.localParamsOffset = app->lightsBuffer.head;
-        PushMat4(app->lightsBuffer, worldViewProjection);
-        light.localParamsSize = app->lightsBuffer.head - light.localParamsOffset;
-    }
+void ForEachEntityRange(App* app, const ParallelForFunction& function)
+{
+    if (app->parallelEntityUpdate)
+        ParallelFor(app->entities.size(), ENTITY_UPDATE_MIN_BATCH, function);
+    else
+        function(0, app->entities.size());
+}
 
-    UnmapBuffer(app->lightsBuffer);
+void UpdateEntityBounds(App* app)
+{
+    EntityBounds& bounds = app->entityBounds;
+    const u32 count = app->entities.size();
+
+    // Entities were added or removed, every sphere has to be placed again
+    const bool resized = bounds.radius.size() != count;
+    bounds.centerX.resize(count);
+    bounds.centerY.resize(count);
+    bounds.centerZ.resize(count);
+    bounds.radius.resize(count);
+    app->entityBoundsDirty.resize(count);
+
+    // Before UpdateEntityParams, that clears the dirty flags
+    ForEachEntityRange(app, [&](u32 begin, u32 end) {
+        for (u32 i = begin; i < end; ++i)
+        {
+            const Entity& entity = app->entities[i];
+            if (!entity.dirty && !resized)
+                continue;
+
+            const Mesh& mesh = app->meshes[app->models[entity.modelIndex].meshIdx];
+            BoundingSphere sphere = TransformBoundingSphere(entity.worldMatrix, mesh.sphere);
+            bounds.centerX[i] = sphere.center.x;
+            bounds.centerY[i] = sphere.center.y;
+            bounds.centerZ[i] = sphere.center.z;
+            bounds.radius[i] = sphere.radius;
+            app->entityBoundsDirty[i] = 1;
+        }
+    });
 }
 
+void BuildEntityBvh(App* app)
+{
+    const EntityBounds& bounds = app->entityBounds;
+    BuildBvh(app->entityBvh, bounds.centerX.data(), bounds.centerY.data(), bounds.centerZ.data(), bounds.radius.data(),
+             app->entities.size(), app->parallelEntityUpdate);
+    memset(app->entityBoundsDirty.data(), 0, app->entityBoundsDirty.size());
+}
 
-void Render(App* app)
+void UpdateEntityBvh(App* app)
 {
-    //OpenGL Settings
-    glDepthMask(GL_TRUE);
-    glDisable(GL_BLEND);
-    glEnable(GL_CULL_FACE);
-    glEnable(GL_DEPTH_TEST);
+    TRACE_FUNCTION();
 
-    //Select mode of rendering (Forward or Deferred)
-    switch (app->mode)
+    // Rebuilt when entities are added or removed, otherwise only the moved spheres are refitted
+    if (app->entityBvh.items.size() != app->entities.size())
     {
-        case Mode_Deferred: DeferredRender(app); break;
-        case Mode_Forward: ForwardRender(app); break;
-    }  
+        BuildEntityBvh(app);
+        return;
+    }
+
+    const EntityBounds& bounds = app->entityBounds;
+    RefitBvh(app->entityBvh, bounds.centerX.data(), bounds.centerY.data(), bounds.centerZ.data(), bounds.radius.data(),
+             app->entityBoundsDirty.data());
 }
 
-void ForwardRender(App* app)
+void CullEntities(App* app, const glm::mat4& viewProjection)
 {
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    TRACE_FUNCTION();
+
+    const u32 count = app->entities.size();
+    app->visibleEntities.resize(count);
+
+    if (!app->useFrustumCulling)
+    {
+        for (u32 i = 0; i < count; ++i)
+            app->visibleEntities[i] = i;
+        return;
+    }
+
+    vec4 planes[6];
+    Camera::ExtractFrustumPlanes(viewProjection, planes);
+
+    if (app->useBvhCulling)
+    {
+        app->visibleEntities.clear();
+        BvhQueryFrustum(app->entityBvh, planes, app->visibleEntities);
+        return;
+    }
+
+    const EntityBounds& bounds = app->entityBounds;
+    u32 visibleCount = CullSpheres(planes, bounds.centerX.data(), bounds.centerY.data(), bounds.centerZ.data(), bounds.radius.data(),
+                                   count, app->visibleEntities.data());
+    app->visibleEntities.resize(visibleCount);
+}
+
+void PickEntity(App* app, const glm::mat4& viewProjection)
+{
+    // Ray from the near to the far plane through the mouse position
+    vec2 ndc = vec2(2.0f * app->input.mousePos.x / app->displaySize.x - 1.0f, 1.0f - 2.0f * app->input.mousePos.y / app->displaySize.y);
+    glm::mat4 inverseViewProjection = glm::inverse(viewProjection);
+    vec4 nearPoint = inverseViewProjection * vec4(ndc, -1.0f, 1.0f);
+    vec4 farPoint = inverseViewProjection * vec4(ndc, 1.0f, 1.0f);
+    vec3 origin = vec3(nearPoint) / nearPoint.w;
+    vec3 target = vec3(farPoint) / farPoint.w;
+
+    app->pickedEntity = BvhRaycast(app->entityBvh, origin, glm::normalize(target - origin), glm::distance(origin, target), NULL);
+}
+
+// False when no entity is inside the light volume, so the light can't reach any pixel
+bool PointLightTouchesEntities(App* app, const Light& light)
+{
+    return BvhAnySphereOverlap(app->entityBvh, light.position, CalcPointLightRadius(light));
+}
+
+void UpdateEntityParams(App* app)
+{
+    TRACE_FUNCTION();
+
+    SlotBuffer& params = app->useTransformTable ? app->transformTable : app->entityParams;
+    ResizeSlotBuffer(params, app->entities.size());
+    if (app->useTransformTable)
+        UpdateEntityIndexBuffer(app);
+
+    Entity* entities = app->entities.data();
+    u8* slots = params.shadow.data();
+    u8* dirtySlots = params.dirtySlots.data();
+    ForEachEntityRange(app, [&](u32 begin, u32 end) {
+        WriteEntityLocalParams(entities, begin, end, slots, params.slotStride, dirtySlots);
+    });
+
+    FlushSlotBuffer(params, app->slotStaging);
+    app->frameUploadBytes += params.bytesUploaded;
+    app->frameFullUploadBytes += params.slotCount * params.slotStride - params.bytesUploaded; //the clean slots
+}
+
+void WriteEntityLocalParams(Entity* entities, u32 begin, u32 end, u8* slots, u32 slotStride, u8* dirtySlots)
+{
+    for (u32 i = begin; i < end; ++i)
+    {
+        Entity& entity = entities[i];
+        if (!entity.dirty)
+            continue;
+
+        EntityLocalParams* params = (EntityLocalParams*)(slots + i * slotStride);
+        params->worldMatrix = entity.worldMatrix;
+
+        // Inverse transpose, keeps the normals perpendicular under non uniform scales
+        glm::mat3 normalMatrix = glm::transpose(glm::inverse(glm::mat3(entity.worldMatrix)));
+        for (u32 c = 0; c < 3; ++c)
+            params->normalMatrix[c] = vec4(normalMatrix[c], 0.0f);
+
+        dirtySlots[i] = 1;
+        entity.dirty = false;
+    }
+}
+
+// Returns true if any light changed
+bool UpdateLightParams(App* app)
+{
+    bool changed = ResizeSlotBuffer(app->lightParams, app->lights.size());
+
+    for (u32 i = 0; i < app->lights.size(); ++i)
+    {
+        Light& light = app->lights[i];
+        if (!light.dirty)
+            continue;
+
+        changed = true;
+        light.dirty = false;
+
+        if (light.type != LightType_Point) //Point Light
+            continue;
+
+        //Translation * uniform scale written directly, makes sphere size same as radius of light
+        const f32 radius = CalcPointLightRadius(light);
+        glm::mat4 model = glm::mat4(radius);
+        model[3] = vec4(light.position, 1.0f);
+        memcpy(WriteSlot(app->lightParams, i), glm::value_ptr(model), sizeof(glm::mat4));
+    }
+
+    FlushSlotBuffer(app->lightParams, app->slotStaging);
+    app->frameUploadBytes += app->lightParams.bytesUploaded;
+    app->frameFullUploadBytes += app->lightParams.slotCount * app->lightParams.slotStride - app->lightParams.bytesUploaded;
+    return changed;
+}
+
+void UpdateLightLists(App* app)
+{
+    TRACE_FUNCTION();
+
+    // Compact per-type lists, so each pass only iterates the lights it shades
+    u32 directionalCount = 0, pointCount = 0;
+    for (Light& light : app->lights)
+        light.listIdx = light.type == LightType_Point ? pointCount++ : directionalCount++;
+
+    // At least one element per list so the bound ranges are never empty
+    u32 directionalSize = Align(glm::max(directionalCount, 1u) * sizeof(DirectionalLightData), app->storageBufferAlignment);
+    u32 pointSize = glm::max(pointCount, 1u) * sizeof(PointLightData);
+    u32 storageSize = directionalSize + pointSize;
+
+    // Grow with some slack so it is not recreated every time a light is added
+    if (storageSize > app->lightsStorage.regionSize)
+    {
+        if (app->lightsStorage.handle)
+            DestroyBuffer(app->lightsStorage);
+        app->lightsStorage = CreatePersistentStorageBuffer(storageSize + storageSize / 2, app->storageBufferAlignment);
+    }
+
+    //Next region, the previous one may still be in use by the frames in flight
+    MapBuffer(app->lightsStorage, GL_WRITE_ONLY);
+    ASSERT(app->lightsStorage.head + storageSize <= GetBufferRegionEnd(app->lightsStorage), "The light lists don't fit in the region");
+    app->directionalLightsOffset = app->lightsStorage.head;
+    app->directionalLightsSize = directionalSize;
+    app->pointLightsOffset = app->lightsStorage.head + directionalSize;
+    app->pointLightsSize = pointSize;
+
+    u8* data = (u8*)app->lightsStorage.data;
+    DirectionalLightData* directionalLights = (DirectionalLightData*)(data + app->directionalLightsOffset);
+    PointLightData* pointLights = (PointLightData*)(data + app->pointLightsOffset);
+
+    for (const Light& light : app->lights)
+    {
+        if (light.type == LightType_Point)
+        {
+            PointLightData& pointLight = pointLights[light.listIdx];
+            pointLight.position = light.position;
+            pointLight.radius = CalcPointLightRadius(light);
+            pointLight.color = light.color;
+        }
+        else
+        {
+            DirectionalLightData& directionalLight = directionalLights[light.listIdx];
+            directionalLight.direction = light.direction;
+            directionalLight.color = light.color;
+        }
+    }
+
+    app->lightsStorage.head += storageSize;
+    UnmapBuffer(app->lightsStorage);
+
+    app->directionalLightCount = directionalCount;
+    app->pointLightCount = pointCount;
+    app->frameUploadBytes += storageSize;
+}
+
+// Copies every texture to a layer of the array with its size and format
+void BuildTextureArrays(App* app)
+{
+    if (!app->textureArrays.empty())
+        GLStateDeleteTextures(app->textureArrays.size(), app->textureArrays.data());
+    app->textureArrays.clear();
+
+    struct TextureArrayGroup
+    {
+        ivec2  size;
+        GLenum internalFormat;
+        u32    layerCount;
+    };
+    std::vector<TextureArrayGroup> groups;
+
+    for (Texture& texture : app->textures)
+    {
+        u32 groupIdx = 0;
+        while (groupIdx < groups.size() && (groups[groupIdx].size != texture.size || groups[groupIdx].internalFormat != texture.internalFormat))
+            groupIdx++;
+
+        if (groupIdx == MAX_MATERIAL_TEXTURE_ARRAYS)
+        {
+            ELOG("Too many texture sizes/formats for the material texture arrays, %s will show the first texture", texture.filepath.c_str());
+            texture.arrayIdx = 0;
+            texture.arrayLayer = 0;
+            continue;
+        }
+        if (groupIdx == groups.size())
+            groups.push_back(TextureArrayGroup{ texture.size, texture.internalFormat, 0 });
+
+        texture.arrayIdx = groupIdx;
+        texture.arrayLayer = groups[groupIdx].layerCount++;
+    }
+
+    for (const TextureArrayGroup& group : groups)
+    {
+        //Same sampling as the 2D textures (CreateTexture2DFromImage)
+        GLuint arrayHandle;
+        glGenTextures(1, &arrayHandle);
+        GLStateBindTexture(GL_TEXTURE_2D_ARRAY, arrayHandle);
+        glTexStorage3D(GL_TEXTURE_2D_ARRAY, 1 + (u32)log2f((f32)glm::max(group.size.x, group.size.y)), group.internalFormat, group.size.x, group.size.y, group.layerCount);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        GLStateBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+        app->textureArrays.push_back(arrayHandle);
+    }
+
+    //Copy on the GPU, mip levels included
+    for (u32 texIdx = 0; texIdx < app->textures.size(); ++texIdx)
+    {
+        const Texture& texture = app->textures[texIdx];
+        const TextureArrayGroup& group = groups[texture.arrayIdx];
+        if (group.size != texture.size || group.internalFormat != texture.internalFormat)
+            continue; // one of the textures that did not fit
+
+        u32 levelCount = 1 + (u32)log2f((f32)glm::max(texture.size.x, texture.size.y));
+        for (u32 level = 0; level < levelCount; ++level)
+        {
+            GLsizei width = glm::max(texture.size.x >> level, 1);
+            GLsizei height = glm::max(texture.size.y >> level, 1);
+            glCopyImageSubData(texture.handle, GL_TEXTURE_2D, level, 0, 0, 0,
+                app->textureArrays[texture.arrayIdx], GL_TEXTURE_2D_ARRAY, level, 0, 0, texture.arrayLayer, width, height, 1);
+        }
+    }
+}
+
+u64 GetMaterialTextureRef(App* app, u32 textureIdx)
+{
+    if (textureIdx == NO_TEXTURE_ATTACHED || textureIdx >= app->textures.size())
+        return 0;
+
+    const Texture& texture = app->textures[textureIdx];
+    if (app->materialTexturesMode == MaterialTextures_Bindless)
+        return texture.bindlessHandle;
+    return (texture.arrayIdx << 16) | texture.arrayLayer;
+}
+
+// Writes the material buffer again when materials or textures have been added
+void UpdateMaterialTextures(App* app)
+{
+    if (!UseMaterialTextures(app))
+        return;
+
+    bool texturesChanged = app->textures.size() != app->materialTexturesTextureCount;
+    if (!texturesChanged && app->materials.size() == app->materialsBufferCount)
+        return;
+
+    if (texturesChanged)
+    {
+        if (app->materialTexturesMode == MaterialTextures_Bindless)
+        {
+            for (u32 texIdx = app->materialTexturesTextureCount; texIdx < app->textures.size(); ++texIdx)
+            {
+                Texture& texture = app->textures[texIdx];
+                texture.bindlessHandle = glGetTextureHandleARB(texture.handle);
+                glMakeTextureHandleResidentARB(texture.bindlessHandle);
+            }
+        }
+        else
+        {
+            BuildTextureArrays(app);
+        }
+        app->materialTexturesTextureCount = app->textures.size();
+    }
+
+    std::vector<MaterialTexturesData> materials(glm::max((u32)app->materials.size(), 1u));
+    for (u32 i = 0; i < app->materials.size(); ++i)
+    {
+        materials[i].albedo = GetMaterialTextureRef(app, app->materials[i].albedoTextureIdx);
+        materials[i].normal = GetMaterialTextureRef(app, app->materials[i].normalTextureIdx);
+        materials[i].bump = GetMaterialTextureRef(app, app->materials[i].bumpTextureIdx);
+    }
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, app->materialsBufferHandle);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, materials.size() * sizeof(MaterialTexturesData), materials.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    app->materialsBufferCount = app->materials.size();
+    app->frameUploadBytes += materials.size() * sizeof(MaterialTexturesData);
+}
+
+// Point lights of every cluster of the view frustum for the clustered forward mode. The lights
+// are moved to view space, so the cluster bounds only change with the projection
+void UpdateLightClusters(App* app)
+{
+    TRACE_FUNCTION();
+
+    LightClusters& clusters = app->lightClusters;
+    if (clusters.boundsMin.empty() || clusters.projection != app->projectionMatrix)
+        BuildLightClusters(clusters, app->projectionMatrix, app->camera.NearPlane, app->camera.FarPlane);
+
+    ClusterLights& lights = app->clusterLights;
+    lights.centerX.resize(app->pointLightCount);
+    lights.centerY.resize(app->pointLightCount);
+    lights.centerZ.resize(app->pointLightCount);
+    lights.radius.resize(app->pointLightCount);
+    for (const Light& light : app->lights)
+    {
+        if (light.type != LightType_Point)
+            continue;
+
+        //Same index as in the point light list
+        vec3 center = vec3(app->viewMatrix * vec4(light.position, 1.0f));
+        lights.centerX[light.listIdx] = center.x;
+        lights.centerY[light.listIdx] = center.y;
+        lights.centerZ[light.listIdx] = center.z;
+        lights.radius[light.listIdx] = CalcPointLightRadius(light);
+    }
+
+    AssignLightsToClusters(clusters, lights, true);
+
+    // Header, ranges and indices, at least one index so the bound range is never empty
+    const u32 rangesSize = CLUSTER_COUNT * sizeof(glm::uvec2);
+    const u32 indicesSize = glm::max((u32)clusters.lightIndices.size(), 1u) * sizeof(u32);
+    const u32 storageSize = sizeof(LightClustersHeader) + rangesSize + indicesSize;
+
+    // Grow with some slack so it is not recreated every time a light is added
+    if (storageSize > app->lightClustersStorage.regionSize)
+    {
+        if (app->lightClustersStorage.handle)
+            DestroyBuffer(app->lightClustersStorage);
+        app->lightClustersStorage = CreatePersistentStorageBuffer(storageSize + storageSize / 2, app->storageBufferAlignment);
+    }
+
+    LightClustersHeader header = {};
+    header.tileSize = vec2(app->displaySize) / vec2(CLUSTER_GRID_X, CLUSTER_GRID_Y);
+    header.depthScale = CLUSTER_GRID_Z / logf(clusters.farPlane / clusters.nearPlane);
+    header.depthBias = -logf(clusters.nearPlane) * header.depthScale;
+    header.nearPlane = clusters.nearPlane;
+    header.farPlane = clusters.farPlane;
+
+    MapBuffer(app->lightClustersStorage, GL_WRITE_ONLY);
+    app->lightClustersOffset = app->lightClustersStorage.head;
+    app->lightClustersSize = storageSize;
+    PushData(app->lightClustersStorage, &header, sizeof(header));
+    PushData(app->lightClustersStorage, clusters.ranges.data(), rangesSize);
+    if (!clusters.lightIndices.empty())
+        PushData(app->lightClustersStorage, clusters.lightIndices.data(), clusters.lightIndices.size() * sizeof(u32));
+    app->lightClustersStorage.head = app->lightClustersOffset + storageSize;
+    UnmapBuffer(app->lightClustersStorage);
+
+    app->frameUploadBytes += storageSize;
+}
+
+// Instances of the instanced light volume draw, only the point lights that touch an entity.
+// Every frame, as the entities move without changing the lights
+void UpdatePointLightInstances(App* app)
+{
+    const u32 storageSize = glm::max(app->pointLightCount, 1u) * sizeof(u32);
+
+    // Grow with some slack so it is not recreated every time a light is added
+    if (storageSize > app->pointLightInstances.regionSize)
+    {
+        if (app->pointLightInstances.handle)
+            DestroyBuffer(app->pointLightInstances);
+        app->pointLightInstances = CreatePersistentStorageBuffer(storageSize + storageSize / 2, app->storageBufferAlignment);
+    }
+
+    MapBuffer(app->pointLightInstances, GL_WRITE_ONLY);
+    app->pointLightInstancesOffset = app->pointLightInstances.head;
+    app->pointLightInstancesSize = storageSize;
+
+    u32 instanceCount = 0;
+    for (const Light& light : app->lights)
+    {
+        if (light.type == LightType_Point && PointLightTouchesEntities(app, light))
+        {
+            u32 lightIdx = light.listIdx;
+            PushData(app->pointLightInstances, &lightIdx, sizeof(lightIdx));
+            ++instanceCount;
+        }
+    }
+    app->pointLightInstances.head = app->pointLightInstancesOffset + storageSize;
+    UnmapBuffer(app->pointLightInstances);
+
+    app->pointLightInstanceCount = instanceCount;
+    app->frameUploadBytes += instanceCount * sizeof(u32);
+}
+
+void UpdateGlobalParams(App* app, const glm::mat4& viewProjection)
+{
+    if (!app->globalParams.handle)
+        app->globalParams = CreatePersistentConstantBuffer(sizeof(glm::mat4) + sizeof(vec4) + sizeof(vec4), app->uniformBufferAlignment);
+
+    //Next region, the previous one may still be in use by the frames in flight
+    MapBuffer(app->globalParams, GL_WRITE_ONLY);
+    app->globalParamsOffset = app->globalParams.head;
+
+    PushMat4(app->globalParams, viewProjection);
+    PushVec3(app->globalParams, app->camera.Position);
+    PushUInt(app->globalParams, app->directionalLightCount);
+    PushUInt(app->globalParams, app->pointLightCount);
+
+    app->globalParamsSize = app->globalParams.head - app->globalParamsOffset;
+    UnmapBuffer(app->globalParams);
+
+    app->globalParamsViewProjection = viewProjection;
+    app->globalParamsInverseViewProjection = glm::inverse(viewProjection);
+    app->globalParamsCameraPosition = app->camera.Position;
+    app->frameUploadBytes += app->globalParamsSize;
+}
+
+void Update(App* app)
+{
+    TRACE_FUNCTION();
+
+    glm::mat4 projection, view;
+    // You can handle app->input keyboard/mouse here
+
+    //////////////////////////////////////////KEYBOARD///////////////////////////////////////////
+    if (app->input.keys[K_W] == ButtonState::BUTTON_PRESSED) {
+        app->camera.ProcessKeyboard(Camera_Movement::FORWARD, app->deltaTime);
+    }
+    if (app->input.keys[K_S] == ButtonState::BUTTON_PRESSED) {
+        app->camera.ProcessKeyboard(Camera_Movement::BACKWARD, app->deltaTime);
+    }
+    if (app->input.keys[K_A] == ButtonState::BUTTON_PRESSED) {
+        app->camera.ProcessKeyboard(Camera_Movement::LEFT, app->deltaTime);
+    }
+    if (app->input.keys[K_D] == ButtonState::BUTTON_PRESSED) {
+        app->camera.ProcessKeyboard(Camera_Movement::RIGHT, app->deltaTime);
+    }
+    if (app->input.keys[K_SPACE] == ButtonState::BUTTON_PRESSED) {
+        app->camera.ProcessKeyboard(Camera_Movement::UP, app->deltaTime);
+    }
+    if (app->input.keys[K_SHIFT] == ButtonState::BUTTON_PRESS) {
+        app->camera.ProcessSpeed(true);
+    }
+    if (app->input.keys[K_SHIFT] == ButtonState::BUTTON_RELEASE) {
+        app->camera.ProcessSpeed(false);
+    }
+
+    if (app->input.keys[K_I] == ButtonState::BUTTON_PRESSED) {
+        app->lights[0].position += vec3(0.0, 0.1, 0.0);
+        app->lights[0].dirty = true;
+    }
+    if (app->input.keys[K_K] == ButtonState::BUTTON_PRESSED) {
+        app->lights[0].position -= vec3(0.0, 0.1, 0.0);
+        app->lights[0].dirty = true;
+    }
+    if (app->input.keys[K_J] == ButtonState::BUTTON_PRESSED) {
+        app->lights[0].position += vec3(0.1, 0.0, 0.0);
+        app->lights[0].dirty = true;
+    }
+    if (app->input.keys[K_L] == ButtonState::BUTTON_PRESSED) {
+        app->lights[0].position -= vec3(0.1, 0.0, 0.0);
+        app->lights[0].dirty = true;
+    }
+
+    ////////////////////////////////////////////MOUSE/////////////////////////////////////////////
+    if (app->input.mouseButtons[1] == ButtonState::BUTTON_PRESSED) {
+        app->camera.ProcessMouseMovement(app->input.mouseDelta.x, -app->input.mouseDelta.y);
+        app->camera.Orbit = false;
+    }
+
+    if (app->input.mouseButtons[0] == ButtonState::BUTTON_PRESSED && app->input.keys[K_SHIFT] == ButtonState::BUTTON_PRESSED) {
+        app->camera.ProcessArcBallMovement(-app->input.mouseDelta.x, -app->input.mouseDelta.y, app->displaySize.x, app->displaySize.y);
+        app->camera.Orbit = true;
+    }
+
+    if (app->input.mouseButtons[0] == ButtonState::BUTTON_RELEASE || app->input.keys[K_SHIFT] == ButtonState::BUTTON_RELEASE) {
+        app->camera.Orbit = false;
+    }
+
+    //GLOBAL AND LOCAL CBUFFER
+    float aspectRatio = (float)app->displaySize.x / (float)app->displaySize.y;
+    vec3 upVector = { 0, 1, 0 };
+    projection = app->camera.GetProjectionMatrix(aspectRatio);
+
+    view = app->camera.GetViewMatrix();
+
+    app->viewMatrix = view;
+    app->projectionMatrix = projection;
+
+    // Applied in the shaders, the entity and light volume blocks only hold world matrices
+    glm::mat4 viewProjection = MultiplyMat4(projection, view);
+
+    //The full upload counts what the dirty tracking skipped, the real uploads are added at the end
+    app->frameUploadBytes = 0;
+    app->frameFullUploadBytes = 0;
+
+    // The dirty slots of the light volumes and entities are staged here until the end of the update
+    MapUniformArena(app->slotStaging);
+
+    // -- Light volumes, only the lights that changed
+    bool lightsChanged = UpdateLightParams(app);
+
+    // -- Light lists
+    if (lightsChanged || !app->lightsStorage.handle)
+        UpdateLightLists(app);
+    else
+        app->frameFullUploadBytes += app->directionalLightsSize + app->pointLightsSize;
+
+    // -- Global params, rewritten only when the camera or the light counts changed
+    if (lightsChanged || !app->globalParams.handle ||
+        viewProjection != app->globalParamsViewProjection || app->camera.Position != app->globalParamsCameraPosition)
+    {
+        UpdateGlobalParams(app, viewProjection);
+    }
+    else
+    {
+        app->frameFullUploadBytes += app->globalParamsSize;
+    }
+
+    // -- Light clusters, every frame as they are in view space
+    if (app->mode == Mode_ForwardClustered)
+        UpdateLightClusters(app);
+
+    // -- Frustum culling, only the visible entities get to the render queues
+    UpdateEntityBounds(app);
+    UpdateEntityBvh(app);
+    CullEntities(app, viewProjection);
+
+    // -- Instanced light volumes, after the bvh as they skip the lights that touch no entity
+    if (app->mode == Mode_Deferred && app->instancedLightVolumes && app->instancedLightVolumesSupported)
+        UpdatePointLightInstances(app);
+
+    // -- Picking, the entity under the mouse when clicking
+    if (app->input.mouseButtons[0] == ButtonState::BUTTON_PRESS && app->input.keys[K_SHIFT] != ButtonState::BUTTON_PRESSED)
+        PickEntity(app, viewProjection);
+
+    // -- Local params, only the entities that moved
+    UpdateEntityParams(app);
+    UnmapUniformArena(app->slotStaging);
+    UpdateMaterialTextures(app);
+
+    app->frameFullUploadBytes += app->frameUploadBytes;
+}
+
+
+void Render(App* app)
+{
+    TRACE_FUNCTION();
+
+    //The GL state changed outside the wrappers since the last frame (ImGui)
+    BeginGLStateFrame();
+
+    //OpenGL Settings
+    glDepthMask(GL_TRUE);
+    GLStateDisable(GL_BLEND);
+    GLStateEnable(GL_CULL_FACE);
+    GLStateEnable(GL_DEPTH_TEST);
+
+    //Global params (camera and light counts) and the light lists are shared by every pass
+    glBindBufferRange(GL_UNIFORM_BUFFER, BINDING(0), app->globalParams.handle, app->globalParamsOffset, app->globalParamsSize);
+    glBindBufferRange(GL_SHADER_STORAGE_BUFFER, BINDING(3), app->lightsStorage.handle, app->directionalLightsOffset, app->directionalLightsSize);
+    glBindBufferRange(GL_SHADER_STORAGE_BUFFER, BINDING(4), app->lightsStorage.handle, app->pointLightsOffset, app->pointLightsSize);
+
+    //Select mode of rendering (Forward or Deferred)
+    switch (app->mode)
+    {
+        case Mode_Deferred: DeferredRender(app); break;
+        case Mode_DeferredTiled: DeferredRender(app); break;
+        case Mode_Forward: ForwardRender(app); break;
+        case Mode_ForwardClustered: ForwardRender(app); break;
+    }  
+    ReadOpaqueTimers(app);
+    ReadLightPassTimer(app);
+
+    //Fence the current regions so they are not rewritten while the GPU reads them
+    FenceBuffer(app->globalParams);
+    FenceBuffer(app->lightsStorage);
+    FenceBuffer(app->lightClustersStorage);
+    FenceBuffer(app->pointLightInstances);
+    FenceBuffer(app->indirectCommands);
+    FenceUniformArena(app->slotStaging);
+}
+
+bool InitOffscreenBackbuffer(App* app)
+{
+    glGenTextures(1, &app->backbufferTextureHandle);
+    GLStateBindTexture(GL_TEXTURE_2D, app->backbufferTextureHandle);
+    glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA8, app->displaySize.x, app->displaySize.y);
+    GLStateBindTexture(GL_TEXTURE_2D, 0);
+
+    glGenRenderbuffers(1, &app->backbufferDepthStencilHandle);
+    glBindRenderbuffer(GL_RENDERBUFFER, app->backbufferDepthStencilHandle);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, app->displaySize.x, app->displaySize.y);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+    glGenFramebuffers(1, &app->backbufferFramebufferHandle);
+    GLStateBindFramebuffer(GL_FRAMEBUFFER, app->backbufferFramebufferHandle);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, app->backbufferTextureHandle, 0);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, app->backbufferDepthStencilHandle);
+    GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    GLStateBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    if (status != GL_FRAMEBUFFER_COMPLETE)
+    {
+        ELOG("Offscreen backbuffer incomplete (0x%x)", status);
+        return false;
+    }
+    return true;
+}
+
+void DestroyOffscreenBackbuffer(App* app)
+{
+    glDeleteFramebuffers(1, &app->backbufferFramebufferHandle);
+    glDeleteRenderbuffers(1, &app->backbufferDepthStencilHandle);
+    GLStateDeleteTextures(1, &app->backbufferTextureHandle);
+    app->backbufferFramebufferHandle = 0;
+    app->backbufferDepthStencilHandle = 0;
+    app->backbufferTextureHandle = 0;
+}
+
+void ForwardRender(App* app)
+{
+    RenderGraph& graph = app->renderGraph;
+    BeginRenderGraph(graph);
+
+    //Straight to the backbuffer. Running it through the graph still releases the deferred targets
+    u32 backbuffer = ImportRenderGraphTexture(graph, "Backbuffer", app->backbufferTextureHandle);
+    u32 forwardPass = AddRenderGraphPass(graph, "Forward", [app]() { ForwardPass(app); });
+    RenderGraphWrite(graph, forwardPass, backbuffer);
+
+    ExecuteRenderGraph(graph);
+}
+
+void ForwardPass(App* app)
+{
+    PushGpuZone(app->gpuProfiler, "Forward");
+
+    GLStateBindFramebuffer(GL_FRAMEBUFFER, app->backbufferFramebufferHandle);
 
     glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-    glViewport(0, 0, app->displaySize.x, app->displaySize.y);
+    glViewport(0, 0, app->displaySize.x, app->displaySize.y);
+
+    //Pass the matrices of all the entities at once
+    if (app->useTransformTable)
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, BINDING(2), app->transformTable.buffer.handle);
+
+    //The lights of each cluster, for the clustered variant of the program
+    if (app->mode == Mode_ForwardClustered)
+        glBindBufferRange(GL_SHADER_STORAGE_BUFFER, BINDING(0), app->lightClustersStorage.handle, app->lightClustersOffset, app->lightClustersSize);
+
+    //Every entity with the basic textured geometry program
+    BuildRenderQueue(app, RenderPass_Forward);
+    SubmitOpaqueRenderQueue(app, false);
+
+    PopGpuZone(app->gpuProfiler);
+}
+
+void DeferredRender(App* app)
+{
+    //Minimized, there is no size to create the targets with
+    const ivec2 size = app->displaySize;
+    if (size.x == 0 || size.y == 0)
+        return;
+
+    RenderGraph& graph = app->renderGraph;
+    BeginRenderGraph(graph);
+
+    //G-buffer, the compact layout has no position target
+    u32 position = app->useCompactGBuffer ? UINT32_MAX : AddRenderGraphTexture(graph, "Position", GL_RGBA16F, size, &app->positionAttachmentHandle);
+    u32 diffuse = AddRenderGraphTexture(graph, "Diffuse", GL_RGBA8, size, &app->diffuseAttachmentHandle);
+    u32 normals = AddRenderGraphTexture(graph, "Normals", app->useCompactGBuffer ? GL_RG16 : GL_RGBA16F, size, &app->normalsAttachmentHandle);
+    u32 depth = AddRenderGraphTexture(graph, "Depth", GL_DEPTH32F_STENCIL8, size, &app->depthAttachmentHandle);
+    u32 final = AddRenderGraphTexture(graph, "Final", GetFinalTargetFormat(app), size, &app->finalAttachmentHandle);
+    u32 backbuffer = ImportRenderGraphTexture(graph, "Backbuffer", app->backbufferTextureHandle);
+
+    //Max depth pyramid of the previous frame, kept between frames
+    u32 hiZ = UINT32_MAX;
+    if (UseOcclusionCulling(app))
+    {
+        app->hiZLevelCount = 1 + (u32)log2f((f32)glm::max(size.x, size.y));
+        hiZ = AddRenderGraphTexture(graph, "Hi-Z", GL_R32F, size, &app->hiZTextureHandle, app->hiZLevelCount, true);
+    }
+
+    //Geomtry Pass
+    u32 geometryPass = AddRenderGraphPass(graph, "Geometry", [app, hiZ]()
+    {
+        if (hiZ != UINT32_MAX && IsRenderGraphTextureNew(app->renderGraph, hiZ))
+            app->hiZValid = false;
+        GeometryPass(app);
+    });
+    if (position != UINT32_MAX)
+        RenderGraphWrite(graph, geometryPass, position, GL_COLOR_ATTACHMENT0);
+    RenderGraphWrite(graph, geometryPass, diffuse, GL_COLOR_ATTACHMENT1);
+    RenderGraphWrite(graph, geometryPass, normals, GL_COLOR_ATTACHMENT2);
+    RenderGraphWrite(graph, geometryPass, depth, GL_DEPTH_STENCIL_ATTACHMENT);
+    if (hiZ != UINT32_MAX)
+    {
+        RenderGraphRead(graph, geometryPass, hiZ);
+        RenderGraphWrite(graph, geometryPass, hiZ);
+    }
+
+    //The light volumes are tested against the depth stencil and write its stencil, sampling it at the same
+    //time is a feedback loop. The compact layout rebuilds the positions from the depth, so it samples a copy
+    u32 depthCopy = UINT32_MAX;
+    if (app->useCompactGBuffer && app->mode != Mode_DeferredTiled)
+    {
+        depthCopy = AddRenderGraphTexture(graph, "Depth Copy", GL_DEPTH32F_STENCIL8, size, &app->depthCopyHandle);
+        u32 depthCopyPass = AddRenderGraphPass(graph, "Depth Copy", [app, size]()
+        {
+            glCopyImageSubData(app->depthAttachmentHandle, GL_TEXTURE_2D, 0, 0, 0, 0, app->depthCopyHandle, GL_TEXTURE_2D, 0, 0, 0, 0, size.x, size.y, 1);
+        });
+        RenderGraphRead(graph, depthCopyPass, depth);
+        RenderGraphWrite(graph, depthCopyPass, depthCopy);
+    }
+
+    //Light Pass, culled when the final target is not shown
+    u32 lightPass = AddRenderGraphPass(graph, "Light", [app]()
+    {
+        glBeginQuery(GL_TIME_ELAPSED, app->lightPassTimerQueries[app->opaqueTimersFrame]);
+        if (app->mode == Mode_DeferredTiled)
+            TiledLightPass(app);
+        else
+            LightPass(app);
+        glEndQuery(GL_TIME_ELAPSED);
+        app->lightPassTimersPending[app->opaqueTimersFrame] = true;
+        app->lightPassTimersCompact[app->opaqueTimersFrame] = app->useCompactGBuffer;
+    });
+    if (position != UINT32_MAX)
+        RenderGraphRead(graph, lightPass, position);
+    RenderGraphRead(graph, lightPass, normals);
+    RenderGraphRead(graph, lightPass, diffuse);
+    //The light volumes are tested against the depth and stencil, the tiled pass only samples it
+    RenderGraphRead(graph, lightPass, depth, app->mode == Mode_DeferredTiled ? GL_NONE : GL_DEPTH_STENCIL_ATTACHMENT);
+    if (depthCopy != UINT32_MAX)
+        RenderGraphRead(graph, lightPass, depthCopy);
+    RenderGraphWrite(graph, lightPass, final, app->mode == Mode_DeferredTiled ? GL_NONE : GL_COLOR_ATTACHMENT3);
+
+    //Quad Render for Selected Texture
+    u32 outputPass = AddRenderGraphPass(graph, "Output", [app]() { OutputPass(app); });
+    switch (app->renderTarget)
+    {
+    case RenderTarget::RT_Position:
+    {
+        //Rebuilt from the depth in the compact layout, which also tells the background apart
+        if (position != UINT32_MAX)
+            RenderGraphRead(graph, outputPass, position);
+        RenderGraphRead(graph, outputPass, depth);
+    }break;
+    case RenderTarget::RT_Diffuse:
+    {
+        RenderGraphRead(graph, outputPass, diffuse);
+    }break;
+    case RenderTarget::RT_Depth:
+    {
+        RenderGraphRead(graph, outputPass, depth);
+    }break;
+    case RenderTarget::RT_Normals:
+    {
+        RenderGraphRead(graph, outputPass, normals);
+        RenderGraphRead(graph, outputPass, depth);
+    }break;
+    case RenderTarget::RT_Final:
+    {
+        RenderGraphRead(graph, outputPass, final);
+    }break;
+    }
+    RenderGraphWrite(graph, outputPass, backbuffer);
+
+    ExecuteRenderGraph(graph);
+}
+
+void OutputPass(App* app)
+{
+    PushGpuZone(app->gpuProfiler, "Output");
+
+    //Settings for Quad Rendering of Texture, Swapping to the backbuffer
+    GLStateBindFramebuffer(GL_FRAMEBUFFER, app->backbufferFramebufferHandle);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    glViewport(0, 0, app->displaySize.x, app->displaySize.y);
+
+    //Quad Render for Selected Texture
+    switch (app->renderTarget)
+    {
+    case RenderTarget::RT_Position:
+    {
+        PositionRender(app);
+    }break;
+    case RenderTarget::RT_Diffuse:
+    {
+        DiffuseRender(app);
+    }break;
+    case RenderTarget::RT_Depth:
+    {
+        DepthRender(app);
+    }break;
+    case RenderTarget::RT_Normals:
+    {
+        NormalRender(app);
+    }break;
+    case RenderTarget::RT_Final:
+    {
+        FinalRender(app);
+    }break;
+    }
+
+    PopGpuZone(app->gpuProfiler);
+}
+
+void OnGlError(GLenum source, GLenum type, GLuint id, GLenum severity, GLsizei length, const GLchar* message, const void* userParan) {
+
+
+    if (severity == GL_DEBUG_SEVERITY_NOTIFICATION)
+        return;
+
+    ELOG("OpenGL debug message : % s", message);
+
+    switch (source)
+    {
+        case GL_DEBUG_SOURCE_API: ELOG(" - source: GL_DEBUG_SOURCE_API"); break; // Calls to the OpenGL API
+        case GL_DEBUG_SOURCE_WINDOW_SYSTEM: ELOG(" - source: GL_DEBUG_SOURCE_WINDOW_SYSTEM"); break; // Calls to a window-system API
+        case GL_DEBUG_SOURCE_SHADER_COMPILER: ELOG(" - source: GL_DEBUG_SOURCE_SHADER_COMPILER"); break; // A compiler for a shading language
+        case GL_DEBUG_SOURCE_THIRD_PARTY: ELOG(" - source: GL_DEBUG_SOURCE_THIRD_PARTY"); break; // An application associated with OpenGL
+        case GL_DEBUG_SOURCE_APPLICATION: ELOG(" - source: GL_DEBUG_SOURCE_APPLICATION"); break; // Generated by the user of this applicat
+        case GL_DEBUG_SOURCE_OTHER: ELOG(" - source: GL_DEBUG_SOURCE_OTHER"); break; // Some source that isn't one of these
+
+    }
+    switch (type)
+    {
+        case GL_DEBUG_TYPE_ERROR: ELOG(" - type: GL_DEBUG_TYPE_ERROR"); break; // An error, typically from the API
+        case GL_DEBUG_TYPE_DEPRECATED_BEHAVIOR : ELOG(" - type: GL_DEBUG_TYPE_DEPRECATED BEHAVIOR"); break; // Some behavior marked deprecated |
+        case GL_DEBUG_TYPE_UNDEFINED_BEHAVIOR : ELOG(" - type: GL_DEBUG_TYPE_UNDEFINED_BEHAVIOR"); break; // Something has invoked undefined bi
+        case GL_DEBUG_TYPE_PORTABILITY: ELOG(" - type: GL_DEBUG_TYPE_PORTABILITY"); break; // Some functionality the user relies upon
+        case GL_DEBUG_TYPE_PERFORMANCE: ELOG(" - type: GL_DEBUG_TYPE_PERFORMANCE"); break; // Code has triggered possible performance
+        case GL_DEBUG_TYPE_MARKER: ELOG(" - type: GL_DEBUG_TYPE_MARKER"); break; // Command stream annotation
+        case GL_DEBUG_TYPE_PUSH_GROUP: ELOG(" - type: GL_DEBUG_TYPE_PUSH_GROUP"); break; // Group pushing
+        case GL_DEBUG_TYPE_POP_GROUP: ELOG(" - type: GL_DEBUG_TYPE_POP_GROUP"); break; // foo
+        case GL_DEBUG_TYPE_OTHER: ELOG(" - type: GL_DEBUG_TYPE_OTHER"); break; // Some type that isnt one of these
+    }
+
+    switch (severity) 
+    {
+        case GL_DEBUG_SEVERITY_HIGH: ELOG(" - severity: GL_DEBUG_SEVERITY_HIGH"); break; // All OpenGL Errors, shader compilation/link
+        case GL_DEBUG_SEVERITY_MEDIUM: ELOG(" - severity: GL_DEBUG_SEVERITY_MEDIUM"); break; // Major performance warnings, shader compi
+        case GL_DEBUG_SEVERITY_LOW: ELOG(" - severity: GL_DEBUG_SEVERITY_LOW"); break; // Redundant state change performance warning,
+        case GL_DEBUG_SEVERITY_NOTIFICATION: ELOG(" - severity: GL_DEBUG_SEVERITY_NOTIFICATION"); break; // Anything that isnt an error or pei
+    }
+}
+
+GLenum GetFinalTargetFormat(App* app)
+{
+    return app->useCompactGBuffer ? GL_R11F_G11F_B10F : GL_RGBA8;
+}
+
+// Bytes per pixel of the deferred render targets (the depth one taken as 8, its usual size in memory)
+u32 GetGBufferPixelSize(bool compact)
+{
+    //Position RGBA16F, diffuse RGBA8, normals RGBA16F, final RGBA8, D32F_S8
+    if (!compact)
+        return 8 + 4 + 8 + 4 + 8;
+    //Diffuse RGBA8, normals RG16, final R11G11B10F, D32F_S8
+    return 4 + 4 + 4 + 8;
+}
+
+void BuildRenderQueue(App* app, RenderPass pass)
+{
+    TRACE_FUNCTION();
+
+    RenderQueue& queue = app->renderQueue;
+    ClearRenderQueue(queue);
+
+    for (u32 entityIdx : app->visibleEntities)
+    {
+        const Entity& entity = app->entities[entityIdx];
+        const Model& model = app->models[entity.modelIndex];
+        const Mesh& mesh = app->meshes[model.meshIdx];
+
+        u32 programIdx = entity.programIdx;
+        if (pass == RenderPass_Forward)
+            programIdx = app->mode == Mode_ForwardClustered ? app->texturedGeometryClusteredProgramIdx : app->texturedGeometryProgramIdx;
+
+        //Behind the pre-pass depth the ray march can be skipped, as long as no fragment is discarded
+        if (app->useDepthPrePass && programIdx == app->reliefMappingIdx && !app->discardEdges)
+            programIdx = app->reliefMappingEarlyDepthIdx;
+        programIdx = GetProgramVariant(app, programIdx);
+
+        for (u32 i = 0; i < mesh.submeshes.size(); ++i)
+            PushDrawCommand(queue, MakeSortKey(pass, programIdx, model.materialIdx[i], model.meshIdx, i), entityIdx, i);
+    }
+
+    SortRenderQueue(queue);
+}
+
+//Last state bound while submitting the render queue, it is only bound again when it changes
+struct QueueBindState
+{
+    u32    programIdx = UINT32_MAX;
+    u32    entityIdx = UINT32_MAX;
+    u32    materialIdx = UINT32_MAX;
+    GLuint vao = 0;
+    GLuint textures[3] = {};
+    bool   reliefUniformsSet = false;
+};
+
+void BindQueueProgram(App* app, QueueBindState& state, u32 programIdx)
+{
+    RenderQueue& queue = app->renderQueue;
+    if (programIdx == state.programIdx) {
+        queue.stateChangesSkipped++;
+        return;
+    }
+    GLStateUseProgram(app->programs[programIdx].handle);
+    state.programIdx = programIdx;
+    state.materialIdx = UINT32_MAX;
+    state.reliefUniformsSet = false;
+    queue.stateChanges++;
+}
+
+void BindQueueVAO(App* app, QueueBindState& state, GLuint vao)
+{
+    RenderQueue& queue = app->renderQueue;
+    if (vao == state.vao) {
+        queue.stateChangesSkipped++;
+        return;
+    }
+    GLStateBindVertexArray(vao);
+    state.vao = vao;
+    queue.stateChanges++;
+}
+
+void BindQueueTexture(App* app, QueueBindState& state, u32 unit, u32 textureIdx)
+{
+    RenderQueue& queue = app->renderQueue;
+    GLuint handle = app->textures[textureIdx].handle;
+    if (handle == state.textures[unit]) {
+        queue.stateChangesSkipped++;
+        return;
+    }
+    GLStateActiveTexture(GL_TEXTURE0 + unit);
+    GLStateBindTexture(GL_TEXTURE_2D, handle);
+    state.textures[unit] = handle;
+    queue.stateChanges++;
+}
+
+void BindQueueMaterial(App* app, QueueBindState& state, RenderPass pass, u32 materialIdx)
+{
+    RenderQueue& queue = app->renderQueue;
+    const Material& material = app->materials[materialIdx];
+
+    if (UseMaterialTextures(app))
+    {
+        //The shader takes the textures of the material from the material buffer
+        if (materialIdx != state.materialIdx) {
+            glUniform1ui(app->programs[state.programIdx].materialIndexLocation, materialIdx);
+            state.materialIdx = materialIdx;
+            queue.stateChanges++;
+        }
+        else queue.stateChangesSkipped++;
+    }
+    else
+    {
+        BindQueueTexture(app, state, 0, material.albedoTextureIdx);
+
+        //Check if uses normal mapping
+        if (pass == RenderPass_Geometry && material.normalTextureIdx != NO_TEXTURE_ATTACHED)
+            BindQueueTexture(app, state, 1, material.normalTextureIdx);
+
+        //Check if uses parallax occlusion mapping
+        if (pass == RenderPass_Geometry && material.bumpTextureIdx != NO_TEXTURE_ATTACHED)
+            BindQueueTexture(app, state, 2, material.bumpTextureIdx);
+    }
+
+    //Pass uniforms for parallax occlusion mapping calculations and settings, they don't change during the frame
+    if (pass == RenderPass_Geometry && material.bumpTextureIdx != NO_TEXTURE_ATTACHED && !state.reliefUniformsSet) {
+        GLuint programHandle = app->programs[state.programIdx].handle;
+        glUniform3f(glGetUniformLocation(programHandle, "uCameraPos"),
+            app->camera.Position.x, app->camera.Position.y, app->camera.Position.z);
+        glUniform1f(glGetUniformLocation(programHandle, "uHeightScale"), app->heightScale);
+        glUniform1f(glGetUniformLocation(programHandle, "zNear"), app->camera.NearPlane);
+        glUniform1f(glGetUniformLocation(programHandle, "zFar"), app->camera.FarPlane);
+        glUniform1i(glGetUniformLocation(programHandle, "discardEdges"), app->discardEdges);
+        glUniform1i(glGetUniformLocation(programHandle, "minLayers"), app->minLayers);
+        glUniform1i(glGetUniformLocation(programHandle, "maxLayers"), app->maxLayers);
+        state.reliefUniformsSet = true;
+    }
+}
 
-    //Select basic textured geometry program
-    Program& texturedMeshProgram = app->programs[app->texturedGeometryProgramIdx];
-    glUseProgram(texturedMeshProgram.handle);
+// Material buffer and texture arrays, bound once for all the draws of the queue
+void BindMaterialTextures(App* app)
+{
+    if (!UseMaterialTextures(app))
+        return;
 
-    //Pass light buffer
-    glBindBufferRange(GL_UNIFORM_BUFFER, BINDING(0), app->cbuffer.handle, app->globalParamsOffset, app->globalParamsSize);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, BINDING(5), app->materialsBufferHandle);
 
-    //Iterate entities to render each one
-    for (const Entity& entity : app->entities)
+    for (u32 i = 0; i < app->textureArrays.size(); ++i)
     {
-        Model& model = app->models[entity.modelIndex];
-        Mesh& mesh = app->meshes[model.meshIdx];
+        GLStateActiveTexture(GL_TEXTURE0 + MATERIAL_TEXTURE_ARRAY_UNIT + i);
+        GLStateBindTexture(GL_TEXTURE_2D_ARRAY, app->textureArrays[i]);
+    }
+    GLStateActiveTexture(GL_TEXTURE0);
+}
 
-        //Pass local buffer with matrices
-        glBindBufferRange(GL_UNIFORM_BUFFER, BINDING(1), app->cbuffer.handle, entity.localParamsOffset, entity.localParamsSize);
+// Program of the depth pre-pass for the draws of a queue program, or UINT32_MAX if they are left out
+u32 GetDepthPrePassProgram(App* app, u32 programIdx)
+{
+    if (app->programs[programIdx].discardsFragments)
+        return UINT32_MAX;
 
-        for (u32 i = 0; i < mesh.submeshes.size(); ++i)
-        {
-            //Find or generate vao for used program and mesh
-            GLuint vao = FindVAO(mesh, i, texturedMeshProgram);
-            glBindVertexArray(vao);
+    u32 depthProgramIdx = app->depthPrePassProgramIdx;
+    if (app->useTransformTable)
+        depthProgramIdx = app->programs[depthProgramIdx].transformTableProgramIdx;
+    return depthProgramIdx;
+}
 
-            u32 submeshMaterialIdx = model.materialIdx[i];
-            Material& submeshMaterial = app->materials[submeshMaterialIdx];
+// With depthOnly the draws go through the depth pre-pass program, without materials
+void SubmitRenderQueue(App* app, bool depthOnly)
+{
+    RenderQueue& queue = app->renderQueue;
+    QueueBindState state;
+    if (!depthOnly)
+        BindMaterialTextures(app);
+
+    for (const DrawCommand& command : queue.commands)
+    {
+        const Entity& entity = app->entities[command.entityIdx];
+        Model& model = app->models[entity.modelIndex];
+        Mesh& mesh = app->meshes[model.meshIdx];
 
-            glActiveTexture(GL_TEXTURE0);
-            glBindTexture(GL_TEXTURE_2D, app->textures[submeshMaterial.albedoTextureIdx].handle);
+        u32 programIdx = GetSortKeyProgram(command.key);
+        if (depthOnly && (programIdx = GetDepthPrePassProgram(app, programIdx)) == UINT32_MAX)
+            continue;
+        BindQueueProgram(app, state, programIdx);
 
-            Submesh& submesh = mesh.submeshes[i];
-            glDrawElements(GL_TRIANGLES, submesh.indices.size(), GL_UNSIGNED_INT, (void*)(u64)submesh.indexOffset);
+        //Pass local buffer with matrices
+        if (!app->useTransformTable) {
+            if (command.entityIdx != state.entityIdx) {
+                glBindBufferRange(GL_UNIFORM_BUFFER, BINDING(1), app->entityParams.buffer.handle, GetSlotOffset(app->entityParams, command.entityIdx), app->entityParams.slotSize);
+                state.entityIdx = command.entityIdx;
+                queue.stateChanges++;
+            }
+            else queue.stateChangesSkipped++;
         }
 
-        glBindVertexArray(0);
+        //Find or generate vao for used program and mesh
+        BindQueueVAO(app, state, FindVAO(mesh, command.submeshIdx, app->programs[programIdx], app->entityIndexBufferHandle));
+
+        if (!depthOnly)
+            BindQueueMaterial(app, state, GetSortKeyPass(command.key), model.materialIdx[command.submeshIdx]);
+
+        DrawEntitySubmesh(app, mesh.submeshes[command.submeshIdx], command.entityIdx);
+        queue.drawCalls++;
     }
 
-    glUseProgram(0);
+    GLStateBindVertexArray(0);
+    GLStateUseProgram(0);
 }
 
-void DeferredRender(App* app)
+// Writes one indirect command per draw of the queue and returns the offset of the first one. With
+// occlusion culling there is also room for the retest list and the bounding sphere of every draw
+u32 WriteIndirectCommands(App* app, bool occlusionCulling, u32* spheresOffset)
 {
-    //Geomtry Pass
-    GeometryPass(app);
-    //Light Pass
-    LightPass(app);
+    RenderQueue& queue = app->renderQueue;
 
+    const u32 commandCount = queue.commands.size();
+    const u32 commandsSize = glm::max(commandCount, 1u) * sizeof(DrawElementsIndirectCommand);
+    const u32 spheresSize = glm::max(commandCount, 1u) * sizeof(vec4);
+    const u32 regionSize = occlusionCulling ? Align(2 * commandsSize, app->storageBufferAlignment) + spheresSize : commandsSize;
 
-    //Settings for Quad Rendering of Texture, Swapping to default buffer
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    glViewport(0, 0, app->displaySize.x, app->displaySize.y);
-
-    //Quad Render for Selected Texture
-    switch (app->renderTarget)
-    {
-    case RenderTarget::RT_Position:
+    // Grow with some slack so it is not recreated every time an entity is added
+    if (regionSize > app->indirectCommands.regionSize)
     {
-        PositionRender(app);
-    }break;
-    case RenderTarget::RT_Diffuse:
+        if (app->indirectCommands.handle)
+            DestroyBuffer(app->indirectCommands);
+        app->indirectCommands = CreatePersistentBuffer(regionSize + regionSize / 2, GL_DRAW_INDIRECT_BUFFER, app->storageBufferAlignment);
+    }
+
+    //One command per draw in queue order, the base instance picks the entity index (and so its transform)
+    MapBuffer(app->indirectCommands, GL_WRITE_ONLY);
+    const u32 commandsOffset = app->indirectCommands.head;
+    ASSERT(commandsOffset + regionSize <= GetBufferRegionEnd(app->indirectCommands), "The indirect commands don't fit in the region");
+    DrawElementsIndirectCommand* commands = (DrawElementsIndirectCommand*)((u8*)app->indirectCommands.data + commandsOffset);
+    for (u32 i = 0; i < commandCount; ++i)
     {
-        DiffuseRender(app);
-    }break;
-    case RenderTarget::RT_Depth:
+        const DrawCommand& command = queue.commands[i];
+        const Submesh& submesh = app->meshes[app->models[app->entities[command.entityIdx].modelIndex].meshIdx].submeshes[command.submeshIdx];
+
+        commands[i].count = submesh.indices.size();
+        commands[i].instanceCount = 1;
+        commands[i].firstIndex = submesh.indexOffset / sizeof(u32);
+        commands[i].baseVertex = submesh.vertexOffset / submesh.vertexBufferLayout.stride;
+        commands[i].baseInstance = command.entityIdx;
+    }
+    app->indirectCommands.head += commandsSize;
+
+    if (occlusionCulling)
     {
-        DepthRender(app);
-    }break;
-    case RenderTarget::RT_Normals:
+        //The retest list is written by the first culling phase
+        app->indirectCommands.head += commandsSize;
+        AlignHead(app->indirectCommands, app->storageBufferAlignment);
+
+        *spheresOffset = app->indirectCommands.head;
+        vec4* spheres = (vec4*)((u8*)app->indirectCommands.data + *spheresOffset);
+        for (u32 i = 0; i < commandCount; ++i)
+        {
+            const DrawCommand& command = queue.commands[i];
+            const Submesh& submesh = app->meshes[app->models[app->entities[command.entityIdx].modelIndex].meshIdx].submeshes[command.submeshIdx];
+            spheres[i] = vec4(submesh.sphere.center, submesh.sphere.radius);
+        }
+        app->indirectCommands.head += spheresSize;
+    }
+
+    UnmapBuffer(app->indirectCommands);
+    return commandsOffset;
+}
+
+// One multi-draw per run of draws sharing program, material, geometry page and vertex format.
+// With depthOnly they go through the depth pre-pass program, without materials
+void DrawIndirectBuckets(App* app, u32 commandsOffset, bool depthOnly)
+{
+    RenderQueue& queue = app->renderQueue;
+    const u32 commandCount = queue.commands.size();
+
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, app->indirectCommands.handle);
+
+    QueueBindState state;
+    if (!depthOnly)
+        BindMaterialTextures(app);
+    u32 bucketStart = 0;
+    for (u32 i = 1; i <= commandCount; ++i)
     {
-        NormalRender(app);
-    }break;
-    case RenderTarget::RT_Final:
+        const DrawCommand& first = queue.commands[bucketStart];
+        const Submesh& firstSubmesh = app->meshes[app->models[app->entities[first.entityIdx].modelIndex].meshIdx].submeshes[first.submeshIdx];
+
+        if (i < commandCount)
+        {
+            const DrawCommand& command = queue.commands[i];
+            const Submesh& submesh = app->meshes[app->models[app->entities[command.entityIdx].modelIndex].meshIdx].submeshes[command.submeshIdx];
+            if (GetSortKeyBucket(command.key) == GetSortKeyBucket(first.key) &&
+                submesh.geometryPage == firstSubmesh.geometryPage && submesh.geometryLayoutIdx == firstSubmesh.geometryLayoutIdx)
+                continue;
+        }
+
+        u32 programIdx = GetSortKeyProgram(first.key);
+        if (depthOnly)
+            programIdx = GetDepthPrePassProgram(app, programIdx);
+
+        if (programIdx != UINT32_MAX)
+        {
+            BindQueueProgram(app, state, programIdx);
+            BindQueueVAO(app, state, FindPageVAO(app->geometryPool, firstSubmesh.geometryPage, firstSubmesh.geometryLayoutIdx, app->programs[programIdx], app->entityIndexBufferHandle));
+
+            const Model& model = app->models[app->entities[first.entityIdx].modelIndex];
+            if (!depthOnly)
+                BindQueueMaterial(app, state, GetSortKeyPass(first.key), model.materialIdx[first.submeshIdx]);
+
+            glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (void*)(u64)(commandsOffset + bucketStart * sizeof(DrawElementsIndirectCommand)), i - bucketStart, 0);
+            queue.drawCalls++;
+        }
+
+        bucketStart = i;
+    }
+
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+    GLStateBindVertexArray(0);
+    GLStateUseProgram(0);
+}
+
+bool UseOcclusionCulling(App* app)
+{
+    return app->useOcclusionCulling && app->useMultiDrawIndirect && app->useTransformTable;
+}
+
+// Max depth pyramid of the current G-buffer depth, level 0 is a copy of it
+void BuildHiZ(App* app)
+{
+    Program& program = app->programs[app->hiZBuildProgramIdx];
+    GLStateUseProgram(program.handle);
+    GLint sourceLevelLocation = glGetUniformLocation(program.handle, "uSourceLevel");
+
+    GLStateActiveTexture(GL_TEXTURE0);
+    for (u32 level = 0; level < app->hiZLevelCount; ++level)
     {
-        FinalRender(app);
-    }break;
+        ivec2 size = glm::max(ivec2(app->displaySize.x >> level, app->displaySize.y >> level), ivec2(1));
+
+        GLStateBindTexture(GL_TEXTURE_2D, level == 0 ? app->depthAttachmentHandle : app->hiZTextureHandle);
+        glUniform1i(sourceLevelLocation, (GLint)level - 1);
+        glBindImageTexture(0, app->hiZTextureHandle, level, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+        glDispatchCompute((size.x + 7) / 8, (size.y + 7) / 8, 1);
+
+        //The next level reads this one
+        glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
     }
+
+    GLStateBindTexture(GL_TEXTURE_2D, 0);
+    GLStateUseProgram(0);
+    app->hiZValid = true;
 }
 
-void OnGlError(GLenum source, GLenum type, GLuint id, GLenum severity, GLsizei length, const GLchar* message, const void* userParan) {
+void OcclusionCullingPass(App* app, u32 commandsOffset, u32 spheresOffset, u32 phase)
+{
+    const u32 commandCount = app->renderQueue.commands.size();
 
+    Program& program = app->programs[app->occlusionCullingProgramIdx];
+    GLStateUseProgram(program.handle);
+    glUniform1ui(glGetUniformLocation(program.handle, "uCommandCount"), commandCount);
+    glUniform1i(glGetUniformLocation(program.handle, "uPhase"), phase);
+    glUniform1i(glGetUniformLocation(program.handle, "uHiZValid"), app->hiZValid);
 
-    if (severity == GL_DEBUG_SEVERITY_NOTIFICATION)
-        return;
+    GLStateActiveTexture(GL_TEXTURE0);
+    GLStateBindTexture(GL_TEXTURE_2D, app->hiZTextureHandle);
 
-    ELOG("OpenGL debug message : % s", message);
+    glBindBufferRange(GL_SHADER_STORAGE_BUFFER, BINDING(6), app->indirectCommands.handle, commandsOffset, 2 * commandCount * sizeof(DrawElementsIndirectCommand));
+    glBindBufferRange(GL_SHADER_STORAGE_BUFFER, BINDING(7), app->indirectCommands.handle, spheresOffset, commandCount * sizeof(vec4));
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, BINDING(1), app->occlusionStatsBufferHandle);
 
-    switch (source)
+    glDispatchCompute((commandCount + 63) / 64, 1, 1);
+
+    //The draws read the instance counts written here
+    glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+
+    GLStateBindTexture(GL_TEXTURE_2D, 0);
+    GLStateUseProgram(0);
+}
+
+// Reads the newest counters whose copy is done, without waiting for the others
+void ReadOcclusionStats(App* app)
+{
+    const u32 size = sizeof(app->occlusionVisibleDraws);
+    for (u32 i = 1; i <= BUFFER_FRAMES_IN_FLIGHT; ++i)
     {
-        case GL_DEBUG_SOURCE_API: ELOG(" - source: GL_DEBUG_SOURCE_API"); break; // Calls to the OpenGL API
-        case GL_DEBUG_SOURCE_WINDOW_SYSTEM: ELOG(" - source: GL_DEBUG_SOURCE_WINDOW_SYSTEM"); break; // Calls to a window-system API
-        case GL_DEBUG_SOURCE_SHADER_COMPILER: ELOG(" - source: GL_DEBUG_SOURCE_SHADER_COMPILER"); break; // A compiler for a shading language
-        case GL_DEBUG_SOURCE_THIRD_PARTY: ELOG(" - source: GL_DEBUG_SOURCE_THIRD_PARTY"); break; // An application associated with OpenGL
-        case GL_DEBUG_SOURCE_APPLICATION: ELOG(" - source: GL_DEBUG_SOURCE_APPLICATION"); break; // Generated by the user of this applicat
-        case GL_DEBUG_SOURCE_OTHER: ELOG(" - source: GL_DEBUG_SOURCE_OTHER"); break; // Some source that isn't one of these
+        //Oldest slot first, so the newest finished one is read last
+        u32 slot = (app->occlusionStatsSlot + i) % BUFFER_FRAMES_IN_FLIGHT;
+        GLsync& fence = app->occlusionStatsFences[slot];
+        if (!fence)
+            continue;
+
+        GLenum result = glClientWaitSync(fence, 0, 0);
+        if (result != GL_ALREADY_SIGNALED && result != GL_CONDITION_SATISFIED)
+            continue;
+        glDeleteSync(fence);
+        fence = NULL;
 
+        if (app->occlusionStatsReadbackData)
+        {
+            memcpy(app->occlusionVisibleDraws, (u8*)app->occlusionStatsReadbackData + slot * size, size);
+        }
+        else
+        {
+            //The copy is done, this does not wait
+            glBindBuffer(GL_COPY_READ_BUFFER, app->occlusionStatsReadbackHandle);
+            glGetBufferSubData(GL_COPY_READ_BUFFER, slot * size, size, app->occlusionVisibleDraws);
+            glBindBuffer(GL_COPY_READ_BUFFER, 0);
+        }
     }
-    switch (type)
+}
+
+// Copies the counters of this frame to the next readback slot, skipped while the GPU still has it
+void CopyOcclusionStats(App* app)
+{
+    const u32 size = sizeof(app->occlusionVisibleDraws);
+    u32 slot = (app->occlusionStatsSlot + 1) % BUFFER_FRAMES_IN_FLIGHT;
+    if (app->occlusionStatsFences[slot])
+        return;
+
+    //The culling passes wrote the counters with atomics
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    glBindBuffer(GL_COPY_READ_BUFFER, app->occlusionStatsBufferHandle);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, app->occlusionStatsReadbackHandle);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, slot * size, size);
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+    app->occlusionStatsFences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    app->occlusionStatsSlot = slot;
+}
+
+// Draws the indirect commands written with room for the occlusion culling
+void DrawIndirectOcclusionCulled(App* app, u32 commandsOffset, u32 spheresOffset)
+{
+    const u32 commandCount = app->renderQueue.commands.size();
+    if (commandCount == 0)
+        return;
+
+    //The CPU never touches the counters, it only reads the copies of previous frames
+    ReadOcclusionStats(app);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, app->occlusionStatsBufferHandle);
+    glClearBufferSubData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, 0, sizeof(app->occlusionVisibleDraws), GL_RED_INTEGER, GL_UNSIGNED_INT, NULL);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    u32 retestOffset = commandsOffset + commandCount * sizeof(DrawElementsIndirectCommand);
+
+    //After the depth pre-pass the pyramid holds the final depth of this frame: a single phase
+    //is exact and there is nothing to retest
+    if (app->useDepthPrePass)
     {
-        case GL_DEBUG_TYPE_ERROR: ELOG(" - type: GL_DEBUG_TYPE_ERROR"); break; // An error, typically from the API
-        case GL_DEBUG_TYPE_DEPRECATED_BEHAVIOR : ELOG(" - type: GL_DEBUG_TYPE_DEPRECATED BEHAVIOR"); break; // Some behavior marked deprecated |
-        case GL_DEBUG_TYPE_UNDEFINED_BEHAVIOR : ELOG(" - type: GL_DEBUG_TYPE_UNDEFINED_BEHAVIOR"); break; // Something has invoked undefined bi
-        case GL_DEBUG_TYPE_PORTABILITY: ELOG(" - type: GL_DEBUG_TYPE_PORTABILITY"); break; // Some functionality the user relies upon
-        case GL_DEBUG_TYPE_PERFORMANCE: ELOG(" - type: GL_DEBUG_TYPE_PERFORMANCE"); break; // Code has triggered possible performance
-        case GL_DEBUG_TYPE_MARKER: ELOG(" - type: GL_DEBUG_TYPE_MARKER"); break; // Command stream annotation
-        case GL_DEBUG_TYPE_PUSH_GROUP: ELOG(" - type: GL_DEBUG_TYPE_PUSH_GROUP"); break; // Group pushing
-        case GL_DEBUG_TYPE_POP_GROUP: ELOG(" - type: GL_DEBUG_TYPE_POP_GROUP"); break; // foo
-        case GL_DEBUG_TYPE_OTHER: ELOG(" - type: GL_DEBUG_TYPE_OTHER"); break; // Some type that isnt one of these
+        BuildHiZ(app);
+        OcclusionCullingPass(app, commandsOffset, spheresOffset, 0);
+        DrawIndirectBuckets(app, commandsOffset, false);
+        CopyOcclusionStats(app);
+        return;
     }
 
-    switch (severity) 
+    //Phase 1: the draws not hidden by the pyramid of the previous frame
+    OcclusionCullingPass(app, commandsOffset, spheresOffset, 0);
+    DrawIndirectBuckets(app, commandsOffset, false);
+
+    //Phase 2: the draws culled before are tested again with the depth drawn so far, so the ones
+    //that just became visible (disocclusions, wrong guesses of the previous frame) still get drawn
+    BuildHiZ(app);
+    OcclusionCullingPass(app, commandsOffset, spheresOffset, 1);
+    DrawIndirectBuckets(app, retestOffset, false);
+    CopyOcclusionStats(app);
+
+    //The next frame starts with the complete depth, including the occluders drawn in phase 2
+    BuildHiZ(app);
+}
+
+/**
+ * Draws the queue of an opaque pass (geometry or forward). With the depth pre-pass enabled the
+ * draws first write only their depth, then they are drawn again with GL_LEQUAL so each pixel is
+ * shaded once. The positions are invariant in both programs, so they get the same depth.
+ */
+void SubmitOpaqueRenderQueue(App* app, bool occlusionCulling)
+{
+    TRACE_FUNCTION();
+
+    const bool indirect = app->useMultiDrawIndirect && app->useTransformTable;
+
+    //Both passes read the same indirect commands
+    u32 spheresOffset = 0;
+    u32 commandsOffset = indirect ? WriteIndirectCommands(app, occlusionCulling, &spheresOffset) : 0;
+
+    glBeginQuery(GL_TIME_ELAPSED, app->opaqueTimerQueries[app->opaqueTimersFrame][OpaqueTimer_PrePass]);
+    if (app->useDepthPrePass)
     {
-        case GL_DEBUG_SEVERITY_HIGH: ELOG(" - severity: GL_DEBUG_SEVERITY_HIGH"); break; // All OpenGL Errors, shader compilation/link
-        case GL_DEBUG_SEVERITY_MEDIUM: ELOG(" - severity: GL_DEBUG_SEVERITY_MEDIUM"); break; // Major performance warnings, shader compi
-        case GL_DEBUG_SEVERITY_LOW: ELOG(" - severity: GL_DEBUG_SEVERITY_LOW"); break; // Redundant state change performance warning,
-        case GL_DEBUG_SEVERITY_NOTIFICATION: ELOG(" - severity: GL_DEBUG_SEVERITY_NOTIFICATION"); break; // Anything that isnt an error or pei
+        glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+        if (indirect)
+            DrawIndirectBuckets(app, commandsOffset, true);
+        else
+            SubmitRenderQueue(app, true);
+        glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+
+        //Depth writes stay on for the draws left out of the pre-pass
+        glDepthFunc(GL_LEQUAL);
     }
+    glEndQuery(GL_TIME_ELAPSED);
+
+    glBeginQuery(GL_TIME_ELAPSED, app->opaqueTimerQueries[app->opaqueTimersFrame][OpaqueTimer_Main]);
+    if (occlusionCulling)
+        DrawIndirectOcclusionCulled(app, commandsOffset, spheresOffset);
+    else if (indirect)
+        DrawIndirectBuckets(app, commandsOffset, false);
+    else
+        SubmitRenderQueue(app, false);
+    glEndQuery(GL_TIME_ELAPSED);
+
+    glDepthFunc(GL_LESS);
+    app->opaqueTimersPending[app->opaqueTimersFrame] = true;
+    app->opaqueTimersPrePass[app->opaqueTimersFrame] = app->useDepthPrePass;
 }
 
-void CreateFrameBufferObjects(App* app)
-{
-    //Framebuffer creation
-
-    //Position render target
-    glGenTextures(1, &app->positionAttachmentHandle);
-    glBindTexture(GL_TEXTURE_2D, app->positionAttachmentHandle);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, app->displaySize.x, app->displaySize.y, 0, GL_RGBA, GL_FLOAT, NULL);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glBindTexture(GL_TEXTURE_2D, 0);
-
-    //Diffuse render target
-    glGenTextures(1, &app->diffuseAttachmentHandle);
-    glBindTexture(GL_TEXTURE_2D, app->diffuseAttachmentHandle);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, app->displaySize.x, app->displaySize.y, 0, GL_RGBA, GL_FLOAT, NULL);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glBindTexture(GL_TEXTURE_2D, 0);
-
-    //Normals render target
-    glGenTextures(1, &app->normalsAttachmentHandle);
-    glBindTexture(GL_TEXTURE_2D, app->normalsAttachmentHandle);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, app->displaySize.x, app->displaySize.y, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glBindTexture(GL_TEXTURE_2D, 0);
-
-    //Final render target
-    glGenTextures(1, &app->finalAttachmentHandle);
-    glBindTexture(GL_TEXTURE_2D, app->finalAttachmentHandle);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, app->displaySize.x, app->displaySize.y, 0, GL_RGB, GL_FLOAT, NULL);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glBindTexture(GL_TEXTURE_2D, 0);
-
-    //Depth render target              
-    glGenTextures(1, &app->depthAttachmentHandle);
-    glBindTexture(GL_TEXTURE_2D, app->depthAttachmentHandle);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH32F_STENCIL8, app->displaySize.x, app->displaySize.y, 0, GL_DEPTH_STENCIL,
-                    GL_FLOAT_32_UNSIGNED_INT_24_8_REV, NULL);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glBindTexture(GL_TEXTURE_2D, 0);
-
-    //frame buffer creation and render target attachments
-    glGenFramebuffers(1, &app->framebufferHandle);
-    glBindFramebuffer(GL_FRAMEBUFFER, app->framebufferHandle);
-    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, app->positionAttachmentHandle, 0);
-    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, app->diffuseAttachmentHandle, 0);
-    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, app->normalsAttachmentHandle, 0);
-    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT3, app->finalAttachmentHandle, 0);
-    glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, app->depthAttachmentHandle, 0);
-    
-    GLenum framebufferStatus = glCheckFramebufferStatus(GL_FRAMEBUFFER); 
-    if (framebufferStatus != GL_FRAMEBUFFER_COMPLETE)
+// Results of the opaque pass timers of the previous frame, only if they are ready so it never stalls
+void ReadOpaqueTimers(App* app)
+{
+    app->opaqueTimersFrame = (app->opaqueTimersFrame + 1) % 2;
+
+    const u32 frame = app->opaqueTimersFrame;
+    if (!app->opaqueTimersPending[frame])
+        return;
+
+    GLint available = 0;
+    glGetQueryObjectiv(app->opaqueTimerQueries[frame][OpaqueTimer_Main], GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!available)
+        return;
+
+    f32 total = 0.0f;
+    for (u32 timer = 0; timer < OpaqueTimer_Count; ++timer)
     {
-        switch (framebufferStatus)
-        {
-            case GL_FRAMEBUFFER_UNDEFINED : ELOG("GL_FRAMEBUFFER_UNDEFINED"); break;
-            case GL_FRAMEBUFFER_INCOMPLETE_ATTACHMENT : ELOG("GL_FRAMEBUFFER_INCOMPLETE_ATTACHMENT"); break;
-            case GL_FRAMEBUFFER_INCOMPLETE_MISSING_ATTACHMENT: ELOG("GL_FRAMEBUFFER_INCOMPLETE_MISSING_ATTACHMENT"); break;
-            case GL_FRAMEBUFFER_INCOMPLETE_DRAW_BUFFER : ELOG("GL_FRAMEBUFFER_INCOMPLETE_DRAW_BUFFER"); break;
-            case GL_FRAMEBUFFER_INCOMPLETE_READ_BUFFER : ELOG("GL_FRAMEBUFFER_INCOMPLETE_READ_BUFFER"); break;
-            case GL_FRAMEBUFFER_UNSUPPORTED : ELOG("GL_FRAMEBUFFER_UNSUPPORTED"); break;
-            case GL_FRAMEBUFFER_INCOMPLETE_MULTISAMPLE : ELOG("GL_FRAMEBUFFER_INCOMPLETE_MULTISAMPLE"); break;
-            case GL_FRAMEBUFFER_INCOMPLETE_LAYER_TARGETS : ELOG("GL_FRAMEBUFFER_INCOMPLETE_LAYER_TARGETS"); break;
-            default: ELOG("Unknown framebuifer status error"); break;
-        }
+        GLuint64 nanoseconds = 0;
+        glGetQueryObjectui64v(app->opaqueTimerQueries[frame][timer], GL_QUERY_RESULT, &nanoseconds);
+        app->opaqueTimes[timer] = nanoseconds / 1000000.0f;
+        total += app->opaqueTimes[timer];
     }
-        
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    app->opaqueTotalTimes[app->opaqueTimersPrePass[frame]] = total;
+    app->opaqueTimersPending[frame] = false;
+}
+
+// Same for the deferred light pass, after ReadOpaqueTimers so both come from the same frame
+void ReadLightPassTimer(App* app)
+{
+    const u32 frame = app->opaqueTimersFrame;
+    if (!app->lightPassTimersPending[frame])
+        return;
+
+    GLint available = 0;
+    glGetQueryObjectiv(app->lightPassTimerQueries[frame], GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!available)
+        return;
 
+    GLuint64 nanoseconds = 0;
+    glGetQueryObjectui64v(app->lightPassTimerQueries[frame], GL_QUERY_RESULT, &nanoseconds);
+    app->lightPassTime = nanoseconds / 1000000.0f;
+    app->gBufferFrameTimes[app->lightPassTimersCompact[frame]] = app->opaqueTimes[OpaqueTimer_PrePass] + app->opaqueTimes[OpaqueTimer_Main] + app->lightPassTime;
+    app->lightPassTimersPending[frame] = false;
 }
 
-void GeometryPass(App* app)
+u32 GetGBufferProgram(App* app, u32 programIdx)
 {
-    //Render on this framebuffer render targets
-    glBindFramebuffer(GL_FRAMEBUFFER, app->framebufferHandle);
+    return app->useCompactGBuffer ? app->programs[programIdx].compactGBufferProgramIdx : programIdx;
+}
 
-    //Color attachments
-    GLuint drawBuffers[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2 };
-    glDrawBuffers(ARRAY_COUNT(drawBuffers), drawBuffers);
+// G-buffer targets on units 0 to 3 and, for the compact layout, the matrix to rebuild the position from the depth.
+// The depth is passed apart: a pass can't sample the depth stencil attached to its framebuffer
+void BindGBufferTextures(App* app, const Program& program, GLuint depthHandle)
+{
+    GLStateActiveTexture(GL_TEXTURE0);
+    GLStateBindTexture(GL_TEXTURE_2D, app->positionAttachmentHandle);
 
-    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    GLStateActiveTexture(GL_TEXTURE1);
+    GLStateBindTexture(GL_TEXTURE_2D, app->normalsAttachmentHandle);
 
-    glViewport(0, 0, app->displaySize.x, app->displaySize.y);
+    GLStateActiveTexture(GL_TEXTURE2);
+    GLStateBindTexture(GL_TEXTURE_2D, app->diffuseAttachmentHandle);
 
-    for (const Entity& entity : app->entities)
-    {
-        Model& model = app->models[entity.modelIndex];
-        Mesh& mesh = app->meshes[model.meshIdx];
+    GLStateActiveTexture(GL_TEXTURE3);
+    GLStateBindTexture(GL_TEXTURE_2D, depthHandle);
 
-        Program& texturedMeshProgram = app->programs[entity.programIdx];
-        glUseProgram(texturedMeshProgram.handle);
+    if (program.inverseViewProjectionLocation != -1)
+        glUniformMatrix4fv(program.inverseViewProjectionLocation, 1, GL_FALSE, glm::value_ptr(app->globalParamsInverseViewProjection));
+}
 
-        glBindBufferRange(GL_UNIFORM_BUFFER, BINDING(1), app->cbuffer.handle, entity.localParamsOffset, entity.localParamsSize);
+void DrawEntitySubmesh(App* app, const Submesh& submesh, u32 entityIdx)
+{
+    if (app->useTransformTable)
+    {
+        //The base instance selects the entity index from the per-instance attribute
+        glDrawElementsInstancedBaseInstance(GL_TRIANGLES, submesh.indices.size(), GL_UNSIGNED_INT, (void*)(u64)submesh.indexOffset, 1, entityIdx);
+    }
+    else
+    {
+        glDrawElements(GL_TRIANGLES, submesh.indices.size(), GL_UNSIGNED_INT, (void*)(u64)submesh.indexOffset);
+    }
+}
 
-        for (u32 i = 0; i < mesh.submeshes.size(); ++i)
-        {
-            GLuint vao = FindVAO(mesh, i, texturedMeshProgram);
-            glBindVertexArray(vao);
+void GeometryPass(App* app)
+{
+    PushGpuZone(app->gpuProfiler, "Geometry");
 
-            u32 submeshMaterialIdx = model.materialIdx[i];
-            Material& submeshMaterial = app->materials[submeshMaterialIdx];
+    //The render graph bound its framebuffer with the G-buffer targets
 
-            glActiveTexture(GL_TEXTURE0);
-            glBindTexture(GL_TEXTURE_2D, app->textures[submeshMaterial.albedoTextureIdx].handle);
+    //Color attachments, the position output goes nowhere in the compact layout
+    GLenum drawBuffers[] = { app->useCompactGBuffer ? (GLenum)GL_NONE : (GLenum)GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2 };
+    GLStateDrawBuffers(ARRAY_COUNT(drawBuffers), drawBuffers);
 
-            //Check if uses normal mapping
-            if (submeshMaterial.normalTextureIdx != NO_TEXTURE_ATTACHED) {
-                glActiveTexture(GL_TEXTURE1);
-                glBindTexture(GL_TEXTURE_2D, app->textures[submeshMaterial.normalTextureIdx].handle);
-            }
+    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-            //Check if uses parallax occlusion mapping
-            if (submeshMaterial.bumpTextureIdx != NO_TEXTURE_ATTACHED) {
-                glActiveTexture(GL_TEXTURE2);
-                glBindTexture(GL_TEXTURE_2D, app->textures[submeshMaterial.bumpTextureIdx].handle);
-                //Pass uniforms for calculations and settings
-                glUniform3f(glGetUniformLocation(app->programs[app->reliefMappingIdx].handle, "uCameraPos"),
-                    app->camera.Position.x, app->camera.Position.y, app->camera.Position.z);
-                glUniform1f(glGetUniformLocation(app->programs[app->reliefMappingIdx].handle, "uHeightScale"), app->heightScale);
-                glUniform1f(glGetUniformLocation(app->programs[app->reliefMappingIdx].handle, "zNear"), app->camera.NearPlane);
-                glUniform1f(glGetUniformLocation(app->programs[app->reliefMappingIdx].handle, "zFar"), app->camera.FarPlane);
-                glUniform1i(glGetUniformLocation(app->programs[app->reliefMappingIdx].handle, "discardEdges"), app->discardEdges);
-                glUniform1i(glGetUniformLocation(app->programs[app->reliefMappingIdx].handle, "minLayers"), app->minLayers);
-                glUniform1i(glGetUniformLocation(app->programs[app->reliefMappingIdx].handle, "maxLayers"), app->maxLayers);
-            }
+    glViewport(0, 0, app->displaySize.x, app->displaySize.y);
 
-            Submesh& submesh = mesh.submeshes[i];
-            glDrawElements(GL_TRIANGLES, submesh.indices.size(), GL_UNSIGNED_INT, (void*)(u64)submesh.indexOffset);
-        }
+    if (app->useTransformTable)
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, BINDING(2), app->transformTable.buffer.handle);
 
-        glBindVertexArray(0);
-    }
+    BuildRenderQueue(app, RenderPass_Geometry);
 
-    glUseProgram(0);
+    //The pyramid would be stale the next time the culling is enabled
+    if (!UseOcclusionCulling(app))
+        app->hiZValid = false;
+    SubmitOpaqueRenderQueue(app, UseOcclusionCulling(app));
+
+    PopGpuZone(app->gpuProfiler);
 }
 
 void LightPass(App* app)
 {
+    PushGpuZone(app->gpuProfiler, "Lighting");
+
     glDepthMask(GL_FALSE);
 
-    glDrawBuffer(GL_COLOR_ATTACHMENT3);
+    GLStateDrawBuffer(GL_COLOR_ATTACHMENT3);
     glClear(GL_COLOR_BUFFER_BIT);
 
-    //Point light with stencil
-    glEnable(GL_STENCIL_TEST);
+    if (app->instancedLightVolumes && app->instancedLightVolumesSupported)
+    {
+        //All the point light volumes in a single draw
+        PushGpuZone(app->gpuProfiler, "Point Lights (Instanced)");
+        InstancedPointLightPass(app);
+        PopGpuZone(app->gpuProfiler);
+    }
+    else
+    {
+        //Point light with stencil
+        GLStateEnable(GL_STENCIL_TEST);
 
-    //For Point Light Pass we do it each light at a time so we can use stencil.
-    for (unsigned int i = 0; i < app->lights.size(); i++) {
-        if (app->lights[i].type == LightType_Point) //Point Light
-        {
-            //Stencil pass for sphere light volume
-            StencilPass(app, i);
-            //Point pass using sphere light volume, not working currently because of depth of volume issues
-            PointLightPass(app, i);
+        //For Point Light Pass we do it each light at a time so we can use stencil.
+        for (unsigned int i = 0; i < app->lights.size(); i++) {
+            if (app->lights[i].type == LightType_Point && PointLightTouchesEntities(app, app->lights[i])) //Point Light
+            {
+                //Stencil pass for sphere light volume
+                PushGpuZone(app->gpuProfiler, "Stencil");
+                StencilPass(app, i);
+                PopGpuZone(app->gpuProfiler);
+                //Point pass using sphere light volume, not working currently because of depth of volume issues
+                PushGpuZone(app->gpuProfiler, "Point Light");
+                PointLightPass(app, i);
+                PopGpuZone(app->gpuProfiler);
+            }
         }
-    }
 
-    glDisable(GL_STENCIL_TEST);
+        GLStateDisable(GL_STENCIL_TEST);
+    }
    
     //Directional pass using a quad
+    PushGpuZone(app->gpuProfiler, "Directional Light");
     DirectionalLightPass(app);
+    PopGpuZone(app->gpuProfiler);
+
+    PopGpuZone(app->gpuProfiler);
+}
+
+void TiledLightPass(App* app)
+{
+    //One work group per tile: it culls the point lights against the tile's depth bounds
+    //and shades all the tile's pixels with the lights that survive, in a single dispatch
+    PushGpuZone(app->gpuProfiler, "Tiled Lighting");
+
+    Program& program = app->programs[GetGBufferProgram(app, app->tiledDeferredProgramIdx)];
+    GLStateUseProgram(program.handle);
+
+    glUniformMatrix4fv(glGetUniformLocation(program.handle, "uViewMatrix"), 1, GL_FALSE, glm::value_ptr(app->viewMatrix));
+    glUniformMatrix4fv(glGetUniformLocation(program.handle, "uProjectionMatrix"), 1, GL_FALSE, glm::value_ptr(app->projectionMatrix));
+
+    BindGBufferTextures(app, program, app->depthAttachmentHandle);
+
+    glBindImageTexture(0, app->finalAttachmentHandle, 0, GL_FALSE, 0, GL_WRITE_ONLY, GetFinalTargetFormat(app));
+
+    u32 tileCountX = (app->displaySize.x + LIGHT_TILE_SIZE - 1) / LIGHT_TILE_SIZE;
+    u32 tileCountY = (app->displaySize.y + LIGHT_TILE_SIZE - 1) / LIGHT_TILE_SIZE;
+    glDispatchCompute(tileCountX, tileCountY, 1);
+
+    //The final render target is sampled right after
+    glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+
+    glBindImageTexture(0, 0, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA8);
+    GLStateUseProgram(0);
+
+    PopGpuZone(app->gpuProfiler);
 }
 
 void PositionRender(App* app)
 {
-    Program& program = app->programs[app->texturedQuadProgramIdx];
-    glUseProgram(program.handle);
+    //Through the G-buffer readers' path, so it also works without the position target
+    Program& program = app->programs[GetGBufferProgram(app, app->gBufferViewProgramIdx)];
+    GLStateUseProgram(program.handle);
 
     Mesh& mesh = app->meshes[app->quadIdx];
     GLuint vao = FindVAO(mesh, 0, program);
-    glBindVertexArray(vao);
+    GLStateBindVertexArray(vao);
 
-    glUniform1i(app->quadProgramUniformTexture, 0);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, app->positionAttachmentHandle);
+    glUniform1i(glGetUniformLocation(program.handle, "uShowNormals"), 0);
+    BindGBufferTextures(app, program, app->depthAttachmentHandle);
 
     Submesh& submesh = mesh.submeshes[0];
     glDrawElements(GL_TRIANGLES, submesh.indices.size(), GL_UNSIGNED_INT, (void*)(u64)submesh.indexOffset);
 
-    glBindVertexArray(0);
-    glUseProgram(0);
+    GLStateBindVertexArray(0);
+    GLStateUseProgram(0);
 }
 
 void DiffuseRender(App* app)
 {
     Program& program = app->programs[app->texturedQuadProgramIdx];
-    glUseProgram(program.handle);
+    GLStateUseProgram(program.handle);
 
     Mesh& mesh = app->meshes[app->quadIdx];
     GLuint vao = FindVAO(mesh, 0, program);
-    glBindVertexArray(vao);
+    GLStateBindVertexArray(vao);
 
     glUniform1i(app->quadProgramUniformTexture, 0);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, app->diffuseAttachmentHandle);
+    GLStateActiveTexture(GL_TEXTURE0);
+    GLStateBindTexture(GL_TEXTURE_2D, app->diffuseAttachmentHandle);
 
     Submesh& submesh = mesh.submeshes[0];
     glDrawElements(GL_TRIANGLES, submesh.indices.size(), GL_UNSIGNED_INT, (void*)(u64)submesh.indexOffset);
 
-    glBindVertexArray(0);
-    glUseProgram(0);
+    GLStateBindVertexArray(0);
+    GLStateUseProgram(0);
 }
 
 void DepthRender(App* app)
 {
     Program& program = app->programs[app->depthProgramIdx];
-    glUseProgram(program.handle);
+    GLStateUseProgram(program.handle);
 
     Mesh& mesh = app->meshes[app->quadIdx];
     GLuint vao = FindVAO(mesh, 0, program);
-    glBindVertexArray(vao);
+    GLStateBindVertexArray(vao);
 
     glUniform1i(app->depthProgramUniformTexture, 0);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, app->depthAttachmentHandle);
+    GLStateActiveTexture(GL_TEXTURE0);
+    GLStateBindTexture(GL_TEXTURE_2D, app->depthAttachmentHandle);
 
     Submesh& submesh = mesh.submeshes[0];
     glDrawElements(GL_TRIANGLES, submesh.indices.size(), GL_UNSIGNED_INT, (void*)(u64)submesh.indexOffset);
 
-    glBindVertexArray(0);
-    glUseProgram(0);
+    GLStateBindVertexArray(0);
+    GLStateUseProgram(0);
 }
 
 void NormalRender(App* app)
 {
-    Program& program = app->programs[app->texturedQuadProgramIdx];
-    glUseProgram(program.handle);
+    //Decodes the octahedral normals
+    Program& program = app->programs[GetGBufferProgram(app, app->gBufferViewProgramIdx)];
+    GLStateUseProgram(program.handle);
 
     Mesh& mesh = app->meshes[app->quadIdx];
     GLuint vao = FindVAO(mesh, 0, program);
-    glBindVertexArray(vao);
+    GLStateBindVertexArray(vao);
 
-    glUniform1i(app->quadProgramUniformTexture, 0);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, app->normalsAttachmentHandle);
+    glUniform1i(glGetUniformLocation(program.handle, "uShowNormals"), 1);
+    BindGBufferTextures(app, program, app->depthAttachmentHandle);
 
     Submesh& submesh = mesh.submeshes[0];
     glDrawElements(GL_TRIANGLES, submesh.indices.size(), GL_UNSIGNED_INT, (void*)(u64)submesh.indexOffset);
 
-    glBindVertexArray(0);
-    glUseProgram(0);
+    GLStateBindVertexArray(0);
+    GLStateUseProgram(0);
 }
 
 void FinalRender(App* app)
 {
     Program& program = app->programs[app->texturedQuadProgramIdx];
-    glUseProgram(program.handle);
+    GLStateUseProgram(program.handle);
 
     Mesh& mesh = app->meshes[app->quadIdx];
     GLuint vao = FindVAO(mesh, 0, program);
-    glBindVertexArray(vao);
+    GLStateBindVertexArray(vao);
 
     glUniform1i(app->quadProgramUniformTexture, 0);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, app->finalAttachmentHandle);
+    GLStateActiveTexture(GL_TEXTURE0);
+    GLStateBindTexture(GL_TEXTURE_2D, app->finalAttachmentHandle);
 
     Submesh& submesh = mesh.submeshes[0];
     glDrawElements(GL_TRIANGLES, submesh.indices.size(), GL_UNSIGNED_INT, (void*)(u64)submesh.indexOffset);
 
-    glBindVertexArray(0);
-    glUseProgram(0);
+    GLStateBindVertexArray(0);
+    GLStateUseProgram(0);
 }
 
 void StencilPass(App* app, unsigned int lightIndex)
 {
     Program& program = app->programs[app->nullGeometryIdx];
-    glUseProgram(program.handle);
+    GLStateUseProgram(program.handle);
    
     // Disable color/depth write and enable stencil
-    glDrawBuffer(GL_NONE);
-    glEnable(GL_DEPTH_TEST);
+    GLStateDrawBuffer(GL_NONE);
+    GLStateEnable(GL_DEPTH_TEST);
 
-    glDisable(GL_CULL_FACE);
+    GLStateDisable(GL_CULL_FACE);
 
     glClear(GL_STENCIL_BUFFER_BIT);
 
@@ -1050,135 +2752,177 @@ void StencilPass(App* app, unsigned int lightIndex)
     glStencilOpSeparate(GL_FRONT, GL_KEEP, GL_DECR_WRAP, GL_KEEP);
 
     //Render Sphere to obtain depth of light volume
-    Mesh point_mesh = app->meshes[app->models[app->sphereIdx].meshIdx];
-    Submesh point_submesh = point_mesh.submeshes[0];
+    Mesh& point_mesh = app->meshes[app->models[app->lightVolumeIdx].meshIdx];
+    Submesh& point_submesh = point_mesh.submeshes[0];
 
     GLuint pointVao = FindVAO(point_mesh, 0, program);
-    glBindVertexArray(pointVao);
+    GLStateBindVertexArray(pointVao);
 
-    glBindBufferRange(GL_UNIFORM_BUFFER, BINDING(1), app->lightsBuffer.handle, app->lights[lightIndex].localParamsOffset, app->lights[lightIndex].localParamsSize);
+    glBindBufferRange(GL_UNIFORM_BUFFER, BINDING(1), app->lightParams.buffer.handle, GetSlotOffset(app->lightParams, lightIndex), sizeof(glm::mat4));
 
     glDrawElements(GL_TRIANGLES, point_submesh.indices.size(), GL_UNSIGNED_INT, (void*)(u64)point_submesh.indexOffset);
 
-    glBindVertexArray(0);
+    GLStateBindVertexArray(0);
 }
 
 void PointLightPass(App* app, unsigned int lightIndex)
 {
     //Select color attachment 3 to render. Final Render Texture. 
-    glDrawBuffer(GL_COLOR_ATTACHMENT3);
+    GLStateDrawBuffer(GL_COLOR_ATTACHMENT3);
 
     //OpenGL Settings for light pass using stencil previously generated
     glStencilFunc(GL_NOTEQUAL, 0, 0xFF);
 
-    glDisable(GL_DEPTH_TEST);
-    glEnable(GL_BLEND);
+    GLStateDisable(GL_DEPTH_TEST);
+    GLStateEnable(GL_BLEND);
     glBlendFunc(GL_ONE, GL_ONE);
 
-    glEnable(GL_CULL_FACE);
+    GLStateEnable(GL_CULL_FACE);
     glCullFace(GL_FRONT);
 
     //Render Point Lights into a Sphere Light Volume using the gBuffer textures
-    Program& program = app->programs[app->deferredPointProgramIdx];
-    glUseProgram(app->programs[app->deferredPointProgramIdx].handle);
-
-    glBindBufferRange(GL_UNIFORM_BUFFER, BINDING(0), app->cbuffer.handle, app->globalParamsOffset, app->globalParamsSize);
+    Program& program = app->programs[GetGBufferProgram(app, app->deferredPointProgramIdx)];
+    GLStateUseProgram(program.handle);
 
-    Mesh point_mesh = app->meshes[app->models[app->sphereIdx].meshIdx];
-    Submesh point_submesh = point_mesh.submeshes[0];
+    Mesh& point_mesh = app->meshes[app->models[app->lightVolumeIdx].meshIdx];
+    Submesh& point_submesh = point_mesh.submeshes[0];
 
     GLuint pointVao = FindVAO(point_mesh, 0, program);
-    glBindVertexArray(pointVao);
+    GLStateBindVertexArray(pointVao);
 
-    glBindBufferRange(GL_UNIFORM_BUFFER, BINDING(1), app->lightsBuffer.handle, app->lights[lightIndex].localParamsOffset, app->lights[lightIndex].localParamsSize);
+    glBindBufferRange(GL_UNIFORM_BUFFER, BINDING(1), app->lightParams.buffer.handle, GetSlotOffset(app->lightParams, lightIndex), sizeof(glm::mat4));
     glUniform2f(glGetUniformLocation(program.handle, "gScreenSize"), (float)app->displaySize.x, (float)app->displaySize.y); //Pass screen size to calculate texture coord
-    glUniform1ui(glGetUniformLocation(program.handle, "gLightIndex"), lightIndex); //Light index since we are rendering one light at a time due to usage of stencil
+    glUniform1ui(glGetUniformLocation(program.handle, "gLightIndex"), app->lights[lightIndex].listIdx); //Point list index since we are rendering one light at a time due to usage of stencil
       
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, app->positionAttachmentHandle);
+    BindGBufferTextures(app, program, app->depthCopyHandle);
 
-    glActiveTexture(GL_TEXTURE1);
-    glBindTexture(GL_TEXTURE_2D, app->normalsAttachmentHandle);
+    glDrawElements(GL_TRIANGLES, point_submesh.indices.size(), GL_UNSIGNED_INT, (void*)(u64)point_submesh.indexOffset);
 
-    glActiveTexture(GL_TEXTURE2);
-    glBindTexture(GL_TEXTURE_2D, app->diffuseAttachmentHandle);
+    GLStateBindVertexArray(0);
 
-    glActiveTexture(GL_TEXTURE3);
-    glBindTexture(GL_TEXTURE_2D, app->depthAttachmentHandle);
+    GLStateUseProgram(0);
 
-    glDrawElements(GL_TRIANGLES, point_submesh.indices.size(), GL_UNSIGNED_INT, (void*)(u64)point_submesh.indexOffset);
+    glCullFace(GL_BACK);
+    GLStateDisable(GL_BLEND);
+}
+
+void InstancedPointLightPass(App* app)
+{
+    //Same test as the per light path, the lights touching no entity are left out of the instances
+    if (app->pointLightInstanceCount == 0)
+        return;
+
+    //Select color attachment 3 to render. Final Render Texture. 
+    GLStateDrawBuffer(GL_COLOR_ATTACHMENT3);
+
+    //No stencil: the back faces of the volumes pass where the geometry is in front of them,
+    //and the shader rejects the pixels in front of the volume by distance to the light.
+    GLStateEnable(GL_DEPTH_TEST);
+    glDepthFunc(GL_GEQUAL);
+
+    GLStateEnable(GL_BLEND);
+    glBlendFunc(GL_ONE, GL_ONE);
+
+    GLStateEnable(GL_CULL_FACE);
+    glCullFace(GL_FRONT);
+
+    Program& program = app->programs[GetGBufferProgram(app, app->deferredPointInstancedProgramIdx)];
+    GLStateUseProgram(program.handle);
+
+    glUniform2f(glGetUniformLocation(program.handle, "gScreenSize"), (float)app->displaySize.x, (float)app->displaySize.y);
 
-    glBindVertexArray(0);
+    BindGBufferTextures(app, program, app->depthCopyHandle);
 
-    glUseProgram(0);
+    Mesh& point_mesh = app->meshes[app->models[app->lightVolumeIdx].meshIdx];
+    Submesh& point_submesh = point_mesh.submeshes[0];
 
+    GLuint pointVao = FindVAO(point_mesh, 0, program);
+    GLStateBindVertexArray(pointVao);
+
+    //The instance id indexes the instance list, which holds the index in the point light list
+    glBindBufferRange(GL_SHADER_STORAGE_BUFFER, BINDING(8), app->pointLightInstances.handle, app->pointLightInstancesOffset, app->pointLightInstancesSize);
+    glDrawElementsInstanced(GL_TRIANGLES, point_submesh.indices.size(), GL_UNSIGNED_INT, (void*)(u64)point_submesh.indexOffset, app->pointLightInstanceCount);
+
+    GLStateBindVertexArray(0);
+    GLStateUseProgram(0);
+
+    glDepthFunc(GL_LESS);
+    GLStateDisable(GL_DEPTH_TEST);
     glCullFace(GL_BACK);
-    glDisable(GL_BLEND);
+    GLStateDisable(GL_BLEND);
 }
 
 void DirectionalLightPass(App* app)
 {
     //Select color attachment 3 to render. Final Render Texture. 
-    glDrawBuffer(GL_COLOR_ATTACHMENT3);
+    GLStateDrawBuffer(GL_COLOR_ATTACHMENT3);
 
-    glEnable(GL_BLEND);
+    GLStateEnable(GL_BLEND);
     glBlendFunc(GL_ONE, GL_ONE);
 
     //Render directional light into a quad using gBuffer textures
-    Program& program = app->programs[app->deferredDirectionalProgramIdx];
-    glUseProgram(program.handle);
-
-    glBindBufferRange(GL_UNIFORM_BUFFER, BINDING(0), app->cbuffer.handle, app->globalParamsOffset, app->globalParamsSize);
+    Program& program = app->programs[GetGBufferProgram(app, app->deferredDirectionalProgramIdx)];
+    GLStateUseProgram(program.handle);
 
     Mesh& mesh = app->meshes[app->quadIdx];
     GLuint vao = FindVAO(mesh, 0, program);
-    glBindVertexArray(vao);
-
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, app->positionAttachmentHandle);
+    GLStateBindVertexArray(vao);
 
-    glActiveTexture(GL_TEXTURE1);
-    glBindTexture(GL_TEXTURE_2D, app->normalsAttachmentHandle);
-
-    glActiveTexture(GL_TEXTURE2);
-    glBindTexture(GL_TEXTURE_2D, app->diffuseAttachmentHandle);
+    BindGBufferTextures(app, program, app->depthCopyHandle);
 
     Submesh& submesh = mesh.submeshes[0];
     glDrawElements(GL_TRIANGLES, submesh.indices.size(), GL_UNSIGNED_INT, (void*)(u64)submesh.indexOffset);
 
-    glBindVertexArray(0);
-    glUseProgram(0);
+    GLStateBindVertexArray(0);
+    GLStateUseProgram(0);
 
-    glDisable(GL_BLEND);
+    GLStateDisable(GL_BLEND);
 }
 
 void PointLightDraw(App* app)
 {
     //Render point lights as a small sphere to show where light is positioned.
-    glDisable(GL_BLEND);
+    GLStateDisable(GL_BLEND);
+
+    Mesh& point_mesh = app->meshes[app->models[app->lightVolumeIdx].meshIdx];
+    Submesh& point_submesh = point_mesh.submeshes[0];
+
+    if (app->instancedLightVolumes && app->instancedLightVolumesSupported)
+    {
+        Program& program = app->programs[app->pointLightDrawInstancedProgramIdx];
+        GLStateUseProgram(program.handle);
+
+        GLuint pointVao = FindVAO(point_mesh, 0, program);
+        GLStateBindVertexArray(pointVao);
+
+        glDrawElementsInstanced(GL_TRIANGLES, point_submesh.indices.size(), GL_UNSIGNED_INT, (void*)(u64)point_submesh.indexOffset, app->pointLightCount);
+
+        GLStateBindVertexArray(0);
+        GLStateUseProgram(0);
+        return;
+    }
 
     Program& program = app->programs[app->pointLightDrawProgramIdx];
-    glUseProgram(program.handle);
+    GLStateUseProgram(program.handle);
 
-    Mesh point_mesh = app->meshes[app->models[app->sphereIdx].meshIdx];
-    for (const Light& light : app->lights)
+    for (u32 lightIdx = 0; lightIdx < app->lights.size(); ++lightIdx)
     {
+        const Light& light = app->lights[lightIdx];
         if (light.type == 1) //Point Light
         {
             glUniform3f(glGetUniformLocation(program.handle, "lightColor"),
                 light.color.r, light.color.g, light.color.b);
-            glBindBufferRange(GL_UNIFORM_BUFFER, BINDING(1), app->lightsBuffer.handle, light.localParamsOffset, light.localParamsSize);
+            glBindBufferRange(GL_UNIFORM_BUFFER, BINDING(1), app->lightParams.buffer.handle, GetSlotOffset(app->lightParams, lightIdx), sizeof(glm::mat4));
            
             GLuint pointVao = FindVAO(point_mesh, 0, app->programs[app->pointLightDrawProgramIdx]);
-            glBindVertexArray(pointVao);
+            GLStateBindVertexArray(pointVao);
 
-            Submesh point_submesh = point_mesh.submeshes[0];
             glDrawElements(GL_TRIANGLES, point_submesh.indices.size(), GL_UNSIGNED_INT, (void*)(u64)point_submesh.indexOffset);
 
-            glBindVertexArray(0);
+            GLStateBindVertexArray(0);
         }
     }
-    glUseProgram(0);
+    GLStateUseProgram(0);
 }
 
 float CalcPointLightRadius(const Light& Light)
@@ -7,6 +7,14 @@
 #include "platform.h"
 #include "Camera.h"
 #include <glad/glad.h>
+#include "gl_extensions.h"
+#include "gl_state.h"
+#include "render_queue.h"
+#include "bvh.h"
+#include "clusters.h"
+#include "render_graph.h"
+#include "gpu_profiler.h"
+#include "scene_generator.h"
 
 typedef glm::vec2  vec2;
 typedef glm::vec3  vec3;
@@ -15,6 +23,8 @@ typedef glm::ivec2 ivec2;
 typedef glm::ivec3 ivec3;
 typedef glm::ivec4 ivec4;
 
+#define BUFFER_FRAMES_IN_FLIGHT 3
+
 struct Buffer
 {
     GLuint handle;
@@ -22,6 +32,54 @@ struct Buffer
     u32 size; 
     u32 head;
     void* data; //mapped data
+
+    // Persistent ring, one region per frame in flight
+    bool   persistent;
+    u32    regionSize;
+    u32    regionIdx;
+    GLsync regionFences[BUFFER_FRAMES_IN_FLIGHT];
+
+    // Stats
+    u32 bytesUsed;     // of the region (or the whole buffer) by the last unmap
+    u32 highWaterMark; // max bytesUsed
+};
+
+// Chain of uniform buffers that grows by one chunk every time the current one fills up
+struct UniformArena
+{
+    std::vector<Buffer> chunks;
+    u32 chunkIdx; // chunk currently being filled
+    u32 chunkSize;
+    u32 alignment;
+
+    // Stats
+    u32 frameBytesUsed;
+    u32 highWaterMark;
+};
+
+// Space reserved in a uniform arena, to be filled later through data
+struct UniformBlock
+{
+    GLuint buffer;
+    u32    offset;
+    u32    size;
+    u8*    data;
+};
+
+// Buffer with one fixed slot per element (entity, light...) for data that rarely changes.
+// Slots are written to a CPU copy and only the dirty ones are uploaded, through a staging arena.
+struct SlotBuffer
+{
+    Buffer buffer;
+    std::vector<u8> shadow;     // CPU copy of the whole buffer
+    std::vector<u8> dirtySlots; // one flag per slot (not bool, so threads can flag different slots)
+    u32 slotSize;
+    u32 slotStride;
+    u32 slotCount;
+
+    // Stats
+    u32 bytesUploaded; // by the last flush
+    u32 highWaterMark; // max bytesUploaded
 };
 
 struct Image
@@ -36,6 +94,13 @@ struct Texture
 {
     GLuint      handle;
     std::string filepath;
+    ivec2       size;
+    GLenum      internalFormat;
+
+    // Material textures
+    u64         bindlessHandle; // resident ARB_bindless_texture handle
+    u32         arrayIdx;       // texture array with the textures of the same size and format
+    u32         arrayLayer;
 };
 
 struct Material
@@ -90,13 +155,36 @@ struct Model
     std::vector<u32> materialIdx;
 };
 
+struct AABB
+{
+    vec3 min;
+    vec3 max;
+};
+
+struct BoundingSphere
+{
+    vec3 center;
+    f32  radius;
+};
+
 struct Submesh
 {
     VertexBufferLayout vertexBufferLayout;
     std::vector<float> vertices;
     std::vector<u32>   indices;
-    u32                vertexOffset;
-    u32                indexOffset;
+    u32                vertexOffset; // in vertexBufferHandle
+    u32                indexOffset;  // in indexBufferHandle
+
+    // Sub-allocation in the geometry pool, the buffers are the ones of its page
+    u32                geometryHandle;
+    u32                geometryPage;
+    u32                geometryLayoutIdx;
+    GLuint             vertexBufferHandle;
+    GLuint             indexBufferHandle;
+
+    // Object space bounds, computed at load time
+    AABB               aabb;
+    BoundingSphere     sphere;
 
     std::vector<Vao>   vaos;
 };
@@ -114,15 +202,123 @@ struct Light
     vec3 direction;
     vec3 position;
 
-    u32       localParamsOffset;
-    u32       localParamsSize;
+    bool dirty = true; // set it whenever any of the above changes
+    u32  listIdx = 0;  // index in the directional or point list of the lights storage buffer
+};
+
+// std430 layouts of the light lists
+struct DirectionalLightData
+{
+    vec3 direction;
+    f32  pad0;
+    vec3 color;
+    f32  pad1;
+};
+
+struct PointLightData
+{
+    vec3 position;
+    f32  radius;
+    vec3 color;
+    f32  pad0;
+};
+
+// std430 header of the light clusters buffer, followed by the (offset, count) of every cluster and the light indices
+struct LightClustersHeader
+{
+    vec2 tileSize;   // pixels
+    f32  depthScale; // slice = log(depth) * depthScale + depthBias
+    f32  depthBias;
+    f32  nearPlane;
+    f32  farPlane;   // the ranges follow, 8 byte aligned
 };
 
 struct Mesh
 {
     std::vector<Submesh> submeshes;
+
+    // Object space bounds of all the submeshes
+    AABB                 aabb;
+    BoundingSphere       sphere;
+};
+
+// Free range in a geometry page buffer
+struct GeometryBlock
+{
+    u32 offset;
+    u32 size;
+};
+
+// Vao of a whole geometry page, for the multi-draw path (the draws pick their vertices with the base vertex)
+struct GeometryPageVao
+{
+    GLuint handle;
+    GLuint programHandle;
+    u32    layoutIdx;
+};
+
+// Big vertex and index buffers that many submeshes are sub-allocated from
+struct GeometryPage
+{
     GLuint vertexBufferHandle;
     GLuint indexBufferHandle;
+    u32    vertexBufferSize;
+    u32    indexBufferSize;
+    std::vector<GeometryBlock>   freeVertexBlocks; // sorted by offset, neighbours always merged
+    std::vector<GeometryBlock>   freeIndexBlocks;
+    std::vector<GeometryPageVao> vaos;
+};
+
+// Vertex and index ranges of one submesh, both in the same page
+struct GeometryAllocation
+{
+    u32  page;
+    u32  vertexOffset;
+    u32  vertexSize;
+    u32  vertexAlignment; // the vertex stride, so the offset is a whole number of vertices
+    u32  indexOffset;
+    u32  indexSize;
+    bool used;
+};
+
+struct GeometryPool
+{
+    std::vector<GeometryPage>       pages;
+    std::vector<GeometryAllocation> allocations; // indexed by handle
+    std::vector<u32>                freeHandles;
+    std::vector<VertexBufferLayout> layouts;     // distinct vertex formats of the submeshes
+    u32 vertexPageSize;
+    u32 indexPageSize;
+
+    // Stats
+    u32 vertexBytesUsed;
+    u32 indexBytesUsed;
+};
+
+enum MaterialTexturesMode
+{
+    MaterialTextures_Bound,    // bound to units 0-2 before each draw
+    MaterialTextures_Bindless, // ARB_bindless_texture handles
+    MaterialTextures_Arrays    // layers of texture arrays grouped by size and format
+};
+
+// std430 entry of the material buffer: bindless handles, or (array << 16 | layer) for the texture arrays
+struct MaterialTexturesData
+{
+    u64 albedo;
+    u64 normal;
+    u64 bump;
+    u64 pad;
+};
+
+// Layout of the commands read by glMultiDrawElementsIndirect
+struct DrawElementsIndirectCommand
+{
+    u32 count;
+    u32 instanceCount;
+    u32 firstIndex;
+    i32 baseVertex;
+    u32 baseInstance;
 };
 
 struct Program
@@ -130,8 +326,25 @@ struct Program
     GLuint             handle;
     std::string        filepath;
     std::string        programName;
+    std::string        defines;
     VertexShaderLayout vertexInputLayout;
     u64                lastWriteTimestamp; // What is this for?
+
+    u32                transformTableProgramIdx = UINT32_MAX; // variant reading from the entity transform table
+    u32                materialTexturesProgramIdx = UINT32_MAX; // variant reading the textures from the material buffer
+    bool               discardsFragments = false; // its draws write their own depth, the depth pre-pass skips them
+    u32                compactGBufferProgramIdx = UINT32_MAX; // variant reading the compact G-buffer
+    GLint              materialIndexLocation = -1; // uMaterialIndex of the material textures variants
+    GLint              inverseViewProjectionLocation = -1; // uInverseViewProjectionMatrix of the compact G-buffer readers
+};
+
+// World space bounding spheres of the entities, as separate arrays for the SIMD culling kernel
+struct EntityBounds
+{
+    std::vector<f32> centerX;
+    std::vector<f32> centerY;
+    std::vector<f32> centerZ;
+    std::vector<f32> radius;
 };
 
 struct Entity
@@ -139,14 +352,22 @@ struct Entity
     glm::mat4 worldMatrix;
     u32       modelIndex;
     u32       programIdx;
-    u32       localParamsOffset;
-    u32       localParamsSize;
+    bool      dirty = true; // set it whenever worldMatrix changes
+};
+
+// Slot of an entity in the LocalParams (std140) and EntityTransforms (std430) blocks, both lay it out the same
+struct EntityLocalParams
+{
+    glm::mat4 worldMatrix;
+    vec4      normalMatrix[3]; // mat3 columns, padded to vec4
 };
 
 enum Mode
 {
     Mode_Forward,
     Mode_Deferred,
+    Mode_DeferredTiled,
+    Mode_ForwardClustered,
     Mode_Count
 };
 
@@ -159,6 +380,14 @@ enum RenderTarget
     RT_Final
 };
 
+// GPU timers of the opaque geometry
+enum OpaqueTimer
+{
+    OpaqueTimer_PrePass, // depth pre-pass (nothing when it is off)
+    OpaqueTimer_Main,    // geometry or forward pass
+    OpaqueTimer_Count
+};
+
 struct App
 {
     // Loop
@@ -180,6 +409,7 @@ struct App
 
     // Camera
     Camera camera = Camera({0.0f, 8.0f, -45.0f});
+    glm::mat4 viewMatrix, projectionMatrix; // of the current frame
 
     ivec2 displaySize;
 
@@ -202,6 +432,9 @@ struct App
     u32 gProgramNormalMappingIdx;
     u32 reliefMappingIdx;
     u32 nullGeometryIdx;
+    u32 tiledDeferredProgramIdx;
+    u32 deferredPointInstancedProgramIdx;
+    u32 pointLightDrawInstancedProgramIdx;
     
     // texture indices
     u32 diceTexIdx;
@@ -223,6 +456,7 @@ struct App
 
     // model primitives index
     u32 sphereIdx;
+    u32 lightVolumeIdx; //low poly icosphere for the point light volumes
     u32 quadIdx;
 
     // Mode
@@ -240,24 +474,150 @@ struct App
     GLuint depthProgramUniformTexture;
     GLuint gProgramUniformTexture;
 
+    // Dirty entities are written by all the worker threads
+    bool parallelEntityUpdate = true;
+
+    // Entity world matrices, one LocalParams block per entity
+    SlotBuffer entityParams;
+
+    // Dirty slots of the slot buffers, copied from here into them on the GPU
+    UniformArena slotStaging;
+
+    // Entity transform table (SSBO indexed by entity, alternative to one LocalParams block per entity)
+    bool   useTransformTable = false;
+    bool   transformTableSupported;
+    SlotBuffer transformTable;
+    GLint  storageBufferAlignment;
+    GLuint entityIndexBufferHandle; //per-instance attribute with values 0..N-1, picked with the draw's base instance
+    u32    entityIndexBufferCount;
+
+    // Entities inside the camera frustum, the only ones pushed to the render queue
+    bool   useFrustumCulling = true;
+    bool   useBvhCulling = true; // through the entity BVH instead of testing every entity
+    EntityBounds entityBounds;
+    std::vector<u8>  entityBoundsDirty; // spheres moved since the last BVH refit
+    std::vector<u32> visibleEntities;
+
+    // Spatial index of the entity spheres (culling, light and picking queries)
+    Bvh    entityBvh;
+    u32    pickedEntity = UINT32_MAX;
+
+    // Submesh draws of the scene pass (forward or geometry) sorted by state
+    RenderQueue renderQueue;
+
+    // Vertices and indices of every mesh, sub-allocated from a few big buffers
+    GeometryPool geometryPool;
+
+    // Material textures picked in the shader from the material buffer, so there are no texture binds between draws
+    MaterialTexturesMode materialTexturesMode; // bindless when supported, otherwise texture arrays
+    bool   useMaterialTextures = true;
+    GLuint materialsBufferHandle;
+    u32    materialsBufferCount;         // materials written to it
+    u32    materialTexturesTextureCount; // textures made resident or copied to the arrays
+    std::vector<GLuint> textureArrays;
+
+    // Submission of the scene passes with glMultiDrawElementsIndirect
+    bool   useMultiDrawIndirect = false;
+    Buffer indirectCommands;
+
+    // Hi-Z occlusion culling of the geometry pass draws (deferred modes, with multi-draw indirect)
+    bool   useOcclusionCulling = false;
+    GLuint hiZTextureHandle;           // max depth pyramid (R32F) of the G-buffer depth, a persistent render graph texture
+    u32    hiZLevelCount;
+    bool   hiZValid;                   // it holds the depth of a previous frame
+    u32    hiZBuildProgramIdx;
+    u32    occlusionCullingProgramIdx;
+    GLuint occlusionStatsBufferHandle; // counters written by the culling passes, GPU only
+    GLuint occlusionStatsReadbackHandle; // one copy of the counters per frame in flight
+    void*  occlusionStatsReadbackData; // persistently mapped, NULL without ARB_buffer_storage
+    GLsync occlusionStatsFences[BUFFER_FRAMES_IN_FLIGHT];
+    u32    occlusionStatsSlot;
+    u32    occlusionVisibleDraws[2];   // by phase, read back once the GPU is done with them
+
+    // Depth-only pass of the opaque draws before the geometry / forward pass, which then runs with
+    // GL_LEQUAL and only shades the visible fragments
+    bool   useDepthPrePass = false;
+    u32    depthPrePassProgramIdx;
+    u32    reliefMappingEarlyDepthIdx; // relief mapping with early fragment tests, after the pre-pass
+    GLuint opaqueTimerQueries[2][OpaqueTimer_Count]; // GL_TIME_ELAPSED, by frame parity
+    bool   opaqueTimersPending[2];
+    bool   opaqueTimersPrePass[2];     // whether the pre-pass was on when they were issued
+    u32    opaqueTimersFrame;
+    f32    opaqueTimes[OpaqueTimer_Count]; // ms, read back one frame late
+    f32    opaqueTotalTimes[2];        // ms of the whole opaque geometry, last measured without / with the pre-pass
+
+    // G-buffer without the position target (rebuilt from the depth), with octahedral normals in RG16
+    // and the final target in R11G11B10F
+    bool   useCompactGBuffer = false;
+    u32    gBufferViewProgramIdx;      // position and normals debug views of both layouts
+    GLuint lightPassTimerQueries[2];   // GL_TIME_ELAPSED, by frame parity like the opaque timers
+    bool   lightPassTimersPending[2];
+    bool   lightPassTimersCompact[2];  // the layout when they were issued
+    f32    lightPassTime;              // ms, read back one frame late
+    f32    gBufferFrameTimes[2];       // ms of the opaque passes plus the light pass, last measured with the full / compact layout
+
+    // Light volume world matrices, one LocalParams block per light
+    SlotBuffer lightParams;
+
+    // All the point light volumes in one instanced draw (needs storage buffers on the vertex stage)
+    bool   instancedLightVolumes = true;
+    bool   instancedLightVolumesSupported;
+    Buffer pointLightInstances; // persistent ring, point list index of each instance (only the lights touching an entity)
+    u32    pointLightInstanceCount;
+    GLuint pointLightInstancesOffset, pointLightInstancesSize;
+
+    // Directional and point light lists (persistent ring, only moves to the next region when a light changes)
+    Buffer lightsStorage;
+    u32    directionalLightCount;
+    u32    pointLightCount;
+    GLuint directionalLightsOffset, directionalLightsSize;
+    GLuint pointLightsOffset, pointLightsSize;
+
+    // Point lights per cluster of the view frustum for the clustered forward mode, assigned on the CPU every frame
+    u32           texturedGeometryClusteredProgramIdx;
+    ClusterLights clusterLights; // view space
+    LightClusters lightClusters;
+    Buffer        lightClustersStorage; // persistent ring
+    GLuint        lightClustersOffset, lightClustersSize;
+
     // Uniform buffer
-    Buffer cbuffer, lightsBuffer;
     GLint maxUniformBufferSize, uniformBufferAlignment;
 
+    Buffer globalParams; //persistent ring, only moves to the next region when the camera or the light counts change
     GLuint globalParamsOffset; //offset for global params in uniform buffer
     GLuint globalParamsSize; //size of global params in uniform buffer
+    glm::mat4 globalParamsViewProjection; //camera the current global params were written with
+    glm::mat4 globalParamsInverseViewProjection; //rebuilds the positions from the compact G-buffer depth
+    vec3      globalParamsCameraPosition;
+
+    // Stats
+    u32 frameUploadBytes;
+    u32 frameFullUploadBytes; // what the frame would upload rewriting every slot, light list and the global params
 
     // VAO object to link our screen filling quad with our textured quad shader
     GLuint vao;
 
-    //Framebuffer object stuff
+    //Render targets of the deferred passes, given by the render graph (0 while no pass uses them)
     GLuint positionAttachmentHandle;
     GLuint diffuseAttachmentHandle;
     GLuint normalsAttachmentHandle;
     GLuint depthAttachmentHandle;
+    GLuint depthCopyHandle; // sampled by the light volume passes, which have the depth stencil attached
     GLuint finalAttachmentHandle;
 
-    GLuint framebufferHandle;
+    //Where the output passes draw: the default framebuffer (0) or, without a window, an offscreen one
+    GLuint backbufferFramebufferHandle;
+    GLuint backbufferTextureHandle;
+    GLuint backbufferDepthStencilHandle;
+
+    // Passes of the frame and the render targets they use
+    RenderGraph renderGraph;
+
+    // GPU time of the passes
+    GpuProfiler gpuProfiler;
+
+    // Procedural scene built by Init instead of the default one when enabled
+    SceneGeneratorConfig sceneConfig;
 };
 
 void Init(App* app);
@@ -268,13 +628,29 @@ void Update(App* app);
 
 void Render(App* app);
 
+/**
+ * Creates a displaySize framebuffer (RGBA8 color, depth stencil) the output passes draw into instead of
+ * the default one, for a context without a window (see headless_context.h). Returns false if it's incomplete.
+ */
+bool InitOffscreenBackbuffer(App* app);
+
+void DestroyOffscreenBackbuffer(App* app);
+
 void OnGlError(GLenum source, GLenum type, GLuint id, GLenum severity, GLsizei length, const GLchar* message, const void* userParan);
 
-void CreateFrameBufferObjects(App* app);
 
 u32 LoadTexture2D(App* app, const char* filepath);
 
+/**
+ * Writes the EntityLocalParams of the dirty entities in [begin, end) to their slot (slots + i * slotStride):
+ * the world matrix and the normal matrix computed from it. Flags the slot in dirtySlots and clears the
+ * entity's dirty flag. Entities write disjoint ranges, so several threads can run it at the same time
+ * over different ranges.
+ */
+void WriteEntityLocalParams(Entity* entities, u32 begin, u32 end, u8* slots, u32 slotStride, u8* dirtySlots);
+
 glm::mat4 TransformScale(const vec3& scaleFactors);
 glm::mat4 TransformPositionScale(const vec3 &pos, const vec3& scaleFactors);
+glm::mat4 TransformRotation(const glm::mat4& matrix, float angle, vec3 axis);
 
 
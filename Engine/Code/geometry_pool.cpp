@@ -0,0 +1,326 @@
+#include "geometry_pool.h"
+#include "gl_state.h"
+#include <algorithm>
+
+// Like Align but for any alignment (vertex strides are not powers of 2)
+static u32 AlignUp(u32 value, u32 alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+// First fit. Returns false if no block has room, otherwise the padding before the
+// aligned offset and the remainder after the range are kept as free blocks
+static bool AllocBlock(std::vector<GeometryBlock>& freeBlocks, u32 size, u32 alignment, u32& offset)
+{
+    for (u32 i = 0; i < freeBlocks.size(); ++i)
+    {
+        GeometryBlock block = freeBlocks[i];
+        u32 alignedOffset = AlignUp(block.offset, alignment);
+        if (alignedOffset + size > block.offset + block.size)
+            continue;
+
+        freeBlocks.erase(freeBlocks.begin() + i);
+
+        u32 tail = block.offset + block.size - (alignedOffset + size);
+        if (tail > 0)
+            freeBlocks.insert(freeBlocks.begin() + i, GeometryBlock{ alignedOffset + size, tail });
+        if (alignedOffset > block.offset)
+            freeBlocks.insert(freeBlocks.begin() + i, GeometryBlock{ block.offset, alignedOffset - block.offset });
+
+        offset = alignedOffset;
+        return true;
+    }
+    return false;
+}
+
+static void FreeBlock(std::vector<GeometryBlock>& freeBlocks, u32 offset, u32 size)
+{
+    if (size == 0)
+        return;
+
+    u32 i = 0;
+    while (i < freeBlocks.size() && freeBlocks[i].offset < offset)
+        i++;
+    freeBlocks.insert(freeBlocks.begin() + i, GeometryBlock{ offset, size });
+
+    // Merge with the next and the previous blocks
+    if (i + 1 < freeBlocks.size() && freeBlocks[i].offset + freeBlocks[i].size == freeBlocks[i + 1].offset)
+    {
+        freeBlocks[i].size += freeBlocks[i + 1].size;
+        freeBlocks.erase(freeBlocks.begin() + i + 1);
+    }
+    if (i > 0 && freeBlocks[i - 1].offset + freeBlocks[i - 1].size == freeBlocks[i].offset)
+    {
+        freeBlocks[i - 1].size += freeBlocks[i].size;
+        freeBlocks.erase(freeBlocks.begin() + i);
+    }
+}
+
+static GLuint CreatePageBuffer(GLenum type, u32 size)
+{
+    GLuint handle;
+    glGenBuffers(1, &handle);
+    glBindBuffer(type, handle);
+    glBufferData(type, size, NULL, GL_STATIC_DRAW);
+    glBindBuffer(type, 0);
+    return handle;
+}
+
+static void DeletePageVaos(GeometryPage& page)
+{
+    for (const GeometryPageVao& vao : page.vaos)
+        GLStateDeleteVertexArrays(1, &vao.handle);
+    page.vaos.clear();
+}
+
+static u32 AddGeometryPage(GeometryPool& pool, u32 vertexBufferSize, u32 indexBufferSize)
+{
+    GeometryPage page = {};
+    page.vertexBufferSize = vertexBufferSize;
+    page.indexBufferSize = indexBufferSize;
+    page.vertexBufferHandle = CreatePageBuffer(GL_ARRAY_BUFFER, vertexBufferSize);
+    page.indexBufferHandle = CreatePageBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBufferSize);
+    page.freeVertexBlocks.push_back(GeometryBlock{ 0, vertexBufferSize });
+    page.freeIndexBlocks.push_back(GeometryBlock{ 0, indexBufferSize });
+
+    pool.pages.push_back(page);
+    return pool.pages.size() - 1;
+}
+
+GeometryPool CreateGeometryPool(u32 vertexPageSize, u32 indexPageSize)
+{
+    GeometryPool pool = {};
+    pool.vertexPageSize = vertexPageSize;
+    pool.indexPageSize = indexPageSize;
+    return pool;
+}
+
+void DestroyGeometryPool(GeometryPool& pool)
+{
+    for (GeometryPage& page : pool.pages)
+    {
+        DeletePageVaos(page);
+        glDeleteBuffers(1, &page.vertexBufferHandle);
+        glDeleteBuffers(1, &page.indexBufferHandle);
+    }
+    pool = {};
+}
+
+u32 AllocGeometry(GeometryPool& pool, u32 vertexSize, u32 vertexAlignment, u32 indexSize)
+{
+    GeometryAllocation allocation = {};
+    allocation.vertexSize = vertexSize;
+    allocation.vertexAlignment = vertexAlignment;
+    allocation.indexSize = indexSize;
+    allocation.used = true;
+
+    bool allocated = false;
+    for (u32 pageIdx = 0; pageIdx <= pool.pages.size() && !allocated; ++pageIdx)
+    {
+        // None of the pages had room: a new one, bigger than usual if the mesh does not fit
+        if (pageIdx == pool.pages.size())
+            AddGeometryPage(pool, glm::max(pool.vertexPageSize, vertexSize + vertexAlignment), glm::max(pool.indexPageSize, indexSize));
+
+        GeometryPage& page = pool.pages[pageIdx];
+        if (!AllocBlock(page.freeVertexBlocks, vertexSize, vertexAlignment, allocation.vertexOffset))
+            continue;
+        if (!AllocBlock(page.freeIndexBlocks, indexSize, sizeof(u32), allocation.indexOffset))
+        {
+            FreeBlock(page.freeVertexBlocks, allocation.vertexOffset, vertexSize);
+            continue;
+        }
+
+        allocation.page = pageIdx;
+        allocated = true;
+    }
+    ASSERT(allocated, "A new geometry page must always have room for the allocation");
+
+    pool.vertexBytesUsed += vertexSize;
+    pool.indexBytesUsed += indexSize;
+
+    u32 handle;
+    if (!pool.freeHandles.empty())
+    {
+        handle = pool.freeHandles.back();
+        pool.freeHandles.pop_back();
+        pool.allocations[handle] = allocation;
+    }
+    else
+    {
+        handle = pool.allocations.size();
+        pool.allocations.push_back(allocation);
+    }
+    return handle;
+}
+
+void FreeGeometry(GeometryPool& pool, u32 handle)
+{
+    GeometryAllocation& allocation = pool.allocations[handle];
+    ASSERT(allocation.used, "Geometry allocation freed twice");
+
+    GeometryPage& page = pool.pages[allocation.page];
+    FreeBlock(page.freeVertexBlocks, allocation.vertexOffset, allocation.vertexSize);
+    FreeBlock(page.freeIndexBlocks, allocation.indexOffset, allocation.indexSize);
+
+    pool.vertexBytesUsed -= allocation.vertexSize;
+    pool.indexBytesUsed -= allocation.indexSize;
+
+    allocation.used = false;
+    pool.freeHandles.push_back(handle);
+}
+
+static bool SameVertexLayout(const VertexBufferLayout& a, const VertexBufferLayout& b)
+{
+    if (a.stride != b.stride || a.attributes.size() != b.attributes.size())
+        return false;
+
+    for (u32 i = 0; i < a.attributes.size(); ++i)
+    {
+        if (a.attributes[i].location != b.attributes[i].location ||
+            a.attributes[i].componentCount != b.attributes[i].componentCount ||
+            a.attributes[i].offset != b.attributes[i].offset)
+            return false;
+    }
+    return true;
+}
+
+u32 RegisterVertexLayout(GeometryPool& pool, const VertexBufferLayout& layout)
+{
+    for (u32 i = 0; i < pool.layouts.size(); ++i)
+        if (SameVertexLayout(pool.layouts[i], layout))
+            return i;
+
+    pool.layouts.push_back(layout);
+    return pool.layouts.size() - 1;
+}
+
+void UploadMeshGeometry(GeometryPool& pool, Mesh& mesh)
+{
+    for (Submesh& submesh : mesh.submeshes)
+    {
+        const u32 verticesSize = submesh.vertices.size() * sizeof(float);
+        const u32 indicesSize = submesh.indices.size() * sizeof(u32);
+
+        submesh.geometryHandle = AllocGeometry(pool, verticesSize, submesh.vertexBufferLayout.stride, indicesSize);
+        submesh.geometryLayoutIdx = RegisterVertexLayout(pool, submesh.vertexBufferLayout);
+        RefreshSubmeshGeometry(pool, submesh);
+
+        glBindBuffer(GL_ARRAY_BUFFER, submesh.vertexBufferHandle);
+        glBufferSubData(GL_ARRAY_BUFFER, submesh.vertexOffset, verticesSize, submesh.vertices.data());
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, submesh.indexBufferHandle);
+        glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, submesh.indexOffset, indicesSize, submesh.indices.data());
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    }
+}
+
+void FreeMeshGeometry(GeometryPool& pool, Mesh& mesh)
+{
+    for (Submesh& submesh : mesh.submeshes)
+    {
+        for (const Vao& vao : submesh.vaos)
+            GLStateDeleteVertexArrays(1, &vao.handle);
+        submesh.vaos.clear();
+
+        FreeGeometry(pool, submesh.geometryHandle);
+    }
+}
+
+// Copies the given ranges one after the other to a new buffer, each one at its alignment.
+// The new offsets are written back through the pointers
+static GLuint CompactPageBuffer(GLuint oldBuffer, u32 bufferSize, std::vector<u32*>& offsets, const std::vector<u32>& sizes, const std::vector<u32>& alignments, std::vector<GeometryBlock>& freeBlocks)
+{
+    GLuint newBuffer = CreatePageBuffer(GL_COPY_WRITE_BUFFER, bufferSize);
+    glBindBuffer(GL_COPY_READ_BUFFER, oldBuffer);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, newBuffer);
+
+    u32 head = 0;
+    freeBlocks.clear();
+    for (u32 i = 0; i < offsets.size(); ++i)
+    {
+        u32 newOffset = AlignUp(head, alignments[i]);
+        if (newOffset > head)
+            freeBlocks.push_back(GeometryBlock{ head, newOffset - head });
+        if (sizes[i] > 0)
+            glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, *offsets[i], newOffset, sizes[i]);
+        *offsets[i] = newOffset;
+        head = newOffset + sizes[i];
+    }
+    if (head < bufferSize)
+        freeBlocks.push_back(GeometryBlock{ head, bufferSize - head });
+
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    glDeleteBuffers(1, &oldBuffer);
+
+    return newBuffer;
+}
+
+bool DefragmentGeometryPool(GeometryPool& pool)
+{
+    bool moved = false;
+
+    for (u32 pageIdx = 0; pageIdx < pool.pages.size(); ++pageIdx)
+    {
+        GeometryPage& page = pool.pages[pageIdx];
+
+        // Only a single free block at the end: nothing to pack
+        if (page.freeVertexBlocks.size() <= 1 && page.freeIndexBlocks.size() <= 1)
+            continue;
+
+        std::vector<GeometryAllocation*> live;
+        for (GeometryAllocation& allocation : pool.allocations)
+            if (allocation.used && allocation.page == pageIdx)
+                live.push_back(&allocation);
+
+        // Same order as in the buffers so every range moves towards the start
+        std::vector<u32*> offsets;
+        std::vector<u32>  sizes, alignments;
+
+        std::sort(live.begin(), live.end(), [](const GeometryAllocation* a, const GeometryAllocation* b) { return a->vertexOffset < b->vertexOffset; });
+        for (GeometryAllocation* allocation : live) {
+            offsets.push_back(&allocation->vertexOffset);
+            sizes.push_back(allocation->vertexSize);
+            alignments.push_back(allocation->vertexAlignment);
+        }
+        page.vertexBufferHandle = CompactPageBuffer(page.vertexBufferHandle, page.vertexBufferSize, offsets, sizes, alignments, page.freeVertexBlocks);
+
+        offsets.clear(); sizes.clear(); alignments.clear();
+        std::sort(live.begin(), live.end(), [](const GeometryAllocation* a, const GeometryAllocation* b) { return a->indexOffset < b->indexOffset; });
+        for (GeometryAllocation* allocation : live) {
+            offsets.push_back(&allocation->indexOffset);
+            sizes.push_back(allocation->indexSize);
+            alignments.push_back(sizeof(u32));
+        }
+        page.indexBufferHandle = CompactPageBuffer(page.indexBufferHandle, page.indexBufferSize, offsets, sizes, alignments, page.freeIndexBlocks);
+
+        DeletePageVaos(page);
+        moved = true;
+    }
+
+    return moved;
+}
+
+void RefreshSubmeshGeometry(const GeometryPool& pool, Submesh& submesh)
+{
+    const GeometryAllocation& allocation = pool.allocations[submesh.geometryHandle];
+    const GeometryPage& page = pool.pages[allocation.page];
+
+    bool changed = submesh.vertexBufferHandle != page.vertexBufferHandle || submesh.indexBufferHandle != page.indexBufferHandle ||
+        submesh.vertexOffset != allocation.vertexOffset || submesh.indexOffset != allocation.indexOffset;
+
+    submesh.geometryPage = allocation.page;
+    submesh.vertexBufferHandle = page.vertexBufferHandle;
+    submesh.indexBufferHandle = page.indexBufferHandle;
+    submesh.vertexOffset = allocation.vertexOffset;
+    submesh.indexOffset = allocation.indexOffset;
+
+    // The vaos have the old buffers and offsets baked in
+    if (changed)
+    {
+        for (const Vao& vao : submesh.vaos)
+            GLStateDeleteVertexArrays(1, &vao.handle);
+        submesh.vaos.clear();
+    }
+}
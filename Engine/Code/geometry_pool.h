@@ -0,0 +1,39 @@
+//
+// geometry_pool.h: Vertices and indices of all the meshes, sub-allocated from a few big
+// buffers (pages) with a first-fit free list, instead of a pair of buffers per mesh.
+//
+
+#pragma once
+
+#include "engine.h"
+
+#define GEOMETRY_VERTEX_PAGE_SIZE MB(32)
+#define GEOMETRY_INDEX_PAGE_SIZE  MB(8)
+
+GeometryPool CreateGeometryPool(u32 vertexPageSize, u32 indexPageSize);
+void DestroyGeometryPool(GeometryPool& pool);
+
+/**
+ * Reserves a vertex range (its offset a multiple of vertexAlignment) and an index range in the
+ * same page, adding a new page when none has room. Returns the handle of the allocation: its
+ * offsets may change after a defragmentation, so they are always read through the handle.
+ */
+u32 AllocGeometry(GeometryPool& pool, u32 vertexSize, u32 vertexAlignment, u32 indexSize);
+void FreeGeometry(GeometryPool& pool, u32 handle);
+
+// Returns the index of the layout in the pool, adding it the first time it is seen
+u32 RegisterVertexLayout(GeometryPool& pool, const VertexBufferLayout& layout);
+
+// Allocates and uploads every submesh of the mesh, and fills their buffers and offsets
+void UploadMeshGeometry(GeometryPool& pool, Mesh& mesh);
+void FreeMeshGeometry(GeometryPool& pool, Mesh& mesh);
+
+/**
+ * Packs the allocations of the fragmented pages at the start of new buffers (the data is copied
+ * on the GPU). Returns true if anything moved: then RefreshSubmeshGeometry has to be called on
+ * every submesh, and all the vaos pointing to the old buffers are gone.
+ */
+bool DefragmentGeometryPool(GeometryPool& pool);
+
+// Reads the buffers and offsets of the submesh again from its allocation, and drops its vaos if they moved
+void RefreshSubmeshGeometry(const GeometryPool& pool, Submesh& submesh);
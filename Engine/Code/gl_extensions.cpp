@@ -0,0 +1,40 @@
+#include "gl_extensions.h"
+#include <string.h>
+
+PFNGLBUFFERSTORAGEPROC glad_glBufferStorage = NULL;
+PFNGLGETTEXTUREHANDLEARBPROC glad_glGetTextureHandleARB = NULL;
+PFNGLMAKETEXTUREHANDLERESIDENTARBPROC glad_glMakeTextureHandleResidentARB = NULL;
+PFNGLMAKETEXTUREHANDLENONRESIDENTARBPROC glad_glMakeTextureHandleNonResidentARB = NULL;
+
+GLExtensions GLExt = {};
+
+bool IsGLExtensionSupported(const char* name)
+{
+    GLint extensionCount = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &extensionCount);
+    for (GLint i = 0; i < extensionCount; ++i)
+    {
+        const char* extension = (const char*)glGetStringi(GL_EXTENSIONS, i);
+        if (strcmp(extension, name) == 0)
+            return true;
+    }
+    return false;
+}
+
+void LoadGLExtensions(GLADloadproc load)
+{
+    bool isGL44 = GLVersion.major > 4 || (GLVersion.major == 4 && GLVersion.minor >= 4);
+
+    if (isGL44 || IsGLExtensionSupported("GL_ARB_buffer_storage"))
+        glad_glBufferStorage = (PFNGLBUFFERSTORAGEPROC)load("glBufferStorage");
+    GLExt.bufferStorage = glad_glBufferStorage != NULL;
+
+    // Not core in any version
+    if (IsGLExtensionSupported("GL_ARB_bindless_texture"))
+    {
+        glad_glGetTextureHandleARB = (PFNGLGETTEXTUREHANDLEARBPROC)load("glGetTextureHandleARB");
+        glad_glMakeTextureHandleResidentARB = (PFNGLMAKETEXTUREHANDLERESIDENTARBPROC)load("glMakeTextureHandleResidentARB");
+        glad_glMakeTextureHandleNonResidentARB = (PFNGLMAKETEXTUREHANDLENONRESIDENTARBPROC)load("glMakeTextureHandleNonResidentARB");
+    }
+    GLExt.bindlessTexture = glad_glGetTextureHandleARB && glad_glMakeTextureHandleResidentARB && glad_glMakeTextureHandleNonResidentARB;
+}
@@ -0,0 +1,188 @@
+#include "gl_state.h"
+
+#define GL_STATE_UNKNOWN UINT32_MAX
+
+const char* GLStateCallNames[GLStateCall_Count] = {
+    "glUseProgram", "glBindVertexArray", "glActiveTexture", "glBindTexture", "glEnable/glDisable", "glBindFramebuffer", "glDrawBuffer(s)"
+};
+
+static const GLenum TrackedCapabilities[] = { GL_BLEND, GL_CULL_FACE, GL_DEPTH_TEST, GL_STENCIL_TEST };
+
+struct GLState
+{
+    // GL_STATE_UNKNOWN until set through the wrappers
+    GLuint program;
+    GLuint vertexArray;
+    GLenum activeTexture;                          // unit index, not GL_TEXTUREi
+    GLuint textures2D[GL_STATE_TEXTURE_UNITS];
+    u32    capabilities[ARRAY_COUNT(TrackedCapabilities)];
+    GLuint drawFramebuffer, readFramebuffer;
+    GLenum drawBuffer;                             // of the bound draw framebuffer
+
+    GLStateCounters frame;
+    GLStateCounters lastFrame;
+};
+
+GLState GlobalGLState;
+
+// Counts the call and returns whether it has to reach GL
+static bool ChangeGLState(u32& current, u32 value, GLStateCall call)
+{
+    if (current == value)
+    {
+        GlobalGLState.frame.skipped[call]++;
+        return false;
+    }
+    current = value;
+    GlobalGLState.frame.issued[call]++;
+    return true;
+}
+
+void ResetGLState()
+{
+    GLState& state = GlobalGLState;
+    state.program = GL_STATE_UNKNOWN;
+    state.vertexArray = GL_STATE_UNKNOWN;
+    state.activeTexture = GL_STATE_UNKNOWN;
+    for (GLuint& texture : state.textures2D)
+        texture = GL_STATE_UNKNOWN;
+    for (u32& enabled : state.capabilities)
+        enabled = GL_STATE_UNKNOWN;
+    state.drawFramebuffer = GL_STATE_UNKNOWN;
+    state.readFramebuffer = GL_STATE_UNKNOWN;
+    state.drawBuffer = GL_STATE_UNKNOWN;
+}
+
+void BeginGLStateFrame()
+{
+    GlobalGLState.lastFrame = GlobalGLState.frame;
+    GlobalGLState.frame = {};
+    ResetGLState();
+}
+
+const GLStateCounters& GetLastFrameGLStateCounters()
+{
+    return GlobalGLState.lastFrame;
+}
+
+void GLStateUseProgram(GLuint program)
+{
+    if (ChangeGLState(GlobalGLState.program, program, GLStateCall_UseProgram))
+        glUseProgram(program);
+}
+
+void GLStateBindVertexArray(GLuint vertexArray)
+{
+    if (ChangeGLState(GlobalGLState.vertexArray, vertexArray, GLStateCall_BindVertexArray))
+        glBindVertexArray(vertexArray);
+}
+
+void GLStateActiveTexture(GLenum unit)
+{
+    if (ChangeGLState(GlobalGLState.activeTexture, unit - GL_TEXTURE0, GLStateCall_ActiveTexture))
+        glActiveTexture(unit);
+}
+
+void GLStateBindTexture(GLenum target, GLuint texture)
+{
+    GLState& state = GlobalGLState;
+    if (target != GL_TEXTURE_2D || state.activeTexture >= GL_STATE_TEXTURE_UNITS)
+    {
+        state.frame.issued[GLStateCall_BindTexture]++;
+        glBindTexture(target, texture);
+        return;
+    }
+
+    if (ChangeGLState(state.textures2D[state.activeTexture], texture, GLStateCall_BindTexture))
+        glBindTexture(target, texture);
+}
+
+static u32* FindCapability(GLenum capability)
+{
+    for (u32 i = 0; i < ARRAY_COUNT(TrackedCapabilities); ++i)
+        if (TrackedCapabilities[i] == capability)
+            return &GlobalGLState.capabilities[i];
+    return NULL;
+}
+
+void GLStateEnable(GLenum capability)
+{
+    u32* enabled = FindCapability(capability);
+    if (!enabled)
+    {
+        GlobalGLState.frame.issued[GLStateCall_EnableDisable]++;
+        glEnable(capability);
+        return;
+    }
+
+    if (ChangeGLState(*enabled, 1, GLStateCall_EnableDisable))
+        glEnable(capability);
+}
+
+void GLStateDisable(GLenum capability)
+{
+    u32* enabled = FindCapability(capability);
+    if (!enabled)
+    {
+        GlobalGLState.frame.issued[GLStateCall_EnableDisable]++;
+        glDisable(capability);
+        return;
+    }
+
+    if (ChangeGLState(*enabled, 0, GLStateCall_EnableDisable))
+        glDisable(capability);
+}
+
+void GLStateBindFramebuffer(GLenum target, GLuint framebuffer)
+{
+    GLState& state = GlobalGLState;
+    bool draw = target == GL_FRAMEBUFFER || target == GL_DRAW_FRAMEBUFFER;
+    bool read = target == GL_FRAMEBUFFER || target == GL_READ_FRAMEBUFFER;
+
+    if ((!draw || state.drawFramebuffer == framebuffer) && (!read || state.readFramebuffer == framebuffer))
+    {
+        state.frame.skipped[GLStateCall_BindFramebuffer]++;
+        return;
+    }
+
+    state.frame.issued[GLStateCall_BindFramebuffer]++;
+    glBindFramebuffer(target, framebuffer);
+    if (read)
+        state.readFramebuffer = framebuffer;
+    if (draw && state.drawFramebuffer != framebuffer)
+    {
+        //The draw buffers are state of each framebuffer
+        state.drawFramebuffer = framebuffer;
+        state.drawBuffer = GL_STATE_UNKNOWN;
+    }
+}
+
+void GLStateDrawBuffer(GLenum buffer)
+{
+    if (ChangeGLState(GlobalGLState.drawBuffer, buffer, GLStateCall_DrawBuffer))
+        glDrawBuffer(buffer);
+}
+
+void GLStateDrawBuffers(GLsizei count, const GLenum* buffers)
+{
+    GlobalGLState.frame.issued[GLStateCall_DrawBuffer]++;
+    GlobalGLState.drawBuffer = count == 1 ? buffers[0] : GL_STATE_UNKNOWN;
+    glDrawBuffers(count, buffers);
+}
+
+void GLStateDeleteTextures(GLsizei count, const GLuint* textures)
+{
+    for (GLsizei i = 0; i < count; ++i)
+        for (GLuint& texture : GlobalGLState.textures2D)
+            if (texture == textures[i])
+                texture = 0;
+    glDeleteTextures(count, textures);
+}
+
+void GLStateDeleteVertexArrays(GLsizei count, const GLuint* vertexArrays)
+{
+    for (GLsizei i = 0; i < count; ++i)
+        if (GlobalGLState.vertexArray == vertexArrays[i])
+            GlobalGLState.vertexArray = 0;
+    glDeleteVertexArrays(count, vertexArrays);
+}
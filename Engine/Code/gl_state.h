@@ -0,0 +1,59 @@
+//
+// gl_state.h: Shadow copy of the GL state the passes keep switching (program, vertex array,
+// texture units, blend/cull/depth/stencil tests, framebuffer and draw buffer). The wrappers
+// only call GL when the value changes and count the calls issued and skipped every frame.
+// Anything else that changes this state (e.g. the ImGui renderer) must be followed by
+// ResetGLState, so the engine code goes through the wrappers only.
+//
+
+#pragma once
+
+#include "platform.h"
+#include <glad/glad.h>
+
+#define GL_STATE_TEXTURE_UNITS 32 // units whose GL_TEXTURE_2D binding is tracked
+
+enum GLStateCall
+{
+    GLStateCall_UseProgram,
+    GLStateCall_BindVertexArray,
+    GLStateCall_ActiveTexture,
+    GLStateCall_BindTexture,
+    GLStateCall_EnableDisable,
+    GLStateCall_BindFramebuffer,
+    GLStateCall_DrawBuffer,
+    GLStateCall_Count
+};
+
+struct GLStateCounters
+{
+    u32 issued[GLStateCall_Count];
+    u32 skipped[GLStateCall_Count];
+};
+
+extern const char* GLStateCallNames[GLStateCall_Count];
+
+/**
+ * Forgets the shadow state, so the next call of each wrapper reaches GL, and starts counting a
+ * new frame. The counters of the frame that ends are kept for GetLastFrameGLStateCounters.
+ */
+void BeginGLStateFrame();
+
+// Forgets the shadow state without touching the counters
+void ResetGLState();
+
+const GLStateCounters& GetLastFrameGLStateCounters();
+
+void GLStateUseProgram(GLuint program);
+void GLStateBindVertexArray(GLuint vertexArray);
+void GLStateActiveTexture(GLenum unit);
+void GLStateBindTexture(GLenum target, GLuint texture); // only GL_TEXTURE_2D is tracked, the rest always reaches GL
+void GLStateEnable(GLenum capability);                  // GL_BLEND, GL_CULL_FACE, GL_DEPTH_TEST and GL_STENCIL_TEST are tracked
+void GLStateDisable(GLenum capability);
+void GLStateBindFramebuffer(GLenum target, GLuint framebuffer);
+void GLStateDrawBuffer(GLenum buffer);
+void GLStateDrawBuffers(GLsizei count, const GLenum* buffers); // always reaches GL
+
+// Deleting unbinds them, these keep the shadow state in sync
+void GLStateDeleteTextures(GLsizei count, const GLuint* textures);
+void GLStateDeleteVertexArrays(GLsizei count, const GLuint* vertexArrays);
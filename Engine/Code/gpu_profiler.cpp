@@ -0,0 +1,186 @@
+#include "gpu_profiler.h"
+#include <string.h>
+
+#define GPU_PROFILER_QUERY_CHUNK 64
+
+static bool IsFrameAvailable(const GpuProfilerFrame& frame)
+{
+    //Timestamps complete in order, so the end of the root zone comes last
+    GLint available = 0;
+    glGetQueryObjectiv(frame.queries[frame.zones[0].endQuery], GL_QUERY_RESULT_AVAILABLE, &available);
+    return available != 0;
+}
+
+static GpuProfilerZoneStats& FindZoneStats(GpuProfiler& profiler, const GpuProfilerZone& zone)
+{
+    for (GpuProfilerZoneStats& stats : profiler.zones)
+        if (strcmp(stats.name, zone.name) == 0)
+            return stats;
+
+    GpuProfilerZoneStats stats = {};
+    stats.name = zone.name;
+    stats.depth = zone.depth;
+    profiler.zones.push_back(stats);
+    return profiler.zones.back();
+}
+
+// Adds a sample to every zone history, 0 for the zones the frame didn't have
+static void ReadFrame(GpuProfiler& profiler, const GpuProfilerFrame& frame)
+{
+    std::vector<f32> frameTimes(profiler.zones.size(), 0.0f);
+    for (const GpuProfilerZone& zone : frame.zones)
+    {
+        GLuint64 begin = 0, end = 0;
+        glGetQueryObjectui64v(frame.queries[zone.beginQuery], GL_QUERY_RESULT, &begin);
+        glGetQueryObjectui64v(frame.queries[zone.endQuery], GL_QUERY_RESULT, &end);
+
+        u32 statsIdx = &FindZoneStats(profiler, zone) - profiler.zones.data();
+        frameTimes.resize(profiler.zones.size(), 0.0f);
+        frameTimes[statsIdx] += (end - begin) / 1000000.0f;
+    }
+
+    profiler.historyFrames[profiler.historyHead] = frame.frameIndex;
+    profiler.historyCount = glm::min(profiler.historyCount + 1, (u32)GPU_PROFILER_HISTORY);
+
+    for (u32 statsIdx = 0; statsIdx < profiler.zones.size(); ++statsIdx)
+    {
+        GpuProfilerZoneStats& stats = profiler.zones[statsIdx];
+        stats.history[profiler.historyHead] = frameTimes[statsIdx];
+        stats.last = frameTimes[statsIdx];
+
+        f32 sum = 0.0f;
+        stats.max = 0.0f;
+        for (u32 i = 0; i < profiler.historyCount; ++i)
+        {
+            sum += stats.history[i];
+            stats.max = glm::max(stats.max, stats.history[i]);
+        }
+        stats.average = sum / profiler.historyCount;
+    }
+
+    profiler.historyHead = (profiler.historyHead + 1) % GPU_PROFILER_HISTORY;
+}
+
+void BeginGpuProfilerFrame(GpuProfiler& profiler)
+{
+    profiler.frameIndex++;
+
+    //The slot of this frame holds the oldest one, then they go in order
+    for (u32 i = 0; i < GPU_PROFILER_FRAMES; ++i)
+    {
+        GpuProfilerFrame& frame = profiler.frames[(profiler.frameIndex + i) % GPU_PROFILER_FRAMES];
+        if (!frame.pending)
+            continue;
+        if (!IsFrameAvailable(frame))
+            break;
+        ReadFrame(profiler, frame);
+        frame.pending = false;
+    }
+
+    GpuProfilerFrame& frame = profiler.frames[profiler.frameIndex % GPU_PROFILER_FRAMES];
+    if (frame.pending)
+    {
+        //The GPU is that far behind, reading it would stall
+        profiler.droppedFrames++;
+        frame.pending = false;
+    }
+
+    frame.zones.clear();
+    frame.queryCount = 0;
+    frame.frameIndex = profiler.frameIndex;
+    profiler.openZoneCount = 0;
+    profiler.recording = profiler.enabled;
+
+    PushGpuZone(profiler, "Frame");
+}
+
+void EndGpuProfilerFrame(GpuProfiler& profiler)
+{
+    PopGpuZone(profiler);
+    ASSERT(profiler.openZoneCount == 0, "GPU zones left open at the end of the frame");
+
+    GpuProfilerFrame& frame = profiler.frames[profiler.frameIndex % GPU_PROFILER_FRAMES];
+    frame.pending = !frame.zones.empty();
+}
+
+void PushGpuZone(GpuProfiler& profiler, const char* name)
+{
+    glPushDebugGroup(GL_DEBUG_SOURCE_APPLICATION, 0, -1, name);
+
+    ASSERT(profiler.openZoneCount < GPU_PROFILER_MAX_DEPTH, "Too many nested GPU zones");
+    GpuProfilerFrame& frame = profiler.frames[profiler.frameIndex % GPU_PROFILER_FRAMES];
+
+    //Not recording, the zone is only a debug group (UINT32_MAX so the pop knows)
+    if (!profiler.recording)
+    {
+        profiler.openZones[profiler.openZoneCount++] = UINT32_MAX;
+        return;
+    }
+
+    if (frame.queryCount + 2 > frame.queries.size())
+    {
+        u32 firstNew = frame.queries.size();
+        frame.queries.resize(frame.queries.size() + GPU_PROFILER_QUERY_CHUNK);
+        glGenQueries(GPU_PROFILER_QUERY_CHUNK, &frame.queries[firstNew]);
+    }
+
+    GpuProfilerZone zone = {};
+    zone.name = name;
+    zone.depth = profiler.openZoneCount;
+    zone.beginQuery = frame.queryCount++;
+    zone.endQuery = frame.queryCount++;
+    glQueryCounter(frame.queries[zone.beginQuery], GL_TIMESTAMP);
+
+    profiler.openZones[profiler.openZoneCount++] = frame.zones.size();
+    frame.zones.push_back(zone);
+}
+
+void PopGpuZone(GpuProfiler& profiler)
+{
+    ASSERT(profiler.openZoneCount > 0, "GPU zone popped without a push");
+    GpuProfilerFrame& frame = profiler.frames[profiler.frameIndex % GPU_PROFILER_FRAMES];
+
+    u32 zoneIdx = profiler.openZones[--profiler.openZoneCount];
+    if (zoneIdx != UINT32_MAX)
+        glQueryCounter(frame.queries[frame.zones[zoneIdx].endQuery], GL_TIMESTAMP);
+
+    glPopDebugGroup();
+}
+
+bool ExportGpuProfilerCsv(const GpuProfiler& profiler, const char* filepath)
+{
+    FILE* file = fopen(filepath, "w");
+    if (!file)
+        return false;
+
+    fprintf(file, "frame");
+    for (const GpuProfilerZoneStats& stats : profiler.zones)
+        fprintf(file, ",%s", stats.name);
+    fprintf(file, "\n");
+
+    //Oldest sample first
+    u32 first = (profiler.historyHead + GPU_PROFILER_HISTORY - profiler.historyCount) % GPU_PROFILER_HISTORY;
+    for (u32 i = 0; i < profiler.historyCount; ++i)
+    {
+        u32 sample = (first + i) % GPU_PROFILER_HISTORY;
+        fprintf(file, "%u", profiler.historyFrames[sample]);
+        for (const GpuProfilerZoneStats& stats : profiler.zones)
+            fprintf(file, ",%.4f", stats.history[sample]);
+        fprintf(file, "\n");
+    }
+
+    fclose(file);
+    return true;
+}
+
+void DestroyGpuProfiler(GpuProfiler& profiler)
+{
+    for (GpuProfilerFrame& frame : profiler.frames)
+    {
+        if (!frame.queries.empty())
+            glDeleteQueries(frame.queries.size(), frame.queries.data());
+        frame.queries.clear();
+        frame.zones.clear();
+        frame.pending = false;
+    }
+}
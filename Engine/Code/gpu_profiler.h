@@ -0,0 +1,73 @@
+//
+// gpu_profiler.h: GPU time of the passes, from GL_TIMESTAMP queries at the start and end of each
+// zone. The queries of a frame are read back a few frames later, only once they are available,
+// so the CPU never waits on the GPU. Zones nest and are also pushed as debug groups, so they show
+// up in frame debuggers too.
+//
+
+#pragma once
+
+#include "platform.h"
+#include <glad/glad.h>
+
+#define GPU_PROFILER_FRAMES    4   // frames in flight, the oldest is read back or dropped
+#define GPU_PROFILER_HISTORY   128 // frames of samples kept per zone
+#define GPU_PROFILER_MAX_DEPTH 8
+
+struct GpuProfilerZone
+{
+    const char* name;
+    u32         depth;
+    u32         beginQuery, endQuery; // in the queries of the frame
+};
+
+struct GpuProfilerFrame
+{
+    std::vector<GLuint>          queries; // grows as needed, never deleted
+    std::vector<GpuProfilerZone> zones;
+    u32  queryCount;
+    u32  frameIndex;
+    bool pending;                         // issued and not read back yet
+};
+
+// Rolling timings of the zones with the same name, summed within a frame
+struct GpuProfilerZoneStats
+{
+    const char* name;
+    u32         depth;                    // of its first appearance, for the tree view
+    f32         history[GPU_PROFILER_HISTORY]; // ms
+    f32         last, average, max;       // over the history
+};
+
+struct GpuProfiler
+{
+    bool enabled = true;
+    bool recording;                       // enabled when the frame began, toggling applies next frame
+
+    GpuProfilerFrame frames[GPU_PROFILER_FRAMES];
+    u32              frameIndex;
+    u32              openZones[GPU_PROFILER_MAX_DEPTH];
+    u32              openZoneCount;
+
+    std::vector<GpuProfilerZoneStats> zones;
+    u32 historyHead;                      // next sample of every history
+    u32 historyCount;
+    u32 historyFrames[GPU_PROFILER_HISTORY]; // frame index of each sample
+    u32 droppedFrames;                    // not available when their slot came around again
+};
+
+/**
+ * Reads back the finished frames, oldest first, and starts recording a new one with a root
+ * "Frame" zone. Frames still not available when their slot is needed again are dropped.
+ */
+void BeginGpuProfilerFrame(GpuProfiler& profiler);
+void EndGpuProfilerFrame(GpuProfiler& profiler);
+
+// Zones nest up to GPU_PROFILER_MAX_DEPTH, name must outlive the profiler (a string literal)
+void PushGpuZone(GpuProfiler& profiler, const char* name);
+void PopGpuZone(GpuProfiler& profiler);
+
+// One row per frame of the history, one column per zone (ms). Returns false if the file can't be written
+bool ExportGpuProfilerCsv(const GpuProfiler& profiler, const char* filepath);
+
+void DestroyGpuProfiler(GpuProfiler& profiler);
@@ -0,0 +1,212 @@
+#include "headless_context.h"
+#include <glad/glad.h>
+#include <string.h>
+
+#if HEADLESS_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+EGLDisplay GlobalEglDisplay = EGL_NO_DISPLAY;
+EGLContext GlobalEglContext = EGL_NO_CONTEXT;
+EGLSurface GlobalEglSurface = EGL_NO_SURFACE;
+
+// Whole words of a space separated extension string
+bool HasEglExtension(const char* extensions, const char* name)
+{
+    size_t length = strlen(name);
+    for (const char* found = extensions ? strstr(extensions, name) : NULL; found; found = strstr(found + length, name))
+    {
+        bool start = found == extensions || found[-1] == ' ';
+        bool end = found[length] == ' ' || found[length] == '\0';
+        if (start && end)
+            return true;
+    }
+    return false;
+}
+
+bool CreateEglContext(u32 width, u32 height)
+{
+    // The surfaceless platform needs no display server, without it the default display may be an X11 one
+    const char* clientExtensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+    PFNEGLGETPLATFORMDISPLAYEXTPROC eglGetPlatformDisplayEXT = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (eglGetPlatformDisplayEXT && HasEglExtension(clientExtensions, "EGL_MESA_platform_surfaceless"))
+        GlobalEglDisplay = eglGetPlatformDisplayEXT(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    else
+        ILOG("Headless: EGL_MESA_platform_surfaceless not available, trying the default EGL display");
+
+    if (GlobalEglDisplay == EGL_NO_DISPLAY)
+        GlobalEglDisplay = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+    EGLint major = 0, minor = 0;
+    if (GlobalEglDisplay == EGL_NO_DISPLAY || !eglInitialize(GlobalEglDisplay, &major, &minor))
+    {
+        ELOG("Headless: no EGL display (error 0x%x)", eglGetError());
+        return false;
+    }
+
+    if (!eglBindAPI(EGL_OPENGL_API))
+    {
+        ELOG("Headless: EGL %d.%d has no desktop OpenGL (error 0x%x)", major, minor, eglGetError());
+        return false;
+    }
+
+    // Without surfaceless contexts a small pbuffer is made current, the frames still go to the offscreen framebuffer
+    const bool surfaceless = HasEglExtension(eglQueryString(GlobalEglDisplay, EGL_EXTENSIONS), "EGL_KHR_surfaceless_context");
+    const EGLint configAttribs[] = {
+        EGL_SURFACE_TYPE, surfaceless ? 0 : EGL_PBUFFER_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_NONE
+    };
+
+    EGLConfig config;
+    EGLint configCount = 0;
+    if (!eglChooseConfig(GlobalEglDisplay, configAttribs, &config, 1, &configCount) || configCount == 0)
+    {
+        ELOG("Headless: no EGL config for desktop OpenGL (error 0x%x)", eglGetError());
+        return false;
+    }
+
+    const EGLint contextAttribs[] = {
+        EGL_CONTEXT_MAJOR_VERSION_KHR, 4,
+        EGL_CONTEXT_MINOR_VERSION_KHR, 3,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK_KHR, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT_KHR,
+        EGL_NONE
+    };
+    GlobalEglContext = eglCreateContext(GlobalEglDisplay, config, EGL_NO_CONTEXT, contextAttribs);
+    if (GlobalEglContext == EGL_NO_CONTEXT)
+    {
+        ELOG("Headless: could not create an OpenGL 4.3 core EGL context (error 0x%x)", eglGetError());
+        return false;
+    }
+
+    if (!surfaceless)
+    {
+        const EGLint surfaceAttribs[] = { EGL_WIDTH, (EGLint)width, EGL_HEIGHT, (EGLint)height, EGL_NONE };
+        GlobalEglSurface = eglCreatePbufferSurface(GlobalEglDisplay, config, surfaceAttribs);
+        if (GlobalEglSurface == EGL_NO_SURFACE)
+        {
+            ELOG("Headless: could not create an EGL pbuffer (error 0x%x)", eglGetError());
+            return false;
+        }
+    }
+
+    if (!eglMakeCurrent(GlobalEglDisplay, GlobalEglSurface, GlobalEglSurface, GlobalEglContext))
+    {
+        ELOG("Headless: could not make the EGL context current (error 0x%x)", eglGetError());
+        return false;
+    }
+
+    ILOG("Headless: EGL %d.%d context (%s)", major, minor, surfaceless ? "surfaceless" : "pbuffer");
+    return true;
+}
+
+void DestroyEglContext()
+{
+    if (GlobalEglDisplay == EGL_NO_DISPLAY)
+        return;
+
+    eglMakeCurrent(GlobalEglDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    if (GlobalEglSurface != EGL_NO_SURFACE)
+        eglDestroySurface(GlobalEglDisplay, GlobalEglSurface);
+    if (GlobalEglContext != EGL_NO_CONTEXT)
+        eglDestroyContext(GlobalEglDisplay, GlobalEglContext);
+    eglTerminate(GlobalEglDisplay);
+
+    GlobalEglDisplay = EGL_NO_DISPLAY;
+    GlobalEglContext = EGL_NO_CONTEXT;
+    GlobalEglSurface = EGL_NO_SURFACE;
+}
+#endif
+
+#if HEADLESS_OSMESA
+// After glad, which already defines the GL types and skips GL/gl.h
+#include <GL/osmesa.h>
+
+OSMesaContext   GlobalOSMesaContext = NULL;
+std::vector<u8> GlobalOSMesaColorBuffer; // OSMesa always needs one, even if nothing is drawn to it
+
+bool CreateOSMesaContext(u32 width, u32 height)
+{
+    const int attribs[] = {
+        OSMESA_FORMAT, OSMESA_RGBA,
+        OSMESA_DEPTH_BITS, 0,
+        OSMESA_PROFILE, OSMESA_CORE_PROFILE,
+        OSMESA_CONTEXT_MAJOR_VERSION, 4,
+        OSMESA_CONTEXT_MINOR_VERSION, 3,
+        0
+    };
+    GlobalOSMesaContext = OSMesaCreateContextAttribs(attribs, NULL);
+    if (!GlobalOSMesaContext)
+    {
+        ELOG("Headless: could not create an OpenGL 4.3 core OSMesa context");
+        return false;
+    }
+
+    GlobalOSMesaColorBuffer.resize((size_t)width * height * 4);
+    if (!OSMesaMakeCurrent(GlobalOSMesaContext, GlobalOSMesaColorBuffer.data(), GL_UNSIGNED_BYTE, width, height))
+    {
+        ELOG("Headless: could not make the OSMesa context current");
+        return false;
+    }
+
+    ILOG("Headless: OSMesa context");
+    return true;
+}
+
+void DestroyOSMesaContext()
+{
+    if (GlobalOSMesaContext)
+        OSMesaDestroyContext(GlobalOSMesaContext);
+    GlobalOSMesaContext = NULL;
+    GlobalOSMesaColorBuffer.clear();
+}
+#endif
+
+bool CreateHeadlessContext(const char* api, u32 width, u32 height)
+{
+    if (strcmp(api, "egl") == 0)
+    {
+#if HEADLESS_EGL
+        return CreateEglContext(width, height);
+#else
+        ELOG("Headless: built without EGL (HEADLESS_EGL=1, link libEGL)");
+        return false;
+#endif
+    }
+
+    if (strcmp(api, "osmesa") == 0)
+    {
+#if HEADLESS_OSMESA
+        return CreateOSMesaContext(width, height);
+#else
+        ELOG("Headless: built without OSMesa (HEADLESS_OSMESA=1, link libOSMesa)");
+        return false;
+#endif
+    }
+
+    ELOG("Headless: unknown context API %s, use egl or osmesa", api);
+    return false;
+}
+
+void DestroyHeadlessContext()
+{
+#if HEADLESS_EGL
+    DestroyEglContext();
+#endif
+#if HEADLESS_OSMESA
+    DestroyOSMesaContext();
+#endif
+}
+
+void* GetHeadlessProcAddress(const char* name)
+{
+#if HEADLESS_EGL
+    if (GlobalEglContext != EGL_NO_CONTEXT)
+        return (void*)eglGetProcAddress(name);
+#endif
+#if HEADLESS_OSMESA
+    if (GlobalOSMesaContext)
+        return (void*)OSMesaGetProcAddress(name);
+#endif
+    return NULL;
+}
@@ -0,0 +1,35 @@
+//
+// headless_context.h: GL context without a window nor a display server, for the headless
+// benchmark on machines without a GPU (e.g. Mesa llvmpipe on CI). It is created directly with
+// EGL on Mesa's surfaceless platform or with OSMesa, GLFW is not involved at all. There is no
+// default framebuffer, the frames are drawn into an offscreen one (see InitOffscreenBackbuffer).
+//
+// Both APIs are optional build dependencies, off by default: build with HEADLESS_EGL=1 and link
+// libEGL (Mesa), and/or with HEADLESS_OSMESA=1 and link libOSMesa. Mesa's EGL needs no X11 nor
+// Wayland display with the surfaceless platform (EGL_MESA_platform_surfaceless), it only falls
+// back to the default display with a pbuffer when that platform is missing.
+//
+
+#pragma once
+
+#include "platform.h"
+
+#ifndef HEADLESS_EGL
+#define HEADLESS_EGL 0
+#endif
+
+#ifndef HEADLESS_OSMESA
+#define HEADLESS_OSMESA 0
+#endif
+
+/**
+ * Creates a GL 4.3 core context with the given API ("egl" or "osmesa") and makes it current on
+ * the calling thread. Returns false, after logging why, if the API was not built in or the context
+ * can't be created.
+ */
+bool CreateHeadlessContext(const char* api, u32 width, u32 height);
+
+void DestroyHeadlessContext();
+
+// Loader of the GL functions of the current headless context, for gladLoadGLLoader
+void* GetHeadlessProcAddress(const char* name);
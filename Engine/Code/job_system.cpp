@@ -0,0 +1,136 @@
+#include "job_system.h"
+#include "trace.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+#define BATCHES_PER_THREAD 4
+
+struct JobSystem
+{
+    std::vector<std::thread> workers;
+    std::mutex               mutex;
+    std::condition_variable  wakeCondition;
+    std::condition_variable  doneCondition;
+    u64                      generation;
+    u32                      activeWorkers;
+    bool                     quit;
+
+    // Current job
+    const ParallelForFunction* function;
+    u32                        count;
+    u32                        batchSize;
+    u32                        batchCount;
+    std::atomic<u32>           nextBatch;
+    std::atomic<u32>           completedBatches;
+};
+
+JobSystem GlobalJobSystem;
+
+void RunJobBatches(JobSystem& jobs)
+{
+    TRACE_ZONE("Job Batches");
+
+    for (;;)
+    {
+        u32 batch = jobs.nextBatch.fetch_add(1);
+        if (batch >= jobs.batchCount)
+            break;
+
+        u32 begin = batch * jobs.batchSize;
+        u32 end = glm::min(begin + jobs.batchSize, jobs.count);
+        (*jobs.function)(begin, end);
+
+        jobs.completedBatches.fetch_add(1);
+    }
+}
+
+void WorkerThread(JobSystem* jobs)
+{
+    SetTraceThreadName("Worker");
+    u64 lastGeneration = 0;
+
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> lock(jobs->mutex);
+            jobs->wakeCondition.wait(lock, [&] { return jobs->quit || jobs->generation != lastGeneration; });
+            if (jobs->quit)
+                return;
+            lastGeneration = jobs->generation;
+            jobs->activeWorkers++;
+        }
+
+        RunJobBatches(*jobs);
+
+        {
+            std::lock_guard<std::mutex> lock(jobs->mutex);
+            jobs->activeWorkers--;
+        }
+        jobs->doneCondition.notify_one();
+    }
+}
+
+void InitJobSystem(u32 workerCount)
+{
+    JobSystem& jobs = GlobalJobSystem;
+    jobs.quit = false;
+    for (u32 i = 0; i < workerCount; ++i)
+        jobs.workers.push_back(std::thread(WorkerThread, &jobs));
+}
+
+void ShutdownJobSystem()
+{
+    JobSystem& jobs = GlobalJobSystem;
+    {
+        std::lock_guard<std::mutex> lock(jobs.mutex);
+        jobs.quit = true;
+    }
+    jobs.wakeCondition.notify_all();
+
+    for (std::thread& worker : jobs.workers)
+        worker.join();
+    jobs.workers.clear();
+}
+
+u32 GetJobSystemWorkerCount()
+{
+    return GlobalJobSystem.workers.size();
+}
+
+void ParallelFor(u32 count, u32 minBatchSize, const ParallelForFunction& function)
+{
+    JobSystem& jobs = GlobalJobSystem;
+
+    u32 threadCount = jobs.workers.size() + 1;
+    u32 batchSize = glm::max(minBatchSize, (count + threadCount * BATCHES_PER_THREAD - 1) / (threadCount * BATCHES_PER_THREAD));
+    batchSize = glm::max(batchSize, 1u);
+
+    // Not worth waking anybody up
+    if (jobs.workers.empty() || count <= batchSize)
+    {
+        if (count > 0)
+            function(0, count);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(jobs.mutex);
+        jobs.function = &function;
+        jobs.count = count;
+        jobs.batchSize = batchSize;
+        jobs.batchCount = (count + batchSize - 1) / batchSize;
+        jobs.nextBatch = 0;
+        jobs.completedBatches = 0;
+        jobs.generation++;
+    }
+    jobs.wakeCondition.notify_all();
+
+    // The calling thread works too
+    RunJobBatches(jobs);
+
+    // Wait until all the batches are done and no worker is still looking at this job
+    std::unique_lock<std::mutex> lock(jobs.mutex);
+    jobs.doneCondition.wait(lock, [&] { return jobs.completedBatches == jobs.batchCount && jobs.activeWorkers == 0; });
+}
@@ -0,0 +1,24 @@
+//
+// job_system.h: Small pool of worker threads used to split loops over big arrays
+// (e.g. the per-entity work in Update) across all the cores.
+//
+
+#pragma once
+
+#include "platform.h"
+#include <functional>
+
+typedef std::function<void(u32 begin, u32 end)> ParallelForFunction;
+
+void InitJobSystem(u32 workerCount);
+
+void ShutdownJobSystem();
+
+u32 GetJobSystemWorkerCount();
+
+/**
+ * Splits [0, count) in contiguous ranges of at least minBatchSize elements and runs
+ * them on the workers and the calling thread. It returns once every range is done.
+ * It must always be called from the same (main) thread and can't be nested.
+ */
+void ParallelFor(u32 count, u32 minBatchSize, const ParallelForFunction& function);
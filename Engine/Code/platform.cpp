@@ -16,8 +16,14 @@
 #endif
 
 #include "engine.h"
+#include "job_system.h"
+#include "benchmark.h"
+#include "trace.h"
+#include "scene_generator.h"
+#include "headless_context.h"
 
 #include <GLFW/glfw3.h>
+#include <thread>
 #include <stdio.h>
 #include <imgui.h>
 #include <imgui_impl_glfw.h>
@@ -108,59 +114,7 @@ void OnGlfwResizeFramebuffer(GLFWwindow* window, int width, int height)
     App* app = (App*)glfwGetWindowUserPointer(window);
     app->displaySize = vec2(width, height);
 
-    glDeleteTextures(1, &app->positionAttachmentHandle);
-    glGenTextures(1, &app->positionAttachmentHandle);
-    glBindTexture(GL_TEXTURE_2D, app->positionAttachmentHandle);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, app->displaySize.x, app->displaySize.y, 0, GL_RGBA, GL_FLOAT, NULL);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glBindTexture(GL_TEXTURE_2D, 0);
-
-    //Diffuse render target
-    glDeleteTextures(1, &app->diffuseAttachmentHandle);
-    glGenTextures(1, &app->diffuseAttachmentHandle);
-    glBindTexture(GL_TEXTURE_2D, app->diffuseAttachmentHandle);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, app->displaySize.x, app->displaySize.y, 0, GL_RGBA, GL_FLOAT, NULL);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glBindTexture(GL_TEXTURE_2D, 0);
-
-    //Normals render target
-    glDeleteTextures(1, &app->normalsAttachmentHandle);
-    glGenTextures(1, &app->normalsAttachmentHandle);
-    glBindTexture(GL_TEXTURE_2D, app->normalsAttachmentHandle);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, app->displaySize.x, app->displaySize.y, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glBindTexture(GL_TEXTURE_2D, 0);
-
-    //Depth render target        
-    glDeleteTextures(1, &app->depthAttachmentHandle);
-    glGenTextures(1, &app->depthAttachmentHandle);
-    glBindTexture(GL_TEXTURE_2D, app->depthAttachmentHandle);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH32F_STENCIL8, app->displaySize.x, app->displaySize.y, 0, GL_DEPTH_STENCIL,
-        GL_FLOAT_32_UNSIGNED_INT_24_8_REV, NULL);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glBindTexture(GL_TEXTURE_2D, 0);
-
-    //Final render target
-    glDeleteTextures(1, &app->finalAttachmentHandle);
-    glGenTextures(1, &app->finalAttachmentHandle);
-    glBindTexture(GL_TEXTURE_2D, app->finalAttachmentHandle);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, app->displaySize.x, app->displaySize.y, 0, GL_RGB, GL_FLOAT, NULL);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glBindTexture(GL_TEXTURE_2D, 0);
-
-    //frame buffer creation and render target attachments   
-    glBindFramebuffer(GL_FRAMEBUFFER, app->framebufferHandle);
-    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, app->positionAttachmentHandle, 0);
-    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, app->diffuseAttachmentHandle, 0);
-    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, app->normalsAttachmentHandle, 0);
-    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT3, app->finalAttachmentHandle, 0);
-    glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, app->depthAttachmentHandle, 0);
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    // The render graph recreates the render targets for the new size
 }
 
 void OnGlfwCloseWindow(GLFWwindow* window)
@@ -169,12 +123,149 @@ void OnGlfwCloseWindow(GLFWwindow* window)
     app->isRunning = false;
 }
 
-int main()
+// No window, no GLFW nor ImGui: a context from headless_context.h and the frames in an offscreen framebuffer
+int RunHeadlessMain(App* app, u32 workerCount, u32 frameCount, const char* outputPath, const char* contextApi)
 {
+    if (!CreateHeadlessContext(contextApi, app->displaySize.x, app->displaySize.y))
+        return -1;
+
+    if (!gladLoadGLLoader((GLADloadproc) GetHeadlessProcAddress))
+    {
+        ELOG("Failed to initialize OpenGL context\n");
+        DestroyHeadlessContext();
+        return -1;
+    }
+
+    LoadGLExtensions((GLADloadproc) GetHeadlessProcAddress);
+
+    GlobalFrameArenaMemory = (u8*)malloc(GLOBAL_FRAME_ARENA_SIZE);
+
+    InitJobSystem(workerCount);
+
+    Init(app);
+
+    int exitStatus = InitOffscreenBackbuffer(app) ? RunHeadlessBenchmark(app, frameCount, outputPath) : 1;
+
+    DestroyOffscreenBackbuffer(app);
+
+    DestroyGpuProfiler(app->gpuProfiler);
+
+    free(GlobalFrameArenaMemory);
+
+    ShutdownJobSystem();
+    ShutdownTrace();
+
+    DestroyHeadlessContext();
+
+    return exitStatus;
+}
+
+int main(int argc, char** argv)
+{
+    u32 workerCount = glm::max(std::thread::hardware_concurrency(), 1u) - 1;
+
+    // Command line benchmarks, they don't need a window
+    if (argc > 1 && strcmp(argv[1], "--benchmark-entity-update") == 0)
+    {
+        InitJobSystem(workerCount);
+        RunEntityUpdateBenchmark();
+        ShutdownJobSystem();
+        return 0;
+    }
+
+    if (argc > 1 && strcmp(argv[1], "--benchmark-mat4") == 0)
+    {
+        RunMat4Benchmark();
+        return 0;
+    }
+
+    if (argc > 1 && strcmp(argv[1], "--benchmark-culling") == 0)
+    {
+        RunCullingBenchmark();
+        return 0;
+    }
+
+    if (argc > 1 && strcmp(argv[1], "--benchmark-bvh") == 0)
+    {
+        InitJobSystem(workerCount);
+        RunBvhBenchmark();
+        ShutdownJobSystem();
+        return 0;
+    }
+
+    if (argc > 1 && strcmp(argv[1], "--benchmark-clusters") == 0)
+    {
+        InitJobSystem(workerCount);
+        RunClusterBenchmark();
+        ShutdownJobSystem();
+        return 0;
+    }
+
+    if (argc > 1 && strcmp(argv[1], "--test-clusters") == 0)
+    {
+        InitJobSystem(workerCount);
+        int status = RunClusterSelfTest();
+        ShutdownJobSystem();
+        return status;
+    }
+
+    // Headless benchmark, e.g. --benchmark-headless 300 benchmark.json egl
+    // Renders every mode without a window nor a display, the context API can be egl (surfaceless) or
+    // osmesa, whichever was built in (see headless_context.h). Mesa llvmpipe runs it on machines without a GPU
+    bool headless = argc > 1 && strcmp(argv[1], "--benchmark-headless") == 0;
+    auto headlessArg = [&](int i) { return headless && argc > i && argv[i][0] != '-' ? argv[i] : NULL; }; // up to the next flag
+    u32 headlessFrames = headlessArg(2) ? (u32)atoi(argv[2]) : HEADLESS_BENCHMARK_FRAMES;
+    const char* headlessOutput = headlessArg(3) ? argv[3] : "benchmark.json";
+    const char* headlessContextApi = headlessArg(4) ? argv[4] : "egl";
+
+    // Procedural scene instead of the default one, with any of the modes above
+    // e.g. --scene entities=10000 lights=1000 seed=7 layout=random, or --scene-file stress.cfg
+    SceneGeneratorConfig sceneConfig = DefaultSceneGeneratorConfig();
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--scene") == 0)
+        {
+            sceneConfig.enabled = true;
+            while (i + 1 < argc && strncmp(argv[i + 1], "--", 2) != 0)
+            {
+                if (!ParseSceneGeneratorOption(sceneConfig, argv[++i]))
+                {
+                    ELOG("Bad scene option: %s\n", argv[i]);
+                    return -1;
+                }
+            }
+        }
+        else if (strcmp(argv[i], "--scene-file") == 0 && i + 1 < argc)
+        {
+            sceneConfig.enabled = true;
+            if (!LoadSceneGeneratorConfig(sceneConfig, argv[++i]))
+            {
+                ELOG("Could not load the scene config %s\n", argv[i]);
+                return -1;
+            }
+        }
+    }
+
+    // CPU trace from startup, e.g. --trace trace.json 300 (frames), with any of the modes above
+    SetTraceThreadName("Main");
+    for (int i = 1; i + 1 < argc; ++i)
+    {
+        if (strcmp(argv[i], "--trace") == 0)
+        {
+            bool hasFrames = i + 2 < argc && argv[i + 2][0] != '-';
+            StartTraceCapture(argv[i + 1], hasFrames ? (u32)atoi(argv[i + 2]) : TRACE_DEFAULT_FRAMES);
+            break;
+        }
+    }
+
     App app         = {};
     app.deltaTime   = 1.0f/60.0f;
     app.displaySize = ivec2(WINDOW_WIDTH, WINDOW_HEIGHT);
     app.isRunning   = true;
+    app.sceneConfig = sceneConfig;
+
+    if (headless)
+        return RunHeadlessMain(&app, workerCount, headlessFrames, headlessOutput, headlessContextApi);
 
 		glfwSetErrorCallback(OnGlfwError);
 
@@ -215,6 +306,8 @@ int main()
         return -1;
     }
 
+    LoadGLExtensions((GLADloadproc) glfwGetProcAddress);
+
     IMGUI_CHECKVERSION();
     ImGui::CreateContext();
 
@@ -254,19 +347,31 @@ int main()
 
     GlobalFrameArenaMemory = (u8*)malloc(GLOBAL_FRAME_ARENA_SIZE);
 
+    InitJobSystem(workerCount);
+
     Init(&app);
 
     while (app.isRunning)
     {
+        // Frame boundary of the CPU trace, Init is the first frame of a capture from startup
+        EndTraceFrame();
+        TRACE_ZONE("Frame");
+
         // Tell GLFW to call platform callbacks
-        glfwPollEvents();
+        {
+            TRACE_ZONE("Poll Events");
+            glfwPollEvents();
+        }
 
         // ImGui
-        ImGui_ImplOpenGL3_NewFrame();
-        ImGui_ImplGlfw_NewFrame();
-        ImGui::NewFrame();
-        Gui(&app);
-        ImGui::Render();
+        {
+            TRACE_ZONE("ImGui Frame");
+            ImGui_ImplOpenGL3_NewFrame();
+            ImGui_ImplGlfw_NewFrame();
+            ImGui::NewFrame();
+            Gui(&app);
+            ImGui::Render();
+        }
 
         // Clear input state if required by ImGui
         if (ImGui::GetIO().WantCaptureKeyboard)
@@ -294,19 +399,31 @@ int main()
         app.input.mouseDelta = glm::vec2(0.0f, 0.0f);
 
         // Render
+        BeginGpuProfilerFrame(app.gpuProfiler);
         Render(&app);
 
         // ImGui Render
-        ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
-        if (io.ConfigFlags & ImGuiConfigFlags_ViewportsEnable) {
-            GLFWwindow* backup_current_context = glfwGetCurrentContext();
-            ImGui::UpdatePlatformWindows();
-            ImGui::RenderPlatformWindowsDefault();
-            glfwMakeContextCurrent(backup_current_context);
+        {
+            TRACE_ZONE("ImGui Render");
+            PushGpuZone(app.gpuProfiler, "ImGui");
+            ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+            PopGpuZone(app.gpuProfiler);
+            ResetGLState(); // ImGui changed the GL state behind the wrappers
+            // Before the platform windows make their contexts current
+            EndGpuProfilerFrame(app.gpuProfiler);
+            if (io.ConfigFlags & ImGuiConfigFlags_ViewportsEnable) {
+                GLFWwindow* backup_current_context = glfwGetCurrentContext();
+                ImGui::UpdatePlatformWindows();
+                ImGui::RenderPlatformWindowsDefault();
+                glfwMakeContextCurrent(backup_current_context);
+            }
         }
 
         // Present image on screen
-        glfwSwapBuffers(window);
+        {
+            TRACE_ZONE("Swap Buffers");
+            glfwSwapBuffers(window);
+        }
 
         // Frame time
         f64 currentFrameTime = glfwGetTime();
@@ -317,6 +434,8 @@ int main()
         GlobalFrameArenaHead = 0;
     }
 
+    DestroyGpuProfiler(app.gpuProfiler);
+
     free(GlobalFrameArenaMemory);
 
     ImGui_ImplOpenGL3_Shutdown();
@@ -326,6 +445,9 @@ int main()
 
     glfwTerminate();
 
+    ShutdownJobSystem();
+    ShutdownTrace();
+
     return 0;
 }
 
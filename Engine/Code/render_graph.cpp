@@ -0,0 +1,420 @@
+#include "render_graph.h"
+#include "trace.h"
+#include "gl_state.h"
+#include <string.h>
+
+static u32 GetAttachmentSlot(GLenum attachment)
+{
+    if (attachment == GL_DEPTH_STENCIL_ATTACHMENT)
+        return RENDER_GRAPH_MAX_ATTACHMENTS - 1;
+    ASSERT(attachment >= GL_COLOR_ATTACHMENT0 && attachment < GL_COLOR_ATTACHMENT0 + RENDER_GRAPH_MAX_ATTACHMENTS - 1, "Unsupported render graph attachment");
+    return attachment - GL_COLOR_ATTACHMENT0;
+}
+
+static GLenum GetSlotAttachment(u32 slot)
+{
+    return slot == RENDER_GRAPH_MAX_ATTACHMENTS - 1 ? GL_DEPTH_STENCIL_ATTACHMENT : GL_COLOR_ATTACHMENT0 + slot;
+}
+
+// Bytes per texel of the formats the engine renders to
+static u32 GetTexelSize(GLenum internalFormat)
+{
+    switch (internalFormat)
+    {
+        case GL_RGBA16F:            return 8;
+        case GL_DEPTH32F_STENCIL8:  return 8;
+        case GL_RGBA8:              return 4;
+        case GL_RG16:               return 4;
+        case GL_R11F_G11F_B10F:     return 4;
+        case GL_R32F:               return 4;
+        default:                    return 4;
+    }
+}
+
+static u64 GetTextureBytes(const RenderGraphTextureDesc& desc)
+{
+    u64 bytes = 0;
+    for (u32 level = 0; level < desc.levels; ++level)
+        bytes += (u64)glm::max(desc.size.x >> level, 1) * glm::max(desc.size.y >> level, 1) * GetTexelSize(desc.internalFormat);
+    return bytes;
+}
+
+static bool SameDesc(const RenderGraphTextureDesc& a, const RenderGraphTextureDesc& b)
+{
+    return a.internalFormat == b.internalFormat && a.size == b.size && a.levels == b.levels;
+}
+
+static GLuint CreateGraphTexture(const RenderGraphTextureDesc& desc)
+{
+    GLuint handle = 0;
+    glGenTextures(1, &handle);
+    GLStateBindTexture(GL_TEXTURE_2D, handle);
+    glTexStorage2D(GL_TEXTURE_2D, desc.levels, desc.internalFormat, desc.size.x, desc.size.y);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, desc.levels > 1 ? GL_NEAREST_MIPMAP_NEAREST : GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    GLStateBindTexture(GL_TEXTURE_2D, 0);
+    return handle;
+}
+
+// Deleting it while the framebuffer is bound detaches it, so a new texture reusing the name is attached again
+static void DeleteGraphTexture(RenderGraph& graph, GLuint handle)
+{
+    GLStateBindFramebuffer(GL_FRAMEBUFFER, graph.framebufferHandle);
+    GLStateDeleteTextures(1, &handle);
+    GLStateBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    for (u32 slot = 0; slot < RENDER_GRAPH_MAX_ATTACHMENTS; ++slot)
+        if (graph.attached[slot] == handle)
+            graph.attached[slot] = 0;
+}
+
+void InitRenderGraph(RenderGraph& graph)
+{
+    glGenFramebuffers(1, &graph.framebufferHandle);
+    for (u32 slot = 0; slot < RENDER_GRAPH_MAX_ATTACHMENTS; ++slot)
+        graph.attached[slot] = 0;
+}
+
+void DestroyRenderGraph(RenderGraph& graph)
+{
+    for (RenderGraphPhysicalTexture& physical : graph.pool)
+        GLStateDeleteTextures(1, &physical.handle);
+    graph.pool.clear();
+    glDeleteFramebuffers(1, &graph.framebufferHandle);
+    graph.framebufferHandle = 0;
+}
+
+void BeginRenderGraph(RenderGraph& graph)
+{
+    //The textures of the last frame may be gone, nobody should keep using them
+    for (GLuint* handle : graph.publishedHandles)
+        *handle = 0;
+    graph.publishedHandles.clear();
+
+    graph.textures.clear();
+    graph.passes.clear();
+    graph.frame++;
+}
+
+u32 AddRenderGraphTexture(RenderGraph& graph, const char* name, GLenum internalFormat, glm::ivec2 size, GLuint* handle, u32 levels, bool persistent)
+{
+    RenderGraphTexture texture = {};
+    texture.name = name;
+    texture.desc = { internalFormat, size, levels };
+    texture.persistent = persistent;
+    texture.handle = handle;
+    graph.textures.push_back(texture);
+    return graph.textures.size() - 1;
+}
+
+u32 ImportRenderGraphTexture(RenderGraph& graph, const char* name, GLuint handle)
+{
+    RenderGraphTexture texture = {};
+    texture.name = name;
+    texture.imported = true;
+    texture.importedHandle = handle;
+    graph.textures.push_back(texture);
+    return graph.textures.size() - 1;
+}
+
+u32 AddRenderGraphPass(RenderGraph& graph, const char* name, const RenderPassFunction& execute)
+{
+    RenderGraphPass pass = {};
+    pass.name = name;
+    pass.execute = execute;
+    graph.passes.push_back(pass);
+    return graph.passes.size() - 1;
+}
+
+void RenderGraphRead(RenderGraph& graph, u32 pass, u32 texture, GLenum attachment)
+{
+    ASSERT(!graph.textures[texture].imported || attachment == GL_NONE, "Imported textures can't be attached");
+    graph.passes[pass].accesses.push_back({ texture, attachment, false });
+}
+
+void RenderGraphWrite(RenderGraph& graph, u32 pass, u32 texture, GLenum attachment)
+{
+    ASSERT(!graph.textures[texture].imported || attachment == GL_NONE, "Imported textures can't be attached");
+    graph.passes[pass].accesses.push_back({ texture, attachment, true });
+}
+
+static void CullPass(RenderGraph& graph, RenderGraphPass& pass, std::vector<u32>& unreadTextures)
+{
+    pass.culled = true;
+    graph.culledPassCount++;
+    for (const RenderGraphAccess& access : pass.accesses)
+        if (!access.write && --graph.textures[access.texture].readerCount == 0)
+            unreadTextures.push_back(access.texture);
+}
+
+// Drops the passes none of whose writes are read, then the writers of what only they read, and so on
+static void CullPasses(RenderGraph& graph)
+{
+    for (RenderGraphPass& pass : graph.passes)
+    {
+        for (const RenderGraphAccess& access : pass.accesses)
+        {
+            const RenderGraphTexture& texture = graph.textures[access.texture];
+            if (!access.write)
+                graph.textures[access.texture].readerCount++;
+            else if (texture.imported || texture.persistent)
+                pass.root = true;
+            else
+                pass.refCount++;
+        }
+    }
+
+    std::vector<u32> unreadTextures;
+    for (u32 textureIdx = 0; textureIdx < graph.textures.size(); ++textureIdx)
+        if (graph.textures[textureIdx].readerCount == 0)
+            unreadTextures.push_back(textureIdx);
+
+    //Nothing written, nothing to run
+    for (RenderGraphPass& pass : graph.passes)
+        if (!pass.root && pass.refCount == 0)
+            CullPass(graph, pass, unreadTextures);
+
+    while (!unreadTextures.empty())
+    {
+        u32 textureIdx = unreadTextures.back();
+        unreadTextures.pop_back();
+
+        for (RenderGraphPass& pass : graph.passes)
+        {
+            if (pass.root || pass.culled)
+                continue;
+
+            bool writes = false;
+            for (const RenderGraphAccess& access : pass.accesses)
+                writes |= access.write && access.texture == textureIdx;
+            if (writes && --pass.refCount == 0)
+                CullPass(graph, pass, unreadTextures);
+        }
+    }
+}
+
+static bool IsSizeDeclared(const RenderGraph& graph, glm::ivec2 size)
+{
+    for (const RenderGraphTexture& texture : graph.textures)
+        if (!texture.imported && texture.desc.size == size)
+            return true;
+    return false;
+}
+
+// Deletes the pool textures no frame used for a while, before the indices are handed out. The
+// transient ones of a size no texture has this frame go right away: after a resize they could
+// never be given out again, and each step of a drag-resize would keep a whole G-buffer alive
+static void ReleaseUnusedTextures(RenderGraph& graph)
+{
+    for (u32 i = 0; i < graph.pool.size();)
+    {
+        RenderGraphPhysicalTexture& physical = graph.pool[i];
+        bool staleSize = physical.persistentName == NULL && !IsSizeDeclared(graph, physical.desc.size);
+        if (staleSize || graph.frame - physical.lastUsedFrame > RENDER_GRAPH_RELEASE_FRAMES)
+        {
+            DeleteGraphTexture(graph, physical.handle);
+            graph.pool[i] = graph.pool.back();
+            graph.pool.pop_back();
+        }
+        else
+        {
+            physical.busyUntilPass = -1;
+            physical.created = false;
+            ++i;
+        }
+    }
+}
+
+static u32 FindPhysicalTexture(RenderGraph& graph, const RenderGraphTexture& texture)
+{
+    for (u32 i = 0; i < graph.pool.size(); ++i)
+    {
+        RenderGraphPhysicalTexture& physical = graph.pool[i];
+        if (texture.persistent)
+        {
+            if (physical.persistentName == NULL || strcmp(physical.persistentName, texture.name) != 0)
+                continue;
+
+            //Same owner with another size or format, its contents are useless anyway
+            if (!SameDesc(physical.desc, texture.desc))
+            {
+                DeleteGraphTexture(graph, physical.handle);
+                physical.handle = CreateGraphTexture(texture.desc);
+                physical.desc = texture.desc;
+                physical.created = true;
+            }
+            return i;
+        }
+
+        //Free again once the last pass of the textures it got so far is done
+        if (physical.persistentName == NULL && SameDesc(physical.desc, texture.desc) && physical.busyUntilPass < (i32)texture.firstPass)
+        {
+            if (physical.busyUntilPass >= 0)
+                graph.aliasedTextureCount++;
+            return i;
+        }
+    }
+
+    RenderGraphPhysicalTexture physical = {};
+    physical.handle = CreateGraphTexture(texture.desc);
+    physical.desc = texture.desc;
+    physical.persistentName = texture.persistent ? texture.name : NULL;
+    physical.busyUntilPass = -1;
+    physical.created = true;
+    graph.pool.push_back(physical);
+    return graph.pool.size() - 1;
+}
+
+// Lifetimes over the passes that run, then a pool texture for each texture in order of first use
+static void AllocateTextures(RenderGraph& graph)
+{
+    for (RenderGraphTexture& texture : graph.textures)
+    {
+        texture.firstPass = UINT32_MAX;
+        texture.lastPass = 0;
+        texture.physicalIdx = UINT32_MAX;
+    }
+
+    for (u32 passIdx = 0; passIdx < graph.passes.size(); ++passIdx)
+    {
+        if (graph.passes[passIdx].culled)
+            continue;
+        for (const RenderGraphAccess& access : graph.passes[passIdx].accesses)
+        {
+            RenderGraphTexture& texture = graph.textures[access.texture];
+            texture.firstPass = glm::min(texture.firstPass, passIdx);
+            texture.lastPass = glm::max(texture.lastPass, passIdx);
+        }
+    }
+
+    ReleaseUnusedTextures(graph);
+
+    for (u32 passIdx = 0; passIdx < graph.passes.size(); ++passIdx)
+    {
+        if (graph.passes[passIdx].culled)
+            continue;
+        for (const RenderGraphAccess& access : graph.passes[passIdx].accesses)
+        {
+            RenderGraphTexture& texture = graph.textures[access.texture];
+            if (texture.imported || texture.firstPass != passIdx || texture.physicalIdx != UINT32_MAX)
+                continue;
+
+            texture.physicalIdx = FindPhysicalTexture(graph, texture);
+            RenderGraphPhysicalTexture& physical = graph.pool[texture.physicalIdx];
+            physical.busyUntilPass = texture.lastPass;
+            physical.lastUsedFrame = graph.frame;
+        }
+    }
+
+    graph.poolBytes = 0;
+    for (const RenderGraphPhysicalTexture& physical : graph.pool)
+        graph.poolBytes += GetTextureBytes(physical.desc);
+
+    for (RenderGraphTexture& texture : graph.textures)
+    {
+        if (texture.handle == NULL)
+            continue;
+        *texture.handle = texture.physicalIdx != UINT32_MAX ? graph.pool[texture.physicalIdx].handle : 0;
+        graph.publishedHandles.push_back(texture.handle);
+    }
+}
+
+static GLuint GetTextureHandle(const RenderGraph& graph, const RenderGraphTexture& texture)
+{
+    if (texture.imported)
+        return texture.importedHandle;
+    return texture.physicalIdx != UINT32_MAX ? graph.pool[texture.physicalIdx].handle : 0;
+}
+
+// Binds the framebuffer with the attachments of the pass, the rest detached
+static void BindPassAttachments(RenderGraph& graph, const RenderGraphPass& pass)
+{
+    GLuint attachments[RENDER_GRAPH_MAX_ATTACHMENTS] = {};
+    bool anyAttachment = false;
+    for (const RenderGraphAccess& access : pass.accesses)
+    {
+        if (access.attachment == GL_NONE)
+            continue;
+        attachments[GetAttachmentSlot(access.attachment)] = GetTextureHandle(graph, graph.textures[access.texture]);
+        anyAttachment = true;
+    }
+
+    //The pass binds what it draws to itself
+    if (!anyAttachment)
+        return;
+
+    GLStateBindFramebuffer(GL_FRAMEBUFFER, graph.framebufferHandle);
+
+    bool changed = false;
+    for (u32 slot = 0; slot < RENDER_GRAPH_MAX_ATTACHMENTS; ++slot)
+    {
+        if (graph.attached[slot] == attachments[slot])
+            continue;
+        glFramebufferTexture(GL_FRAMEBUFFER, GetSlotAttachment(slot), attachments[slot], 0);
+        graph.attached[slot] = attachments[slot];
+        changed = true;
+    }
+
+    if (!changed)
+        return;
+
+    GLenum framebufferStatus = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    if (framebufferStatus != GL_FRAMEBUFFER_COMPLETE)
+    {
+        switch (framebufferStatus)
+        {
+            case GL_FRAMEBUFFER_UNDEFINED : ELOG("GL_FRAMEBUFFER_UNDEFINED (pass %s)", pass.name); break;
+            case GL_FRAMEBUFFER_INCOMPLETE_ATTACHMENT : ELOG("GL_FRAMEBUFFER_INCOMPLETE_ATTACHMENT (pass %s)", pass.name); break;
+            case GL_FRAMEBUFFER_INCOMPLETE_MISSING_ATTACHMENT: ELOG("GL_FRAMEBUFFER_INCOMPLETE_MISSING_ATTACHMENT (pass %s)", pass.name); break;
+            case GL_FRAMEBUFFER_INCOMPLETE_DRAW_BUFFER : ELOG("GL_FRAMEBUFFER_INCOMPLETE_DRAW_BUFFER (pass %s)", pass.name); break;
+            case GL_FRAMEBUFFER_INCOMPLETE_READ_BUFFER : ELOG("GL_FRAMEBUFFER_INCOMPLETE_READ_BUFFER (pass %s)", pass.name); break;
+            case GL_FRAMEBUFFER_UNSUPPORTED : ELOG("GL_FRAMEBUFFER_UNSUPPORTED (pass %s)", pass.name); break;
+            case GL_FRAMEBUFFER_INCOMPLETE_MULTISAMPLE : ELOG("GL_FRAMEBUFFER_INCOMPLETE_MULTISAMPLE (pass %s)", pass.name); break;
+            case GL_FRAMEBUFFER_INCOMPLETE_LAYER_TARGETS : ELOG("GL_FRAMEBUFFER_INCOMPLETE_LAYER_TARGETS (pass %s)", pass.name); break;
+            default: ELOG("Unknown framebuffer status error (pass %s)", pass.name); break;
+        }
+    }
+}
+
+void ExecuteRenderGraph(RenderGraph& graph)
+{
+    TRACE_FUNCTION();
+
+    graph.culledPassCount = 0;
+    graph.aliasedTextureCount = 0;
+
+    {
+        TRACE_ZONE("Compile Render Graph");
+        CullPasses(graph);
+        AllocateTextures(graph);
+    }
+
+    for (u32 passIdx = 0; passIdx < graph.passes.size(); ++passIdx)
+    {
+        const RenderGraphPass& pass = graph.passes[passIdx];
+        if (pass.culled)
+            continue;
+
+        TRACE_ZONE(pass.name);
+        BindPassAttachments(graph, pass);
+        pass.execute();
+
+        //Contents nobody reads again this frame: the texture may go to another one right after
+        for (const RenderGraphAccess& access : pass.accesses)
+        {
+            RenderGraphTexture& texture = graph.textures[access.texture];
+            if (texture.imported || texture.persistent || texture.lastPass != passIdx || texture.physicalIdx == UINT32_MAX)
+                continue;
+
+            for (u32 level = 0; level < texture.desc.levels; ++level)
+                glInvalidateTexImage(graph.pool[texture.physicalIdx].handle, level);
+            texture.lastPass = UINT32_MAX; // once per texture
+        }
+    }
+}
+
+bool IsRenderGraphTextureNew(const RenderGraph& graph, u32 texture)
+{
+    u32 physicalIdx = graph.textures[texture].physicalIdx;
+    return physicalIdx != UINT32_MAX && graph.pool[physicalIdx].created;
+}
@@ -0,0 +1,119 @@
+//
+// render_graph.h: Frame graph of the render passes. Every frame the passes are declared with the
+// textures they read and write. The graph then drops the passes whose outputs nobody reads, gives
+// the textures left a GL texture from its pool (transient textures whose lifetimes don't overlap
+// share one) and runs the passes in order, invalidating each texture after its last use.
+//
+
+#pragma once
+
+#include "platform.h"
+#include <glad/glad.h>
+#include <functional>
+
+#define RENDER_GRAPH_MAX_ATTACHMENTS 9  // 8 color and the depth stencil one
+#define RENDER_GRAPH_RELEASE_FRAMES  60 // pool textures unused for this many frames are deleted (at once if their size is gone)
+
+typedef std::function<void()> RenderPassFunction;
+
+struct RenderGraphTextureDesc
+{
+    GLenum     internalFormat;
+    glm::ivec2 size;
+    u32        levels;
+};
+
+// Texture of the frame
+struct RenderGraphTexture
+{
+    const char*            name;
+    RenderGraphTextureDesc desc;
+    bool                   persistent; // keeps its contents between frames, never shared
+    bool                   imported;   // not owned by the graph (e.g. the default framebuffer)
+    GLuint                 importedHandle;
+    GLuint*                handle;     // set to the GL texture (0 if unused) before the passes run
+
+    // Compiled
+    u32 readerCount;
+    u32 firstPass, lastPass;           // among the passes that run
+    u32 physicalIdx;                   // in the pool, UINT32_MAX if no pass that runs uses it
+};
+
+struct RenderGraphAccess
+{
+    u32    texture;
+    GLenum attachment; // of the graph framebuffer, GL_NONE when sampled or used as an image
+    bool   write;
+};
+
+struct RenderGraphPass
+{
+    const char*                    name;
+    RenderPassFunction             execute;
+    std::vector<RenderGraphAccess> accesses;
+
+    // Compiled
+    u32  refCount; // written textures some pass reads
+    bool root;     // writes an imported or persistent texture, never culled
+    bool culled;
+};
+
+// GL texture of the pool
+struct RenderGraphPhysicalTexture
+{
+    GLuint                 handle;
+    RenderGraphTextureDesc desc;
+    const char*            persistentName; // owner of a persistent texture, NULL if transient
+    i32                    busyUntilPass;  // last pass of the textures given it this frame, -1 if free
+    u32                    lastUsedFrame;
+    bool                   created;        // this frame, nothing from previous frames in it
+};
+
+struct RenderGraph
+{
+    GLuint framebufferHandle;
+    GLuint attached[RENDER_GRAPH_MAX_ATTACHMENTS]; // current attachments of the framebuffer
+
+    std::vector<RenderGraphTexture>         textures;
+    std::vector<RenderGraphPass>            passes;
+    std::vector<RenderGraphPhysicalTexture> pool;
+    std::vector<GLuint*>                    publishedHandles; // reset to 0 when the next frame begins
+    u32 frame;
+
+    // Statistics of the last execution
+    u32 culledPassCount;
+    u32 aliasedTextureCount; // textures that got a pool texture already used earlier in the frame
+    u64 poolBytes;
+};
+
+void InitRenderGraph(RenderGraph& graph);
+void DestroyRenderGraph(RenderGraph& graph);
+
+// Clears the declarations of the previous frame
+void BeginRenderGraph(RenderGraph& graph);
+
+/**
+ * Declares a texture of the frame. handle receives its GL texture when the graph executes.
+ * Persistent textures (e.g. history of a previous frame) keep their GL texture while they are
+ * declared every frame with the same name and description.
+ */
+u32 AddRenderGraphTexture(RenderGraph& graph, const char* name, GLenum internalFormat, glm::ivec2 size, GLuint* handle, u32 levels = 1, bool persistent = false);
+
+// Texture the graph does not own, e.g. 0 for the default framebuffer. The passes writing it always run
+u32 ImportRenderGraphTexture(RenderGraph& graph, const char* name, GLuint texture);
+
+u32 AddRenderGraphPass(RenderGraph& graph, const char* name, const RenderPassFunction& execute);
+
+/**
+ * Declares the access of a pass to a texture. With an attachment the graph binds its framebuffer
+ * with the texture there before running the pass (a read attachment is only tested against,
+ * like the depth stencil of the light volumes).
+ */
+void RenderGraphRead(RenderGraph& graph, u32 pass, u32 texture, GLenum attachment = GL_NONE);
+void RenderGraphWrite(RenderGraph& graph, u32 pass, u32 texture, GLenum attachment = GL_NONE);
+
+// Culls, allocates and runs the passes in declaration order
+void ExecuteRenderGraph(RenderGraph& graph);
+
+// Whether the texture got a new GL texture this frame, so a persistent one lost its contents
+bool IsRenderGraphTextureNew(const RenderGraph& graph, u32 texture);
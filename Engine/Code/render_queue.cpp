@@ -0,0 +1,83 @@
+#include "render_queue.h"
+#include <string.h>
+
+#define RADIX_BITS    8
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+#define RADIX_DIGITS  (64 / RADIX_BITS)
+
+u64 MakeSortKey(RenderPass pass, u32 programIdx, u32 materialIdx, u32 meshIdx, u32 submeshIdx)
+{
+    ASSERT(programIdx < (1u << SORT_KEY_PROGRAM_BITS), "Too many programs for the sort key");
+    ASSERT(materialIdx < (1u << SORT_KEY_MATERIAL_BITS), "Too many materials for the sort key");
+    ASSERT(meshIdx < (1u << SORT_KEY_MESH_BITS), "Too many meshes for the sort key");
+    ASSERT(submeshIdx < (1u << SORT_KEY_SUBMESH_BITS), "Too many submeshes for the sort key");
+
+    u64 key = (u64)pass;
+    key = (key << SORT_KEY_PROGRAM_BITS) | programIdx;
+    key = (key << SORT_KEY_MATERIAL_BITS) | materialIdx;
+    key = (key << SORT_KEY_MESH_BITS) | meshIdx;
+    key = (key << SORT_KEY_SUBMESH_BITS) | submeshIdx;
+    return key;
+}
+
+void ClearRenderQueue(RenderQueue& queue)
+{
+    queue.commands.clear();
+    queue.stateChanges = 0;
+    queue.stateChangesSkipped = 0;
+    queue.drawCalls = 0;
+}
+
+void PushDrawCommand(RenderQueue& queue, u64 key, u32 entityIdx, u32 submeshIdx)
+{
+    queue.commands.push_back(DrawCommand{ key, entityIdx, submeshIdx });
+}
+
+void SortRenderQueue(RenderQueue& queue)
+{
+    const u32 count = (u32)queue.commands.size();
+    if (count < 2)
+        return;
+
+    // All the histograms in a single read of the keys
+    static u32 histograms[RADIX_DIGITS][RADIX_BUCKETS];
+    memset(histograms, 0, sizeof(histograms));
+    for (const DrawCommand& command : queue.commands)
+    {
+        for (u32 digit = 0; digit < RADIX_DIGITS; ++digit)
+            histograms[digit][(command.key >> (digit * RADIX_BITS)) & (RADIX_BUCKETS - 1)]++;
+    }
+
+    queue.scratch.resize(count);
+    DrawCommand* src = queue.commands.data();
+    DrawCommand* dst = queue.scratch.data();
+
+    for (u32 digit = 0; digit < RADIX_DIGITS; ++digit)
+    {
+        const u32 shift = digit * RADIX_BITS;
+        u32* histogram = histograms[digit];
+
+        // Every key has the same value here, this pass would not move anything
+        if (histogram[(src[0].key >> shift) & (RADIX_BUCKETS - 1)] == count)
+            continue;
+
+        u32 offset = 0;
+        for (u32 bucket = 0; bucket < RADIX_BUCKETS; ++bucket)
+        {
+            u32 bucketCount = histogram[bucket];
+            histogram[bucket] = offset;
+            offset += bucketCount;
+        }
+
+        for (u32 i = 0; i < count; ++i)
+            dst[histogram[(src[i].key >> shift) & (RADIX_BUCKETS - 1)]++] = src[i];
+
+        DrawCommand* tmp = src;
+        src = dst;
+        dst = tmp;
+    }
+
+    // The sorted commands are in the scratch array after an odd number of passes
+    if (src != queue.commands.data())
+        queue.commands.swap(queue.scratch);
+}
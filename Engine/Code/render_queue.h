@@ -0,0 +1,67 @@
+//
+// render_queue.h: List of the submesh draws of a pass, sorted by a 64 bit key so draws
+// sharing a program, material and mesh end up together and their binds can be skipped.
+//
+
+#pragma once
+
+#include "platform.h"
+
+enum RenderPass
+{
+    RenderPass_Forward,
+    RenderPass_Geometry,
+    RenderPass_Count
+};
+
+// Key layout, most significant first: pass (4) | program (12) | material (16) | mesh (20) | submesh (12)
+#define SORT_KEY_PROGRAM_BITS  12
+#define SORT_KEY_MATERIAL_BITS 16
+#define SORT_KEY_MESH_BITS     20
+#define SORT_KEY_SUBMESH_BITS  12
+
+struct DrawCommand
+{
+    u64 key;
+    u32 entityIdx;
+    u32 submeshIdx;
+};
+
+struct RenderQueue
+{
+    std::vector<DrawCommand> commands;
+    std::vector<DrawCommand> scratch; // radix sort ping-pong
+
+    // Statistics of the last submission
+    u32 stateChanges;
+    u32 stateChangesSkipped;
+    u32 drawCalls;
+};
+
+u64 MakeSortKey(RenderPass pass, u32 programIdx, u32 materialIdx, u32 meshIdx, u32 submeshIdx);
+
+inline u32 GetSortKeyProgram(u64 key)
+{
+    return (u32)(key >> (SORT_KEY_MATERIAL_BITS + SORT_KEY_MESH_BITS + SORT_KEY_SUBMESH_BITS)) & ((1u << SORT_KEY_PROGRAM_BITS) - 1);
+}
+
+// Pass, program and material: the draws with the same bucket can share the bound state
+inline u64 GetSortKeyBucket(u64 key)
+{
+    return key >> (SORT_KEY_MESH_BITS + SORT_KEY_SUBMESH_BITS);
+}
+
+inline RenderPass GetSortKeyPass(u64 key)
+{
+    return (RenderPass)(key >> 60);
+}
+
+void ClearRenderQueue(RenderQueue& queue);
+
+void PushDrawCommand(RenderQueue& queue, u64 key, u32 entityIdx, u32 submeshIdx);
+
+/**
+ * Sorts the commands by key with a LSD radix sort (8 bit digits). It is stable, so draws with
+ * the same key keep their push order, and it skips the digits where all the keys are equal.
+ */
+void SortRenderQueue(RenderQueue& queue);
@@ -0,0 +1,166 @@
+#include "scene_generator.h"
+#include "engine.h"
+#include <string.h>
+#include <stdlib.h>
+
+// xorshift32, the same sequence on every platform unlike rand()
+struct SceneRandom
+{
+    u32 state;
+};
+
+static u32 NextRandom(SceneRandom& random)
+{
+    u32 x = random.state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    random.state = x;
+    return x;
+}
+
+// [min, max)
+static f32 RandomRange(SceneRandom& random, f32 min, f32 max)
+{
+    return min + (NextRandom(random) >> 8) * (1.0f / 16777216.0f) * (max - min);
+}
+
+SceneGeneratorConfig DefaultSceneGeneratorConfig()
+{
+    SceneGeneratorConfig config = {};
+    config.seed = 1;
+    config.entityCount = 10000;
+    config.lightCount = 1000;
+    config.layout = SceneLayout_Grid;
+    config.spacing = 3.0f;
+    return config;
+}
+
+bool ParseSceneGeneratorOption(SceneGeneratorConfig& config, const char* option)
+{
+    const char* separator = strchr(option, '=');
+    if (!separator)
+        return false;
+
+    std::string key(option, separator - option);
+    const char* value = separator + 1;
+    char* end = NULL;
+
+    if (key == "layout")
+    {
+        if (strcmp(value, "grid") == 0)        config.layout = SceneLayout_Grid;
+        else if (strcmp(value, "random") == 0) config.layout = SceneLayout_Random;
+        else return false;
+        return true;
+    }
+
+    if (key == "spacing")
+    {
+        f32 spacing = strtof(value, &end);
+        if (end == value || *end != '\0' || spacing <= 0.0f)
+            return false;
+        config.spacing = spacing;
+        return true;
+    }
+
+    u32 number = (u32)strtoul(value, &end, 10);
+    if (end == value || *end != '\0')
+        return false;
+
+    if (key == "entities")   config.entityCount = number;
+    else if (key == "lights") config.lightCount = number;
+    else if (key == "seed")   config.seed = number;
+    else return false;
+    return true;
+}
+
+bool LoadSceneGeneratorConfig(SceneGeneratorConfig& config, const char* filepath)
+{
+    FILE* file = fopen(filepath, "r");
+    if (!file)
+        return false;
+
+    SceneGeneratorConfig loaded = config;
+    bool valid = true;
+    char line[256];
+    while (valid && fgets(line, sizeof(line), file))
+    {
+        // Strip the comment and the whitespace around the option
+        if (char* comment = strchr(line, '#'))
+            *comment = '\0';
+        char* option = line + strspn(line, " \t");
+        size_t length = strlen(option);
+        while (length > 0 && strchr(" \t\r\n", option[length - 1]))
+            option[--length] = '\0';
+
+        if (length > 0 && !ParseSceneGeneratorOption(loaded, option))
+        {
+            ELOG("Bad scene option in %s: %s", filepath, option);
+            valid = false;
+        }
+    }
+    fclose(file);
+
+    if (valid)
+        config = loaded;
+    return valid;
+}
+
+void GenerateScene(App* app, const SceneGeneratorConfig& config)
+{
+    struct EntityKind
+    {
+        u32 modelIdx;
+        u32 programIdx;
+        f32 height; // of the origin, so it stands on the floor
+    };
+    const EntityKind kinds[] = {
+        { app->patrickIdx,  app->gProgramIdx,              3.0f },
+        { app->cubeIdx,     app->gProgramNormalMappingIdx, 0.5f },
+        { app->cubeBumpIdx, app->reliefMappingIdx,         0.5f },
+        { app->sphereIdx,   app->gProgramIdx,              1.0f },
+    };
+
+    SceneRandom random = { config.seed != 0 ? config.seed : 1 }; // xorshift is stuck at 0
+
+    // Square area that holds the entities at the given spacing, centered on the origin
+    const u32 side = glm::max((u32)ceilf(sqrtf((f32)config.entityCount)), 1u);
+    const f32 extent = side * config.spacing;
+
+    app->entities.reserve(app->entities.size() + config.entityCount + 1);
+    for (u32 i = 0; i < config.entityCount; ++i)
+    {
+        const EntityKind& kind = kinds[NextRandom(random) % ARRAY_COUNT(kinds)];
+
+        vec3 position;
+        f32 yaw;
+        if (config.layout == SceneLayout_Grid)
+        {
+            position = vec3(((i % side) + 0.5f) * config.spacing - extent * 0.5f, kind.height, ((i / side) + 0.5f) * config.spacing - extent * 0.5f);
+            yaw = 180.0f;
+        }
+        else
+        {
+            position = vec3(RandomRange(random, -0.5f, 0.5f) * extent, kind.height, RandomRange(random, -0.5f, 0.5f) * extent);
+            yaw = RandomRange(random, 0.0f, 360.0f);
+        }
+
+        app->entities.push_back(Entity{ TransformPositionScale(position, vec3(1.0f)), kind.modelIdx, kind.programIdx });
+        app->entities.back().worldMatrix = TransformRotation(app->entities.back().worldMatrix, yaw, { 0, 1, 0 });
+    }
+
+    // Floor under all of them
+    app->entities.push_back(Entity{ TransformPositionScale({0, -0.5, 0}, {extent + config.spacing, 1.0, extent + config.spacing}), app->quadIdx, app->gProgramIdx });
+    app->entities.back().worldMatrix = TransformRotation(app->entities.back().worldMatrix, -90, { 1, 0, 0 });
+
+    app->lights.reserve(app->lights.size() + config.lightCount);
+    for (u32 i = 0; i < config.lightCount; ++i)
+    {
+        vec3 position = vec3(RandomRange(random, -0.5f, 0.5f) * extent, RandomRange(random, 0.5f, 3.5f), RandomRange(random, -0.5f, 0.5f) * extent);
+        vec3 color = vec3(RandomRange(random, 0.5f, 1.0f), RandomRange(random, 0.5f, 1.0f), RandomRange(random, 0.5f, 1.0f));
+        app->lights.push_back(Light{ LightType_Point, color, {0.0, 0.0, 0.0}, position });
+    }
+
+    ILOG("Generated scene: %u entities (%s, seed %u) and %u point lights over %.0fx%.0f",
+         config.entityCount, config.layout == SceneLayout_Grid ? "grid" : "random", config.seed, config.lightCount, extent, extent);
+}
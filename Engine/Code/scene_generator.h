@@ -0,0 +1,45 @@
+//
+// scene_generator.h: Procedural scenes to measure how the renderer scales. A seeded generator
+// places N entities (Patrick, cubes and spheres with the textured, normal mapping and relief
+// mapping programs) on a grid or at random over a square floor, and M point lights over it,
+// so the same configuration always builds the same scene.
+//
+
+#pragma once
+
+#include "platform.h"
+
+struct App;
+
+enum SceneLayout
+{
+    SceneLayout_Grid,
+    SceneLayout_Random,
+};
+
+struct SceneGeneratorConfig
+{
+    bool        enabled;     // replaces the default scene of Init
+    u32         seed;
+    u32         entityCount;
+    u32         lightCount;
+    SceneLayout layout;
+    f32         spacing;     // between entities (mean distance in the random layout)
+};
+
+SceneGeneratorConfig DefaultSceneGeneratorConfig();
+
+/**
+ * Applies one "key=value" option: entities, lights, seed, layout (grid or random) and spacing.
+ * Returns false and leaves the config as it was if the option is unknown or malformed.
+ */
+bool ParseSceneGeneratorOption(SceneGeneratorConfig& config, const char* option);
+
+/**
+ * Reads a config file with one option per line (see ParseSceneGeneratorOption), # starts a comment.
+ * Returns false if the file can't be read or has a bad option.
+ */
+bool LoadSceneGeneratorConfig(SceneGeneratorConfig& config, const char* filepath);
+
+// Adds the entities, the lights and a floor under them, needs the models and programs of Init
+void GenerateScene(App* app, const SceneGeneratorConfig& config);
@@ -0,0 +1,73 @@
+//
+// simd_math.h: SIMD (AVX / SSE, scalar fallback) math for the per-frame hot paths, culling.h
+// and clusters.h pick their path from here too. Matrices are column-major glm::mat4, loaded and
+// stored unaligned. The instruction set is picked at compile time (/arch:AVX or -mavx enables
+// the AVX path).
+//
+
+#pragma once
+
+#include "platform.h"
+
+#if defined(__AVX__)
+#define SIMD_MATH_AVX
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SIMD_MATH_SSE
+#include <xmmintrin.h>
+#endif
+
+#if defined(SIMD_MATH_AVX)
+#define SIMD_MATH_NAME "AVX"
+#elif defined(SIMD_MATH_SSE)
+#define SIMD_MATH_NAME "SSE"
+#else
+#define SIMD_MATH_NAME "Scalar"
+#endif
+
+// left * right, same result as glm up to the rounding of the reassociated sums
+inline glm::mat4 MultiplyMat4(const glm::mat4& left, const glm::mat4& right)
+{
+    glm::mat4 result;
+    const f32* a = glm::value_ptr(left);
+    const f32* b = glm::value_ptr(right);
+    f32* c = glm::value_ptr(result);
+
+#if defined(SIMD_MATH_AVX)
+    // Both 128 bit lanes hold the same column of left, so two result columns are done at once
+    const __m256 a0 = _mm256_broadcast_ps((const __m128*)(a + 0));
+    const __m256 a1 = _mm256_broadcast_ps((const __m128*)(a + 4));
+    const __m256 a2 = _mm256_broadcast_ps((const __m128*)(a + 8));
+    const __m256 a3 = _mm256_broadcast_ps((const __m128*)(a + 12));
+
+    for (u32 j = 0; j < 2; ++j)
+    {
+        __m256 bj = _mm256_loadu_ps(b + 8 * j);
+        __m256 r = _mm256_mul_ps(a0, _mm256_shuffle_ps(bj, bj, 0x00));
+        r = _mm256_add_ps(r, _mm256_mul_ps(a1, _mm256_shuffle_ps(bj, bj, 0x55)));
+        r = _mm256_add_ps(r, _mm256_mul_ps(a2, _mm256_shuffle_ps(bj, bj, 0xAA)));
+        r = _mm256_add_ps(r, _mm256_mul_ps(a3, _mm256_shuffle_ps(bj, bj, 0xFF)));
+        _mm256_storeu_ps(c + 8 * j, r);
+    }
+#elif defined(SIMD_MATH_SSE)
+    const __m128 a0 = _mm_loadu_ps(a + 0);
+    const __m128 a1 = _mm_loadu_ps(a + 4);
+    const __m128 a2 = _mm_loadu_ps(a + 8);
+    const __m128 a3 = _mm_loadu_ps(a + 12);
+
+    for (u32 j = 0; j < 4; ++j)
+    {
+        __m128 r = _mm_mul_ps(a0, _mm_set1_ps(b[4 * j + 0]));
+        r = _mm_add_ps(r, _mm_mul_ps(a1, _mm_set1_ps(b[4 * j + 1])));
+        r = _mm_add_ps(r, _mm_mul_ps(a2, _mm_set1_ps(b[4 * j + 2])));
+        r = _mm_add_ps(r, _mm_mul_ps(a3, _mm_set1_ps(b[4 * j + 3])));
+        _mm_storeu_ps(c + 4 * j, r);
+    }
+#else
+    for (u32 j = 0; j < 4; ++j)
+        for (u32 k = 0; k < 4; ++k)
+            c[4 * j + k] = a[k] * b[4 * j + 0] + a[4 + k] * b[4 * j + 1] + a[8 + k] * b[4 * j + 2] + a[12 + k] * b[4 * j + 3];
+#endif
+
+    return result;
+}
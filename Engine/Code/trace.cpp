@@ -0,0 +1,185 @@
+#include "trace.h"
+#include <mutex>
+#include <atomic>
+#include <chrono>
+
+struct TraceEvent
+{
+    const char* name;
+    u64         begin, end; // ns
+};
+
+// Only its thread writes events, the main thread reads them between frames
+struct TraceBuffer
+{
+    std::vector<TraceEvent> events;
+    std::atomic<u32>        count;
+    u32                     dropped;
+    u32                     threadId;
+    const char*             threadName;
+};
+
+struct TraceState
+{
+    std::mutex                mutex;   // guards the list of buffers, taken once per thread
+    std::vector<TraceBuffer*> buffers;
+    std::atomic<bool>         capturing;
+
+    std::string filepath;
+    u32         framesLeft;
+    u64         captureStart;
+};
+
+TraceState GlobalTrace;
+
+thread_local TraceBuffer* ThreadTraceBuffer = NULL;
+thread_local const char*  ThreadTraceName = NULL;
+
+static u64 GetTraceTime()
+{
+    using namespace std::chrono;
+    return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+static TraceBuffer* GetThreadTraceBuffer()
+{
+    if (!ThreadTraceBuffer)
+    {
+        TraceBuffer* buffer = new TraceBuffer();
+        buffer->events.resize(TRACE_BUFFER_EVENTS);
+        buffer->count = 0;
+        buffer->dropped = 0;
+        buffer->threadName = ThreadTraceName;
+
+        std::lock_guard<std::mutex> lock(GlobalTrace.mutex);
+        buffer->threadId = GlobalTrace.buffers.size();
+        GlobalTrace.buffers.push_back(buffer);
+        ThreadTraceBuffer = buffer;
+    }
+    return ThreadTraceBuffer;
+}
+
+TraceZone::TraceZone(const char* name) : name(name)
+{
+    begin = GlobalTrace.capturing.load(std::memory_order_relaxed) ? GetTraceTime() : 0;
+}
+
+TraceZone::~TraceZone()
+{
+    if (begin == 0 || !GlobalTrace.capturing.load(std::memory_order_relaxed))
+        return;
+
+    //Before the first event of the thread allocates its buffer
+    u64 end = GetTraceTime();
+
+    TraceBuffer* buffer = GetThreadTraceBuffer();
+    u32 index = buffer->count.load(std::memory_order_relaxed);
+    if (index >= TRACE_BUFFER_EVENTS)
+    {
+        buffer->dropped++;
+        return;
+    }
+
+    buffer->events[index] = { name, begin, end };
+    buffer->count.store(index + 1, std::memory_order_release);
+}
+
+static bool WriteTrace(const char* filepath)
+{
+    FILE* file = fopen(filepath, "w");
+    if (!file)
+        return false;
+
+    std::lock_guard<std::mutex> lock(GlobalTrace.mutex);
+
+    fprintf(file, "{\"traceEvents\":[\n");
+    bool first = true;
+    u32 dropped = 0;
+    for (TraceBuffer* buffer : GlobalTrace.buffers)
+    {
+        if (buffer->threadName)
+        {
+            fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}", first ? "" : ",\n", buffer->threadId, buffer->threadName);
+            first = false;
+        }
+
+        u32 count = buffer->count.load(std::memory_order_acquire);
+        for (u32 i = 0; i < count; ++i)
+        {
+            const TraceEvent& event = buffer->events[i];
+            //Began during a previous capture
+            if (event.begin < GlobalTrace.captureStart)
+                continue;
+
+            fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}", first ? "" : ",\n",
+                    event.name, buffer->threadId, (event.begin - GlobalTrace.captureStart) / 1000.0, (event.end - event.begin) / 1000.0);
+            first = false;
+        }
+        dropped += buffer->dropped;
+    }
+    fprintf(file, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    fclose(file);
+
+    if (dropped > 0)
+        ELOG("CPU trace: %u events dropped, more than %u per thread", dropped, TRACE_BUFFER_EVENTS);
+    return true;
+}
+
+bool StartTraceCapture(const char* filepath, u32 frameCount)
+{
+    if (GlobalTrace.capturing)
+        return false;
+
+    {
+        std::lock_guard<std::mutex> lock(GlobalTrace.mutex);
+        for (TraceBuffer* buffer : GlobalTrace.buffers)
+        {
+            buffer->count = 0;
+            buffer->dropped = 0;
+        }
+    }
+
+    GlobalTrace.filepath = filepath;
+    GlobalTrace.framesLeft = glm::max(frameCount, 1u);
+    GlobalTrace.captureStart = GetTraceTime();
+    GlobalTrace.capturing = true;
+    return true;
+}
+
+void EndTraceFrame()
+{
+    if (!GlobalTrace.capturing || --GlobalTrace.framesLeft > 0)
+        return;
+
+    GlobalTrace.capturing = false;
+    if (WriteTrace(GlobalTrace.filepath.c_str()))
+    {
+        ILOG("CPU trace written to %s", GlobalTrace.filepath.c_str());
+    }
+    else
+    {
+        ELOG("Could not write the CPU trace to %s", GlobalTrace.filepath.c_str());
+    }
+}
+
+bool IsTraceCapturing()
+{
+    return GlobalTrace.capturing;
+}
+
+void SetTraceThreadName(const char* name)
+{
+    ThreadTraceName = name;
+    if (ThreadTraceBuffer)
+        ThreadTraceBuffer->threadName = name;
+}
+
+void ShutdownTrace()
+{
+    std::lock_guard<std::mutex> lock(GlobalTrace.mutex);
+    for (TraceBuffer* buffer : GlobalTrace.buffers)
+        delete buffer;
+    GlobalTrace.buffers.clear();
+    GlobalTrace.capturing = false;
+    ThreadTraceBuffer = NULL;
+}
@@ -0,0 +1,58 @@
+//
+// trace.h: CPU timeline of the engine. Scoped zones (TRACE_ZONE) record when they start and end
+// into a buffer owned by the calling thread, so recording takes no lock. A capture spans a number
+// of frames and is written as trace event JSON, to be opened in Perfetto or chrome://tracing.
+//
+
+#pragma once
+
+#include "platform.h"
+
+// Compile-time kill switch, with 0 the zones compile to nothing
+#ifndef TRACE_ENABLED
+#define TRACE_ENABLED 1
+#endif
+
+#define TRACE_BUFFER_EVENTS  65536 // per thread and capture, the events past it are dropped
+#define TRACE_DEFAULT_FRAMES 300
+
+/**
+ * Starts recording the zones of every thread for the next frameCount frames (see EndTraceFrame).
+ * It must be called from the main thread while no ParallelFor runs, as it resets the buffers of
+ * the other threads. Returns false if a capture is already running.
+ */
+bool StartTraceCapture(const char* filepath, u32 frameCount = TRACE_DEFAULT_FRAMES);
+
+/**
+ * Marks the boundary between two frames. When the last frame of the capture ends it stops
+ * recording and writes the file. Same threading rules as StartTraceCapture.
+ */
+void EndTraceFrame();
+
+bool IsTraceCapturing();
+
+// Names the calling thread in the trace (e.g. "Main"), name must be a string literal
+void SetTraceThreadName(const char* name);
+
+// Frees the buffers of all the threads, once the other threads are joined
+void ShutdownTrace();
+
+// Records from its construction to its destruction, name must be a string literal
+struct TraceZone
+{
+    const char* name;
+    u64         begin;
+
+    explicit TraceZone(const char* name);
+    ~TraceZone();
+};
+
+#if TRACE_ENABLED
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b)  TRACE_CONCAT_(a, b)
+#define TRACE_ZONE(name)    TraceZone TRACE_CONCAT(traceZone, __LINE__)(name)
+#define TRACE_FUNCTION()    TRACE_ZONE(__FUNCTION__)
+#else
+#define TRACE_ZONE(name)
+#define TRACE_FUNCTION()
+#endif
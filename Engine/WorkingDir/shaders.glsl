@@ -1,3 +1,118 @@
+///////////////////////////////////////////////////////////////////////
+// Material textures of the mesh shaders. Every program gets this part,
+// only the ones listed here use it.
+///////////////////////////////////////////////////////////////////////
+#if defined(FRAGMENT) && (defined(SHOW_TEXTURED_MESH) || defined(G_BUFFER_SHADER) || defined(RELIEF_MAPPING) || defined(G_BUFFER_NORMAL_MAPPING))
+
+#ifdef MATERIAL_TEXTURES_BINDLESS
+#extension GL_ARB_bindless_texture : require
+#endif
+
+#if defined(MATERIAL_TEXTURES_BINDLESS) || defined(MATERIAL_TEXTURES_ARRAYS)
+// Textures of all the materials, picked with the material index: nothing is bound between draws
+struct MaterialTextures
+{
+    uvec2 albedo; // bindless handle, or (array << 16 | layer) in x
+    uvec2 normal;
+    uvec2 bump;
+    uvec2 pad;
+};
+
+layout(binding = 5, std430) readonly buffer Materials
+{
+    MaterialTextures uMaterials[];
+};
+
+uniform uint uMaterialIndex;
+
+#ifdef MATERIAL_TEXTURES_BINDLESS
+vec4 SampleMaterialTexture(uvec2 handle, vec2 uv)
+{
+    return texture(sampler2D(handle), uv);
+}
+#else
+#define MAX_MATERIAL_TEXTURE_ARRAYS 8
+
+// Same size and format textures as layers of an array. The index comes from a uniform so it is dynamically uniform
+uniform sampler2DArray uTextureArrays[MAX_MATERIAL_TEXTURE_ARRAYS];
+
+vec4 SampleMaterialTexture(uvec2 handle, vec2 uv)
+{
+    return texture(uTextureArrays[handle.x >> 16], vec3(uv, float(handle.x & 0xFFFFu)));
+}
+#endif
+
+#define SampleAlbedo(uv)    SampleMaterialTexture(uMaterials[uMaterialIndex].albedo, uv)
+#define SampleNormalMap(uv) SampleMaterialTexture(uMaterials[uMaterialIndex].normal, uv)
+#define SampleHeightMap(uv) SampleMaterialTexture(uMaterials[uMaterialIndex].bump, uv)
+#else
+uniform sampler2D uTexture;
+uniform sampler2D uNormalMap;
+uniform sampler2D uHeightMap;
+
+#define SampleAlbedo(uv)    texture(uTexture, uv)
+#define SampleNormalMap(uv) texture(uNormalMap, uv)
+#define SampleHeightMap(uv) texture(uHeightMap, uv)
+#endif
+
+#endif
+
+///////////////////////////////////////////////////////////////////////
+// Entity transform table entry, matches EntityLocalParams. The normal
+// matrix (inverse transpose of the world one) is computed on the CPU.
+///////////////////////////////////////////////////////////////////////
+#if defined(TRANSFORM_TABLE) || defined(OCCLUSION_CULLING)
+struct EntityTransform
+{
+    mat4 worldMatrix;
+    mat3 normalMatrix;
+};
+#endif
+
+///////////////////////////////////////////////////////////////////////
+// G-buffer encoding. Normals are octahedral encoded in [0, 1], so they
+// fit the RG16 target of the compact layout, which also has no position
+// target: the readers rebuild it from the depth (COMPACT_G_BUFFER).
+///////////////////////////////////////////////////////////////////////
+#if (defined(FRAGMENT) || defined(COMPUTE)) && (defined(G_BUFFER_SHADER) || defined(RELIEF_MAPPING) || defined(G_BUFFER_NORMAL_MAPPING) || \
+    defined(DEFERRED_DIRECTIONAL_LIGHTING_PASS) || defined(DEFERRED_POINT_LIGHTING_PASS) || defined(TILED_DEFERRED_LIGHTING) || defined(G_BUFFER_VIEW))
+
+vec2 EncodeNormal(vec3 n)
+{
+    n /= abs(n.x) + abs(n.y) + abs(n.z);
+    vec2 signs = vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+    vec2 e = n.z >= 0.0 ? n.xy : (1.0 - abs(n.yx)) * signs;
+    return e * 0.5 + 0.5;
+}
+
+vec3 DecodeNormal(vec2 e)
+{
+    e = e * 2.0 - 1.0;
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    float t = max(-n.z, 0.0);
+    n.x += n.x >= 0.0 ? -t : t;
+    n.y += n.y >= 0.0 ? -t : t;
+    return normalize(n);
+}
+
+#ifdef COMPACT_G_BUFFER
+uniform mat4 uInverseViewProjectionMatrix;
+#endif
+
+// World space position of a G-buffer pixel, stored or rebuilt from the depth
+vec3 ReadGBufferPosition(sampler2D positions, sampler2D depths, vec2 uv)
+{
+#ifdef COMPACT_G_BUFFER
+    vec3 ndc = vec3(uv, texture(depths, uv).r) * 2.0 - 1.0;
+    vec4 position = uInverseViewProjectionMatrix * vec4(ndc, 1.0);
+    return position.xyz / position.w;
+#else
+    return texture(positions, uv).rgb;
+#endif
+}
+
+#endif
+
 ///////////////////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////////////////
@@ -32,6 +147,46 @@ void main()
 #endif
 #endif
 
+#ifdef G_BUFFER_VIEW
+
+#if defined(VERTEX) ///////////////////////////////////////////////////
+
+layout(location = 0) in vec3 aPosition;
+layout(location = 2) in vec2 aTextCoord;
+
+out vec2 vTexCoord;
+
+void main()
+{
+    vTexCoord = aTextCoord;
+    gl_Position = vec4(aPosition, 1.0);
+}
+
+#elif defined(FRAGMENT) ///////////////////////////////////////////////
+
+in vec2 vTexCoord;
+
+uniform sampler2D gPosition;
+uniform sampler2D gNormal;
+uniform sampler2D gDepth;
+uniform bool uShowNormals;
+
+layout(location = 0) out vec4 oColor;
+
+void main()
+{
+    // Decoded, so both G-buffer layouts look the same. The background stays black
+    if (texture(gDepth, vTexCoord).r == 1.0)
+        oColor = vec4(0.0, 0.0, 0.0, 1.0);
+    else if (uShowNormals)
+        oColor = vec4(DecodeNormal(texture(gNormal, vTexCoord).rg), 1.0);
+    else
+        oColor = vec4(ReadGBufferPosition(gPosition, gDepth, vTexCoord), 1.0);
+}
+
+#endif
+#endif
+
 #ifdef TEXTURED_DEPTH
 
 #if defined(VERTEX) ///////////////////////////////////////////////////
@@ -69,12 +224,17 @@ void main()
 ///////////////////////////////////////////////////////////////////////
 #ifdef SHOW_TEXTURED_MESH
 
-struct Light
+struct DirectionalLight
 {
-    uint type;
-    vec3 color;
     vec3 direction;
+    vec3 color;
+};
+
+struct PointLight
+{
     vec3 position;
+    float radius;
+    vec3 color;
 };
 
 #if defined(VERTEX) ///////////////////////////////////////////////////
@@ -87,32 +247,46 @@ layout(location = 2) in vec2 aTextCoord;
 
 layout(binding = 0, std140) uniform GlobalParams
 {
+    mat4 uViewProjectionMatrix;
     vec3 uCameraPosition;
-    uint uLightCount;
-    Light uLight[16];
+    uint uDirectionalLightCount;
+    uint uPointLightCount;
 };
 
+#ifdef TRANSFORM_TABLE
+layout(location = 5) in uint aEntityIndex;
+
+layout(binding = 2, std430) readonly buffer EntityTransforms
+{
+    EntityTransform uEntityTransforms[];
+};
+
+#define uWorldMatrix uEntityTransforms[aEntityIndex].worldMatrix
+#define uNormalMatrix uEntityTransforms[aEntityIndex].normalMatrix
+#else
 layout(binding = 1, std140) uniform LocalParams
 {
     mat4 uWorldMatrix;
-    mat4 uWorldViewMatrix;
-    mat4 uWorldViewProjectionMatrix;
+    mat3 uNormalMatrix;
 };
+#endif
 
 out vec3 vPosition; //In worldspace
 out vec3 vNormal; //In worldspace
 out vec2 vTexCoord;
 out vec3 vViewDir;
 
+// Matches the depth pre-pass exactly
+invariant gl_Position;
+
 void main()
 {
     vTexCoord = aTextCoord;
     vPosition = vec3(uWorldMatrix * vec4(aPosition, 1.0));
 
-    mat3 normalMatrix = transpose(inverse(mat3(uWorldMatrix)));
-    vNormal = normalMatrix * aNormal;
+    vNormal = uNormalMatrix * aNormal;
     vViewDir = uCameraPosition - vPosition;
-    gl_Position = uWorldViewProjectionMatrix * vec4(aPosition, 1.0);
+    gl_Position = uViewProjectionMatrix * vec4(vPosition, 1.0);
 }
 
 #elif defined(FRAGMENT) ///////////////////////////////////////////////
@@ -122,52 +296,93 @@ in vec3 vNormal; //In worldspace
 in vec2 vTexCoord;
 in vec3 vViewDir; // In worldspace
 
-uniform sampler2D uTexture;
-
 layout(binding = 0, std140) uniform GlobalParams
 {
+    mat4 uViewProjectionMatrix;
     vec3 uCameraPosition;
-    uint uLightCount;
-    Light uLight[16];
+    uint uDirectionalLightCount;
+    uint uPointLightCount;
+};
+
+layout(binding = 3, std430) readonly buffer DirectionalLights
+{
+    DirectionalLight uDirectionalLights[];
+};
+
+layout(binding = 4, std430) readonly buffer PointLights
+{
+    PointLight uPointLights[];
 };
 
+#ifdef CLUSTERED_LIGHTS
+#define CLUSTER_GRID_X 16 // CLUSTER_GRID_X/Y/Z in clusters.h
+#define CLUSTER_GRID_Y 9
+#define CLUSTER_GRID_Z 24
+
+// Point lights touching each cluster of the view frustum, assigned on the CPU
+layout(binding = 0, std430) readonly buffer LightClusters
+{
+    vec2  uClusterTileSize;   // pixels
+    float uClusterDepthScale; // slice = log(depth) * scale + bias
+    float uClusterDepthBias;
+    float uClusterNear;
+    float uClusterFar;
+    uvec2 uClusters[CLUSTER_GRID_X * CLUSTER_GRID_Y * CLUSTER_GRID_Z]; // first index and count
+    uint  uClusterLightIndices[];
+};
+
+uvec2 GetFragmentCluster()
+{
+    // Distance to the camera from the depth buffer value
+    float ndcDepth = gl_FragCoord.z * 2.0 - 1.0;
+    float depth = 2.0 * uClusterNear * uClusterFar / (uClusterFar + uClusterNear - ndcDepth * (uClusterFar - uClusterNear));
+
+    uvec3 cluster;
+    cluster.xy = min(uvec2(gl_FragCoord.xy / uClusterTileSize), uvec2(CLUSTER_GRID_X - 1, CLUSTER_GRID_Y - 1));
+    cluster.z = min(uint(max(log(depth) * uClusterDepthScale + uClusterDepthBias, 0.0)), uint(CLUSTER_GRID_Z - 1));
+    return uClusters[(cluster.z * CLUSTER_GRID_Y + cluster.y) * CLUSTER_GRID_X + cluster.x];
+}
+#endif
+
 layout(location = 0) out vec4 oColor;
 
 void main()
 {
     vec3 finalColor;
-    vec3 textureColor = vec3(texture(uTexture, vTexCoord));
+    vec3 textureColor = vec3(SampleAlbedo(vTexCoord));
 
-    //TODO: Sum all lights
-    for(uint i = 0; i < uLightCount; ++i)
+    for(uint i = 0; i < uDirectionalLightCount; ++i)
     {
-        switch(uLight[i].type)
-        {            
-            case 0: 
-            {
-                //Directional
-                float cosAngle = max(dot(vNormal, -uLight[i].direction), 0.0); 
-                vec3 ambient = 0.1 * uLight[i].color;
-                vec3 diffuse = 0.6 * uLight[i].color * cosAngle;
-
-                finalColor += (ambient + diffuse) * textureColor;
-            } break;
-            case 1:
-            {
-                //Point
-                // diffuse
-                vec3 lightDir = normalize(uLight[i].position - vPosition);
-                vec3 diffuse = 0.6 * max(dot(vNormal, lightDir), 0.0) * textureColor * uLight[i].color;
-                vec3 ambient = 0.1 * textureColor;
-          
-                // attenuation
-                float distance = length(uLight[i].position - vPosition);
-                float attenuation = 1.0 / (1.0 + 0.14 * distance + 0.07 * (distance * distance));
-                diffuse *= attenuation;
+        //Directional
+        float cosAngle = max(dot(vNormal, -uDirectionalLights[i].direction), 0.0); 
+        vec3 ambient = 0.1 * uDirectionalLights[i].color;
+        vec3 diffuse = 0.6 * uDirectionalLights[i].color * cosAngle;
 
-                finalColor += diffuse;
-            } break;
-        }
+        finalColor += (ambient + diffuse) * textureColor;
+    }
+
+#ifdef CLUSTERED_LIGHTS
+    // Only the lights of the cluster of the fragment
+    uvec2 cluster = GetFragmentCluster();
+    for(uint j = cluster.x; j < cluster.x + cluster.y; ++j)
+    {
+        uint i = uClusterLightIndices[j];
+#else
+    for(uint i = 0; i < uPointLightCount; ++i)
+    {
+#endif
+        //Point
+        // diffuse
+        vec3 lightDir = normalize(uPointLights[i].position - vPosition);
+        vec3 diffuse = 0.6 * max(dot(vNormal, lightDir), 0.0) * textureColor * uPointLights[i].color;
+        vec3 ambient = 0.1 * textureColor;
+  
+        // attenuation
+        float distance = length(uPointLights[i].position - vPosition);
+        float attenuation = 1.0 / (1.0 + 0.14 * distance + 0.07 * (distance * distance));
+        diffuse *= attenuation;
+
+        finalColor += diffuse;
     }
 
     oColor = vec4(finalColor, 1.0);
@@ -181,14 +396,6 @@ void main()
 ///////////////////////////////////////////////////////////////////////
 #ifdef G_BUFFER_SHADER
 
-struct Light
-{
-    uint type;
-    vec3 color;
-    vec3 direction;
-    vec3 position;
-};
-
 #if defined(VERTEX) ///////////////////////////////////////////////////
 
 layout(location = 0) in vec3 aPosition;
@@ -197,31 +404,45 @@ layout(location = 2) in vec2 aTextCoord;
 
 layout(binding = 0, std140) uniform GlobalParams
 {
+    mat4 uViewProjectionMatrix;
     vec3 uCameraPosition;
-    uint uLightCount;
-    Light uLight[16];
+    uint uDirectionalLightCount;
+    uint uPointLightCount;
 };
 
+#ifdef TRANSFORM_TABLE
+layout(location = 5) in uint aEntityIndex;
+
+layout(binding = 2, std430) readonly buffer EntityTransforms
+{
+    EntityTransform uEntityTransforms[];
+};
+
+#define uWorldMatrix uEntityTransforms[aEntityIndex].worldMatrix
+#define uNormalMatrix uEntityTransforms[aEntityIndex].normalMatrix
+#else
 layout(binding = 1, std140) uniform LocalParams
 {
     mat4 uWorldMatrix;
-    mat4 uWorldViewMatrix;
-    mat4 uWorldViewProjectionMatrix;
+    mat3 uNormalMatrix;
 };
+#endif
 
 out vec3 vPosition; //In worldspace
 out vec3 vNormal; //In worldspace
 out vec2 vTexCoord;
 
+// Matches the depth pre-pass exactly
+invariant gl_Position;
+
 void main()
 {
     vTexCoord = aTextCoord;
     vPosition = (uWorldMatrix * vec4(aPosition, 1.0)).xyz;
 
-    mat3 normalMatrix = transpose(inverse(mat3(uWorldMatrix)));
-    vNormal = normalMatrix * aNormal;
+    vNormal = uNormalMatrix * aNormal;
 
-    gl_Position = uWorldViewProjectionMatrix * vec4(aPosition, 1.0);
+    gl_Position = uViewProjectionMatrix * vec4(vPosition, 1.0);
 }
 
 #elif defined(FRAGMENT) ///////////////////////////////////////////////
@@ -230,17 +451,16 @@ in vec3 vPosition; //In worldspace
 in vec3 vNormal; //In worldspace
 in vec2 vTexCoord;
 
-uniform sampler2D uTexture;
-
 layout (location = 0) out vec3 gPosition;
 layout (location = 1) out vec4 gAlbedo;
-layout (location = 2) out vec3 gNormal;
+layout (location = 2) out vec2 gNormal;
 
 layout(binding = 0, std140) uniform GlobalParams
 {
+    mat4 uViewProjectionMatrix;
     vec3 uCameraPosition;
-    uint uLightCount;
-    Light uLight[16];
+    uint uDirectionalLightCount;
+    uint uPointLightCount;
 };
 
 void main()
@@ -248,9 +468,9 @@ void main()
     // store the fragment position vector in the first gbuffer texture
     gPosition = vPosition;
     // also store the per-fragment normals into the gbuffer
-    gNormal = normalize(vNormal);
+    gNormal = EncodeNormal(normalize(vNormal));
     // and the diffuse per-fragment color
-    gAlbedo = texture(uTexture, vTexCoord);
+    gAlbedo = SampleAlbedo(vTexCoord);
 } 
 
 #endif
@@ -261,12 +481,10 @@ void main()
 ///////////////////////////////////////////////////////////////////////
 #ifdef DEFERRED_DIRECTIONAL_LIGHTING_PASS
 
-struct Light
+struct DirectionalLight
 {
-    uint type;
-    vec3 color;
     vec3 direction;
-    vec3 position;
+    vec3 color;
 };
 
 #if defined(VERTEX) ///////////////////////////////////////////////////
@@ -277,9 +495,10 @@ layout(location = 2) in vec2 aTextCoord;
 
 layout(binding = 0, std140) uniform GlobalParams
 {
+    mat4 uViewProjectionMatrix;
     vec3 uCameraPosition;
-    uint uLightCount;
-    Light uLight[16];
+    uint uDirectionalLightCount;
+    uint uPointLightCount;
 };
 
 out vec2 vTexCoord;
@@ -294,9 +513,15 @@ void main()
 
 layout(binding = 0, std140) uniform GlobalParams
 {
+    mat4 uViewProjectionMatrix;
     vec3 uCameraPosition;
-    uint uLightCount;
-    Light uLight[16];
+    uint uDirectionalLightCount;
+    uint uPointLightCount;
+};
+
+layout(binding = 3, std430) readonly buffer DirectionalLights
+{
+    DirectionalLight uDirectionalLights[];
 };
 
 out vec4 oColor;
@@ -306,29 +531,26 @@ in vec2 vTexCoord;
 uniform sampler2D gPosition;
 uniform sampler2D gNormal;
 uniform sampler2D gDiffuse;
+uniform sampler2D gDepth;
 
 void main()
 {             
     // retrieve data from G-buffer
-    vec3 Position = texture(gPosition, vTexCoord).rgb;
-    vec3 Normal = texture(gNormal, vTexCoord).rgb;
+    vec3 Position = ReadGBufferPosition(gPosition, gDepth, vTexCoord);
+    vec3 Normal = DecodeNormal(texture(gNormal, vTexCoord).rg);
     vec3 Diffuse = texture(gDiffuse, vTexCoord).rgb;
     
     // then calculate lighting as usual
     vec3 finalColor;
 
-    //TODO: Sum all lights
-    for(uint i = 0; i < uLightCount; ++i)
+    for(uint i = 0; i < uDirectionalLightCount; ++i)
     {
-        if(uLight[i].type == 0)
-        {            
-            //Directional
-            float cosAngle = max(dot(Normal, -uLight[i].direction), 0.0); 
-            vec3 ambient = 0.1 * uLight[i].color;
-            vec3 diffuse = 0.6 * uLight[i].color * cosAngle;
-
-            finalColor += (ambient + diffuse) * Diffuse;
-        }
+        //Directional
+        float cosAngle = max(dot(Normal, -uDirectionalLights[i].direction), 0.0); 
+        vec3 ambient = 0.1 * uDirectionalLights[i].color;
+        vec3 diffuse = 0.6 * uDirectionalLights[i].color * cosAngle;
+
+        finalColor += (ambient + diffuse) * Diffuse;
     }
 
     oColor = vec4(finalColor, 1.0);
@@ -342,38 +564,79 @@ void main()
 ///////////////////////////////////////////////////////////////////////
 #ifdef DEFERRED_POINT_LIGHTING_PASS
 
-struct Light
+struct PointLight
 {
-    uint type;
-    vec3 color;
-    vec3 direction;
     vec3 position;
+    float radius;
+    vec3 color;
 };
 
 #if defined(VERTEX) ///////////////////////////////////////////////////
 
 layout(location = 0) in vec3 aPosition;
 
+layout(binding = 0, std140) uniform GlobalParams
+{
+    mat4 uViewProjectionMatrix;
+    vec3 uCameraPosition;
+    uint uDirectionalLightCount;
+    uint uPointLightCount;
+};
+
+#ifdef INSTANCED_LIGHTS
+// One instance per point light touching an entity, the proxy mesh is scaled by the light's radius
+layout(binding = 4, std430) readonly buffer PointLights
+{
+    PointLight uPointLights[];
+};
+
+layout(binding = 8, std430) readonly buffer PointLightInstances
+{
+    uint uPointLightInstances[]; // index in uPointLights
+};
+
+flat out uint vLightIndex;
+
+void main()
+{
+    uint lightIndex = uPointLightInstances[gl_InstanceID];
+    PointLight light = uPointLights[lightIndex];
+    vLightIndex = lightIndex;
+    gl_Position = uViewProjectionMatrix * vec4(light.position + aPosition * light.radius, 1.0);
+}
+#else
 layout(binding = 1, std140) uniform LocalParams
 {
-    mat4 uWorldViewProjectionMatrix;
+    mat4 uWorldMatrix;
 };
 
 void main()
 {
-    gl_Position = uWorldViewProjectionMatrix * vec4(aPosition, 1.0);
+    gl_Position = uViewProjectionMatrix * uWorldMatrix * vec4(aPosition, 1.0);
 }
+#endif
 
 #elif defined(FRAGMENT) ///////////////////////////////////////////////
 
 uniform vec2 gScreenSize;
+#ifdef INSTANCED_LIGHTS
+flat in uint vLightIndex;
+#define gLightIndex vLightIndex
+#else
 uniform uint gLightIndex;
+#endif
 
 layout(binding = 0, std140) uniform GlobalParams
 {
+    mat4 uViewProjectionMatrix;
     vec3 uCameraPosition;
-    uint uLightCount;
-    Light uLight[16];
+    uint uDirectionalLightCount;
+    uint uPointLightCount;
+};
+
+layout(binding = 4, std430) readonly buffer PointLights
+{
+    PointLight uPointLights[];
 };
 
 out vec4 oColor;
@@ -388,8 +651,8 @@ void main()
     vec2 vTexCoord = gl_FragCoord.xy / gScreenSize;
 
     // retrieve data from G-buffer
-    vec3 Position = texture(gPosition, vTexCoord).rgb;
-    vec3 Normal = normalize(texture(gNormal, vTexCoord).rgb);
+    vec3 Position = ReadGBufferPosition(gPosition, gDepth, vTexCoord);
+    vec3 Normal = DecodeNormal(texture(gNormal, vTexCoord).rg);
     vec3 Diffuse = texture(gDiffuse, vTexCoord).rgb;
     
     // then calculate lighting as usual
@@ -397,12 +660,17 @@ void main()
          
     //Point          
     // diffuse
-    vec3 lightDir = normalize(uLight[gLightIndex].position - Position);
-    vec3 diffuse = 0.6 * max(dot(Normal, lightDir), 0.0) * Diffuse * uLight[gLightIndex].color;
+    vec3 lightDir = normalize(uPointLights[gLightIndex].position - Position);
+    vec3 diffuse = 0.6 * max(dot(Normal, lightDir), 0.0) * Diffuse * uPointLights[gLightIndex].color;
     vec3 ambient = 0.1 * Diffuse;
           
-    // attenuation
-    float distance = length(uLight[gLightIndex].position - Position);
+    // attenuation, nothing past the light volume (without the stencil the pixels in front of it get here too)
+    float distance = length(uPointLights[gLightIndex].position - Position);
+    if (distance > uPointLights[gLightIndex].radius)
+    {
+        oColor = vec4(0.0);
+        return;
+    }
     float attenuation = 1.0 / (1.0 + 0.14 * distance + 0.07 * (distance * distance));
     diffuse *= attenuation;
 
@@ -423,19 +691,52 @@ void main()
 
 layout(location = 0) in vec3 aPosition;
 
+layout(binding = 0, std140) uniform GlobalParams
+{
+    mat4 uViewProjectionMatrix;
+};
+
+#ifdef INSTANCED_LIGHTS
+struct PointLight
+{
+    vec3 position;
+    float radius;
+    vec3 color;
+};
+
+layout(binding = 4, std430) readonly buffer PointLights
+{
+    PointLight uPointLights[];
+};
+
+flat out vec3 vLightColor;
+
+void main()
+{
+    PointLight light = uPointLights[gl_InstanceID];
+    vLightColor = light.color;
+    gl_Position = uViewProjectionMatrix * vec4(light.position + aPosition * light.radius, 1.0);
+}
+#else
 layout(binding = 1, std140) uniform LocalParams
 {
-    mat4 uWorldViewProjectionMatrix;
+    mat4 uWorldMatrix;
 };
 
 void main()
 {
-    gl_Position = uWorldViewProjectionMatrix * vec4(aPosition, 1.0);
+    gl_Position = uViewProjectionMatrix * uWorldMatrix * vec4(aPosition, 1.0);
 }
+#endif
 
 #elif defined(FRAGMENT) ///////////////////////////////////////////////
 
+#ifdef INSTANCED_LIGHTS
+flat in vec3 vLightColor;
+#define lightColor vLightColor
+#else
 uniform vec3 lightColor;
+#endif
 
 out vec4 oColor;
 
@@ -460,12 +761,28 @@ layout(location = 2) in vec2 aTextCoord;
 layout(location = 3) in vec3 aTangent;
 layout(location = 4) in vec3 aBitangent;
 
+layout(binding = 0, std140) uniform GlobalParams
+{
+    mat4 uViewProjectionMatrix;
+};
+
+#ifdef TRANSFORM_TABLE
+layout(location = 5) in uint aEntityIndex;
+
+layout(binding = 2, std430) readonly buffer EntityTransforms
+{
+    EntityTransform uEntityTransforms[];
+};
+
+#define uWorldMatrix uEntityTransforms[aEntityIndex].worldMatrix
+#define uNormalMatrix uEntityTransforms[aEntityIndex].normalMatrix
+#else
 layout(binding = 1, std140) uniform LocalParams
 {
     mat4 uWorldMatrix;
-    mat4 uWorldViewMatrix;
-    mat4 uWorldViewProjectionMatrix;
+    mat3 uNormalMatrix;
 };
+#endif
 
 uniform vec3 uCameraPos;
 
@@ -475,17 +792,17 @@ out mat3 TBN;
 out vec3 vTangentFragPos;
 out vec3 vTangentViewPos;
 
+// Matches the depth pre-pass exactly
+invariant gl_Position;
+
 void main()
 {
     vTexCoord = aTextCoord;
     vPosition = (uWorldMatrix * vec4(aPosition, 1.0)).xyz;
 
-    // Normal matrix
-    mat3 normalMatrix = transpose(inverse(mat3(uWorldMatrix)));
-
     // Tangent to world (TBN) matrix
-    vec3 T = normalize(vec3(normalMatrix * aTangent));
-    vec3 N = normalize(vec3(normalMatrix * aNormal));
+    vec3 T = normalize(vec3(uNormalMatrix * aTangent));
+    vec3 N = normalize(vec3(uNormalMatrix * aNormal));
     // re-orthogonalize T with respect to N
     T = normalize(T - dot(T, N) * N);
     // then retrieve perpendicular vector B with the cross product of T and N
@@ -497,7 +814,7 @@ void main()
     vTangentViewPos = TTBN * uCameraPos;
     vTangentFragPos = TTBN * vPosition;
 
-    gl_Position = uWorldViewProjectionMatrix * vec4(aPosition, 1.0);
+    gl_Position = uViewProjectionMatrix * vec4(vPosition, 1.0);
 }
 
 #elif defined(FRAGMENT) ///////////////////////////////////////////////
@@ -508,11 +825,14 @@ in mat3 TBN;
 in vec3 vTangentFragPos;
 in vec3 vTangentViewPos;
 
+#ifdef EARLY_DEPTH_TEST
+// After the depth pre-pass: the depth test runs before the ray march, so the hidden fragments
+// never pay for it. Only used when the edges are not discarded
+layout(early_fragment_tests) in;
+#endif
+
 vec2 ParallaxMapping(vec2 texCoords, vec3 viewDir, out float parallaxHeight);
 
-uniform sampler2D uTexture;
-uniform sampler2D uNormalMap;
-uniform sampler2D uHeightMap;
 uniform float uHeightScale;
 uniform float zNear;
 uniform float zFar;
@@ -522,13 +842,12 @@ uniform int maxLayers;
 
 layout (location = 0) out vec3 gPosition;
 layout (location = 1) out vec4 gAlbedo;
-layout (location = 2) out vec3 gNormal;
+layout (location = 2) out vec2 gNormal;
 
 layout(binding = 1, std140) uniform LocalParams
 {
     mat4 uWorldMatrix;
-    mat4 uWorldViewMatrix;
-    mat4 uWorldViewProjectionMatrix;
+    mat3 uNormalMatrix;
 };
 
 void main()
@@ -548,10 +867,10 @@ void main()
 
 
     // and the diffuse per-fragment color
-    gAlbedo = texture(uTexture, BumpedTexCoord);
+    gAlbedo = SampleAlbedo(BumpedTexCoord);
 
     // Convert normal from tangent space to world space
-    vec3 tangentSpaceNormal = normalize(texture(uNormalMap, BumpedTexCoord).xyz * 2.0 - 1.0);
+    vec3 tangentSpaceNormal = normalize(SampleNormalMap(BumpedTexCoord).xyz * 2.0 - 1.0);
     vec3 worldSpaceNormal = normalize(TBN * tangentSpaceNormal);
 
     /*vec3 tmpPos = vPosition;
@@ -559,7 +878,7 @@ void main()
     gl_FragDepth = ((tmpPos.z * (zFar + zNear)) + (2 * (zFar * zNear))) / tmpPos.z * (zFar - zNear);*/
 
     // also store the per-fragment normals into the gbuffer
-    gNormal = worldSpaceNormal;
+    gNormal = EncodeNormal(worldSpaceNormal);
 }
 
 vec2 ParallaxMapping(in vec2 texCoords, in vec3 viewDir, out float parallaxHeight)
@@ -579,14 +898,14 @@ vec2 ParallaxMapping(in vec2 texCoords, in vec3 viewDir, out float parallaxHeigh
   
     // get initial values
     vec2  currentTexCoords     = texCoords;
-    float currentDepthMapValue = texture(uHeightMap, currentTexCoords).r;
+    float currentDepthMapValue = SampleHeightMap(currentTexCoords).r;
       
     while(currentLayerDepth < currentDepthMapValue)
     {
         // shift texture coordinates along direction of P
         currentTexCoords -= deltaTexCoords;
         // get depthmap value at current texture coordinates
-        currentDepthMapValue = texture(uHeightMap, currentTexCoords).r;  
+        currentDepthMapValue = SampleHeightMap(currentTexCoords).r;  
         // get depth of next layer
         currentLayerDepth += layerDepth;  
     }
@@ -596,7 +915,7 @@ vec2 ParallaxMapping(in vec2 texCoords, in vec3 viewDir, out float parallaxHeigh
 
     // get depth after and before collision for linear interpolation
     float afterDepth  = currentDepthMapValue - currentLayerDepth;
-    float beforeDepth = texture(uHeightMap, prevTexCoords).r - currentLayerDepth + layerDepth;
+    float beforeDepth = SampleHeightMap(prevTexCoords).r - currentLayerDepth + layerDepth;
  
     // interpolation of texture coordinates
     float weight = afterDepth / (afterDepth - beforeDepth);
@@ -621,28 +940,44 @@ layout(location = 2) in vec2 aTextCoord;
 layout(location = 3) in vec3 aTangent;
 layout(location = 4) in vec3 aBitangent;
 
+layout(binding = 0, std140) uniform GlobalParams
+{
+    mat4 uViewProjectionMatrix;
+};
+
+#ifdef TRANSFORM_TABLE
+layout(location = 5) in uint aEntityIndex;
+
+layout(binding = 2, std430) readonly buffer EntityTransforms
+{
+    EntityTransform uEntityTransforms[];
+};
+
+#define uWorldMatrix uEntityTransforms[aEntityIndex].worldMatrix
+#define uNormalMatrix uEntityTransforms[aEntityIndex].normalMatrix
+#else
 layout(binding = 1, std140) uniform LocalParams
 {
     mat4 uWorldMatrix;
-    mat4 uWorldViewMatrix;
-    mat4 uWorldViewProjectionMatrix;
+    mat3 uNormalMatrix;
 };
+#endif
 
 out vec3 vPosition;
 out vec2 vTexCoord;
 out mat3 TBN;
 
+// Matches the depth pre-pass exactly
+invariant gl_Position;
+
 void main()
 {
     vTexCoord = aTextCoord;
     vPosition = (uWorldMatrix * vec4(aPosition, 1.0)).xyz;
 
-    // Normal matrix
-    mat3 normalMatrix = transpose(inverse(mat3(uWorldMatrix)));
-
     // Tangent to world (TBN) matrix
-    vec3 T = normalize(vec3(normalMatrix * aTangent));
-    vec3 N = normalize(vec3(normalMatrix * aNormal));
+    vec3 T = normalize(vec3(uNormalMatrix * aTangent));
+    vec3 N = normalize(vec3(uNormalMatrix * aNormal));
     // re-orthogonalize T with respect to N
     T = normalize(T - dot(T, N) * N);
     // then retrieve perpendicular vector B with the cross product of T and N
@@ -650,7 +985,7 @@ void main()
     TBN = mat3(T, B, N);
 
 
-    gl_Position = uWorldViewProjectionMatrix * vec4(aPosition, 1.0);
+    gl_Position = uViewProjectionMatrix * vec4(vPosition, 1.0);
 }
 
 #elif defined(FRAGMENT) ///////////////////////////////////////////////
@@ -660,19 +995,14 @@ in vec3 vPosition;
 in vec2 vTexCoord;
 in mat3 TBN;
 
-
-uniform sampler2D uTexture;
-uniform sampler2D uNormalMap;
-
 layout (location = 0) out vec3 gPosition;
 layout (location = 1) out vec4 gAlbedo;
-layout (location = 2) out vec3 gNormal;
+layout (location = 2) out vec2 gNormal;
 
 layout(binding = 1, std140) uniform LocalParams
 {
     mat4 uWorldMatrix;
-    mat4 uWorldViewMatrix;
-    mat4 uWorldViewProjectionMatrix;
+    mat3 uNormalMatrix;
 };
 
 void main()
@@ -680,33 +1010,88 @@ void main()
     // store the fragment position vector in the first gbuffer texture
     gPosition = vPosition;
     // and the diffuse per-fragment color
-    gAlbedo = texture(uTexture, vTexCoord);
+    gAlbedo = SampleAlbedo(vTexCoord);
 
     // Convert normal from tangent space to world space
-    vec3 tangentSpaceNormal = normalize(texture(uNormalMap, vTexCoord).xyz * 2.0 - 1.0);
+    vec3 tangentSpaceNormal = normalize(SampleNormalMap(vTexCoord).xyz * 2.0 - 1.0);
     vec3 worldSpaceNormal = normalize(TBN * tangentSpaceNormal);
 
     // also store the per-fragment normals into the gbuffer
-    gNormal = worldSpaceNormal;
+    gNormal = EncodeNormal(worldSpaceNormal);
 } 
 
 #endif
 #endif
 
+#ifdef DEPTH_PRE_PASS
+
+#if defined(VERTEX) ///////////////////////////////////////////////////
+
+layout(location = 0) in vec3 aPosition;
+
+layout(binding = 0, std140) uniform GlobalParams
+{
+    mat4 uViewProjectionMatrix;
+};
+
+#ifdef TRANSFORM_TABLE
+layout(location = 5) in uint aEntityIndex;
+
+layout(binding = 2, std430) readonly buffer EntityTransforms
+{
+    EntityTransform uEntityTransforms[];
+};
+
+#define uWorldMatrix uEntityTransforms[aEntityIndex].worldMatrix
+#define uNormalMatrix uEntityTransforms[aEntityIndex].normalMatrix
+#else
+layout(binding = 1, std140) uniform LocalParams
+{
+    mat4 uWorldMatrix;
+    mat3 uNormalMatrix;
+};
+#endif
+
+// Same operations as the opaque programs, so the pass after this one gets the same depth
+invariant gl_Position;
+
+void main()
+{
+    vec3 position = (uWorldMatrix * vec4(aPosition, 1.0)).xyz;
+    gl_Position = uViewProjectionMatrix * vec4(position, 1.0);
+}
+
+#elif defined(FRAGMENT) ///////////////////////////////////////////////
+
+void main()
+{
+}
+
+#endif
+#endif
+
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
 #ifdef NULL_GEOMETRY
 
 #if defined(VERTEX) ///////////////////////////////////////////////////
 
 layout(location = 0) in vec3 aPosition;
 
+layout(binding = 0, std140) uniform GlobalParams
+{
+    mat4 uViewProjectionMatrix;
+};
+
 layout(binding = 1, std140) uniform LocalParams
 {
-    mat4 uWorldViewProjectionMatrix;
+    mat4 uWorldMatrix;
 };
 
 void main()
 {
-    gl_Position = uWorldViewProjectionMatrix * vec4(aPosition, 1.0);
+    gl_Position = uViewProjectionMatrix * uWorldMatrix * vec4(aPosition, 1.0);
 }
 
 #elif defined(FRAGMENT) ///////////////////////////////////////////////
@@ -719,6 +1104,350 @@ void main()
 #endif
 #endif
 
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+#ifdef TILED_DEFERRED_LIGHTING
+
+#define TILE_SIZE 16 // LIGHT_TILE_SIZE in engine.cpp
+#define MAX_LIGHTS_PER_TILE 1024
+
+struct DirectionalLight
+{
+    vec3 direction;
+    vec3 color;
+};
+
+struct PointLight
+{
+    vec3 position;
+    float radius;
+    vec3 color;
+};
+
+#if defined(COMPUTE) //////////////////////////////////////////////////
+
+layout(local_size_x = TILE_SIZE, local_size_y = TILE_SIZE) in;
+
+layout(binding = 0, std140) uniform GlobalParams
+{
+    mat4 uViewProjectionMatrix;
+    vec3 uCameraPosition;
+    uint uDirectionalLightCount;
+    uint uPointLightCount;
+};
+
+layout(binding = 3, std430) readonly buffer DirectionalLights
+{
+    DirectionalLight uDirectionalLights[];
+};
+
+layout(binding = 4, std430) readonly buffer PointLights
+{
+    PointLight uPointLights[];
+};
+
+uniform mat4 uViewMatrix;
+uniform mat4 uProjectionMatrix;
+
+uniform sampler2D gPosition;
+uniform sampler2D gNormal;
+uniform sampler2D gDiffuse;
+uniform sampler2D gDepth;
+
+#ifdef COMPACT_G_BUFFER
+layout(binding = 0, r11f_g11f_b10f) uniform writeonly image2D uFinalImage;
+#else
+layout(binding = 0, rgba8) uniform writeonly image2D uFinalImage;
+#endif
+
+// View space distances as uint bits, positive floats keep their order
+shared uint sMinDepth;
+shared uint sMaxDepth;
+shared uint sTileLightCount;
+shared uint sTileLights[MAX_LIGHTS_PER_TILE];
+
+void main()
+{
+    ivec2 pixel = ivec2(gl_GlobalInvocationID.xy);
+    ivec2 screenSize = textureSize(gDepth, 0);
+    bool insideScreen = pixel.x < screenSize.x && pixel.y < screenSize.y;
+
+    if (gl_LocalInvocationIndex == 0)
+    {
+        sMinDepth = 0xFFFFFFFFu;
+        sMaxDepth = 0u;
+        sTileLightCount = 0u;
+    }
+    barrier();
+
+    // Tile depth bounds, the background does not count
+    float depth = insideScreen ? texelFetch(gDepth, pixel, 0).r : 1.0;
+    if (depth < 1.0)
+    {
+        float ndcDepth = depth * 2.0 - 1.0;
+        float viewDepth = uProjectionMatrix[3][2] / (ndcDepth + uProjectionMatrix[2][2]);
+        atomicMin(sMinDepth, floatBitsToUint(viewDepth));
+        atomicMax(sMaxDepth, floatBitsToUint(viewDepth));
+    }
+    barrier();
+
+    float minDepth = uintBitsToFloat(sMinDepth);
+    float maxDepth = uintBitsToFloat(sMaxDepth);
+
+    // Side planes of the tile frustum in view space (through the origin, pointing inwards)
+    vec2 tileMin = vec2(gl_WorkGroupID.xy * TILE_SIZE) / vec2(screenSize) * 2.0 - 1.0;
+    vec2 tileMax = vec2((gl_WorkGroupID.xy + 1) * TILE_SIZE) / vec2(screenSize) * 2.0 - 1.0;
+    vec3 planes[4];
+    planes[0] = normalize(vec3(uProjectionMatrix[0][0], 0.0, tileMin.x));
+    planes[1] = normalize(vec3(-uProjectionMatrix[0][0], 0.0, -tileMax.x));
+    planes[2] = normalize(vec3(0.0, uProjectionMatrix[1][1], tileMin.y));
+    planes[3] = normalize(vec3(0.0, -uProjectionMatrix[1][1], -tileMax.y));
+
+    // Every thread of the tile culls a share of the point lights
+    uint threadCount = TILE_SIZE * TILE_SIZE;
+    for (uint i = gl_LocalInvocationIndex; i < uPointLightCount && minDepth <= maxDepth; i += threadCount)
+    {
+        vec3 center = (uViewMatrix * vec4(uPointLights[i].position, 1.0)).xyz;
+        float radius = uPointLights[i].radius;
+
+        bool visible = -center.z + radius >= minDepth && -center.z - radius <= maxDepth;
+        for (int p = 0; p < 4 && visible; ++p)
+            visible = dot(planes[p], center) >= -radius;
+
+        if (visible)
+        {
+            uint index = atomicAdd(sTileLightCount, 1u);
+            if (index < MAX_LIGHTS_PER_TILE)
+                sTileLights[index] = i;
+        }
+    }
+    barrier();
+
+    if (!insideScreen)
+        return;
+
+    // retrieve data from G-buffer
+    vec2 uv = (vec2(pixel) + 0.5) / vec2(screenSize);
+    vec3 Position = ReadGBufferPosition(gPosition, gDepth, uv);
+    vec3 Normal = DecodeNormal(texelFetch(gNormal, pixel, 0).rg);
+    vec3 Diffuse = texelFetch(gDiffuse, pixel, 0).rgb;
+
+    vec3 finalColor = vec3(0);
+
+    for (uint i = 0; i < uDirectionalLightCount; ++i)
+    {
+        //Directional
+        float cosAngle = max(dot(Normal, -uDirectionalLights[i].direction), 0.0); 
+        vec3 ambient = 0.1 * uDirectionalLights[i].color;
+        vec3 diffuse = 0.6 * uDirectionalLights[i].color * cosAngle;
+
+        finalColor += (ambient + diffuse) * Diffuse;
+    }
+
+    uint tileLightCount = min(sTileLightCount, uint(MAX_LIGHTS_PER_TILE));
+    for (uint i = 0; i < tileLightCount && depth < 1.0; ++i)
+    {
+        PointLight light = uPointLights[sTileLights[i]];
+
+        //Point
+        // diffuse
+        vec3 lightDir = normalize(light.position - Position);
+        vec3 diffuse = 0.6 * max(dot(Normal, lightDir), 0.0) * Diffuse * light.color;
+
+        // attenuation
+        float distance = length(light.position - Position);
+        float attenuation = 1.0 / (1.0 + 0.14 * distance + 0.07 * (distance * distance));
+        diffuse *= attenuation;
+
+        finalColor += diffuse;
+    }
+
+    imageStore(uFinalImage, pixel, vec4(finalColor, 1.0));
+}
+
+#endif
+#endif
+
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+#ifdef HI_Z_BUILD
+
+#if defined(COMPUTE) //////////////////////////////////////////////////
+
+layout(local_size_x = 8, local_size_y = 8) in;
+
+uniform sampler2D uSource;  // G-buffer depth for level 0, the pyramid itself for the others
+uniform int uSourceLevel;   // -1 copies the depth to level 0
+
+layout(binding = 0, r32f) uniform writeonly image2D uDestination;
+
+void main()
+{
+    ivec2 texel = ivec2(gl_GlobalInvocationID.xy);
+    ivec2 size = imageSize(uDestination);
+    if (texel.x >= size.x || texel.y >= size.y)
+        return;
+
+    if (uSourceLevel < 0)
+    {
+        imageStore(uDestination, texel, vec4(texelFetch(uSource, texel, 0).r));
+        return;
+    }
+
+    // Farthest depth of the source texels covered, with odd sizes the last texel also takes the extra row / column
+    ivec2 sourceSize = textureSize(uSource, uSourceLevel);
+    ivec2 first = texel * 2;
+    ivec2 last = min(first + 1 + ivec2(equal(texel, size - 1)) * (sourceSize & 1), sourceSize - 1);
+
+    float depth = 0.0;
+    for (int y = first.y; y <= last.y; ++y)
+        for (int x = first.x; x <= last.x; ++x)
+            depth = max(depth, texelFetch(uSource, ivec2(x, y), uSourceLevel).r);
+
+    imageStore(uDestination, texel, vec4(depth));
+}
+
+#endif
+#endif
+
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+#ifdef OCCLUSION_CULLING
+
+struct DrawCommand
+{
+    uint count;
+    uint instanceCount;
+    uint firstIndex;
+    int  baseVertex;
+    uint baseInstance; // entity index
+};
+
+#if defined(COMPUTE) //////////////////////////////////////////////////
+
+layout(local_size_x = 64) in;
+
+layout(binding = 0, std140) uniform GlobalParams
+{
+    mat4 uViewProjectionMatrix;
+    vec3 uCameraPosition;
+    uint uDirectionalLightCount;
+    uint uPointLightCount;
+};
+
+layout(binding = 2, std430) readonly buffer EntityTransforms
+{
+    EntityTransform uEntityTransforms[];
+};
+
+// The draws of the first phase followed by the ones to retest in the second
+layout(binding = 6, std430) buffer DrawCommands
+{
+    DrawCommand uCommands[];
+};
+
+// Object space bounding sphere of the submesh of every draw
+layout(binding = 7, std430) readonly buffer DrawSpheres
+{
+    vec4 uDrawSpheres[];
+};
+
+layout(binding = 1, std430) buffer OcclusionStats
+{
+    uint uVisibleDraws[2];
+};
+
+uniform sampler2D uHiZ;
+uniform uint uCommandCount;
+uniform int  uPhase;    // 0: the draws, the occluded ones go to the retest list. 1: the retest list
+uniform bool uHiZValid; // false until there is a pyramid of a previous frame
+
+bool IsOccluded(vec3 center, float radius)
+{
+    // Screen rectangle and nearest depth of the box around the sphere
+    vec3 ndcMin = vec3(1.0e30);
+    vec3 ndcMax = vec3(-1.0e30);
+    for (int i = 0; i < 8; ++i)
+    {
+        vec3 corner = center + radius * vec3((i & 1) != 0 ? 1.0 : -1.0, (i & 2) != 0 ? 1.0 : -1.0, (i & 4) != 0 ? 1.0 : -1.0);
+        vec4 clip = uViewProjectionMatrix * vec4(corner, 1.0);
+
+        // Crossing the near plane, it can't be projected
+        if (clip.w <= 0.0)
+            return false;
+
+        vec3 ndc = clip.xyz / clip.w;
+        ndcMin = min(ndcMin, ndc);
+        ndcMax = max(ndcMax, ndc);
+    }
+
+    vec2 uvMin = clamp(ndcMin.xy * 0.5 + 0.5, 0.0, 1.0);
+    vec2 uvMax = clamp(ndcMax.xy * 0.5 + 0.5, 0.0, 1.0);
+    float nearestDepth = ndcMin.z * 0.5 + 0.5;
+
+    // Level where the rectangle covers at most 2x2 texels
+    vec2 extent = (uvMax - uvMin) * vec2(textureSize(uHiZ, 0));
+    int levelCount = textureQueryLevels(uHiZ);
+    int level = clamp(int(ceil(log2(max(max(extent.x, extent.y), 1.0)))), 0, levelCount - 1);
+
+    ivec2 levelSize = textureSize(uHiZ, level);
+    ivec2 texelMin = min(ivec2(uvMin * vec2(levelSize)), levelSize - 1);
+    ivec2 texelMax = min(ivec2(uvMax * vec2(levelSize)), levelSize - 1);
+
+    float farthestDepth = max(max(texelFetch(uHiZ, texelMin, level).r, texelFetch(uHiZ, ivec2(texelMax.x, texelMin.y), level).r),
+                              max(texelFetch(uHiZ, ivec2(texelMin.x, texelMax.y), level).r, texelFetch(uHiZ, texelMax, level).r));
+
+    return nearestDepth > farthestDepth;
+}
+
+bool IsVisible(uint commandIdx)
+{
+    mat4 world = uEntityTransforms[uCommands[commandIdx].baseInstance].worldMatrix;
+    vec4 sphere = uDrawSpheres[commandIdx % uCommandCount];
+
+    // Largest axis scale, so the sphere stays conservative with non uniform scales
+    float scale = sqrt(max(dot(world[0].xyz, world[0].xyz), max(dot(world[1].xyz, world[1].xyz), dot(world[2].xyz, world[2].xyz))));
+    return !IsOccluded((world * vec4(sphere.xyz, 1.0)).xyz, sphere.w * scale);
+}
+
+void main()
+{
+    uint i = gl_GlobalInvocationID.x;
+    if (i >= uCommandCount)
+        return;
+
+    if (uPhase == 0)
+    {
+        bool visible = !uHiZValid || IsVisible(i);
+
+        DrawCommand retest = uCommands[i];
+        retest.instanceCount = visible ? 0u : 1u;
+        uCommands[uCommandCount + i] = retest;
+        uCommands[i].instanceCount = visible ? 1u : 0u;
+
+        if (visible)
+            atomicAdd(uVisibleDraws[0], 1u);
+    }
+    else
+    {
+        uint retestIdx = uCommandCount + i;
+        if (uCommands[retestIdx].instanceCount == 0u)
+            return;
+
+        bool visible = IsVisible(retestIdx);
+        uCommands[retestIdx].instanceCount = visible ? 1u : 0u;
+
+        if (visible)
+            atomicAdd(uVisibleDraws[1], 1u);
+    }
+}
+
+#endif
+#endif
+
 ///////////////////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////////////////